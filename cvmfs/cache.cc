@@ -22,6 +22,12 @@
  *
  * Identical URLs won't be concurrently downloaded.  The first thread performs
  * the download and informs the other, waiting threads on pipes.
+ *
+ * Small files can be kept in the pack store instead of files of their own.
+ * They are fetched into memory by Fetch2Mem().
+ *
+ * The cache directory can be striped over several directories (see
+ * stripes.cc).  Every stripe has its own 00..ff and txn directories.
  */
 
 #define __STDC_FORMAT_MACROS
@@ -30,6 +36,7 @@
 #include "cache.h"
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -47,10 +54,13 @@
 #include "platform.h"
 #include "dirent.h"
 #include "quota.h"
+#include "pack_store.h"
+#include "stripes.h"
 #include "util.h"
 #include "hash.h"
 #include "logging.h"
 #include "download.h"
+#include "latency.h"
 #include "compression.h"
 #include "smalloc.h"
 #include "signature.h"
@@ -119,44 +129,76 @@ void Fini() {
 }
 
 
+/**
+ * Downloads and records the time spent in the download manager.
+ */
+static void TimedDownload(download::JobInfo *info) {
+  const uint64_t start = latency::Now();
+  download::Fetch(info);
+  latency::Record(latency::kDownload, start);
+}
+
+
+static inline string GetStripePath(const unsigned stripe) {
+  return (stripe == 0) ? *cache_path_ : stripes::GetPath(stripe);
+}
+
+
 /**
  * Transforms a catalog entry into a name for local cache.
  *
  * @param[in] id content hash of the catalog entry.
+ * @param[in] stripe cache stripe of the file
  * \return Absolute path in local cache.
  */
-static inline string GetPathInCache(const hash::Any &id) {
-  return *cache_path_ + id.MakePath(1, 2);
+static inline string GetPathInCache(const hash::Any &id,
+                                    const unsigned stripe)
+{
+  return GetStripePath(stripe) + id.MakePath(1, 2);
 }
 
 
 /**
  * Transform a catalog entry into a temporary name in txn-directory.
  *
- * @param[in] id content hash of the catalog entry.
+ * @param[in] stripe cache stripe of the final file
  * \return Absolute path in local cache txn-directory.
  */
-static inline string GetTempName()
+static inline string GetTempName(const unsigned stripe)
 {
-  return *cache_path_ + "/txn/" + "fetchXXXXXX";
+  return GetStripePath(stripe) + "/txn/" + "fetchXXXXXX";
 }
 
 
 /**
- * Tries to open a catalog entry in local cache.
+ * Tries to open a catalog entry in local cache.  Searches all stripes.
  *
  * @param[in] id content hash of the catalog entry.
  * \return A file descriptor if file is in cache.  Error code of open() else.
  */
 int Open(const hash::Any &id) {
-  const string path = GetPathInCache(id);
-  int result = ::open(path.c_str(), O_RDONLY);
-
-  if (result >= 0) {
-    LogCvmfs(kLogCache, kLogDebug, "hit %s", path.c_str());
-    platform_disable_kcache(result);
-  } else {
+  unsigned order[stripes::kMaxStripes];
+  const unsigned num_stripes = stripes::GetProbeOrder(id, order);
+  int result = -ENOENT;
+  for (unsigned i = 0; i < num_stripes; ++i) {
+    const string path = GetPathInCache(id, order[i]);
+    struct timeval start, end;
+    if (num_stripes > 1)
+      gettimeofday(&start, NULL);
+    result = ::open(path.c_str(), O_RDONLY);
+
+    if (result >= 0) {
+      if (num_stripes > 1) {
+        gettimeofday(&end, NULL);
+        stripes::RecordLatency(order[i],
+          uint64_t(DiffTimeSeconds(start, end) * 1000000.0));
+      }
+      LogCvmfs(kLogCache, kLogDebug, "hit %s", path.c_str());
+      platform_disable_kcache(result);
+      return result;
+    }
     result = -errno;
+    stripes::RecordError(order[i], errno);
     LogCvmfs(kLogCache, kLogDebug, "miss %s (%d)", path.c_str(), result);
   }
 
@@ -209,24 +251,27 @@ bool Open2Mem(const hash::Any &id, unsigned char **buffer, uint64_t *size) {
  * temporary file.
  *
  * @param[in] id content hash of the catalog entry.
+ * @param[in] stripe cache stripe of the file, 0 for file catalogs
  * @param[out] path Absolute path of the file in local cache after commit
  * @param[out] temp_path Absolute path of the temporoary file in local cache
  * \return File descriptor of temporary file, error code of mkstemp() else
  */
-int StartTransaction(const hash::Any &id,
+int StartTransaction(const hash::Any &id, const unsigned stripe,
                      string *final_path, string *temp_path)
 {
   int result;
-  *final_path = GetPathInCache(id);
-  *temp_path = GetTempName();
+  *final_path = GetPathInCache(id, stripe);
+  *temp_path = GetTempName(stripe);
   const unsigned temp_path_length = temp_path->length();
 
   char template_path[temp_path_length + 1];
   memcpy(template_path, &(*temp_path)[0], temp_path_length);
   template_path[temp_path_length] = '\0';
   result = ::mkstemp(template_path);
-  if (result == -1)
+  if (result == -1) {
     result = -errno;
+    stripes::RecordError(stripe, errno);
+  }
 
   LogCvmfs(kLogCache, kLogDebug, "start transaction on %s has result %d",
            template_path, result);
@@ -299,7 +344,8 @@ bool CommitFromMem(const hash::Any &id, const unsigned char *buffer,
   string temp_path;
   string final_path;
 
-  int fd = StartTransaction(id, &final_path, &temp_path);
+  int fd = StartTransaction(id, stripes::Place(id, size), &final_path,
+                            &temp_path);
   if (fd < 0)
     return false;
 
@@ -323,7 +369,93 @@ bool CommitFromMem(const hash::Any &id, const unsigned char *buffer,
  */
 bool Contains(const hash::Any &id) {
   platform_stat64 info;
-  return platform_stat(GetPathInCache(id).c_str(), &info) == 0;
+  unsigned order[stripes::kMaxStripes];
+  const unsigned num_stripes = stripes::GetProbeOrder(id, order);
+  for (unsigned i = 0; i < num_stripes; ++i) {
+    if (platform_stat(GetPathInCache(id, order[i]).c_str(), &info) == 0)
+      return true;
+  }
+  return false;
+}
+
+
+/**
+ * Verifies the size of a finished download and commits it to the cache.
+ * Consumes the transaction's file descriptor fd.
+ *
+ * \return Read-only file descriptor for the file in the cache, a negative
+ *         error code on failure
+ */
+static int CommitDownload(const hash::Any &id, const uint64_t size,
+                          const string &cvmfs_path, const string &url,
+                          const download::JobInfo &download_job, int fd,
+                          const string &final_path, const string &temp_path)
+{
+  int result = -EIO;
+  if (download_job.error_code == download::kFailOk) {
+    LogCvmfs(kLogCache, kLogDebug, "finished downloading of %s", url.c_str());
+
+    // Check decompressed size (a cross check just in case)
+    const uint64_t num_written = download_job.destination_fd.offset;
+    if (num_written != size) {
+      LogCvmfs(kLogCache, kLogSyslog,
+               "size check failure for %s, expected %lu, got %lu",
+               url.c_str(), size, num_written);
+      if (CopyPath2Path(temp_path, *cache_path_ + "/quarantaine/" +
+                        id.ToString()) != 0)
+      {
+        LogCvmfs(kLogCache, kLogSyslog,
+                 "failed to move %s to quarantaine", temp_path.c_str());
+      }
+    } else {
+      // The descriptor of the transaction is used for reading, which saves
+      // closing and reopening the file
+      LogCvmfs(kLogCache, kLogDebug, "trying to commit %s",
+               final_path.c_str());
+      result = cache::CommitTransaction(final_path, temp_path, cvmfs_path,
+                                        id, size);
+      if (result == 0) {
+        platform_disable_kcache(fd);
+        result = fd;
+        fd = -1;
+      } else {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+
+  LogCvmfs(kLogCache, kLogDebug, "finalizing download of %s",
+           cvmfs_path.c_str());
+  if (result < 0) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog, "failed to fetch %s (hash: %s, "
+             "error %d)", cvmfs_path.c_str(), id.ToString().c_str(),
+             download_job.error_code);
+  }
+  if (fd >= 0) {
+    close(fd);
+    AbortTransaction(temp_path);
+  }
+  return result;
+}
+
+
+/**
+ * Hands the result of a download to the threads waiting for the same file and
+ * removes the file's queue.
+ */
+static void SignalWaiting(const hash::Any &id, const int result,
+                          vector<int> *other_pipes_waiting)
+{
+  pthread_mutex_lock(&lock_queues_download_);
+  for (unsigned i = 0, s = other_pipes_waiting->size(); i < s; ++i) {
+    int fd_dup = dup(result);
+    int retval = write((*other_pipes_waiting)[i], &fd_dup, sizeof(int));
+    assert(retval == sizeof(int));
+  }
+  other_pipes_waiting->clear();
+  queues_download_->erase(id);
+  pthread_mutex_unlock(&lock_queues_download_);
 }
 
 
@@ -336,10 +468,12 @@ bool Contains(const hash::Any &id) {
  *
  * @param[in] d Demanded catalog entry
  * @param[in] cvmfs_path Path of the chunk as seen in cvmfs
+ * @param[in] priority Priority class of the download
  * \return Read-only file descriptor for the file pointing into local cache.
  *         On failure a negative error code.
  */
-int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path)
+int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path,
+          const download::Priority priority)
 {
   int fd_return;  // Read-only file descriptor that is returned
   int retval;
@@ -363,7 +497,7 @@ int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path)
     tls = new ThreadLocalStorage();
     retval = pipe(tls->pipe_wait);
     assert(retval == 0);
-    tls->download_job.destination = download::kDestinationFile;
+    tls->download_job.destination = download::kDestinationFd;
     tls->download_job.compressed = true;
     tls->download_job.probe_hosts = true;
     retval = pthread_setspecific(thread_local_storage_, tls);
@@ -406,11 +540,11 @@ int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path)
   const string url = "/data" + d.checksum().MakePath(1, 2);
   string final_path;
   string temp_path;
-  int fd;  // Used to write the downloaded file
-  FILE *f = NULL;
+  int fd;  // Used to write the downloaded file, returned on success
   int result = -EIO;
 
-  fd = StartTransaction(d.checksum(), &final_path, &temp_path);
+  fd = StartTransaction(d.checksum(), stripes::Place(d.checksum(), d.size()),
+                        &final_path, &temp_path);
   if (fd < 0) {
     LogCvmfs(kLogCache, kLogDebug, "could not start transaction on %s",
              final_path.c_str());
@@ -418,85 +552,198 @@ int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path)
     goto fetch_finalize;
   }
 
-  f = fdopen(fd, "w");
-  if (!f) {
-    result = -errno;
-    LogCvmfs(kLogCache, kLogDebug, "could not fdopen %s", final_path.c_str());
-    goto fetch_finalize;
-  }
+  // Reserve the space up front, avoids fragmentation of large files
+  platform_preallocate(fd, d.size());
 
   tls->download_job.url = &url;
-  tls->download_job.destination_file = f;
+  tls->download_job.priority = priority;
+  tls->download_job.destination_fd.fd = fd;
   tls->download_job.expected_hash = d.checksum_ptr();
-  download::Fetch(&tls->download_job);
+  TimedDownload(&tls->download_job);
+  result = CommitDownload(d.checksum(), d.size(), cvmfs_path, url,
+                          tls->download_job, fd, final_path, temp_path);
 
-  if (tls->download_job.error_code == download::kFailOk) {
-    LogCvmfs(kLogCache, kLogDebug, "finished downloading of %s", url.c_str());
+ fetch_finalize:
+  SignalWaiting(d.checksum(), result, &tls->other_pipes_waiting);
+  return result;
+}
 
-    // Check decompressed size (a cross check just in case)
-    platform_stat64 stat_info;
-    stat_info.st_size = -1;
-    if ((platform_fstat(fileno(f), &stat_info) != 0) ||
-        (stat_info.st_size != (int64_t)d.size()))
-    {
-      LogCvmfs(kLogCache, kLogSyslog,
-               "size check failure for %s, expected %lu, got %ld",
-               url.c_str(), d.size(), stat_info.st_size);
-      if (CopyPath2Path(temp_path, *cache_path_ + "/quarantaine/" +
-                        d.checksum().ToString()) != 0)
-      {
-        LogCvmfs(kLogCache, kLogSyslog,
-                 "failed to move %s to quarantaine", temp_path.c_str());
-      }
-      result = -EIO;
-      goto fetch_finalize;
-    }
 
-    LogCvmfs(kLogCache, kLogDebug, "trying to commit %s", final_path.c_str());
-    fclose(f);
-    fd = -1;
-    fd_return = ::open(temp_path.c_str(), O_RDONLY);
-    if (fd_return < 0) {
-      result = -errno;
-      goto fetch_finalize;
-    }
-    result = cache::CommitTransaction(final_path, temp_path, cvmfs_path,
-                                      d.checksum(), d.size());
-    if (result == 0) {
-      platform_disable_kcache(fd_return);
-      result = fd_return;
-    } else {
-      close(fd_return);
-    }
+/**
+ * A download started by FetchAsync().  Threads that fetch the same file
+ * in the meantime wait for it like for a download by Fetch().
+ */
+struct AsyncFetch {
+  hash::Any id;
+  uint64_t size;
+  string cvmfs_path;
+  string url;
+  string final_path;
+  string temp_path;
+  int fd;
+  vector<int> other_pipes_waiting;
+  download::JobInfo download_job;
+  FetchCallback callback;
+  void *callback_data;
+  uint64_t start;
+};
+
+
+/**
+ * Completes a download started by FetchAsync() in the download I/O thread.
+ */
+static void FinishAsyncFetch(download::JobInfo *info, void *data) {
+  AsyncFetch *fetch = static_cast<AsyncFetch *>(data);
+  latency::Record(latency::kDownload, fetch->start);
+  const int result = CommitDownload(fetch->id, fetch->size, fetch->cvmfs_path,
+                                    fetch->url, *info, fetch->fd,
+                                    fetch->final_path, fetch->temp_path);
+  SignalWaiting(fetch->id, result, &fetch->other_pipes_waiting);
+  fetch->callback(result, fetch->callback_data);
+  delete fetch;
+}
+
+
+/**
+ * Like Fetch() but does not wait for the download.  The callback gets the
+ * read-only file descriptor or a negative error code.  It runs in the
+ * download I/O thread, or in the calling thread if the file is in the cache
+ * or the download cannot be started, and it must not block.
+ *
+ * @param[in] d Demanded catalog entry
+ * @param[in] cvmfs_path Path of the chunk as seen in cvmfs
+ * @param[in] priority Priority class of the download
+ * @param[in] callback Called once with the result
+ * @param[in] data Passed to the callback
+ * \return false if another thread downloads the same file or if the file
+ *         is too big for the cache, the callback is not called in that case
+ *         and the caller has to use Fetch()
+ */
+bool FetchAsync(const catalog::DirectoryEntry &d, const string &cvmfs_path,
+                const download::Priority priority,
+                FetchCallback callback, void *data)
+{
+  if (d.size() > quota::GetMaxFileSize())
+    return false;
+
+  int fd;
+  pthread_mutex_lock(&lock_queues_download_);
+  if (queues_download_->find(d.checksum()) != queues_download_->end()) {
+    pthread_mutex_unlock(&lock_queues_download_);
+    return false;
   }
+  fd = cache::Open(d.checksum());
+  if (fd >= 0) {
+    pthread_mutex_unlock(&lock_queues_download_);
+    quota::Touch(d.checksum());
+    callback(fd, data);
+    return true;
+  }
+  AsyncFetch *fetch = new AsyncFetch();
+  (*queues_download_)[d.checksum()] = &fetch->other_pipes_waiting;
+  pthread_mutex_unlock(&lock_queues_download_);
 
- fetch_finalize:
-  // Cleanup
-  LogCvmfs(kLogCache, kLogDebug, "finalizing download of %s",
+  LogCvmfs(kLogCache, kLogDebug, "downloading %s asynchronously",
            cvmfs_path.c_str());
-  if (result < 0) {
+  atomic_inc64(&num_download_);
+  fetch->id = d.checksum();
+  fetch->size = d.size();
+  fetch->cvmfs_path = cvmfs_path;
+  fetch->url = "/data" + d.checksum().MakePath(1, 2);
+  fetch->callback = callback;
+  fetch->callback_data = data;
+
+  fd = StartTransaction(fetch->id, stripes::Place(fetch->id, fetch->size),
+                        &fetch->final_path, &fetch->temp_path);
+  if (fd < 0) {
+    LogCvmfs(kLogCache, kLogDebug, "could not start transaction on %s",
+             fetch->final_path.c_str());
+    SignalWaiting(fetch->id, fd, &fetch->other_pipes_waiting);
+    delete fetch;
+    callback(fd, data);
+    return true;
+  }
+  platform_preallocate(fd, fetch->size);
+
+  fetch->fd = fd;
+  download::JobInfo *job = &fetch->download_job;
+  job->url = &fetch->url;
+  job->compressed = true;
+  job->probe_hosts = true;
+  job->destination = download::kDestinationFd;
+  job->destination_fd.fd = fd;
+  job->expected_hash = &fetch->id;
+  job->priority = priority;
+  fetch->start = latency::Now();
+  if (!download::FetchAsync(job, FinishAsyncFetch, fetch)) {
+    job->error_code = download::kFailOther;
+    FinishAsyncFetch(job, fetch);
+  }
+  return true;
+}
+
+
+/**
+ * Fetches a small file into memory, from the pack store, a regular cache
+ * file, or the network.  Downloaded files are stored in the pack store if
+ * they are small enough.  Concurrent downloads of the same small file are not
+ * merged, the second insert into the pack store is a no-op.
+ *
+ * @param[in] d Demanded catalog entry
+ * @param[in] cvmfs_path Path of the chunk as seen in cvmfs
+ * @param[in] priority Priority class of the download
+ * @param[out] buffer Contents of the file, to be freed by the caller
+ * @param[out] size Size of the file
+ * \return Zero on success, a negative error code otherwise.
+ */
+int Fetch2Mem(const catalog::DirectoryEntry &d, const string &cvmfs_path,
+              const download::Priority priority,
+              unsigned char **buffer, uint64_t *size)
+{
+  if (d.size() > quota::GetMaxFileSize()) {
+    LogCvmfs(kLogCache, kLogDebug, "file too big for lru cache (%"PRIu64")",
+             d.size());
+    return -ENOSPC;
+  }
+
+  if (pack_store::Read(d.checksum(), buffer, size) ||
+      Open2Mem(d.checksum(), buffer, size))
+  {
+    quota::Touch(d.checksum());
+    return 0;
+  }
+
+  LogCvmfs(kLogCache, kLogDebug, "downloading %s into memory",
+           cvmfs_path.c_str());
+  atomic_inc64(&num_download_);
+  const string url = "/data" + d.checksum().MakePath(1, 2);
+  download::JobInfo download_job(&url, true, true, d.checksum_ptr());
+  download_job.priority = priority;
+  TimedDownload(&download_job);
+  if (download_job.error_code != download::kFailOk) {
     LogCvmfs(kLogCache, kLogDebug | kLogSyslog, "failed to fetch %s (hash: %s, "
              "error %d)", cvmfs_path.c_str(), d.checksum().ToString().c_str(),
-             tls->download_job.error_code);
-  }
-  if (fd >= 0) {
-    if (f) fclose(f);
-    else close(fd);
-    AbortTransaction(temp_path);
+             download_job.error_code);
+    return -EIO;
   }
 
-  // Signal the waiting threads and remove the queue
-  pthread_mutex_lock(&lock_queues_download_);
-  for (unsigned i = 0, s = tls->other_pipes_waiting.size(); i < s; ++i) {
-    int fd_dup = dup(result);
-    int retval = write(tls->other_pipes_waiting[i], &fd_dup, sizeof(int));
-    assert(retval == sizeof(int));
+  *buffer = reinterpret_cast<unsigned char *>(
+    download_job.destination_mem.data);
+  *size = download_job.destination_mem.size;
+  if (*size != d.size()) {
+    LogCvmfs(kLogCache, kLogSyslog,
+             "size check failure for %s, expected %lu, got %lu",
+             url.c_str(), d.size(), *size);
+    free(*buffer);
+    *buffer = NULL;
+    return -EIO;
   }
-  tls->other_pipes_waiting.clear();
-  queues_download_->erase(d.checksum());
-  pthread_mutex_unlock(&lock_queues_download_);
 
-  return result;
+  if (pack_store::Insert(d.checksum(), *buffer, *size))
+    quota::Insert(d.checksum(), *size, cvmfs_path);
+  else
+    CommitFromMem(d.checksum(), *buffer, *size, cvmfs_path);
+  return 0;
 }
 
 
@@ -580,7 +827,7 @@ catalog::LoadError CatalogManager::LoadCatalogCas(const hash::Any &hash,
 
   // Download
   string temp_path;
-  int catalog_fd = StartTransaction(hash, catalog_path, &temp_path);
+  int catalog_fd = StartTransaction(hash, 0, catalog_path, &temp_path);
   if (catalog_fd < 0)
     return catalog::kLoadFail;
 
@@ -592,7 +839,8 @@ catalog::LoadError CatalogManager::LoadCatalogCas(const hash::Any &hash,
 
   const string url = "/data" + hash.MakePath(1, 2) + "C";
   download::JobInfo download_catalog(&url, true, true, catalog_file, &hash);
-  download::Fetch(&download_catalog);
+  download_catalog.priority = download::kPriorityCatalog;
+  TimedDownload(&download_catalog);
   fclose(catalog_file);
   if (download_catalog.error_code != download::kFailOk) {
     LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
@@ -684,7 +932,8 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
 
   // Load remote checksum
   download::JobInfo download_checksum(&checksum_url, false, true, NULL);
-  download::Fetch(&download_checksum);
+  download_checksum.priority = download::kPriorityCatalog;
+  TimedDownload(&download_checksum);
   if (download_checksum.error_code != download::kFailOk) {
     LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
              "unable to load checksum from %s (%d)",
@@ -818,7 +1067,8 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
 
       const string cert_url = "/data" + cert_hash.MakePath(1, 2) + "X";
       download::JobInfo download_certificate(&cert_url, true, true, &cert_hash);
-      download::Fetch(&download_certificate);
+      download_certificate.priority = download::kPriorityCatalog;
+      TimedDownload(&download_certificate);
       if (download_certificate.error_code != download::kFailOk) {
         LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
                  "unable to load certificate from %s (%d)",
@@ -843,7 +1093,8 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
     // Verify certificate against whitelist
     const string whitelist_url = "/.cvmfswhitelist";
     download::JobInfo download_whitelist(&whitelist_url, false, true, NULL);
-    download::Fetch(&download_whitelist);
+    download_whitelist.priority = download::kPriorityCatalog;
+    TimedDownload(&download_whitelist);
     if (download_whitelist.error_code != download::kFailOk) {
       LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
                "unable to load whitelist from %s (%d)",
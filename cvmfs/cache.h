@@ -14,6 +14,7 @@
 #include "catalog_mgr.h"
 #include "shortstring.h"
 #include "atomic.h"
+#include "download.h"
 
 namespace catalog {
 class DirectoryEntry;
@@ -26,12 +27,17 @@ struct Any;
 
 namespace cache {
 
+/**
+ * Gets the result of FetchAsync(), a file descriptor or an error code.
+ */
+typedef void (*FetchCallback)(int fd, void *data);
+
 bool Init(const std::string &cache_path);
 void Fini();
 
 int Open(const hash::Any &id);
 bool Open2Mem(const hash::Any &id, unsigned char **buffer, uint64_t *size);
-int StartTransaction(const hash::Any &id,
+int StartTransaction(const hash::Any &id, const unsigned stripe,
                      std::string *final_path, std::string *temp_path);
 int AbortTransaction(const std::string &temp_path);
 int CommitTransaction(const std::string &final_path,
@@ -42,7 +48,14 @@ int CommitTransaction(const std::string &final_path,
 bool CommitFromMem(const hash::Any &id, const unsigned char *buffer,
                    const uint64_t size, const std::string &cvmfs_path);
 bool Contains(const hash::Any &id);
-int Fetch(const catalog::DirectoryEntry &d, const std::string &cvmfs_path);
+int Fetch(const catalog::DirectoryEntry &d, const std::string &cvmfs_path,
+          const download::Priority priority);
+bool FetchAsync(const catalog::DirectoryEntry &d, const std::string &cvmfs_path,
+                const download::Priority priority,
+                FetchCallback callback, void *data);
+int Fetch2Mem(const catalog::DirectoryEntry &d, const std::string &cvmfs_path,
+              const download::Priority priority,
+              unsigned char **buffer, uint64_t *size);
 int64_t GetNumDownloads();
 
 
@@ -32,12 +32,16 @@ typedef std::vector<Catalog *> CatalogList;
  * Every Catalog gets an InodeRange assigned when attached to
  * a CatalogManager.  Inodes are assigned at runtime out of this InodeRange.
  * An inode is computed by <row ID of entry> + offset
+ * Ranges of detached catalogs are reused.  The generation is handed to Fuse
+ * along with the inodes, so that inodes of a reused range are new files for
+ * the kernel.
  */
 struct InodeRange {
   uint64_t offset;
   uint64_t size;
+  uint32_t generation;
 
-  InodeRange() : offset(0), size(0) { }
+  InodeRange() : offset(0), size(0), generation(0) { }
 
   inline bool ContainsInode(const inode_t inode) const {
     return ((inode > offset) && (inode <= size + offset));
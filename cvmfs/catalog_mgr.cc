@@ -2,8 +2,12 @@
  * This file is part of the CernVM File System
  */
 
+#define __STDC_FORMAT_MACROS
+
 #include "catalog_mgr.h"
 
+#include <inttypes.h>
+
 #include <cassert>
 
 #include "logging.h"
@@ -16,6 +20,7 @@ namespace catalog {
 
 AbstractCatalogManager::AbstractCatalogManager() {
   inode_gauge_ = AbstractCatalogManager::kInodeOffset;
+  inode_generation_ = 0;
   rwlock_ =
     reinterpret_cast<pthread_rwlock_t *>(smalloc(sizeof(pthread_rwlock_t)));
   int retval = pthread_rwlock_init(rwlock_, NULL);
@@ -67,8 +72,8 @@ LoadError AbstractCatalogManager::Remount(const bool dry_run) {
   const LoadError load_error = LoadCatalog(PathString("", 0), hash::Any(),
                                            &catalog_path);
   if (load_error == kLoadNew) {
+    // Releases all inodes, the new tree reuses them with a new generation
     DetachAll();
-    inode_gauge_ = AbstractCatalogManager::kInodeOffset;
 
     Catalog *new_root = CreateCatalog(PathString("", 0), NULL);
     assert(new_root);
@@ -96,15 +101,14 @@ bool AbstractCatalogManager::LookupInode(const inode_t inode,
   ReadLock();
   bool found = false;
 
-  // Get corresponding catalog
+  // Get corresponding catalog, the one with the closest offset below inode
   Catalog *catalog = NULL;
-  for (CatalogList::const_iterator i = catalogs_.begin(),
-       iEnd = catalogs_.end(); i != iEnd; ++i)
-  {
-    if ((*i)->inode_range().ContainsInode(inode)) {
-      catalog = *i;
-      break;
-    }
+  map<uint64_t, Catalog *>::const_iterator iter =
+    inode_ranges_.lower_bound(inode);
+  if (iter != inode_ranges_.begin()) {
+    --iter;
+    if (iter->second->inode_range().ContainsInode(inode))
+      catalog = iter->second;
   }
   if (catalog == NULL) {
     LogCvmfs(kLogCatalog, kLogDebug, "cannot find catalog for inode %d", inode);
@@ -334,17 +338,104 @@ string AbstractCatalogManager::PrintHierarchy() const {
 
 
 /**
- * Assigns the next free numbers in the 64 bit space
- * TODO: this may run out of free inodes at some point (with 32bit at least)
+ * The attached catalogs in the order of attachment, which determines their
+ * inode offsets.
+ */
+void AbstractCatalogManager::ListAttached(vector<PathString> *mountpoints,
+                                          vector<uint64_t> *inode_offsets) const
+{
+  ReadLock();
+  for (CatalogList::const_iterator i = catalogs_.begin(),
+       iEnd = catalogs_.end(); i != iEnd; ++i)
+  {
+    mountpoints->push_back((*i)->path());
+    inode_offsets->push_back((*i)->inode_range().offset);
+  }
+  Unlock();
+}
+
+
+/**
+ * Attaches the nested catalog mounted at mountpoint and its parents, if
+ * necessary.
+ * @param mountpoint the root path of a nested catalog
+ * @param inode_offset the inode offset of the catalog
+ * @return false if there is no nested catalog at mountpoint
+ */
+bool AbstractCatalogManager::MountPath(const PathString &mountpoint,
+                                       uint64_t *inode_offset)
+{
+  WriteLock();
+  Catalog *catalog = NULL;
+  bool result = MountSubtree(mountpoint, NULL, &catalog) &&
+                (catalog->path() == mountpoint);
+  if (result)
+    *inode_offset = catalog->inode_range().offset;
+  Unlock();
+  return result;
+}
+
+
+/**
+ * Checks if looking up path requires to load a nested catalog first, i.e. if
+ * path is below the mount point of a nested catalog that is not attached.
+ * @param path the path to look up
+ * @return true if a nested catalog has to be loaded
+ */
+bool AbstractCatalogManager::NeedsMount(const PathString &path) {
+  ReadLock();
+  const Catalog *best_fit = FindCatalog(path);
+  PathString path_slash(path);
+  path_slash.Append("/", 1);
+  const Catalog::NestedCatalogList nested_catalogs =
+    best_fit->ListNestedCatalogs();
+  bool result = false;
+  for (Catalog::NestedCatalogList::const_iterator i = nested_catalogs.begin(),
+       iEnd = nested_catalogs.end(); i != iEnd; ++i)
+  {
+    PathString nested_path_slash(i->path);
+    nested_path_slash.Append("/", 1);
+    if (path_slash.StartsWith(nested_path_slash) && (path != i->path)) {
+      result = true;
+      break;
+    }
+  }
+  Unlock();
+  return result;
+}
+
+
+/**
+ * Assigns the first released range that is large enough or, if there is
+ * none, the next free numbers in the 64 bit space.
  */
 InodeRange AbstractCatalogManager::AcquireInodes(uint64_t size) {
   InodeRange result;
-  result.offset = inode_gauge_;
   result.size = size;
+  result.generation = inode_generation_;
+
+  if (size > 0) {
+    for (map<uint64_t, uint64_t>::iterator i = free_inodes_.begin(),
+         iEnd = free_inodes_.end(); i != iEnd; ++i)
+    {
+      if (i->second < size)
+        continue;
+      result.offset = i->first;
+      if (i->second > size)
+        free_inodes_[i->first + size] = i->second - size;
+      free_inodes_.erase(i);
+      LogCvmfs(kLogCatalog, kLogDebug, "reusing inodes from %"PRIu64" to "
+               "%"PRIu64" (generation %u)", result.offset + 1,
+               result.offset + size, result.generation);
+      return result;
+    }
+  }
 
+  result.offset = inode_gauge_;
   inode_gauge_ += size;
-  LogCvmfs(kLogCatalog, kLogDebug, "allocating inodes from %d to %d.",
-           result.offset + 1, inode_gauge_);
+  LogCvmfs(kLogCatalog, kLogDebug, "allocating inodes from %"PRIu64" to "
+           "%"PRIu64" (generation %u)", result.offset + 1, inode_gauge_,
+           result.generation);
 
   return result;
 }
@@ -352,11 +443,38 @@ InodeRange AbstractCatalogManager::AcquireInodes(uint64_t size) {
 
 /**
  * Called if a catalog is detached which renders the associated InodeChunk
- * invalid.
+ * invalid.  The inodes are reused by catalogs attached later on, with a new
+ * generation.
  * @param chunk the InodeChunk to be freed
  */
 void AbstractCatalogManager::ReleaseInodes(const InodeRange chunk) {
-  // TODO currently inodes are only released on remount
+  if (chunk.size == 0)
+    return;
+  inode_generation_++;
+
+  uint64_t offset = chunk.offset;
+  uint64_t size = chunk.size;
+  map<uint64_t, uint64_t>::iterator next = free_inodes_.lower_bound(offset);
+  if ((next != free_inodes_.end()) && (next->first == offset + size)) {
+    size += next->second;
+    free_inodes_.erase(next);
+  }
+  map<uint64_t, uint64_t>::iterator prev = free_inodes_.lower_bound(offset);
+  if (prev != free_inodes_.begin()) {
+    --prev;
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      free_inodes_.erase(prev);
+    }
+  }
+
+  if (offset + size == inode_gauge_)
+    inode_gauge_ = offset;
+  else
+    free_inodes_[offset] = size;
+  LogCvmfs(kLogCatalog, kLogDebug, "released inodes from %"PRIu64" to "
+           "%"PRIu64, chunk.offset + 1, chunk.offset + chunk.size);
 }
 
 
@@ -507,11 +625,12 @@ bool AbstractCatalogManager::AttachCatalog(const string &db_path,
   if (!new_catalog->IsInitialized()) {
     LogCvmfs(kLogCatalog, kLogDebug,
              "catalog initialization failed (obscure data)");
-    inode_gauge_ -= inode_chunk_size;
+    ReleaseInodes(range);
     return false;
   }
 
   catalogs_.push_back(new_catalog);
+  inode_ranges_[range.offset] = new_catalog;
   return true;
 }
 
@@ -528,6 +647,7 @@ void AbstractCatalogManager::DetachCatalog(Catalog *catalog) {
   if (!catalog->IsRoot())
     catalog->parent()->RemoveChild(catalog);
 
+  inode_ranges_.erase(catalog->inode_range().offset);
   ReleaseInodes(catalog->inode_range());
   UnloadCatalog(catalog);
 
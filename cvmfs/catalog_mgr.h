@@ -10,6 +10,7 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 #include "catalog.h"
 #include "dirent.h"
@@ -114,6 +115,10 @@ class AbstractCatalogManager {
   uint64_t GetTTL() const;
   int GetNumCatalogs() const;
   std::string PrintHierarchy() const;
+  void ListAttached(std::vector<PathString> *mountpoints,
+                    std::vector<uint64_t> *inode_offsets) const;
+  bool MountPath(const PathString &mountpoint, uint64_t *inode_offset);
+  bool NeedsMount(const PathString &path);
 
   /**
    * Get the inode number of the root DirectoryEntry
@@ -186,12 +191,21 @@ class AbstractCatalogManager {
  private:
   const static inode_t kInodeOffset = 255;
   /**
-   * This list is only needed to find a catalog given an inode.
-   * This might possibly be done by walking the catalog tree, similar to
-   * finding a catalog given the path.
+   * Attached catalogs in the order of attachment.
    */
   CatalogList catalogs_;
+  /**
+   * Attached catalogs by the offset of their inode range, needed to find a
+   * catalog given an inode.
+   */
+  std::map<uint64_t, Catalog *> inode_ranges_;
   uint64_t inode_gauge_;  /**< highest issued inode */
+  /**
+   * Released inode ranges below the gauge, offset --> size.  Adjacent ranges
+   * are merged, the range touching the gauge lowers the gauge instead.
+   */
+  std::map<uint64_t, uint64_t> free_inodes_;
+  uint32_t inode_generation_;  /**< increased whenever inodes are released */
   pthread_rwlock_t *rwlock_;
   Statistics statistics_;
   pthread_key_t pkey_sqlitemem_;
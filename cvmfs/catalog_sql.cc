@@ -471,6 +471,7 @@ DirectoryEntry SqlLookup::GetDirent(const Catalog *catalog) const {
     result.uid_ = RetrieveInt64(13);
     result.gid_ = RetrieveInt64(14);
   }
+  result.generation_ = catalog->inode_range().generation;
   result.mode_ = RetrieveInt(3);
   result.size_ = RetrieveInt64(2);
   result.mtime_ = RetrieveInt64(4);
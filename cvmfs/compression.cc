@@ -12,11 +12,14 @@
 #include "compression.h"
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <alloca.h>
 
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 
 #include "logging.h"
 #include "hash.h"
@@ -185,6 +188,79 @@ StreamStates DecompressZStream2File(z_stream *strm, FILE *f, const void *buf,
 }
 
 
+/**
+ * Writes the buffered data of the sink to its file descriptor.
+ */
+bool FlushFdSink(FdSink *sink) {
+  size_t written = 0;
+  while (written < sink->pos) {
+    const ssize_t retval = pwrite(sink->fd, sink->buffer + written,
+                                  sink->pos - written, sink->offset + written);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    written += retval;
+  }
+  sink->offset += sink->pos;
+  sink->pos = 0;
+  return true;
+}
+
+
+/**
+ * Inflates directly into the buffer of the sink, which is written out when
+ * it is full.  Call FlushFdSink() after the end of the stream.
+ */
+StreamStates DecompressZStream2Fd(z_stream *strm, FdSink *sink,
+                                  const void *buf, const int64_t size)
+{
+  int z_ret;
+  strm->avail_in = size;
+  strm->next_in = (unsigned char *)buf;
+
+  // Run inflate() on input until output buffer not full
+  do {
+    strm->avail_out = sink->size - sink->pos;
+    strm->next_out = sink->buffer + sink->pos;
+    z_ret = inflate(strm, Z_NO_FLUSH);
+    switch (z_ret) {
+      case Z_NEED_DICT:
+        z_ret = Z_DATA_ERROR;  // and fall through
+      case Z_STREAM_ERROR:
+      case Z_DATA_ERROR:
+      case Z_MEM_ERROR:
+        return kStreamError;
+    }
+    sink->pos = sink->size - strm->avail_out;
+    if ((sink->pos == sink->size) && !FlushFdSink(sink))
+      return kStreamError;
+  } while (strm->avail_out == 0);
+
+  return (z_ret == Z_STREAM_END ? kStreamEnd : kStreamContinue);
+}
+
+
+/**
+ * Copies uncompressed data into the buffer of the sink.
+ */
+bool WriteFdSink(FdSink *sink, const void *buf, const int64_t size) {
+  int64_t pos = 0;
+  while (pos < size) {
+    const size_t num_bytes =
+      min(static_cast<int64_t>(sink->size - sink->pos), size - pos);
+    memcpy(sink->buffer + sink->pos, (const unsigned char *)buf + pos,
+           num_bytes);
+    sink->pos += num_bytes;
+    pos += num_bytes;
+    if ((sink->pos == sink->size) && !FlushFdSink(sink))
+      return false;
+  }
+  return true;
+}
+
+
 bool CompressPath2Path(const string &src, const string &dest) {
   FILE *fsrc = fopen(src.c_str(), "r");
   if (!fsrc) {
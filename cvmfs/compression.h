@@ -35,8 +35,24 @@ void DecompressInit(z_stream *strm);
 void CompressFini(z_stream *strm);
 void DecompressFini(z_stream *strm);
 
+/**
+ * Collects decompressed data in a large buffer that is written to fd at
+ * offset whenever it is full.
+ */
+struct FdSink {
+  int fd;
+  uint64_t offset;  /**< Bytes written to fd so far */
+  unsigned char *buffer;
+  size_t size;
+  size_t pos;  /**< Bytes in buffer not yet written */
+};
+
 StreamStates DecompressZStream2File(z_stream *strm, FILE *f, const void *buf,
                                     const int64_t size);
+StreamStates DecompressZStream2Fd(z_stream *strm, FdSink *sink,
+                                  const void *buf, const int64_t size);
+bool WriteFdSink(FdSink *sink, const void *buf, const int64_t size);
+bool FlushFdSink(FdSink *sink);
 
 bool CompressPath2Path(const std::string &src, const std::string &dest);
 bool CompressPath2Path(const std::string &src, const std::string &dest,
@@ -72,6 +72,15 @@
 #include "monitor.h"
 #include "signature.h"
 #include "quota.h"
+#include "pack_store.h"
+#include "ram_cache.h"
+#include "stripes.h"
+#include "memcache_snapshot.h"
+#include "pin_sets.h"
+#include "fuse_async.h"
+#include "fuse_loop.h"
+#include "latency.h"
+#include "metrics.h"
 #include "util.h"
 #include "atomic.h"
 #include "lru.h"
@@ -143,6 +152,32 @@ atomic_int32 drainout_mode_;
 time_t drainout_deadline_;
 time_t catalogs_valid_until_;
 
+/**
+ * Lookups that miss the md5path cache are counted per parent directory.  Once
+ * prefetch_threshold_ misses accumulate within kPrefetchWindow, the entire
+ * directory is loaded with a single listing and inserted as cold entries into
+ * the md5path and inode caches.  The threshold adapts to the share of
+ * prefetched entries that is used.
+ */
+struct PrefetchSlot {
+  fuse_ino_t parent;
+  uint64_t window_start;  /**< Microseconds */
+  unsigned num_misses;
+  bool prefetched;
+  unsigned num_prefetched;  /**< Entries inserted by the prefetch */
+  unsigned num_hits;  /**< Cached lookups in the directory since the prefetch */
+};
+const unsigned kPrefetchNumSlots = 64;
+const uint64_t kPrefetchWindow = 1000000;
+const unsigned kPrefetchMinThreshold = 2;
+const unsigned kPrefetchMaxThreshold = 64;
+PrefetchSlot prefetch_slots_[kPrefetchNumSlots];
+unsigned prefetch_threshold_ = 4;
+unsigned prefetch_max_entries_ = 0;  /**< Larger directories are skipped */
+pthread_mutex_t lock_prefetch_ = PTHREAD_MUTEX_INITIALIZER;
+atomic_int64 num_prefetch_;
+atomic_int64 num_prefetch_entries_;
+
 struct hash_dirhandle {
   size_t operator() (const uint64_t handle) const {
 #ifdef __x86_64__
@@ -172,6 +207,13 @@ unsigned max_open_files_; /**< maximum allowed number of open files */
 const int kNumReservedFd = 512;  /**< Number of reserved file descriptors for
                                       internal use */
 
+/**
+ * Small files from the RAM cache or the pack store are held in memory while
+ * they are open.  Their file handles have the kMemoryFileFlag bit set, the
+ * other bits are the pointer to the ram_cache::Object.
+ */
+const uint64_t kMemoryFileFlag = uint64_t(1) << 63;
+
 
 unsigned GetMaxTTL() {
   pthread_mutex_lock(&lock_max_ttl_);
@@ -247,6 +289,139 @@ string GetFsStats() {
 }
 
 
+static void CollectLruMetrics(const string &cache, lru::Statistics *stats,
+                              metrics::Collection *collection)
+{
+  const string label = "cache=\"" + cache + "\"";
+  collection->AddGauge("cvmfs_lru_size", label,
+                       "Capacity of the file catalog memory caches",
+                       stats->size);
+  collection->AddGauge("cvmfs_lru_allocated_bytes", label,
+                       "Memory allocated by the file catalog memory caches",
+                       atomic_read64(&stats->allocated));
+  collection->AddCounter("cvmfs_lru_hits_total", label,
+                         "Hits in the file catalog memory caches",
+                         atomic_read64(&stats->num_hit));
+  collection->AddCounter("cvmfs_lru_misses_total", label,
+                         "Misses in the file catalog memory caches",
+                         atomic_read64(&stats->num_miss));
+  collection->AddCounter("cvmfs_lru_inserts_total", label,
+                         "Insertions into the file catalog memory caches",
+                         atomic_read64(&stats->num_insert));
+  collection->AddCounter("cvmfs_lru_inserts_negative_total", label,
+                         "Negative insertions into the file catalog memory "
+                         "caches", atomic_read64(&stats->num_insert_negative));
+  collection->AddCounter("cvmfs_lru_replaces_total", label,
+                         "Evictions from the file catalog memory caches",
+                         atomic_read64(&stats->num_replace));
+  collection->AddCounter("cvmfs_lru_drops_total", label,
+                         "Flushes of the file catalog memory caches",
+                         atomic_read64(&stats->num_drop));
+}
+
+
+/**
+ * Metrics of the file system calls, the memory caches, the catalogs, the
+ * download manager, and the cache directory.
+ */
+static void CollectMetrics(metrics::Collection *collection) {
+  const string help_calls = "File system calls";
+  collection->AddCounter("cvmfs_fs_calls_total", "call=\"lookup\"",
+                         help_calls, atomic_read64(&num_fs_lookup_));
+  collection->AddCounter("cvmfs_fs_calls_total", "call=\"stat\"",
+                         help_calls, atomic_read64(&num_fs_stat_));
+  collection->AddCounter("cvmfs_fs_calls_total", "call=\"open\"",
+                         help_calls, atomic_read64(&num_fs_open_));
+  collection->AddCounter("cvmfs_fs_calls_total", "call=\"diropen\"",
+                         help_calls, atomic_read64(&num_fs_dir_open_));
+  collection->AddCounter("cvmfs_fs_calls_total", "call=\"read\"",
+                         help_calls, atomic_read64(&num_fs_read_));
+  collection->AddCounter("cvmfs_fs_calls_total", "call=\"readlink\"",
+                         help_calls, atomic_read64(&num_fs_readlink_));
+  collection->AddCounter("cvmfs_fs_lookups_negative_total", "",
+                         "Lookups of non-existing names",
+                         atomic_read64(&num_fs_lookup_negative_));
+  collection->AddCounter("cvmfs_io_errors_total", "",
+                         "Files that failed to open",
+                         atomic_read32(&num_io_error_));
+  collection->AddGauge("cvmfs_open_files", "", "Open file descriptors",
+                       atomic_read32(&open_files_));
+
+  lru::Statistics inode_stats;
+  lru::Statistics path_stats;
+  lru::Statistics md5path_stats;
+  GetLruStatistics(&inode_stats, &path_stats, &md5path_stats);
+  CollectLruMetrics("inode", &inode_stats, collection);
+  CollectLruMetrics("path", &path_stats, collection);
+  CollectLruMetrics("md5path", &md5path_stats, collection);
+
+  catalog::Statistics catalog_stats = GetCatalogStatistics();
+  const string help_catalog = "Lookups in the file catalogs";
+  collection->AddCounter("cvmfs_catalog_lookups_total", "type=\"inode\"",
+                         help_catalog,
+                         atomic_read64(&catalog_stats.num_lookup_inode));
+  collection->AddCounter("cvmfs_catalog_lookups_total", "type=\"path\"",
+                         help_catalog,
+                         atomic_read64(&catalog_stats.num_lookup_path));
+  collection->AddCounter("cvmfs_catalog_lookups_total",
+                         "type=\"path_negative\"", help_catalog,
+                         atomic_read64(&catalog_stats.num_lookup_path_negative));
+  collection->AddCounter("cvmfs_catalog_listings_total", "",
+                         "Directory listings from the file catalogs",
+                         atomic_read64(&catalog_stats.num_listing));
+  collection->AddCounter("cvmfs_lookup_prefetch_total", "",
+                         "Directories prefetched after lookups",
+                         atomic_read64(&num_prefetch_));
+  collection->AddCounter("cvmfs_lookup_prefetch_entries_total", "",
+                         "Entries inserted into the caches by prefetches",
+                         atomic_read64(&num_prefetch_entries_));
+  pthread_mutex_lock(&lock_prefetch_);
+  const unsigned prefetch_threshold = prefetch_threshold_;
+  pthread_mutex_unlock(&lock_prefetch_);
+  collection->AddGauge("cvmfs_lookup_prefetch_threshold", "",
+                       "Cache misses in a directory that trigger a prefetch",
+                       prefetch_threshold);
+  collection->AddGauge("cvmfs_catalog_revision", "",
+                       "Revision of the mounted root catalog",
+                       GetRevision());
+
+  collection->AddCounter("cvmfs_download_bytes_total", "",
+                         "Bytes received by the download manager",
+                         download::GetTransferredBytes());
+  collection->AddCounter("cvmfs_download_seconds_total", "",
+                         "Time spent in transfers by the download manager",
+                         download::GetTransferTime());
+  collection->AddCounter("cvmfs_cache_downloads_total", "",
+                         "Files downloaded into the cache",
+                         cache::GetNumDownloads());
+
+  if (quota::GetCapacity() > 0) {
+    const quota::EvictionStatistics evict = quota::GetEvictionStatistics();
+    collection->AddGauge("cvmfs_cache_capacity_bytes", "",
+                         "Limit of the cache size", quota::GetCapacity());
+    collection->AddGauge("cvmfs_cache_size_bytes", "", "Size of the cache",
+                         quota::GetSize());
+    collection->AddGauge("cvmfs_cache_pinned_bytes", "",
+                         "Size of the pinned files in the cache",
+                         quota::GetSizePinned());
+    collection->AddCounter("cvmfs_cache_evictions_total", "",
+                           "Runs of the cache cleanup", evict.num_runs);
+    collection->AddCounter("cvmfs_cache_evicted_files_total", "",
+                           "Files removed by the cache cleanup",
+                           evict.num_files);
+    collection->AddCounter("cvmfs_cache_evicted_bytes_total", "",
+                           "Bytes removed by the cache cleanup",
+                           evict.num_bytes);
+  }
+
+  if (nfs_maps_) {
+    collection->AddCounter("cvmfs_nfs_inodes_total", "",
+                           "Inodes issued by the NFS maps",
+                           nfs_maps::GetNumInodes());
+  }
+}
+
+
 static void AlarmReload(int signal __attribute__((unused)),
                         siginfo_t *siginfo __attribute__((unused)),
                         void *context __attribute__((unused)))
@@ -344,9 +519,13 @@ static bool GetDirentForInode(const fuse_ino_t ino,
   if (nfs_maps_) {
     // NFS mode
     PathString path;
-    if (nfs_maps::GetPath(ino, &path) &&
-        catalog_manager_->LookupPath(path, catalog::kLookupFull, dirent))
-    {
+    bool found = false;
+    if (nfs_maps::GetPath(ino, &path)) {
+      const uint64_t start = latency::Now();
+      found = catalog_manager_->LookupPath(path, catalog::kLookupFull, dirent);
+      latency::Record(latency::kCatalog, start);
+    }
+    if (found) {
       // Fix inodes
       dirent->set_inode(ino);
       catalog::DirectoryEntry parent_dirent;
@@ -365,7 +544,11 @@ static bool GetDirentForInode(const fuse_ino_t ino,
     }
   } else {
     // Normal mode
-    if (catalog_manager_->LookupInode(ino, catalog::kLookupFull, dirent)) {
+    const uint64_t start = latency::Now();
+    const bool found =
+      catalog_manager_->LookupInode(ino, catalog::kLookupFull, dirent);
+    latency::Record(latency::kCatalog, start);
+    if (found) {
       inode_cache_->Insert(ino, *dirent);
       return true;
     }
@@ -376,16 +559,132 @@ static bool GetDirentForInode(const fuse_ino_t ino,
 }
 
 
+/**
+ * Called when a slot is recycled.  If a good part of the prefetched entries was
+ * used, directories are prefetched earlier, otherwise the threshold doubles.
+ */
+static void EvaluatePrefetch(const PrefetchSlot &slot) {
+  if (!slot.prefetched || (slot.num_prefetched == 0))
+    return;
+  if ((slot.num_hits * 4 >= slot.num_prefetched) || (slot.num_hits >= 32)) {
+    if (prefetch_threshold_ > kPrefetchMinThreshold)
+      --prefetch_threshold_;
+  } else {
+    prefetch_threshold_ = min(2 * prefetch_threshold_, kPrefetchMaxThreshold);
+  }
+}
+
+
+/**
+ * Counts a lookup in the directory parent that missed the md5path cache.
+ * \return true if the directory should be prefetched now
+ */
+static bool NoteLookupMiss(const fuse_ino_t parent) {
+  const uint64_t now = latency::Now();
+  bool result = false;
+  pthread_mutex_lock(&lock_prefetch_);
+  PrefetchSlot *slot = &prefetch_slots_[parent % kPrefetchNumSlots];
+  if ((slot->parent != parent) || (now - slot->window_start > kPrefetchWindow))
+  {
+    EvaluatePrefetch(*slot);
+    slot->parent = parent;
+    slot->window_start = now;
+    slot->num_misses = 0;
+    slot->prefetched = false;
+    slot->num_prefetched = 0;
+    slot->num_hits = 0;
+  }
+  slot->num_misses++;
+  if (!slot->prefetched && (slot->num_misses >= prefetch_threshold_)) {
+    slot->prefetched = true;
+    result = true;
+  }
+  pthread_mutex_unlock(&lock_prefetch_);
+  return result;
+}
+
+
+static void NoteLookupHit(const fuse_ino_t parent) {
+  pthread_mutex_lock(&lock_prefetch_);
+  PrefetchSlot *slot = &prefetch_slots_[parent % kPrefetchNumSlots];
+  if ((slot->parent == parent) && slot->prefetched)
+    slot->num_hits++;
+  pthread_mutex_unlock(&lock_prefetch_);
+}
+
+
+/**
+ * Loads the directory with a single listing into the md5path and inode
+ * caches.  Nested catalog mountpoints are left to regular lookups, which
+ * return the root entry of the nested catalog instead.
+ */
+static void PrefetchDirectory(const PathString &parent_path,
+                              const fuse_ino_t parent_inode)
+{
+  catalog::DirectoryEntryList listing;
+  const uint64_t start = latency::Now();
+  const bool retval = catalog_manager_->Listing(parent_path, &listing);
+  latency::Record(latency::kCatalog, start);
+
+  unsigned num_inserted = 0;
+  if (retval && (listing.size() <= prefetch_max_entries_)) {
+    PathString path;
+    for (unsigned i = 0; i < listing.size(); ++i) {
+      catalog::DirectoryEntry *dirent = &listing[i];
+      if (dirent->IsNestedCatalogMountpoint())
+        continue;
+      path.Assign(parent_path);
+      path.Append("/", 1);
+      path.Append(dirent->name().GetChars(), dirent->name().GetLength());
+      dirent->set_parent_inode(parent_inode);
+      md5path_cache_->InsertCold(hash::Md5(path.GetChars(), path.GetLength()),
+                                 *dirent);
+      inode_cache_->InsertCold(dirent->inode(), *dirent);
+      ++num_inserted;
+    }
+    atomic_inc64(&num_prefetch_);
+    atomic_xadd64(&num_prefetch_entries_, num_inserted);
+  }
+  LogCvmfs(kLogCvmfs, kLogDebug, "prefetched %u entries of %s", num_inserted,
+           parent_path.c_str());
+
+  pthread_mutex_lock(&lock_prefetch_);
+  PrefetchSlot *slot = &prefetch_slots_[parent_inode % kPrefetchNumSlots];
+  if (slot->parent == parent_inode)
+    slot->num_prefetched = num_inserted;
+  pthread_mutex_unlock(&lock_prefetch_);
+}
+
+
+/**
+ * In normal mode, a lookup that misses the md5path cache can trigger the
+ * prefetch of the parent directory (see PrefetchSlot).
+ */
 static bool GetDirentForPath(const PathString &path,
                              const fuse_ino_t parent_inode,
                              catalog::DirectoryEntry *dirent)
 {
   hash::Md5 md5path(path.GetChars(), path.GetLength());
-  if (md5path_cache_->Lookup(md5path, dirent))
+  if (md5path_cache_->Lookup(md5path, dirent)) {
+    if (!nfs_maps_)
+      NoteLookupHit(parent_inode);
     return dirent->GetSpecial() != catalog::kDirentNegative;
+  }
+
+  if (!nfs_maps_ && NoteLookupMiss(parent_inode)) {
+    PrefetchDirectory(GetParentPath(path), parent_inode);
+    if (md5path_cache_->Lookup(md5path, dirent)) {
+      NoteLookupHit(parent_inode);
+      return true;
+    }
+  }
 
   // Lookup inode in catalog TODO: not twice md5 calculation
-  if (catalog_manager_->LookupPath(path, catalog::kLookupSole, dirent)) {
+  const uint64_t start = latency::Now();
+  const bool found =
+    catalog_manager_->LookupPath(path, catalog::kLookupSole, dirent);
+  latency::Record(latency::kCatalog, start);
+  if (found) {
     if (nfs_maps_) {
       // Fix inode
       dirent->set_inode(nfs_maps::GetInode(path));
@@ -443,10 +742,54 @@ static bool GetPathForInode(const fuse_ino_t ino, PathString *path) {
 }
 
 
+static void ReplyLookup(fuse_req_t req, const bool found,
+                        const catalog::DirectoryEntry &dirent)
+{
+  struct fuse_entry_param result;
+  memset(&result, 0, sizeof(result));
+  double timeout = GetKcacheTimeout();
+  result.attr_timeout = timeout;
+  result.entry_timeout = timeout;
+
+  if (found) {
+    result.ino = dirent.inode();
+    // Inodes from the NFS maps are never reused
+    result.generation = nfs_maps_ ? 0 : dirent.generation();
+    result.attr = dirent.GetStatStructure();
+  } else {
+    atomic_inc64(&num_fs_lookup_negative_);
+    result.ino = 0;
+  }
+  fuse_reply_entry(req, &result);
+}
+
+
+/**
+ * A lookup that waits for a nested catalog in an async worker.
+ */
+struct LookupRequest {
+  fuse_req_t req;
+  fuse_ino_t parent;
+  PathString path;
+  uint64_t start;
+};
+
+static void ReplyLookupAsync(void *data) {
+  LookupRequest *request = reinterpret_cast<LookupRequest *>(data);
+  catalog::DirectoryEntry dirent;
+  const bool found = GetDirentForPath(request->path, request->parent, &dirent);
+  ReplyLookup(request->req, found, dirent);
+  latency::Record(latency::kLookupAsync, request->start);
+  delete request;
+}
+
+
 /**
  * Find the inode number of a file name in a directory given by inode.
  * This or getattr is called as kind of prerequisit to every operation.
- * We do check catalog TTL here (and reload, if necessary).
+ * We do check catalog TTL here (and reload, if necessary).  Lookups that
+ * have to load a nested catalog are handed over to the async workers, if
+ * possible.
  */
 static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
                          const char *name)
@@ -461,12 +804,6 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
   PathString path;
   PathString parent_path;
   catalog::DirectoryEntry dirent;
-  struct fuse_entry_param result;
-
-  memset(&result, 0, sizeof(result));
-  double timeout = GetKcacheTimeout();
-  result.attr_timeout = timeout;
-  result.entry_timeout = timeout;
 
   // Special NFS lookups
   if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
@@ -496,21 +833,37 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
   path.Assign(parent_path);
   path.Append("/", 1);
   path.Append(name, strlen(name));
-  tracer::Trace(tracer::kFuseLookup, path, "lookup()");
+  if (fuse_async::IsEnabled()) {
+    if (md5path_cache_->Lookup(hash::Md5(path.GetChars(), path.GetLength()),
+                               &dirent))
+    {
+      if (!nfs_maps_)
+        NoteLookupHit(parent);
+      if (dirent.GetSpecial() == catalog::kDirentNegative)
+        goto reply_negative;
+      goto reply_positive;
+    }
+    if (catalog_manager_->NeedsMount(path)) {
+      LookupRequest *request = new LookupRequest();
+      request->req = req;
+      request->parent = parent;
+      request->path = path;
+      request->start = latency::Now();
+      if (fuse_async::Dispatch(ReplyLookupAsync, request))
+        return;
+      delete request;
+    }
+  }
   if (!GetDirentForPath(path, parent, &dirent)) {
     goto reply_negative;
   }
 
  reply_positive:
-  result.ino = dirent.inode();
-  result.attr = dirent.GetStatStructure();
-  fuse_reply_entry(req, &result);
+  ReplyLookup(req, true, dirent);
   return;
 
  reply_negative:
-  atomic_inc64(&num_fs_lookup_negative_);
-  result.ino = 0;
-  fuse_reply_entry(req, &result);
+  ReplyLookup(req, false, dirent);
 }
 
 
@@ -629,7 +982,11 @@ static void cvmfs_opendir(fuse_req_t req, fuse_ino_t ino,
 
   // Add all names
   catalog::StatEntryList listing_from_catalog;
-  if (!catalog_manager_->ListingStat(path, &listing_from_catalog)) {
+  const uint64_t start = latency::Now();
+  const bool retval = catalog_manager_->ListingStat(path,
+                                                    &listing_from_catalog);
+  latency::Record(latency::kCatalog, start);
+  if (!retval) {
     free(listing.buffer);
     fuse_reply_err(req, EIO);
     return;
@@ -744,9 +1101,257 @@ static void cvmfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 
 
 /**
- * Open a file from cache.  If necessary, file is downloaded first.
+ * If file has changed with a new catalog, the kernel data cache needs to be
+ * invalidated.  Special case: 0s metadata timeout includes no page cache
+ */
+static void SetKeepCache(const fuse_ino_t ino,
+                         catalog::DirectoryEntry *dirent,
+                         struct fuse_file_info *fi)
+{
+  fi->keep_cache = kcache_timeout_ == 0.0 ? 0 : 1;
+  if (dirent->cached_mtime() != dirent->mtime()) {
+    LogCvmfs(kLogCvmfs, kLogDebug,
+             "file might be new or changed, invalidating cache (%d %d)",
+             dirent->mtime(), dirent->cached_mtime());
+    fi->keep_cache = 0;
+    dirent->set_cached_mtime(dirent->mtime());
+    inode_cache_->Insert(ino, *dirent);
+  }
+}
+
+
+/**
+ * Reads a file from the disk cache into the RAM cache.  On success, the file
+ * descriptor fd is closed and set to 0.
  *
- * \return Read-only file descriptor in fi->fh
+ * \return Referenced object, or NULL with fd left open as a fallback
+ */
+static ram_cache::Object *ReadObject(const catalog::DirectoryEntry &dirent,
+                                     int *fd)
+{
+  platform_stat64 info;
+  if ((platform_fstat(*fd, &info) != 0) ||
+      (uint64_t(info.st_size) != dirent.size()))
+  {
+    return NULL;
+  }
+  const uint64_t size = info.st_size;
+  unsigned char *data =
+    static_cast<unsigned char *>(smalloc(size > 0 ? size : 1));
+  if (pread(*fd, data, size, 0) != int64_t(size)) {
+    free(data);
+    return NULL;
+  }
+  close(*fd);
+  *fd = 0;
+  return ram_cache::Insert(dirent.checksum(), data, size);
+}
+
+
+/**
+ * Gets a small file from the RAM cache, the pack store, or the disk cache.
+ * Files from the disk cache are read into memory.  If that fails, the file
+ * descriptor is returned in fd as a fallback.
+ *
+ * \return Referenced object, or NULL with a file descriptor or a negative
+ *         error code in fd
+ */
+static ram_cache::Object *FetchObject(const catalog::DirectoryEntry &dirent,
+                                      const string &cvmfs_path, int *fd)
+{
+  ram_cache::Object *object = ram_cache::Lookup(dirent.checksum());
+  if (object != NULL) {
+    quota::Touch(dirent.checksum());
+    *fd = 0;
+    return object;
+  }
+
+  unsigned char *data;
+  uint64_t size;
+  const uint64_t start = latency::Now();
+  if (dirent.size() < pack_store::GetThreshold()) {
+    *fd = cache::Fetch2Mem(dirent, cvmfs_path, download::kPriorityDemand,
+                           &data, &size);
+    latency::Record(latency::kCacheFetch, start);
+    if (*fd < 0)
+      return NULL;
+    return ram_cache::Insert(dirent.checksum(), data, size);
+  }
+
+  *fd = cache::Fetch(dirent, cvmfs_path, download::kPriorityDemand);
+  latency::Record(latency::kCacheFetch, start);
+  if (*fd < 0)
+    return NULL;
+  return ReadObject(dirent, fd);
+}
+
+
+/**
+ * Replies to an open request with the object in memory or, if object is NULL,
+ * with the file descriptor.
+ *
+ * \return false if fd is a download error, which the caller has to reply
+ */
+static bool ReplyOpenResult(fuse_req_t req, const fuse_ino_t ino,
+                            catalog::DirectoryEntry *dirent,
+                            const string &cvmfs_path,
+                            struct fuse_file_info *fi,
+                            ram_cache::Object *object, const int fd)
+{
+  if (object != NULL) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened in memory",
+             cvmfs_path.c_str());
+    SetKeepCache(ino, dirent, fi);
+    fi->fh = kMemoryFileFlag | uint64_t(reinterpret_cast<uintptr_t>(object));
+    fuse_reply_open(req, fi);
+    return true;
+  }
+
+  if (fd >= 0) {
+    if (atomic_xadd32(&open_files_, 1) <
+        (static_cast<int>(max_open_files_))-kNumReservedFd) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened (fd %d)",
+               cvmfs_path.c_str(), fd);
+      SetKeepCache(ino, dirent, fi);
+      fi->fh = fd;
+      fuse_reply_open(req, fi);
+      return true;
+    } else {
+      if (close(fd) == 0) atomic_dec32(&open_files_);
+      LogCvmfs(kLogCvmfs, kLogSyslog, "open file descriptor limit exceeded");
+      fuse_reply_err(req, EMFILE);
+      return true;
+    }
+  }
+
+  LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+           "failed to open inode: %d, CAS key %s, error code %d",
+           ino, dirent->checksum().ToString().c_str(), -fd);
+  if (fd == -EMFILE) {
+    fuse_reply_err(req, EMFILE);
+    return true;
+  }
+  return false;
+}
+
+
+/**
+ * Slows down the reply to a failed open, so that applications that retry
+ * right away do not hammer the proxies.
+ */
+static void DelayIoError() {
+  // Prevent Squid DoS
+  // TODO: move to download
+  time_t now = time(NULL);
+  if (now - previous_io_error_.timestamp < kForgetDos) {
+    usleep(previous_io_error_.delay*1000);
+    if (previous_io_error_.delay < kMaxIoDelay)
+      previous_io_error_.delay *= 2;
+  } else {
+    // Initial delay
+    previous_io_error_.delay = (random() % (kMaxInitIoDelay-1)) + 2;
+  }
+  previous_io_error_.timestamp = now;
+
+  atomic_inc32(&num_io_error_);
+}
+
+
+/**
+ * Fetches the file and replies to the open request.  Small files are held in
+ * memory if the RAM cache or the pack store is enabled.
+ */
+static void ReplyOpen(fuse_req_t req, const fuse_ino_t ino,
+                      catalog::DirectoryEntry *dirent,
+                      const string &cvmfs_path, struct fuse_file_info *fi)
+{
+  ram_cache::Object *object = NULL;
+  int fd = -1;
+  if ((dirent->size() < ram_cache::GetMaxObjectSize()) ||
+      (dirent->size() < pack_store::GetThreshold()))
+  {
+    object = FetchObject(*dirent, cvmfs_path, &fd);
+  } else {
+    const uint64_t start = latency::Now();
+    fd = cache::Fetch(*dirent, cvmfs_path, download::kPriorityDemand);
+    latency::Record(latency::kCacheFetch, start);
+  }
+  atomic_inc64(&num_fs_open_);
+
+  if (ReplyOpenResult(req, ino, dirent, cvmfs_path, fi, object, fd))
+    return;
+  DelayIoError();
+  fuse_reply_err(req, -fd);
+}
+
+
+/**
+ * An open request that waits for a download, either in an async worker or
+ * as a continuation of the download.
+ */
+struct OpenRequest {
+  fuse_req_t req;
+  fuse_ino_t ino;
+  catalog::DirectoryEntry dirent;
+  string cvmfs_path;
+  struct fuse_file_info fi;
+  uint64_t start;
+  int fd;  /**< Result of the download, set by ReplyOpenContinue() */
+};
+
+static void ReplyOpenAsync(void *data) {
+  OpenRequest *request = reinterpret_cast<OpenRequest *>(data);
+  ReplyOpen(request->req, request->ino, &request->dirent, request->cvmfs_path,
+            &request->fi);
+  latency::Record(latency::kOpenAsync, request->start);
+  delete request;
+}
+
+static void ReplyOpenErrorAsync(void *data) {
+  OpenRequest *request = reinterpret_cast<OpenRequest *>(data);
+  DelayIoError();
+  fuse_reply_err(request->req, -request->fd);
+  latency::Record(latency::kOpenAsync, request->start);
+  delete request;
+}
+
+
+/**
+ * Replies to an open request when its download is done.  Runs in the
+ * download I/O thread, which must not sleep, so that failed opens are
+ * delayed by an async worker.
+ */
+static void ReplyOpenContinue(int fd, void *data) {
+  OpenRequest *request = reinterpret_cast<OpenRequest *>(data);
+  ram_cache::Object *object = NULL;
+  // Files for the pack store are not fetched asynchronously, see cvmfs_open()
+  if ((fd >= 0) && (request->dirent.size() < ram_cache::GetMaxObjectSize()))
+    object = ReadObject(request->dirent, &fd);
+  atomic_inc64(&num_fs_open_);
+
+  if (!ReplyOpenResult(request->req, request->ino, &request->dirent,
+                       request->cvmfs_path, &request->fi, object, fd))
+  {
+    request->fd = fd;
+    if (fuse_async::Dispatch(ReplyOpenErrorAsync, request)) {
+      fuse_async::EndContinuation();
+      return;
+    }
+    atomic_inc32(&num_io_error_);
+    fuse_reply_err(request->req, -fd);
+  }
+  latency::Record(latency::kOpenAsync, request->start);
+  delete request;
+  fuse_async::EndContinuation();
+}
+
+
+/**
+ * Open a file from cache.  If necessary, file is downloaded first.  If
+ * possible, the fuse thread does not wait for downloads: the reply is sent
+ * from the completion of the download or by an async worker.
+ *
+ * \return Read-only file descriptor or ram_cache::Object handle in fi->fh
  */
 static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
                        struct fuse_file_info *fi)
@@ -754,7 +1359,6 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
   ino = catalog_manager_->MangleInode(ino);
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_open on inode: %d", ino);
 
-  int fd = -1;
   catalog::DirectoryEntry dirent;
   PathString path;
 
@@ -784,60 +1388,33 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
     return;
   }
 
-  fd = cache::Fetch(dirent, string(path.GetChars(), path.GetLength()));  // TODO
-  atomic_inc64(&num_fs_open_);
-
-  if (fd >= 0) {
-    if (atomic_xadd32(&open_files_, 1) <
-        (static_cast<int>(max_open_files_))-kNumReservedFd) {
-      LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened (fd %d)",
-               path.c_str(), fd);
-      // If file has changed with a new catalog, the kernel data cache needs
-      // to be invalidated.  Special case: 0s metadata timeout includes no page
-      // cache
-      fi->keep_cache = kcache_timeout_ == 0.0 ? 0 : 1;
-      if (dirent.cached_mtime() != dirent.mtime()) {
-        LogCvmfs(kLogCvmfs, kLogDebug,
-                 "file might be new or changed, invalidating cache (%d %d)",
-                 dirent.mtime(), dirent.cached_mtime());
-        fi->keep_cache = 0;
-        dirent.set_cached_mtime(dirent.mtime());
-        inode_cache_->Insert(ino, dirent);
+  const string cvmfs_path(path.GetChars(), path.GetLength());
+  if (fuse_async::IsEnabled() && !pack_store::Contains(dirent.checksum()) &&
+      !cache::Contains(dirent.checksum()))
+  {
+    OpenRequest *request = new OpenRequest();
+    request->req = req;
+    request->ino = ino;
+    request->dirent = dirent;
+    request->cvmfs_path = cvmfs_path;
+    request->fi = *fi;
+    request->start = latency::Now();
+    // Files for the pack store are downloaded into memory by the workers
+    if ((dirent.size() >= pack_store::GetThreshold()) &&
+        fuse_async::BeginContinuation())
+    {
+      if (cache::FetchAsync(dirent, cvmfs_path, download::kPriorityDemand,
+                            ReplyOpenContinue, request))
+      {
+        return;
       }
-      fi->fh = fd;
-      fuse_reply_open(req, fi);
-      return;
-    } else {
-      if (close(fd) == 0) atomic_dec32(&open_files_);
-      LogCvmfs(kLogCvmfs, kLogSyslog, "open file descriptor limit exceeded");
-      fuse_reply_err(req, EMFILE);
-      return;
+      fuse_async::EndContinuation();
     }
-  } else {
-    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
-             "failed to open inode: %d, CAS key %s, error code %d",
-             ino, dirent.checksum().ToString().c_str(), errno);
-    if (errno == EMFILE) {
-      fuse_reply_err(req, EMFILE);
+    if (fuse_async::Dispatch(ReplyOpenAsync, request))
       return;
-    }
+    delete request;
   }
-
-  // Prevent Squid DoS
-  // TODO: move to download
-  time_t now = time(NULL);
-  if (now - previous_io_error_.timestamp < kForgetDos) {
-    usleep(previous_io_error_.delay*1000);
-    if (previous_io_error_.delay < kMaxIoDelay)
-      previous_io_error_.delay *= 2;
-  } else {
-    // Initial delay
-    previous_io_error_.delay = (random() % (kMaxInitIoDelay-1)) + 2;
-  }
-  previous_io_error_.timestamp = now;
-
-  atomic_inc32(&num_io_error_);
-  fuse_reply_err(req, -fd);
+  ReplyOpen(req, ino, &dirent, cvmfs_path, fi);
 }
 
 
@@ -852,6 +1429,18 @@ static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
            catalog_manager_->MangleInode(ino), size, off, fi->fh);
   atomic_inc64(&num_fs_read_);
 
+  if (fi->fh & kMemoryFileFlag) {
+    const ram_cache::Object *object =
+      reinterpret_cast<const ram_cache::Object *>(
+        uintptr_t(fi->fh & ~kMemoryFileFlag));
+    const uint64_t begin = (uint64_t(off) < object->size) ? off : object->size;
+    const uint64_t end = (begin + size < object->size) ? begin + size :
+                         object->size;
+    fuse_reply_buf(req, reinterpret_cast<const char *>(object->data + begin),
+                   end - begin);
+    return;
+  }
+
   // Get data chunk (<=4k guaranteed by Fuse)
   char *data = static_cast<char *>(alloca(size));
   const int64_t fd = fi->fh;
@@ -877,6 +1466,13 @@ static void cvmfs_release(fuse_req_t req, fuse_ino_t ino,
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_release on inode: %d",
            catalog_manager_->MangleInode(ino));
 
+  if (fi->fh & kMemoryFileFlag) {
+    ram_cache::Release(reinterpret_cast<ram_cache::Object *>(
+      uintptr_t(fi->fh & ~kMemoryFileFlag)));
+    fuse_reply_err(req, 0);
+    return;
+  }
+
   const int64_t fd = fi->fh;
   if (close(fd) == 0) atomic_dec32(&open_files_);
 
@@ -1063,8 +1659,9 @@ static void cvmfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
   } else if (attr == "user.host") {
     vector<string> host_chain;
     vector<int> rtt;
+    vector<download::TransferScore> scores;
     unsigned current_host;
-    download::GetHostInfo(&host_chain, &rtt, &current_host);
+    download::GetHostInfo(&host_chain, &rtt, &scores, &current_host);
     if (host_chain.size()) {
       attribute_value = string(host_chain[current_host]);
     } else {
@@ -1161,9 +1758,10 @@ static void cvmfs_init(void *userdata, struct fuse_conn_info *conn) {
   talk::Spawn();
   if (nfs_maps_)
     nfs_maps::Spawn();
+  fuse_async::Spawn();
 
   if (*tracefile_ != "")
-    tracer::Init(8192, 7000, *tracefile_);
+    tracer::Init(1024, *tracefile_);
   else
     tracer::InitNull();
 
@@ -1175,11 +1773,157 @@ static void cvmfs_init(void *userdata, struct fuse_conn_info *conn) {
 #endif
 }
 
+/**
+ * File name of the memory cache snapshot, relative to the cache directory
+ */
+static string GetMemcacheSnapshotPath() {
+  return "memcache." + (*repository_name_);
+}
+
 static void cvmfs_destroy(void *unused __attribute__((unused))) {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_destroy");
+  // Pending replies have to be sent before the fuse channel is gone
+  fuse_async::Terminate();
+  // Warm restart: the next mount of the same root catalog reloads the caches
+  memcache_snapshot::Save(GetMemcacheSnapshotPath(),
+                          catalog_manager_->GetRootHash(), catalog_manager_,
+                          inode_cache_, path_cache_, md5path_cache_);
   tracer::Fini();
 }
 
+/**
+ * Traces a call on an inode together with the path of the inode.  Looking up
+ * the path is skipped if the tracer is off.
+ */
+static void TraceInode(const int event, const fuse_ino_t ino,
+                       const uint64_t duration)
+{
+  if (!tracer::active_)
+    return;
+  PathString path;
+  GetPathForInode(catalog_manager_->MangleInode(ino), &path);
+  tracer::Trace(event, ino, path, duration);
+}
+
+
+/**
+ * The callbacks as seen by fuse, recording the time until they return.
+ * Requests handed over to the async workers are recorded again when the
+ * worker replies.
+ */
+static void timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_lookup(req, parent, name);
+  const uint64_t duration = latency::Record(latency::kLookup, start);
+  if (tracer::active_) {
+    PathString path;
+    GetPathForInode(catalog_manager_->MangleInode(parent), &path);
+    path.Append("/", 1);
+    path.Append(name, strlen(name));
+    tracer::Trace(tracer::kFuseLookup, parent, path, duration);
+  }
+}
+
+static void timed_getattr(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_getattr(req, ino, fi);
+  TraceInode(tracer::kFuseStat, ino,
+             latency::Record(latency::kGetattr, start));
+}
+
+static void timed_readlink(fuse_req_t req, fuse_ino_t ino) {
+  const uint64_t start = latency::Now();
+  cvmfs_readlink(req, ino);
+  TraceInode(tracer::kFuseReadlink, ino,
+             latency::Record(latency::kReadlink, start));
+}
+
+static void timed_opendir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_opendir(req, ino, fi);
+  TraceInode(tracer::kFuseLs, ino, latency::Record(latency::kOpendir, start));
+}
+
+static void timed_releasedir(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_releasedir(req, ino, fi);
+  latency::Record(latency::kReleasedir, start);
+}
+
+static void timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_readdir(req, ino, size, off, fi);
+  latency::Record(latency::kReaddir, start);
+}
+
+static void timed_open(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_open(req, ino, fi);
+  TraceInode(tracer::kFuseOpen, ino, latency::Record(latency::kOpen, start));
+}
+
+/**
+ * Reads are traced without path, it is known from the preceding open.
+ */
+static void timed_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_read(req, ino, size, off, fi);
+  tracer::Trace(tracer::kFuseRead, ino, PathString(),
+                latency::Record(latency::kRead, start));
+}
+
+static void timed_release(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_release(req, ino, fi);
+  latency::Record(latency::kRelease, start);
+}
+
+static void timed_statfs(fuse_req_t req, fuse_ino_t ino) {
+  const uint64_t start = latency::Now();
+  cvmfs_statfs(req, ino);
+  latency::Record(latency::kStatfs, start);
+}
+
+#ifdef __APPLE__
+static void timed_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           size_t size, uint32_t position)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_getxattr(req, ino, name, size, position);
+  latency::Record(latency::kGetxattr, start);
+}
+#else
+static void timed_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           size_t size)
+{
+  const uint64_t start = latency::Now();
+  cvmfs_getxattr(req, ino, name, size);
+  latency::Record(latency::kGetxattr, start);
+}
+#endif
+
+static void timed_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  const uint64_t start = latency::Now();
+  cvmfs_listxattr(req, ino, size);
+  latency::Record(latency::kListxattr, start);
+}
+
+
 /**
  * Puts the callback functions in one single structure
  */
@@ -1190,18 +1934,18 @@ static void set_cvmfs_ops(struct fuse_lowlevel_ops *cvmfs_operations) {
   cvmfs_operations->init     = cvmfs_init;
   cvmfs_operations->destroy  = cvmfs_destroy;
 
-  cvmfs_operations->lookup      = cvmfs_lookup;
-  cvmfs_operations->getattr     = cvmfs_getattr;
-  cvmfs_operations->readlink    = cvmfs_readlink;
-  cvmfs_operations->open        = cvmfs_open;
-  cvmfs_operations->read        = cvmfs_read;
-  cvmfs_operations->release     = cvmfs_release;
-  cvmfs_operations->opendir     = cvmfs_opendir;
-  cvmfs_operations->readdir     = cvmfs_readdir;
-  cvmfs_operations->releasedir  = cvmfs_releasedir;
-  cvmfs_operations->statfs      = cvmfs_statfs;
-  cvmfs_operations->getxattr    = cvmfs_getxattr;
-  cvmfs_operations->listxattr   = cvmfs_listxattr;
+  cvmfs_operations->lookup      = timed_lookup;
+  cvmfs_operations->getattr     = timed_getattr;
+  cvmfs_operations->readlink    = timed_readlink;
+  cvmfs_operations->open        = timed_open;
+  cvmfs_operations->read        = timed_read;
+  cvmfs_operations->release     = timed_release;
+  cvmfs_operations->opendir     = timed_opendir;
+  cvmfs_operations->readdir     = timed_readdir;
+  cvmfs_operations->releasedir  = timed_releasedir;
+  cvmfs_operations->statfs      = timed_statfs;
+  cvmfs_operations->getxattr    = timed_getxattr;
+  cvmfs_operations->listxattr   = timed_listxattr;
 }
 
 }  // namespace cvmfs
@@ -1241,6 +1985,20 @@ struct CvmfsOptions {
   int      diskless;
   int      no_reload;
   int      shared_cache;
+  int      proxy_shard;
+  int      rebuild_background;
+  unsigned probe_interval;
+  unsigned download_threads;
+  unsigned prefetch_limit;
+  unsigned max_bandwidth;
+  unsigned pack_threshold;
+  unsigned ram_cache_size;
+  char     *cache_stripes;
+  unsigned cache_stripe_hot;
+  unsigned async_threads;
+  unsigned async_requests;
+  unsigned fuse_threads;
+  int      fuse_pin_threads;
 #ifdef CVMFS_NFS_SUPPORT
   int      nfs_source;
 #endif
@@ -1284,6 +2042,20 @@ static struct fuse_opt cvmfs_array_opts[] = {
   CVMFS_OPT("root_hash=%s",        root_hash, 0),
   CVMFS_SWITCH("no_reload",        no_reload),
   CVMFS_SWITCH("shared_cache",     shared_cache),
+  CVMFS_SWITCH("proxy_shard",      proxy_shard),
+  CVMFS_SWITCH("rebuild_background", rebuild_background),
+  CVMFS_OPT("probe_interval=%u",   probe_interval, 0),
+  CVMFS_OPT("download_threads=%u", download_threads, 0),
+  CVMFS_OPT("prefetch_limit=%u", prefetch_limit, 0),
+  CVMFS_OPT("max_bandwidth=%u", max_bandwidth, 0),
+  CVMFS_OPT("pack_threshold=%u", pack_threshold, 0),
+  CVMFS_OPT("ram_cache_size=%u", ram_cache_size, 0),
+  CVMFS_OPT("cache_stripes=%s", cache_stripes, 0),
+  CVMFS_OPT("cache_stripe_hot=%u", cache_stripe_hot, 0),
+  CVMFS_OPT("async_threads=%u", async_threads, 0),
+  CVMFS_OPT("async_requests=%u", async_requests, 0),
+  CVMFS_OPT("fuse_threads=%u", fuse_threads, 0),
+  CVMFS_SWITCH("fuse_pin_threads", fuse_pin_threads),
 #ifdef CVMFS_NFS_SUPPORT
   CVMFS_SWITCH("nfs_source",       nfs_source),
 #endif
@@ -1345,6 +2117,8 @@ static void usage(const char *progname) {
       "Except unsigned catalogs\n"
     " -o rebuild_cachedb         "
       "Force rebuilding the quota cache db from cache directory\n"
+    " -o rebuild_background      "
+      "Rebuild the quota cache db while the repository is mounted\n"
     " -o quota_limit=MB          "
       "Limit size of data chunks in cache. -1 Means unlimited.\n"
     " -o quota_threshold=MB      Cleanup until size is <= threshold\n"
@@ -1370,6 +2144,33 @@ static void usage(const char *progname) {
       "Avoids to reload catalogs when the TTL expires.\n"
     " -o shared_cache            "
       "Cache directory is shared among multiple instances\n"
+    " -o proxy_shard             "
+      "Select the proxy of a load-balancing group by consistent hashing\n"
+    " -o probe_interval=SECONDS  "
+      "Probe the hosts periodically in the background (default: off)\n"
+    " -o download_threads=NUMBER "
+      "Number of download I/O threads (default: 1)\n"
+    " -o prefetch_limit=NUMBER   "
+      "Concurrent background transfers (default: 4)\n"
+    " -o max_bandwidth=KB/S      "
+      "Limit the download bandwidth (default: unlimited)\n"
+    " -o pack_threshold=BYTES    "
+      "Keep files smaller than BYTES in the pack store (default: off)\n"
+    " -o ram_cache_size=MB       "
+      "Memory for hot small files in front of the disk cache (default: off)\n"
+    " -o cache_stripes=DIR:DIR   "
+      "Stripe the cache over additional directories\n"
+    " -o cache_stripe_hot=BYTES  "
+      "Keep smaller files on the fastest stripe (default: off)\n"
+    " -o async_threads=NUMBER    "
+      "Threads for opens and lookups that download (default: off)\n"
+    " -o async_requests=NUMBER   "
+      "Maximum number of queued asynchronous requests and of opens\n"
+      "                            waiting for a download (default: 256)\n"
+    " -o fuse_threads=NUMBER     "
+      "Fixed number of fuse worker threads (default: libfuse pool)\n"
+    " -o fuse_pin_threads        "
+      "Pin the fixed fuse worker threads to cpus\n"
 #ifdef CVMFS_NFS_SUPPORT
     " -o nfs_source              "
       "The CernVM-FS mountpoint is exported by NFS\n"
@@ -1403,6 +2204,7 @@ static void FreeCvmfsOptions(CvmfsOptions *opts) {
   if (opts->repo_name)      free(opts->repo_name);
   if (opts->interface)      free(opts->interface);
   if (opts->root_hash)      free(opts->root_hash);
+  if (opts->cache_stripes)  free(opts->cache_stripes);
   delete cvmfs::cachedir_;
   delete cvmfs::tracefile_;
   delete cvmfs::repository_name_;
@@ -1571,13 +2373,18 @@ int main(int argc, char *argv[]) {
   void *sqlite_page_cache = NULL;
   bool options_ready = false;
   bool download_ready = false;
+  bool fuse_async_ready = false;
   bool cache_ready = false;
+  bool pack_store_ready = false;
+  bool ram_cache_ready = false;
+  bool stripes_ready = false;
   bool nfs_maps_ready = false;
   bool peers_ready = false;
   bool monitor_ready = false;
   bool signature_ready = false;
   bool quota_ready = false;
   bool catalog_ready = false;
+  bool pin_sets_ready = false;
   bool talk_ready = false;
   bool running_created = false;
 
@@ -1647,6 +2454,8 @@ int main(int argc, char *argv[]) {
   atomic_init64(&cvmfs::num_fs_read_);
   atomic_init64(&cvmfs::num_fs_readlink_);
   atomic_init32(&cvmfs::num_io_error_);
+  atomic_init64(&cvmfs::num_prefetch_);
+  atomic_init64(&cvmfs::num_prefetch_entries_);
   cvmfs::previous_io_error_.timestamp = 0;
   cvmfs::previous_io_error_.delay = 0;
 
@@ -1751,6 +2560,42 @@ int main(int argc, char *argv[]) {
   }
   cache_ready = true;
 
+  // Additional cache directories, must be ready before quota
+  if (g_cvmfs_opts.cache_stripes) {
+    if (g_cvmfs_opts.shared_cache) {
+      PrintWarning("cache stripes are not supported with a shared cache");
+    } else {
+      if (!stripes::Init(".", g_cvmfs_opts.cache_stripes,
+                         g_cvmfs_opts.cache_stripe_hot))
+      {
+        PrintError("Failed to setup cache stripes in " +
+                   string(g_cvmfs_opts.cache_stripes));
+        goto cvmfs_cleanup;
+      }
+      stripes_ready = true;
+    }
+  }
+
+  // In-memory files are handed out by the RAM cache, even if it is disabled
+  if (!ram_cache::Init(uint64_t(g_cvmfs_opts.ram_cache_size) * 1024 * 1024)) {
+    PrintError("Failed to initialize RAM cache");
+    goto cvmfs_cleanup;
+  }
+  ram_cache_ready = true;
+
+  // Small files are appended to pack segments, must be ready before quota
+  if (g_cvmfs_opts.pack_threshold > 0) {
+    if (g_cvmfs_opts.shared_cache) {
+      PrintWarning("pack store is not supported with a shared cache");
+    } else {
+      if (!pack_store::Init(".", g_cvmfs_opts.pack_threshold)) {
+        PrintError("Failed to initialize pack store");
+        goto cvmfs_cleanup;
+      }
+      pack_store_ready = true;
+    }
+  }
+
   // Start NFS maps module, if necessary
 #ifdef CVMFS_NFS_SUPPORT
   if (g_cvmfs_opts.nfs_source) {
@@ -1791,6 +2636,7 @@ int main(int argc, char *argv[]) {
       goto cvmfs_cleanup;
     }
   } else {
+    quota::SetBackgroundRebuild(g_cvmfs_opts.rebuild_background);
     if (!quota::Init(".", (uint64_t)g_cvmfs_opts.quota_limit,
                      (uint64_t)g_cvmfs_opts.quota_threshold,
                      g_cvmfs_opts.rebuild_cachedb))
@@ -1838,8 +2684,19 @@ int main(int argc, char *argv[]) {
   download::SetProxyChain(g_cvmfs_opts.proxies ?
                           string(g_cvmfs_opts.proxies) : "");
   download::SetTimeout(g_cvmfs_opts.timeout, g_cvmfs_opts.timeout_direct);
+  download::SetProxySharding(g_cvmfs_opts.proxy_shard);
+  download::SetProbeInterval(g_cvmfs_opts.probe_interval);
+  download::SetNumWorkers(g_cvmfs_opts.download_threads);
+  if (g_cvmfs_opts.prefetch_limit > 0) {
+    download::SetPriorityLimit(download::kPriorityPrefetch,
+                               g_cvmfs_opts.prefetch_limit);
+  }
+  download::SetMaxBandwidth(uint64_t(g_cvmfs_opts.max_bandwidth) * 1024);
   download_ready = true;
 
+  fuse_async::Init(g_cvmfs_opts.async_threads, g_cvmfs_opts.async_requests);
+  fuse_async_ready = true;
+
   signature::Init();
   if (!signature::LoadPublicRsaKeys(g_cvmfs_opts.pubkey ?
                                     g_cvmfs_opts.pubkey : ""))
@@ -1879,6 +2736,12 @@ int main(int argc, char *argv[]) {
   }
   catalog_ready = true;
 
+  if (!pin_sets::Init(cvmfs::catalog_manager_)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "Failed to initialize pin sets");
+    goto cvmfs_cleanup;
+  }
+  pin_sets_ready = true;
+
   // Set fuse callbacks, remove url from arguments
   LogCvmfs(kLogCvmfs, kLogSyslog,
            "CernVM-FS: linking %s to repository %s",
@@ -1898,10 +2761,21 @@ int main(int argc, char *argv[]) {
     cvmfs::path_cache_ = new lru::PathCache(memcache_num_units & mask_64);
     cvmfs::md5path_cache_ =
       new lru::Md5PathCache((memcache_num_units*7) & mask_64);
+    // Prefetched directories must not flush the inode cache
+    cvmfs::prefetch_max_entries_ = (memcache_num_units & mask_64) / 4;
+    if (memcache_snapshot::Restore(cvmfs::GetMemcacheSnapshotPath(),
+                                   cvmfs::catalog_manager_->GetRootHash(),
+                                   cvmfs::catalog_manager_, cvmfs::inode_cache_,
+                                   cvmfs::path_cache_, cvmfs::md5path_cache_))
+    {
+      LogCvmfs(kLogCvmfs, kLogStdout, "CernVM-FS: restored memory caches");
+    }
   }
   cvmfs::directory_handles_ = new cvmfs::DirectoryHandles();
   cvmfs::directory_handles_->set_empty_key((uint64_t)(-1));
   cvmfs::directory_handles_->set_deleted_key((uint64_t)(-2));
+  metrics::Register(cvmfs::CollectMetrics);
+  metrics::Register(latency::CollectMetrics);
 
   if ((ch = fuse_mount(cvmfs::mountpoint_->c_str(), &g_fuse_args)) != NULL) {
     LogCvmfs(kLogCvmfs, kLogStdout, "CernVM-FS: mounted cvmfs on %s",
@@ -1933,10 +2807,14 @@ int main(int argc, char *argv[]) {
     if (se != NULL) {
       if (fuse_set_signal_handlers(se) != -1) {
         fuse_session_add_chan(se, ch);
-        if (g_single_threaded)
+        if (g_single_threaded) {
           result = fuse_session_loop(se);
-        else
+        } else if (g_cvmfs_opts.fuse_threads > 0) {
+          result = fuse_loop::Run(se, ch, g_cvmfs_opts.fuse_threads,
+                                  g_cvmfs_opts.fuse_pin_threads);
+        } else {
           result = fuse_session_loop_mt(se);
+        }
         fuse_remove_signal_handlers(se);
         fuse_session_remove_chan(ch);
       }
@@ -1946,6 +2824,8 @@ int main(int argc, char *argv[]) {
   }
   fuse_opt_free_args(&g_fuse_args);
 
+  metrics::Unregister(latency::CollectMetrics);
+  metrics::Unregister(cvmfs::CollectMetrics);
   delete cvmfs::catalog_manager_;
   delete cvmfs::directory_handles_;
   delete cvmfs::path_cache_;
@@ -1962,11 +2842,16 @@ int main(int argc, char *argv[]) {
 
  cvmfs_cleanup:
   if (signature_ready) signature::Fini();
+  if (fuse_async_ready) fuse_async::Fini();
   if (download_ready) download::Fini();
   if (talk_ready) talk::Fini();
+  if (pin_sets_ready) pin_sets::Fini();
   if (monitor_ready) monitor::Fini();
   if (quota_ready) quota::Fini();
+  if (pack_store_ready) pack_store::Fini();
+  if (ram_cache_ready) ram_cache::Fini();
   if (nfs_maps_ready) nfs_maps::Fini();
+  if (stripes_ready) stripes::Fini();
   if (cache_ready) cache::Fini();
   if (running_created) unlink(("running." + *cvmfs::repository_name_).c_str());
   if (fd_lockfile >= 0) UnlockFile(fd_lockfile);
@@ -0,0 +1,368 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool measures the download code against mock Stratum 1 servers and
+ * proxies on localhost (see mock_server.h).  A synthetic repository of
+ * content-addressed objects is created in a scratch directory and fetched in
+ * several scenarios:
+ *   - cold: a single thread fetches every object once, like a client that
+ *     mounts with an empty cache
+ *   - storm: all threads fetch every object at the same time, like many jobs
+ *     that start at once
+ *   - failover-proxy: the first proxy group refuses connections
+ *   - failover-host: direct connections, the first host answers with errors
+ * Latency, bandwidth, errors, and broken connections of the working servers
+ * are set on the command line.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "atomic.h"
+#include "util.h"
+#include "hash.h"
+#include "logging.h"
+#include "download.h"
+#include "mock_server.h"
+
+using namespace std;  // NOLINT
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage,
+  kErrorSetup,
+};
+
+struct Object {
+  string url;  /**< Relative to the host */
+  hash::Any hash;
+};
+
+struct Result {
+  vector<uint32_t> latencies;  /**< Microseconds */
+  unsigned num_errors;
+  uint64_t num_bytes;
+};
+
+unsigned g_num_files = 1000;
+uint64_t g_file_size = 16 * 1024;
+unsigned g_num_threads = 16;
+vector<Object> *g_objects = NULL;
+bool g_all_objects = false;  /**< Every thread fetches every object */
+atomic_int32 g_next_object;
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+    "CernVM File System download benchmark, version %s\n\n"
+    "Fetches a synthetic repository from mock servers on localhost\n\n"
+    "Usage: cvmfs_bench_download [-n files] [-s size] [-j threads] "
+    "[-l latency] [-b bandwidth] [-e error rate] [-d drop rate] "
+    "[-S scenario] <scratch directory>\n"
+    "Options:\n"
+    "  -n  number of files (default: 1000)\n"
+    "  -s  file size in bytes (default: 16384)\n"
+    "  -j  number of fetching threads (default: 16)\n"
+    "  -l  latency of every response in milliseconds (default: 0)\n"
+    "  -b  bandwidth per connection in kB/s (default: unlimited)\n"
+    "  -e  percentage of requests answered with 503 (default: 0)\n"
+    "  -d  percentage of transfers broken off (default: 0)\n"
+    "  -S  cold, storm, failover-proxy, failover-host, or all (default)",
+    VERSION);
+}
+
+
+static uint64_t Now() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return uint64_t(now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+
+/**
+ * Writes the objects to <scratch>/data/<hash>.  The content is pseudo-random
+ * and reproducible.
+ */
+static bool CreateRepository(const string &scratch_dir) {
+  if (!MkdirDeep(scratch_dir + "/data", 0755)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to create %s/data",
+             scratch_dir.c_str());
+    return false;
+  }
+
+  unsigned seed = 1;
+  unsigned char *buffer = static_cast<unsigned char *>(malloc(g_file_size));
+  assert(buffer);
+  for (unsigned i = 0; i < g_num_files; ++i) {
+    for (uint64_t pos = 0; pos < g_file_size; ++pos)
+      buffer[pos] = rand_r(&seed);
+    // Objects differ in their first bytes even if they are small
+    memcpy(buffer, &i, min(g_file_size, uint64_t(sizeof(i))));
+
+    Object object;
+    object.hash = hash::Any(hash::kSha1);
+    hash::HashMem(buffer, g_file_size, &object.hash);
+    object.url = "/data/" + object.hash.ToString();
+    FILE *f = fopen((scratch_dir + object.url).c_str(), "w");
+    if ((f == NULL) || (fwrite(buffer, 1, g_file_size, f) != g_file_size)) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to write %s%s",
+               scratch_dir.c_str(), object.url.c_str());
+      if (f) fclose(f);
+      free(buffer);
+      return false;
+    }
+    fclose(f);
+    g_objects->push_back(object);
+  }
+  free(buffer);
+  return true;
+}
+
+
+static void *MainFetch(void *data) {
+  Result *result = static_cast<Result *>(data);
+  unsigned position = 0;
+  while (true) {
+    const unsigned index = g_all_objects ? position++ :
+                           atomic_xadd32(&g_next_object, 1);
+    if (index >= g_objects->size())
+      break;
+
+    const Object &object = (*g_objects)[index];
+    download::JobInfo info(&object.url, false, true, &object.hash);
+    const uint64_t start = Now();
+    const download::Failures retval = download::Fetch(&info);
+    const uint64_t duration = Now() - start;
+    result->latencies.push_back(
+      (duration > 0xFFFFFFFFULL) ? 0xFFFFFFFF : duration);
+    if (retval == download::kFailOk)
+      result->num_bytes += info.destination_mem.size;
+    else
+      result->num_errors++;
+    free(info.destination_mem.data);
+  }
+  return NULL;
+}
+
+
+static uint32_t GetPercentile(const vector<uint32_t> &sorted,
+                              const double percentile)
+{
+  if (sorted.empty())
+    return 0;
+  unsigned index = unsigned(percentile * sorted.size());
+  if (index >= sorted.size())
+    index = sorted.size() - 1;
+  return sorted[index];
+}
+
+
+static void PrintHeader() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "%-15s %7s %7s %9s %8s %9s %9s %9s %9s %9s",
+           "scenario", "fetches", "errors", "fetches/s", "MB/s", "mean",
+           "median", "90%", "99%", "max");
+}
+
+
+/**
+ * Fetches the objects with a fresh instance of the download module that uses
+ * the given host and proxy chains.
+ */
+static void RunScenario(const string &name, const string &host_chain,
+                        const string &proxy_chain, const unsigned num_threads,
+                        const bool all_objects)
+{
+  download::Init(16);
+  download::SetHostChain(host_chain);
+  if (proxy_chain != "")
+    download::SetProxyChain(proxy_chain);
+  download::SetTimeout(2, 2);
+  download::Spawn();
+
+  g_all_objects = all_objects;
+  atomic_init32(&g_next_object);
+  Result *results = new Result[num_threads];
+  pthread_t *threads = new pthread_t[num_threads];
+  const uint64_t start = Now();
+  for (unsigned i = 0; i < num_threads; ++i) {
+    results[i].num_errors = 0;
+    results[i].num_bytes = 0;
+    int retval = pthread_create(&threads[i], NULL, MainFetch, &results[i]);
+    assert(retval == 0);
+  }
+  for (unsigned i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+  const double seconds = double(Now() - start) / 1000000.0;
+
+  vector<uint32_t> latencies;
+  unsigned num_errors = 0;
+  uint64_t num_bytes = 0;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    latencies.insert(latencies.end(), results[i].latencies.begin(),
+                     results[i].latencies.end());
+    num_errors += results[i].num_errors;
+    num_bytes += results[i].num_bytes;
+  }
+  sort(latencies.begin(), latencies.end());
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < latencies.size(); ++i)
+    sum += latencies[i];
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "%-15s %7u %7u %9.0f %8.2f %9"PRIu64" %9u %9u %9u %9u",
+           name.c_str(), unsigned(latencies.size()), num_errors,
+           double(latencies.size()) / seconds,
+           double(num_bytes) / (1024.0 * 1024.0) / seconds,
+           latencies.empty() ? 0 : sum / latencies.size(),
+           GetPercentile(latencies, 0.5), GetPercentile(latencies, 0.9),
+           GetPercentile(latencies, 0.99), GetPercentile(latencies, 1.0));
+
+  vector<string> hosts;
+  vector<int> rtt;
+  vector<download::TransferScore> scores;
+  unsigned current_host = 0;
+  download::GetHostInfo(&hosts, &rtt, &scores, &current_host);
+  vector< vector<string> > proxy_groups;
+  unsigned current_group = 0;
+  download::GetProxyInfo(&proxy_groups, &current_group);
+  if ((current_host > 0) || (current_group > 0)) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "%-15s failed over to host %u, "
+             "proxy group %u", "", current_host, current_group);
+  }
+  download::Fini();
+
+  delete[] threads;
+  delete[] results;
+}
+
+
+static bool StartServer(const mock_server::Config &config,
+                        mock_server::Server **server)
+{
+  *server = new mock_server::Server(config);
+  if (!(*server)->Start(0)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to start mock server");
+    return false;
+  }
+  return true;
+}
+
+
+int main(int argc, char **argv) {
+  mock_server::Config config;
+  string scenario = "all";
+  char c;
+  while ((c = getopt(argc, argv, "hn:s:j:l:b:e:d:S:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'n':
+        g_num_files = String2Uint64(optarg);
+        break;
+      case 's':
+        g_file_size = String2Uint64(optarg);
+        break;
+      case 'j':
+        g_num_threads = String2Uint64(optarg);
+        break;
+      case 'l':
+        config.latency_ms = String2Uint64(optarg);
+        break;
+      case 'b':
+        config.bandwidth = String2Uint64(optarg) * 1024;
+        break;
+      case 'e':
+        config.error_rate = String2Uint64(optarg);
+        break;
+      case 'd':
+        config.drop_rate = String2Uint64(optarg);
+        break;
+      case 'S':
+        scenario = optarg;
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if ((optind >= argc) || (g_num_threads == 0) || (g_num_files == 0) ||
+      (g_file_size == 0) ||
+      ((scenario != "all") && (scenario != "cold") && (scenario != "storm") &&
+       (scenario != "failover-proxy") && (scenario != "failover-host")))
+  {
+    Usage();
+    return kErrorUsage;
+  }
+
+  const string scratch_dir = MakeCanonicalPath(argv[optind]);
+  g_objects = new vector<Object>();
+  if (!CreateRepository(scratch_dir))
+    return kErrorSetup;
+
+  // Two working hosts and proxies, a host that fails every request, and a
+  // proxy that is gone
+  mock_server::Config config_host = config;
+  config_host.root = scratch_dir;
+  mock_server::Config config_broken;
+  config_broken.error_rate = 100;
+  mock_server::Server *host1, *host2, *proxy1, *proxy2, *host_broken, *dead;
+  if (!StartServer(config_host, &host1) || !StartServer(config_host, &host2) ||
+      !StartServer(config, &proxy1) || !StartServer(config, &proxy2) ||
+      !StartServer(config_broken, &host_broken) ||
+      !StartServer(config, &dead))
+  {
+    return kErrorSetup;
+  }
+  dead->Stop();
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "%u files of %s bytes, %u threads, "
+           "latency %u ms, bandwidth %s, %u%% errors, %u%% drops",
+           g_num_files, StringifyInt(g_file_size).c_str(), g_num_threads,
+           config.latency_ms, (config.bandwidth == 0) ? "unlimited" :
+           (StringifyInt(config.bandwidth / 1024) + " kB/s").c_str(),
+           config.error_rate, config.drop_rate);
+  PrintHeader();
+  const string hosts = host1->url() + ";" + host2->url();
+  const string proxies = proxy1->url() + "|" + proxy2->url();
+  if ((scenario == "all") || (scenario == "cold"))
+    RunScenario("cold", hosts, proxies, 1, false);
+  if ((scenario == "all") || (scenario == "storm"))
+    RunScenario("storm", hosts, proxies, g_num_threads, true);
+  if ((scenario == "all") || (scenario == "failover-proxy")) {
+    RunScenario("failover-proxy", hosts, dead->url() + ";" + proxies,
+                g_num_threads, false);
+  }
+  if ((scenario == "all") || (scenario == "failover-host")) {
+    RunScenario("failover-host", host_broken->url() + ";" + hosts, "",
+                g_num_threads, false);
+  }
+  LogCvmfs(kLogCvmfs, kLogStdout, "latencies in microseconds");
+
+  mock_server::Server *servers[] =
+    { host1, host2, proxy1, proxy2, host_broken, dead };
+  for (unsigned i = 0; i < sizeof(servers) / sizeof(servers[0]); ++i) {
+    servers[i]->Stop();
+    delete servers[i];
+  }
+  RemoveTree(scratch_dir + "/data");
+  delete g_objects;
+  return kErrorOk;
+}
@@ -0,0 +1,183 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool measures the NFS maps the way a listing of a large directory over
+ * NFS uses them.  Every entry of the directory is looked up once by path,
+ * which issues the inodes on the first listing.  NFS clients come back with
+ * the inodes later, so all inodes are then resolved to paths.  The listing is
+ * repeated after the maps are reopened, i.e. with empty memory caches.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "util.h"
+#include "logging.h"
+#include "shortstring.h"
+#include "nfs_maps.h"
+
+using namespace std;  // NOLINT
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage,
+  kErrorSetup,
+};
+
+enum Phase {
+  kPhaseLookup = 0,
+  kPhaseGetPath,
+};
+
+const uint64_t kRootInode = 256;
+
+unsigned g_num_entries = 100000;
+unsigned g_num_threads = 1;
+vector<uint64_t> g_inodes;
+atomic_int64 g_num_errors;
+
+struct Worker {
+  pthread_t thread;
+  unsigned first;  /**< Workers take every g_num_threads'th entry */
+  Phase phase;
+};
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "CernVM File System NFS maps benchmark, version %s\n\n"
+           "Usage: cvmfs_bench_nfs_maps [-n entries] [-j threads] "
+           "<scratch directory>\n"
+           "  -n  number of entries in the listed directory (default: 100000)\n"
+           "  -j  number of threads sharing the listing (default: 1)",
+           VERSION);
+}
+
+
+static PathString MakePath(const unsigned number) {
+  const string path = "/dir/entry_" + StringifyInt(number);
+  return PathString(path.data(), path.length());
+}
+
+
+static void *MainWorker(void *data) {
+  Worker *worker = static_cast<Worker *>(data);
+  for (unsigned i = worker->first; i < g_num_entries; i += g_num_threads) {
+    if (worker->phase == kPhaseLookup) {
+      const uint64_t inode = nfs_maps::GetInode(MakePath(i));
+      if ((g_inodes[i] != 0) && (g_inodes[i] != inode))
+        atomic_inc64(&g_num_errors);
+      g_inodes[i] = inode;
+    } else {
+      PathString path;
+      if (!nfs_maps::GetPath(g_inodes[i], &path) || (path != MakePath(i)))
+        atomic_inc64(&g_num_errors);
+    }
+  }
+  return NULL;
+}
+
+
+static void RunPhase(const string &name, const Phase phase) {
+  vector<Worker> workers(g_num_threads);
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    workers[i].first = i;
+    workers[i].phase = phase;
+    int retval = pthread_create(&workers[i].thread, NULL, MainWorker,
+                                &workers[i]);
+    assert(retval == 0);
+  }
+  for (unsigned i = 0; i < g_num_threads; ++i)
+    pthread_join(workers[i].thread, NULL);
+  gettimeofday(&end, NULL);
+
+  const double seconds = DiffTimeSeconds(start, end);
+  LogCvmfs(kLogCvmfs, kLogStdout, "%-24s %10.0f ops/s  (%.2f s)",
+           name.c_str(), (seconds > 0.0) ? g_num_entries / seconds : 0.0,
+           seconds);
+}
+
+
+int main(int argc, char **argv) {
+  char c;
+  while ((c = getopt(argc, argv, "hn:j:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'n':
+        g_num_entries = String2Uint64(optarg);
+        break;
+      case 'j':
+        g_num_threads = String2Uint64(optarg);
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if ((optind >= argc) || (g_num_entries == 0) || (g_num_threads == 0)) {
+    Usage();
+    return kErrorUsage;
+  }
+
+  const string scratch_dir = MakeCanonicalPath(argv[optind]) +
+                             "/cvmfs_bench_nfs_maps." + StringifyInt(getpid());
+  if (!MkdirDeep(scratch_dir, 0700)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to create %s",
+             scratch_dir.c_str());
+    return kErrorSetup;
+  }
+  if (!nfs_maps::Init(scratch_dir, kRootInode, true)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to initialize NFS maps");
+    RemoveTree(scratch_dir);
+    return kErrorSetup;
+  }
+  nfs_maps::Spawn();
+  g_inodes.resize(g_num_entries, 0);
+  atomic_init64(&g_num_errors);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "%u entries, %u threads",
+           g_num_entries, g_num_threads);
+  RunPhase("first listing", kPhaseLookup);
+  RunPhase("second listing", kPhaseLookup);
+  RunPhase("inode --> path", kPhaseGetPath);
+  nfs_maps::Fini();
+
+  if (!nfs_maps::Init(scratch_dir, kRootInode, false)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to reopen NFS maps");
+    RemoveTree(scratch_dir);
+    return kErrorSetup;
+  }
+  nfs_maps::Spawn();
+  RunPhase("listing after reopen", kPhaseLookup);
+  RunPhase("inode --> path", kPhaseGetPath);
+  LogCvmfs(kLogCvmfs, kLogStdout, "%s", nfs_maps::GetStatistics().c_str());
+  nfs_maps::Fini();
+  RemoveTree(scratch_dir);
+
+  const int64_t num_errors = atomic_read64(&g_num_errors);
+  if (num_errors > 0) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "%"PRId64" inconsistent mappings",
+             num_errors);
+    return kErrorSetup;
+  }
+  return kErrorOk;
+}
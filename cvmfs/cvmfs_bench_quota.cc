@@ -0,0 +1,258 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool measures how many touches per second the quota manager handles.
+ * For comparison, the same access pattern is run against a SQLite cache
+ * catalog the way the quota manager maintained it before the in-memory index
+ * (one UPDATE per touch, 32 touches per transaction).
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <string>
+
+#include "platform.h"
+#include "util.h"
+#include "hash.h"
+#include "logging.h"
+#include "duplex_sqlite3.h"
+#include "quota.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs {
+bool foreground_ = true;  // Referenced by the shared quota manager
+}
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage,
+  kErrorSetup,
+};
+
+const unsigned kTransactionSize = 32;
+const uint64_t kFileSize = 4096;
+
+unsigned g_num_files = 10000;
+unsigned g_num_touches = 1000000;
+unsigned g_num_threads = 1;
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "CernVM File System quota manager benchmark, version %s\n\n"
+           "Usage: cvmfs_bench_quota [-n files] [-t touches] [-j threads] "
+           "<scratch directory>\n"
+           "  -n  number of files in the cache (default: 10000)\n"
+           "  -t  number of touches (default: 1000000)\n"
+           "  -j  number of touching threads (default: 1)",
+           VERSION);
+}
+
+
+/**
+ * Files are numbered, the number is the content hash.  The digest must not be
+ * null, which is the empty key of the quota manager's index.
+ */
+static hash::Any MakeHash(const unsigned number) {
+  hash::Any result(hash::kSha1);
+  const uint64_t value = uint64_t(number) + 1;
+  memcpy(result.digest, &value, sizeof(value));
+  return result;
+}
+
+
+static double Rate(const unsigned num_operations,
+                   const struct timeval &start, const struct timeval &end)
+{
+  const double seconds = DiffTimeSeconds(start, end);
+  if (seconds <= 0.0)
+    return 0.0;
+  return double(num_operations) / seconds;
+}
+
+
+/**
+ * Replays the touches against a plain SQLite cache catalog.
+ */
+static bool BenchSqlite(const string &db_path) {
+  sqlite3 *db;
+  if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to open %s", db_path.c_str());
+    return false;
+  }
+  int retval = sqlite3_exec(db,
+    "PRAGMA synchronous=0; PRAGMA locking_mode=EXCLUSIVE; "
+    "PRAGMA auto_vacuum=1; "
+    "CREATE TABLE cache_catalog (sha1 TEXT, size INTEGER, "
+    "  acseq INTEGER, path TEXT, type INTEGER, pinned INTEGER, "
+    "CONSTRAINT pk_cache_catalog PRIMARY KEY (sha1)); "
+    "CREATE UNIQUE INDEX idx_cache_catalog_acseq ON cache_catalog (acseq);",
+    NULL, NULL, NULL);
+  if (retval != SQLITE_OK) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to create cache catalog");
+    sqlite3_close(db);
+    return false;
+  }
+
+  sqlite3_stmt *stmt_new;
+  sqlite3_stmt *stmt_touch;
+  sqlite3_prepare_v2(db,
+                     "INSERT INTO cache_catalog "
+                     "(sha1, size, acseq, path, type, pinned) "
+                     "VALUES (:sha1, :s, :seq, :p, 0, 0);",
+                     -1, &stmt_new, NULL);
+  sqlite3_prepare_v2(db, "UPDATE cache_catalog SET acseq=:seq "
+                     "WHERE sha1=:sha1;", -1, &stmt_touch, NULL);
+  uint64_t seq = 0;
+  sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  for (unsigned i = 0; i < g_num_files; ++i) {
+    const string hash_str = MakeHash(i).ToString();
+    const string path = "/bench/" + StringifyInt(i);
+    sqlite3_bind_text(stmt_new, 1, &hash_str[0], hash_str.length(),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt_new, 2, kFileSize);
+    sqlite3_bind_int64(stmt_new, 3, seq++);
+    sqlite3_bind_text(stmt_new, 4, &path[0], path.length(), SQLITE_STATIC);
+    sqlite3_step(stmt_new);
+    sqlite3_reset(stmt_new);
+  }
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+
+  struct timeval start, end;
+  srandom(42);
+  gettimeofday(&start, NULL);
+  for (unsigned i = 0; i < g_num_touches; ++i) {
+    if ((i % kTransactionSize) == 0)
+      sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    const string hash_str = MakeHash(random() % g_num_files).ToString();
+    sqlite3_bind_int64(stmt_touch, 1, seq++);
+    sqlite3_bind_text(stmt_touch, 2, &hash_str[0], hash_str.length(),
+                      SQLITE_STATIC);
+    sqlite3_step(stmt_touch);
+    sqlite3_reset(stmt_touch);
+    if (((i + 1) % kTransactionSize) == 0)
+      sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  }
+  if ((g_num_touches % kTransactionSize) != 0)
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  gettimeofday(&end, NULL);
+
+  sqlite3_finalize(stmt_touch);
+  sqlite3_finalize(stmt_new);
+  sqlite3_close(db);
+  LogCvmfs(kLogCvmfs, kLogStdout, "SQLite cache catalog: %.0f touches/s",
+           Rate(g_num_touches, start, end));
+  return true;
+}
+
+
+static void *MainTouch(void *data) {
+  unsigned seed = *static_cast<unsigned *>(data);
+  const unsigned num_touches = g_num_touches / g_num_threads;
+  for (unsigned i = 0; i < num_touches; ++i)
+    quota::Touch(MakeHash(rand_r(&seed) % g_num_files));
+  return NULL;
+}
+
+
+/**
+ * Runs the touches through the quota manager.  The time includes processing
+ * of all touches because the final status request is queued behind them.
+ */
+static bool BenchQuota(const string &cache_dir) {
+  if (!MakeCacheDirectories(cache_dir, 0700)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to create %s", cache_dir.c_str());
+    return false;
+  }
+  const uint64_t limit = uint64_t(g_num_files) * kFileSize * 4;
+  if (!quota::Init(cache_dir, limit, limit / 2, false)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to initialize quota manager");
+    return false;
+  }
+  quota::Spawn();
+  for (unsigned i = 0; i < g_num_files; ++i)
+    quota::Insert(MakeHash(i), kFileSize, "/bench/" + StringifyInt(i));
+  quota::GetSize();
+
+  pthread_t *threads = new pthread_t[g_num_threads];
+  unsigned *seeds = new unsigned[g_num_threads];
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    seeds[i] = 42 + i;
+    int retval = pthread_create(&threads[i], NULL, MainTouch, &seeds[i]);
+    assert(retval == 0);
+  }
+  for (unsigned i = 0; i < g_num_threads; ++i)
+    pthread_join(threads[i], NULL);
+  const uint64_t gauge = quota::GetSize();
+  gettimeofday(&end, NULL);
+  delete[] seeds;
+  delete[] threads;
+
+  quota::Fini();
+  const unsigned num_touches = (g_num_touches / g_num_threads) * g_num_threads;
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "quota manager:        %.0f touches/s (%u threads, gauge %"PRIu64
+           " KB)", Rate(num_touches, start, end), g_num_threads, gauge / 1024);
+  return true;
+}
+
+
+int main(int argc, char **argv) {
+  char c;
+  while ((c = getopt(argc, argv, "hn:t:j:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'n':
+        g_num_files = String2Uint64(optarg);
+        break;
+      case 't':
+        g_num_touches = String2Uint64(optarg);
+        break;
+      case 'j':
+        g_num_threads = String2Uint64(optarg);
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if ((optind >= argc) || (g_num_files == 0) || (g_num_threads == 0)) {
+    Usage();
+    return kErrorUsage;
+  }
+
+  const string scratch_dir = MakeCanonicalPath(argv[optind]) +
+                             "/cvmfs_bench_quota." + StringifyInt(getpid());
+  if (!MkdirDeep(scratch_dir, 0700)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to create %s",
+             scratch_dir.c_str());
+    return kErrorSetup;
+  }
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "%u files, %u touches",
+           g_num_files, g_num_touches);
+  bool result = BenchSqlite(scratch_dir + "/legacy.db") &&
+                BenchQuota(scratch_dir + "/cache");
+  RemoveTree(scratch_dir);
+
+  return result ? kErrorOk : kErrorSetup;
+}
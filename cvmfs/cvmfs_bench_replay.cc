@@ -0,0 +1,476 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool replays a trace of the client (see tracer.h) against a mounted
+ * repository or in-process against libcvmfs and reports throughput and
+ * latency percentiles per operation.  Lookups and stats are replayed as
+ * lstat(), listings read the entire directory, opens are followed by a close.
+ * Reads are traced without path and offset; they read the next block of the
+ * file that was last opened under the same inode, file descriptors are kept
+ * open for reads until the end of the replay.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "platform.h"
+#include "atomic.h"
+#include "util.h"
+#include "logging.h"
+#include "tracer.h"
+#include "libcvmfs.h"
+
+using namespace std;  // NOLINT
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage,
+  kErrorSetup,
+};
+
+enum Operation {
+  kOpLookup = 0,
+  kOpStat,
+  kOpReadlink,
+  kOpLs,
+  kOpOpen,
+  kOpRead,
+  kNumOperations,
+};
+
+const char *kOperationNames[] = {
+  "lookup", "stat", "readlink", "ls", "open", "read"
+};
+
+/**
+ * Size of a replayed read, the maximum read request of fuse.
+ */
+const unsigned kReadSize = 128 * 1024;
+
+struct Request {
+  uint64_t time;  /**< Microseconds since the first traced record */
+  Operation operation;
+  string path;
+  uint64_t offset;  /**< Of reads */
+};
+
+struct Result {
+  vector<uint32_t> latencies[kNumOperations];  /**< Microseconds */
+  unsigned num_errors[kNumOperations];
+};
+
+unsigned g_num_threads = 1;
+double g_speed = 0.0;
+bool g_libcvmfs = false;
+string *g_mountpoint = NULL;
+vector<Request> *g_requests = NULL;
+atomic_int32 g_next_request;
+uint64_t g_start = 0;
+
+/**
+ * File descriptors of files that are read, by path
+ */
+map<string, int> *g_read_fds = NULL;
+pthread_mutex_t g_lock_read_fds = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "CernVM File System trace replay benchmark, version %s\n\n"
+           "Usage: cvmfs_bench_replay [-j threads] [-s speed] "
+           "-m <mount point> | -l <libcvmfs options> <trace file>\n"
+           "  -j  number of replaying threads (default: 1)\n"
+           "  -s  keep the traced pace, accelerated by speed "
+           "(default: 0, as fast as possible)\n"
+           "  -m  replay against the repository mounted at <mount point>\n"
+           "  -l  replay in-process with libcvmfs, options as for cvmfs_init()",
+           VERSION);
+}
+
+
+static uint64_t Now() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return uint64_t(now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+
+/**
+ * Loads the trace sorted by time.  Reads get the path of the last traced
+ * call on their inode.
+ */
+static bool LoadTrace(const string &path, vector<Request> *requests) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == NULL) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to open %s", path.c_str());
+    return false;
+  }
+
+  vector<tracer::Record> all_records;
+  vector<string> all_paths;
+  tracer::BlockHeader header;
+  vector<tracer::Record> records;
+  string paths;
+  tracer::ReadResult retval;
+  while ((retval = tracer::ReadBlock(f, &header, &records, &paths)) ==
+         tracer::kReadOk)
+  {
+    for (unsigned i = 0; i < records.size(); ++i) {
+      all_records.push_back(records[i]);
+      all_paths.push_back(paths.substr(records[i].path_offset,
+                                       records[i].path_length));
+    }
+  }
+  fclose(f);
+  if (retval == tracer::kReadCorrupted) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "corrupted trace file %s", path.c_str());
+    return false;
+  }
+
+  vector< pair<uint64_t, unsigned> > order;
+  for (unsigned i = 0; i < all_records.size(); ++i)
+    order.push_back(make_pair(all_records[i].timestamp, i));
+  stable_sort(order.begin(), order.end());
+
+  map<uint64_t, string> inode2path;
+  map<uint64_t, uint64_t> inode2offset;
+  unsigned num_skipped = 0;
+  for (unsigned i = 0; i < order.size(); ++i) {
+    const tracer::Record &record = all_records[order[i].second];
+    Request request;
+    request.time = order[i].first - order[0].first;
+    request.path = all_paths[order[i].second];
+    request.offset = 0;
+    switch (record.event) {
+      case tracer::kFuseLookup:
+        // Traced with the parent inode
+        request.operation = kOpLookup;
+        break;
+      case tracer::kFuseStat:
+        request.operation = kOpStat;
+        break;
+      case tracer::kFuseReadlink:
+        request.operation = kOpReadlink;
+        break;
+      case tracer::kFuseLs:
+        request.operation = kOpLs;
+        break;
+      case tracer::kFuseOpen:
+        request.operation = kOpOpen;
+        inode2offset[record.inode] = 0;
+        break;
+      case tracer::kFuseRead:
+        request.operation = kOpRead;
+        if (inode2path.find(record.inode) == inode2path.end()) {
+          num_skipped++;
+          continue;
+        }
+        request.path = inode2path[record.inode];
+        request.offset = inode2offset[record.inode];
+        inode2offset[record.inode] += kReadSize;
+        break;
+      default:
+        continue;
+    }
+    if (record.event != tracer::kFuseLookup)
+      inode2path[record.inode] = request.path;
+    requests->push_back(request);
+  }
+
+  if (num_skipped > 0) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "skipped %u reads of unknown files",
+             num_skipped);
+  }
+  return true;
+}
+
+
+static string GetPosixPath(const string &path) {
+  return *g_mountpoint + path;
+}
+
+
+static string GetLibcvmfsPath(const string &path) {
+  return (path == "") ? "/" : path;
+}
+
+
+static int GetReadFd(const string &path) {
+  pthread_mutex_lock(&g_lock_read_fds);
+  map<string, int>::const_iterator i = g_read_fds->find(path);
+  if (i != g_read_fds->end()) {
+    const int fd = i->second;
+    pthread_mutex_unlock(&g_lock_read_fds);
+    return fd;
+  }
+  const int fd = g_libcvmfs ?
+                 cvmfs_open(GetLibcvmfsPath(path).c_str()) :
+                 open(GetPosixPath(path).c_str(), O_RDONLY);
+  if (fd >= 0)
+    (*g_read_fds)[path] = fd;
+  pthread_mutex_unlock(&g_lock_read_fds);
+  return fd;
+}
+
+
+static void CloseReadFds() {
+  for (map<string, int>::const_iterator i = g_read_fds->begin(),
+       iEnd = g_read_fds->end(); i != iEnd; ++i)
+  {
+    if (g_libcvmfs)
+      cvmfs_close(i->second);
+    else
+      close(i->second);
+  }
+  g_read_fds->clear();
+}
+
+
+static bool ReplayPosix(const Request &request, char *buffer) {
+  const string path = GetPosixPath(request.path);
+  switch (request.operation) {
+    case kOpLookup:
+    case kOpStat: {
+      platform_stat64 info;
+      return platform_lstat(path.c_str(), &info) == 0;
+    }
+    case kOpReadlink:
+      return readlink(path.c_str(), buffer, kReadSize) >= 0;
+    case kOpLs: {
+      DIR *dirp = opendir(path.c_str());
+      if (dirp == NULL)
+        return false;
+      while (platform_readdir(dirp) != NULL) { }
+      closedir(dirp);
+      return true;
+    }
+    case kOpOpen: {
+      const int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      close(fd);
+      return true;
+    }
+    case kOpRead: {
+      const int fd = GetReadFd(request.path);
+      return (fd >= 0) && (pread(fd, buffer, kReadSize, request.offset) >= 0);
+    }
+    default:
+      assert(false);
+  }
+  return false;
+}
+
+
+static bool ReplayLibcvmfs(const Request &request, char *buffer) {
+  const string path = GetLibcvmfsPath(request.path);
+  switch (request.operation) {
+    case kOpLookup:
+    case kOpStat: {
+      struct stat info;
+      return cvmfs_lstat(path.c_str(), &info) == 0;
+    }
+    case kOpReadlink:
+      return cvmfs_readlink(path.c_str(), buffer, kReadSize) == 0;
+    case kOpLs: {
+      char **entries = NULL;
+      size_t num_entries = 0;
+      if (cvmfs_listdir(path.c_str(), &entries, &num_entries) != 0)
+        return false;
+      for (unsigned i = 0; (i < num_entries) && (entries[i] != NULL); ++i)
+        free(entries[i]);
+      free(entries);
+      return true;
+    }
+    case kOpOpen: {
+      const int fd = cvmfs_open(path.c_str());
+      if (fd < 0)
+        return false;
+      cvmfs_close(fd);
+      return true;
+    }
+    case kOpRead: {
+      const int fd = GetReadFd(request.path);
+      return (fd >= 0) && (pread(fd, buffer, kReadSize, request.offset) >= 0);
+    }
+    default:
+      assert(false);
+  }
+  return false;
+}
+
+
+static void *MainReplay(void *data) {
+  Result *result = static_cast<Result *>(data);
+  char *buffer = static_cast<char *>(malloc(kReadSize));
+  assert(buffer != NULL);
+
+  int32_t i;
+  while ((i = atomic_xadd32(&g_next_request, 1)) <
+         static_cast<int32_t>(g_requests->size()))
+  {
+    const Request &request = (*g_requests)[i];
+    if (g_speed > 0.0) {
+      const uint64_t due = g_start + uint64_t(request.time / g_speed);
+      const uint64_t now = Now();
+      if (due > now) {
+        struct timespec wait;
+        wait.tv_sec = (due - now) / 1000000;
+        wait.tv_nsec = ((due - now) % 1000000) * 1000;
+        nanosleep(&wait, NULL);
+      }
+    }
+
+    const uint64_t start = Now();
+    const bool retval = g_libcvmfs ? ReplayLibcvmfs(request, buffer) :
+                                     ReplayPosix(request, buffer);
+    const uint64_t duration = Now() - start;
+    result->latencies[request.operation].push_back(duration);
+    if (!retval)
+      result->num_errors[request.operation]++;
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+
+static uint32_t GetPercentile(const vector<uint32_t> &sorted,
+                              const double fraction)
+{
+  unsigned index = unsigned(fraction * sorted.size());
+  if (index >= sorted.size())
+    index = sorted.size() - 1;
+  return sorted[index];
+}
+
+
+static void PrintReport(Result *results, const uint64_t wall_time) {
+  const double seconds = (wall_time > 0) ? double(wall_time) / 1000000.0 :
+                                           1e-6;
+  LogCvmfs(kLogCvmfs, kLogStdout, "%-9s %9s %7s %9s %9s %9s %9s %9s %9s",
+           "operation", "count", "errors", "ops/s", "mean", "median", "90%",
+           "99%", "max");
+  unsigned total = 0;
+  for (unsigned op = 0; op < kNumOperations; ++op) {
+    vector<uint32_t> latencies;
+    unsigned num_errors = 0;
+    for (unsigned i = 0; i < g_num_threads; ++i) {
+      latencies.insert(latencies.end(), results[i].latencies[op].begin(),
+                       results[i].latencies[op].end());
+      num_errors += results[i].num_errors[op];
+    }
+    if (latencies.empty())
+      continue;
+    total += latencies.size();
+
+    sort(latencies.begin(), latencies.end());
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < latencies.size(); ++i)
+      sum += latencies[i];
+    LogCvmfs(kLogCvmfs, kLogStdout,
+             "%-9s %9u %7u %9.0f %9"PRIu64" %9u %9u %9u %9u",
+             kOperationNames[op], unsigned(latencies.size()), num_errors,
+             double(latencies.size()) / seconds, sum / latencies.size(),
+             GetPercentile(latencies, 0.5), GetPercentile(latencies, 0.9),
+             GetPercentile(latencies, 0.99), latencies[latencies.size() - 1]);
+  }
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "%u operations in %.2f seconds (%.0f ops/s, %u threads), "
+           "latencies in microseconds",
+           total, seconds, double(total) / seconds, g_num_threads);
+}
+
+
+int main(int argc, char **argv) {
+  string libcvmfs_options;
+  char c;
+  while ((c = getopt(argc, argv, "hj:s:m:l:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'j':
+        g_num_threads = String2Uint64(optarg);
+        break;
+      case 's':
+        g_speed = atof(optarg);
+        break;
+      case 'm':
+        g_mountpoint = new string(MakeCanonicalPath(optarg));
+        break;
+      case 'l':
+        g_libcvmfs = true;
+        libcvmfs_options = optarg;
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if ((optind >= argc) || (g_num_threads == 0) || (g_speed < 0.0) ||
+      (g_libcvmfs == (g_mountpoint != NULL)))
+  {
+    Usage();
+    return kErrorUsage;
+  }
+
+  g_requests = new vector<Request>();
+  if (!LoadTrace(argv[optind], g_requests))
+    return kErrorSetup;
+  LogCvmfs(kLogCvmfs, kLogStdout, "replaying %u operations",
+           unsigned(g_requests->size()));
+  if (g_libcvmfs && (cvmfs_init(libcvmfs_options.c_str()) != 0)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to initialize libcvmfs");
+    return kErrorSetup;
+  }
+
+  g_read_fds = new map<string, int>();
+  atomic_init32(&g_next_request);
+  Result *results = new Result[g_num_threads];
+  pthread_t *threads = new pthread_t[g_num_threads];
+  g_start = Now();
+  for (unsigned i = 0; i < g_num_threads; ++i) {
+    memset(results[i].num_errors, 0, sizeof(results[i].num_errors));
+    int retval = pthread_create(&threads[i], NULL, MainReplay, &results[i]);
+    assert(retval == 0);
+  }
+  for (unsigned i = 0; i < g_num_threads; ++i)
+    pthread_join(threads[i], NULL);
+  const uint64_t wall_time = Now() - g_start;
+
+  PrintReport(results, wall_time);
+  CloseReadFds();
+  if (g_libcvmfs)
+    cvmfs_fini();
+
+  delete[] threads;
+  delete[] results;
+  delete g_read_fds;
+  delete g_requests;
+  delete g_mountpoint;
+  return kErrorOk;
+}
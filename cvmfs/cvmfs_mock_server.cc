@@ -0,0 +1,121 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool serves a repository directory over HTTP on localhost and acts as
+ * a forward proxy at the same time.  It replaces Apache and Squid in tests
+ * that should not depend on the network.  Faults are injected as requested on
+ * the command line.
+ */
+
+#include "cvmfs_config.h"
+
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "mock_server.h"
+#include "util.h"
+#include "logging.h"
+
+using namespace std;  // NOLINT
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage,
+  kErrorSetup,
+};
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+    "CernVM File System mock server, version %s\n\n"
+    "Serves a directory as web server and forward proxy on 127.0.0.1\n\n"
+    "Usage: cvmfs_mock_server [-p port] [-l latency] [-b bandwidth] "
+    "[-e error rate] [-d drop rate] [-r seed] [directory]\n"
+    "Options:\n"
+    "  -p  port to listen on (default: any free port)\n"
+    "  -l  latency of every response in milliseconds\n"
+    "  -b  bandwidth per connection in kB/s (default: unlimited)\n"
+    "  -e  percentage of requests answered with 503\n"
+    "  -d  percentage of transfers broken off before the end\n"
+    "  -r  random seed for the injected faults (default: 1)\n"
+    "Without a directory, only proxy requests are served.  "
+    "Terminates on SIGINT and SIGTERM.",
+    VERSION);
+}
+
+
+int main(int argc, char **argv) {
+  mock_server::Config config;
+  uint16_t port = 0;
+  int c;
+  while ((c = getopt(argc, argv, "hp:l:b:e:d:r:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'p':
+        port = String2Uint64(optarg);
+        break;
+      case 'l':
+        config.latency_ms = String2Uint64(optarg);
+        break;
+      case 'b':
+        config.bandwidth = String2Uint64(optarg) * 1024;
+        break;
+      case 'e':
+        config.error_rate = String2Uint64(optarg);
+        break;
+      case 'd':
+        config.drop_rate = String2Uint64(optarg);
+        break;
+      case 'r':
+        config.seed = String2Uint64(optarg);
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if (optind < argc) {
+    config.root = MakeCanonicalPath(argv[optind]);
+    if (!DirectoryExists(config.root)) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "%s is not a directory",
+               config.root.c_str());
+      return kErrorUsage;
+    }
+  }
+
+  // Block the termination signals in all threads and wait for them here
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGINT);
+  sigaddset(&sigset, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  mock_server::Server server(config);
+  if (!server.Start(port)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to listen on port %u", port);
+    return kErrorSetup;
+  }
+  LogCvmfs(kLogCvmfs, kLogStdout, "%s", server.url().c_str());
+
+  int signal_number;
+  sigwait(&sigset, &signal_number);
+  server.Stop();
+
+  mock_server::Statistics *statistics = server.statistics();
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "requests: %s, proxied: %s, ranges: %s, errors: %s, drops: %s, "
+           "bytes sent: %s",
+           StringifyInt(atomic_read64(&statistics->num_requests)).c_str(),
+           StringifyInt(atomic_read64(&statistics->num_proxied)).c_str(),
+           StringifyInt(atomic_read64(&statistics->num_ranges)).c_str(),
+           StringifyInt(atomic_read64(&statistics->num_errors)).c_str(),
+           StringifyInt(atomic_read64(&statistics->num_drops)).c_str(),
+           StringifyInt(atomic_read64(&statistics->num_bytes)).c_str());
+  return kErrorOk;
+}
@@ -0,0 +1,213 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool converts a binary trace file written by the tracer into CSV or
+ * JSON.
+ */
+
+#include "cvmfs_config.h"
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <cstring>
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "tracer.h"
+#include "util.h"
+#include "logging.h"
+
+using namespace std;  // NOLINT
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage = 1,
+  kErrorIo = 2,
+  kErrorFormat = 4,
+};
+
+struct Entry {
+  uint32_t thread;
+  tracer::Record record;
+  string path;
+
+  bool operator <(const Entry &other) const {
+    return record.timestamp < other.record.timestamp;
+  }
+};
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+    "CernVM File System trace converter, version %s\n\n"
+    "Converts a binary trace file into CSV or JSON on stdout\n\n"
+    "Usage: cvmfs_trace_convert [-j] [-s] <trace file>\n"
+    "Options:\n"
+    "  -j      JSON output, one object per line\n"
+    "  -s      sort the records of all threads by time",
+    VERSION);
+}
+
+
+static string GetEventName(const int32_t event) {
+  switch (event) {
+    case -1: return "tracer_start";
+    case -2: return "tracer_stop";
+    case -3: return "tracer_flush";
+    case tracer::kFuseOpen: return "open";
+    case tracer::kFuseLs: return "ls";
+    case tracer::kFuseRead: return "read";
+    case tracer::kFuseReadlink: return "readlink";
+    case tracer::kFuseKcache: return "kcache";
+    case tracer::kFuseLookup: return "lookup";
+    case tracer::kFuseStat: return "stat";
+    case tracer::kFuseCrowd: return "crowd";
+    default: return StringifyInt(event);
+  }
+}
+
+
+static string EscapeCsv(const string &field) {
+  string result = "\"";
+  for (unsigned i = 0; i < field.length(); ++i) {
+    if (field[i] == '"')
+      result += '"';
+    result += field[i];
+  }
+  return result + "\"";
+}
+
+
+static string EscapeJson(const string &field) {
+  string result = "\"";
+  for (unsigned i = 0; i < field.length(); ++i) {
+    const unsigned char c = field[i];
+    if ((c == '"') || (c == '\\')) {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+
+static void PrintEntry(const Entry &entry, const bool json) {
+  const string timestamp =
+    StringifyInt(entry.record.timestamp / 1000000) + "." +
+    StringifyInt(1000000 + entry.record.timestamp % 1000000).substr(1);
+  if (json) {
+    printf("{\"thread\": %u, \"timestamp\": %s, \"event\": %s, "
+           "\"inode\": %s, \"duration\": %u, \"path\": %s}\n",
+           entry.thread, timestamp.c_str(),
+           EscapeJson(GetEventName(entry.record.event)).c_str(),
+           StringifyInt(entry.record.inode).c_str(), entry.record.duration,
+           EscapeJson(entry.path).c_str());
+  } else {
+    printf("%u,%s,%s,%s,%u,%s\n", entry.thread, timestamp.c_str(),
+           GetEventName(entry.record.event).c_str(),
+           StringifyInt(entry.record.inode).c_str(), entry.record.duration,
+           EscapeCsv(entry.path).c_str());
+  }
+}
+
+
+/**
+ * Reads the next block into entries.
+ */
+static tracer::ReadResult ReadEntries(FILE *f, vector<Entry> *entries,
+                                      uint64_t *num_dropped)
+{
+  tracer::BlockHeader header;
+  vector<tracer::Record> records;
+  string paths;
+  const tracer::ReadResult retval =
+    tracer::ReadBlock(f, &header, &records, &paths);
+  if (retval != tracer::kReadOk)
+    return retval;
+
+  for (unsigned i = 0; i < records.size(); ++i) {
+    Entry entry;
+    entry.thread = header.thread;
+    entry.record = records[i];
+    entry.path = paths.substr(records[i].path_offset, records[i].path_length);
+    entries->push_back(entry);
+  }
+  *num_dropped += header.num_dropped;
+  return tracer::kReadOk;
+}
+
+
+int main(int argc, char **argv) {
+  bool json = false;
+  bool sort_entries = false;
+  int c;
+  while ((c = getopt(argc, argv, "hjs")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'j':
+        json = true;
+        break;
+      case 's':
+        sort_entries = true;
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if (optind >= argc) {
+    Usage();
+    return kErrorUsage;
+  }
+
+  FILE *f = fopen(argv[optind], "r");
+  if (f == NULL) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to open %s", argv[optind]);
+    return kErrorIo;
+  }
+
+  vector<Entry> entries;
+  uint64_t num_dropped = 0;
+  tracer::ReadResult retval;
+  if (!json)
+    printf("thread,timestamp,event,inode,duration,path\n");
+  while ((retval = ReadEntries(f, &entries, &num_dropped)) == tracer::kReadOk)
+  {
+    if (sort_entries)
+      continue;
+    for (unsigned i = 0; i < entries.size(); ++i)
+      PrintEntry(entries[i], json);
+    entries.clear();
+  }
+  fclose(f);
+
+  if (sort_entries) {
+    stable_sort(entries.begin(), entries.end());
+    for (unsigned i = 0; i < entries.size(); ++i)
+      PrintEntry(entries[i], json);
+  }
+
+  if (num_dropped > 0) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "%s records were dropped while tracing",
+             StringifyInt(num_dropped).c_str());
+  }
+  if (retval == tracer::kReadCorrupted) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "corrupted trace file %s", argv[optind]);
+    return kErrorFormat;
+  }
+  return kErrorOk;
+}
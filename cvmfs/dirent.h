@@ -24,6 +24,10 @@ namespace publish {
 class SyncItem;
 }
 
+namespace memcache_snapshot {
+class DirentSerializer;
+}
+
 namespace catalog {
 
 class Catalog;
@@ -39,6 +43,7 @@ class DirectoryEntry {
   friend class SqlDirentWrite;          // simplify write of DirectoryEntry objects in database
   friend class publish::SyncItem;       // simplify creation of DirectoryEntry objects for write back
   friend class WritableCatalogManager;  // TODO: remove this dependency
+  friend class memcache_snapshot::DirentSerializer;  // save across restarts
 
 public:
   const static inode_t kInvalidInode = 0;
@@ -54,6 +59,7 @@ public:
     mode_(0),
     uid_(0),
     gid_(0),
+    generation_(0),
     size_(0),
     mtime_(0),
     cached_mtime_(0),
@@ -77,6 +83,7 @@ public:
 
   inline inode_t inode() const { return inode_; }
   inline inode_t parent_inode() const { return parent_inode_; }
+  inline uint32_t generation() const { return generation_; }
   inline uint32_t linkcount() const { return Hardlinks2Linkcount(hardlinks_); }
   inline uint32_t hardlink_group() const {
     return Hardlinks2HardlinkGroup(hardlinks_);
@@ -161,6 +168,7 @@ private:
   unsigned int mode_;
   uid_t uid_;
   gid_t gid_;
+  uint32_t generation_;  // of the inode, see InodeRange
   uint64_t size_;
   time_t mtime_;
   time_t cached_mtime_;  /**< can be compared to mtime to figure out if caches
@@ -8,20 +8,40 @@
  *
  * The module starts in single-threaded mode and can be switched to multi-
  * threaded mode by Spawn().  In multi-threaded mode, the Fetch() function still
- * blocks but there is a separate I/O thread using asynchronous I/O, which
- * maintains all concurrent connections simultaneously.  As there might be more
- * than 1024 file descriptors for the CernVM-FS process, the I/O thread uses
- * poll and the libcurl multi socket interface.
+ * blocks but there are separate I/O threads using asynchronous I/O, which
+ * maintain all concurrent connections simultaneously.  As there might be more
+ * than 1024 file descriptors for the CernVM-FS process, the I/O threads use
+ * poll and the libcurl multi socket interface.  Every I/O thread (worker) has
+ * its own multi handle and pool of easy handles.  Jobs for the same object are
+ * sent to the same worker unless it is considerably busier than the others.
+ *
+ * Jobs belong to priority classes (catalogs, demand, prefetch).  The number of
+ * concurrent transfers per class can be limited, in which case jobs queue up
+ * in the worker and are started in order of priority.  An optional token
+ * bucket limits the overall bandwidth; transfers that run out of tokens are
+ * paused and resumed in order of priority.
  *
  * While downloading, files can be decompressed and the secure hash can be
  * calculated on the fly.
  *
  * The module also implements failure handling.  If corrupted data has been
  * downloaded, the transfer is restarted using HTTP "no-cache" pragma.
+ * Interrupted transfers of files with a known content hash are continued by
+ * an HTTP range request, possibly through another proxy or host.  The hash
+ * and inflate state is kept, so it matches the data already written.  If the
+ * server ignores the range, the download restarts from byte zero.
  * A "host chain" can be configured.  When a host fails, there is automatic
  * fail-over to the next host in the chain until all hosts are probed.
  * Similarly a chain of proxy sets can be configured.  Inside a proxy set,
- * proxies are selected randomly (load-balancing set).
+ * proxies are selected randomly (load-balancing set).  Optionally, the proxy
+ * is selected by consistent hashing of the content hash over the proxy set
+ * (sharding), so that every proxy of a set caches a different part of the
+ * repository.
+ *
+ * Successful transfers feed moving averages of latency and throughput per host
+ * and per proxy.  Hosts, and the proxies of the active group, are kept ordered
+ * by the resulting expected completion time.  Hosts can be probed in parallel,
+ * optionally periodically by a background thread.
  */
 
 //TODO: MS for time summing
@@ -45,6 +65,9 @@
 #include <cstdio>
 
 #include <set>
+#include <map>
+#include <deque>
+#include <algorithm>
 
 #include "duplex_curl.h"
 #include "logging.h"
@@ -58,22 +81,41 @@ using namespace std;  // NOLINT
 
 namespace download {
 
-set<CURL *>  *pool_handles_idle_ = NULL;
-set<CURL *>  *pool_handles_inuse_ = NULL;
+/**
+ * State of a download I/O thread.  Worker 0 exists from Init() on and also
+ * serves Fetch() in single-threaded mode.
+ */
+struct Worker {
+  unsigned id;
+  set<CURL *> *pool_handles_idle;
+  set<CURL *> *pool_handles_inuse;
+  CURLM *curl_multi;
+  pthread_t thread;
+  int pipe_terminate[2];
+  int pipe_jobs[2];
+  struct pollfd *watch_fds;
+  uint32_t watch_fds_size;
+  uint32_t watch_fds_inuse;
+  atomic_int32 num_jobs;  /**< Jobs handed to the worker and not yet done */
+  deque<JobInfo *> queues[kNumPriorities];  /**< Jobs waiting for a slot */
+  // Written by the worker only, summed up by GetTransferredBytes() etc.
+  double stat_transferred_bytes;
+  double stat_transfer_time;
+};
+
+vector<Worker *> *workers_ = NULL;
+unsigned num_workers_;  /**< Number of I/O threads started by Spawn() */
+atomic_int32 next_worker_;  /**< Round robin for jobs without content hash */
+const int32_t kMaxWorkerImbalance = 4;  /**< Number of additional jobs after
+  which the preferred worker for an object is bypassed */
 uint32_t pool_max_handles_;
-CURLM *curl_multi_ = NULL;
+uint32_t watch_fds_max_;
+atomic_int32 num_active_[kNumPriorities];  /**< Transfers in flight */
+atomic_int32 num_paused_;  /**< Transfers waiting for bandwidth */
 curl_slist *http_headers_ = NULL;
 curl_slist *http_headers_nocache_ = NULL;
 
-pthread_t thread_download_;
 atomic_int32 multi_threaded_;
-int pipe_terminate_[2];
-
-int pipe_jobs_[2];
-struct pollfd *watch_fds_ = NULL;
-uint32_t watch_fds_size_ = 0;
-uint32_t watch_fds_inuse_ = 0;
-uint32_t watch_fds_max_;
 
 pthread_mutex_t lock_options_ = PTHREAD_MUTEX_INITIALIZER;
 char *opt_dns_server_ = NULL;
@@ -83,16 +125,48 @@ vector<string> *opt_host_chain_ = NULL;
 vector<int> *opt_host_chain_rtt_ = NULL; /**< created by SetHostChain(),
   filled by probe_hosts.  Contains time to get .cvmfschecksum in ms.
   -1 is unprobed, -2 is error */
+vector<TransferScore> *opt_host_chain_score_ = NULL;  /**< In sync with
+  opt_host_chain_, updated by real transfers */
 unsigned opt_host_chain_current_;
 vector< vector<string> > *opt_proxy_groups_ = NULL;
 unsigned opt_proxy_groups_current_;
 unsigned opt_proxy_groups_current_burned_;
 unsigned opt_num_proxies_;
-
-// Writes and reads should be atomic because reading happens in a different
-// thread than writing.
-double stat_transferred_bytes_;
-double stat_transfer_time_;
+bool opt_proxy_shard_ = false;
+/**
+ * Consistent hashing ring over the members of the active load-balancing group.
+ * Built lazily and dropped whenever the proxy chain or the group changes.
+ */
+map<uint32_t, string> *opt_proxy_ring_ = NULL;
+unsigned opt_proxy_ring_group_;
+const unsigned kProxyRingReplicas = 64;  /**< Virtual ring nodes per proxy */
+map<string, TransferScore> *opt_proxy_score_ = NULL;
+uint64_t opt_num_scored_;  /**< Number of transfers that updated the scores */
+unsigned opt_probe_interval_;  /**< Background host probing, 0 is off */
+unsigned opt_max_active_[kNumPriorities];  /**< Concurrent transfers per
+  priority class, 0 is unlimited */
+const unsigned kDefaultMaxPrefetch = 4;
+const unsigned kFdBufferSize = 256*1024;  /**< Write buffer for kDestinationFd */
+const unsigned kFdBufferAlignment = 4096;
+
+pthread_mutex_t lock_bandwidth_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t opt_max_bandwidth_;  /**< Bytes per second, 0 is unlimited */
+double bucket_tokens_;
+struct timeval bucket_timestamp_;
+
+pthread_t thread_probe_;
+bool probe_running_ = false;
+int pipe_probe_terminate_[2];
+
+const double kScoreWeight = 0.2;  /**< Weight of a new sample in the EWMA */
+const unsigned kScoreObjectSize = 64*1024;  /**< "Typical" object size */
+const unsigned kScoreMinThroughputSize = 16*1024;  /**< Smaller transfers
+  don't tell anything about the throughput */
+const unsigned kScoreReorderInterval = 32;  /**< Reorder every 32 transfers */
+const double kScoreHysteresis = 1.25;  /**< Switch only to a host that is
+  substantially faster than the active one */
+const double kScoreUnknownMs = 1e9;
+const double kScoreDownMs = 1e12;
 
 
 /**
@@ -150,6 +224,9 @@ void SwitchHost(JobInfo *info) {
   }
 
   if (do_switch) {
+    // Sorted to the end of the chain until the next successful probe
+    if (info)
+      (*opt_host_chain_rtt_)[opt_host_chain_current_] = -2;
     opt_host_chain_current_ = (opt_host_chain_current_+1) %
                               opt_host_chain_->size();
     LogCvmfs(kLogDownload, kLogDebug, "switching host to %s",
@@ -178,6 +255,36 @@ static void SwitchProxy(JobInfo *info) {
     pthread_mutex_unlock(&lock_options_);
     return;
   }
+
+  // With sharding, fail-over goes to the next member on the ring.  Only if
+  // the entire group failed for this job, we move on to the next group.
+  if (opt_proxy_shard_ && info) {
+    // The proxy chain might have been replaced since the job was set up
+    if (info->proxy_group >= opt_proxy_groups_->size()) {
+      info->proxy_group = opt_proxy_groups_current_;
+      info->proxy_ring_offset = 0;
+    }
+    info->proxy_ring_offset++;
+    if (info->proxy_ring_offset <
+        (*opt_proxy_groups_)[info->proxy_group].size())
+    {
+      pthread_mutex_unlock(&lock_options_);
+      return;
+    }
+    info->proxy_ring_offset = 0;
+    if ((info->proxy_group == opt_proxy_groups_current_) &&
+        (opt_proxy_groups_->size() > 1))
+    {
+      opt_proxy_groups_current_ = (opt_proxy_groups_current_ + 1) %
+                                  opt_proxy_groups_->size();
+      opt_proxy_groups_current_burned_ = 0;
+      LogCvmfs(kLogDownload, kLogDebug, "all proxies of ring failed, "
+               "switching to proxy group %d", opt_proxy_groups_current_);
+    }
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
+
   if (info &&
       ((*opt_proxy_groups_)[opt_proxy_groups_current_][0] != info->proxy))
   {
@@ -268,6 +375,96 @@ void SwitchProxyGroup() {
 }
 
 
+/**
+ * Adds the tokens for the time passed since the last call.  The bucket holds
+ * at most one second worth of data.
+ * Needs to be called with lock_bandwidth_ held.
+ */
+static void RefillBucket() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  const double elapsed = DiffTimeSeconds(bucket_timestamp_, now);
+  bucket_timestamp_ = now;
+  bucket_tokens_ += elapsed * double(opt_max_bandwidth_);
+  if (bucket_tokens_ > double(opt_max_bandwidth_))
+    bucket_tokens_ = double(opt_max_bandwidth_);
+}
+
+
+/**
+ * Takes num_bytes from the token bucket.  A data chunk is accepted as long as
+ * there are tokens left, which can drive the bucket into debt.
+ *
+ * \return false if the transfer needs to be paused
+ */
+static bool ConsumeBandwidth(const size_t num_bytes) {
+  pthread_mutex_lock(&lock_bandwidth_);
+  if (opt_max_bandwidth_ == 0) {
+    pthread_mutex_unlock(&lock_bandwidth_);
+    return true;
+  }
+  RefillBucket();
+  const bool result = bucket_tokens_ > 0.0;
+  if (result)
+    bucket_tokens_ -= num_bytes;
+  pthread_mutex_unlock(&lock_bandwidth_);
+  return result;
+}
+
+
+static bool HasBandwidth() {
+  pthread_mutex_lock(&lock_bandwidth_);
+  if (opt_max_bandwidth_ == 0) {
+    pthread_mutex_unlock(&lock_bandwidth_);
+    return true;
+  }
+  RefillBucket();
+  const bool result = bucket_tokens_ > 0.0;
+  pthread_mutex_unlock(&lock_bandwidth_);
+  return result;
+}
+
+
+/**
+ * Rewinds a download to byte zero: empties the destination and resets the
+ * hash and the inflate state.
+ *
+ * \return false on local I/O errors, true otherwise
+ */
+static bool ResetDestination(JobInfo *info) {
+  info->range_offset = 0;
+  if ((info->destination == kDestinationMem) && info->destination_mem.data) {
+    free(info->destination_mem.data);
+    info->destination_mem.data = NULL;
+    info->destination_mem.size = 0;
+    info->destination_mem.pos = 0;
+  }
+  if ((info->destination == kDestinationFile) ||
+      (info->destination == kDestinationPath))
+  {
+    if ((fflush(info->destination_file) != 0) ||
+        (ftruncate(fileno(info->destination_file), 0) != 0))
+    {
+      return false;
+    }
+    rewind(info->destination_file);
+  }
+  if (info->destination == kDestinationFd) {
+    info->destination_fd.offset = 0;
+    info->destination_fd.pos = 0;
+    if (ftruncate(info->destination_fd.fd, 0) != 0)
+      return false;
+  }
+  if (info->expected_hash)
+    hash::Init(info->hash_context);
+  if (info->compressed) {
+    zlib::DecompressFini(&info->zstream);
+    zlib::DecompressInit(&info->zstream);
+  }
+  return true;
+}
+
+
 /**
  * Called by curl for every HTTP header. Not called for file:// transfers.
  */
@@ -290,10 +487,24 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
     for (i = 8; (i < header_line.length()) && (header_line[i] == ' '); ++i) {}
 
     if (header_line[i] == '2') {
+      // The server delivers the entire object instead of the requested range
+      if (info->range_resumed && !HasPrefix(header_line.substr(i), "206",
+                                            false))
+      {
+        LogCvmfs(kLogDownload, kLogDebug, "range request for %s ignored, "
+                 "restarting from byte zero", info->url->c_str());
+        info->range_resumed = false;
+        if (!ResetDestination(info)) {
+          info->error_code = kFailLocalIO;
+          return 0;
+        }
+      }
       return num_bytes;
     } else {
       LogCvmfs(kLogDownload, kLogDebug, "http status error code: %s",
                header_line.c_str());
+      if (info->range_resumed)
+        info->range_disabled = true;
       info->error_code = (info->proxy == "") ? kFailHostConnection :
                                                kFailProxyConnection;
       // code dependent error heuristics?
@@ -319,6 +530,18 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
 }
 
 
+/**
+ * Every transfer that leaves the paused state goes through here, so that
+ * num_paused_ does not drift.
+ */
+static void ClearPaused(JobInfo *info) {
+  if (info->paused) {
+    info->paused = false;
+    atomic_dec32(&num_paused_);
+  }
+}
+
+
 /**
  * Called by curl for every received data chunk.
  */
@@ -333,6 +556,15 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
   if (num_bytes == 0)
     return 0;
 
+  // Curl delivers the same chunk again after the transfer is resumed.  The
+  // limit is checked on every chunk, so that SetMaxBandwidth() also applies to
+  // transfers in flight.
+  if (info->pausable && !ConsumeBandwidth(num_bytes)) {
+    info->paused = true;
+    atomic_inc32(&num_paused_);
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
   if (info->expected_hash)
     hash::Update((unsigned char *)ptr, num_bytes, info->hash_context);
 
@@ -343,6 +575,22 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
     memcpy(info->destination_mem.data + info->destination_mem.pos,
            ptr, num_bytes);
     info->destination_mem.pos += num_bytes;
+  } else if (info->destination == kDestinationFd) {
+    // Write to large buffer, then to file descriptor
+    if (info->compressed) {
+      int retval = zlib::DecompressZStream2Fd(&info->zstream,
+                                              &info->destination_fd,
+                                              ptr, num_bytes);
+      if (retval < 0) {
+        info->error_code = kFailBadData;
+        return 0;
+      }
+    } else {
+      if (!zlib::WriteFdSink(&info->destination_fd, ptr, num_bytes)) {
+        info->error_code = kFailLocalIO;
+        return 0;
+      }
+    }
   } else {
     // Write to file
     if (info->compressed) {
@@ -360,6 +608,7 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
       }
     }
   }
+  info->range_offset += num_bytes;
 
   return num_bytes;
 }
@@ -369,10 +618,10 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
  * Gets an idle CURL handle from the pool. Creates a new one and adds it to
  * the pool if necessary.
  */
-static CURL *AcquireCurlHandle() {
+static CURL *AcquireCurlHandle(Worker *worker) {
   CURL *handle;
 
-  if (pool_handles_idle_->empty()) {
+  if (worker->pool_handles_idle->empty()) {
     // Create a new handle
     handle = curl_easy_init();
     assert(handle != NULL);
@@ -383,26 +632,26 @@ static CURL *AcquireCurlHandle() {
     curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, CallbackCurlHeader);
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CallbackCurlData);
   } else {
-    handle = *(pool_handles_idle_->begin());
-    pool_handles_idle_->erase(pool_handles_idle_->begin());
+    handle = *(worker->pool_handles_idle->begin());
+    worker->pool_handles_idle->erase(worker->pool_handles_idle->begin());
   }
 
-  pool_handles_inuse_->insert(handle);
+  worker->pool_handles_inuse->insert(handle);
 
   return handle;
 }
 
 
-static void ReleaseCurlHandle(CURL *handle) {
-  set<CURL *>::iterator elem = pool_handles_inuse_->find(handle);
-  assert(elem != pool_handles_inuse_->end());
+static void ReleaseCurlHandle(Worker *worker, CURL *handle) {
+  set<CURL *>::iterator elem = worker->pool_handles_inuse->find(handle);
+  assert(elem != worker->pool_handles_inuse->end());
 
-  if (pool_handles_idle_->size() > pool_max_handles_)
+  if (worker->pool_handles_idle->size() > pool_max_handles_)
     curl_easy_cleanup(*elem);
   else
-    pool_handles_idle_->insert(*elem);
+    worker->pool_handles_idle->insert(*elem);
 
-  pool_handles_inuse_->erase(elem);
+  worker->pool_handles_inuse->erase(elem);
 }
 
 
@@ -417,6 +666,13 @@ static void InitializeRequest(JobInfo *info, CURL *handle) {
   info->nocache = false;
   info->num_failed_proxies = 0;
   info->num_failed_hosts = 0;
+  info->proxy_ring_offset = 0;
+  info->proxy_group = 0;
+  info->range_offset = 0;
+  info->range_resumed = false;
+  info->range_disabled = false;
+  info->pausable = false;
+  ClearPaused(info);
   if (info->compressed) {
     zlib::DecompressInit(&(info->zstream));
   }
@@ -438,6 +694,65 @@ static void InitializeRequest(JobInfo *info, CURL *handle) {
                    static_cast<void *>(info));
   curl_easy_setopt(handle, CURLOPT_WRITEDATA, static_cast<void *>(info));
   curl_easy_setopt(handle, CURLOPT_HTTPHEADER, http_headers_);
+  curl_easy_setopt(handle, CURLOPT_RANGE, NULL);
+}
+
+
+/**
+ * Places kProxyRingReplicas points per proxy of the active group on the
+ * consistent hashing ring.  The points only depend on the proxy names, so that
+ * all clients of a site end up with the same ring.
+ * Needs to be called with lock_options_ held.
+ */
+static void RebuildProxyRing() {
+  delete opt_proxy_ring_;
+  opt_proxy_ring_ = new map<uint32_t, string>();
+  opt_proxy_ring_group_ = opt_proxy_groups_current_;
+
+  const vector<string> &group = (*opt_proxy_groups_)[opt_proxy_groups_current_];
+  for (unsigned i = 0; i < group.size(); ++i) {
+    for (unsigned j = 0; j < kProxyRingReplicas; ++j) {
+      const string node = group[i] + "#" + StringifyInt(j);
+      hash::Md5 node_hash(node.data(), node.length());
+      uint32_t point;
+      memcpy(&point, node_hash.digest, sizeof(point));
+      (*opt_proxy_ring_)[point] = group[i];
+    }
+  }
+}
+
+
+/**
+ * Finds the proxy responsible for the job on the consistent hashing ring.
+ * The ring position is taken from the content hash, or from the URL if there
+ * is no content hash.  Starting from there, proxy_ring_offset distinct members
+ * are skipped, which have already failed for this job.
+ * Needs to be called with lock_options_ held.
+ */
+static string SelectShardProxy(const JobInfo *info) {
+  if (!opt_proxy_ring_ || (opt_proxy_ring_group_ != opt_proxy_groups_current_))
+    RebuildProxyRing();
+
+  uint32_t point;
+  if (info->expected_hash) {
+    memcpy(&point, info->expected_hash->digest, sizeof(point));
+  } else {
+    hash::Md5 url_hash(info->url->data(), info->url->length());
+    memcpy(&point, url_hash.digest, sizeof(point));
+  }
+
+  set<string> visited;
+  map<uint32_t, string>::const_iterator i = opt_proxy_ring_->lower_bound(point);
+  for (unsigned steps = 0; steps < opt_proxy_ring_->size(); ++steps, ++i) {
+    if (i == opt_proxy_ring_->end())
+      i = opt_proxy_ring_->begin();
+    if (visited.find(i->second) != visited.end())
+      continue;
+    if (visited.size() == info->proxy_ring_offset)
+      return i->second;
+    visited.insert(i->second);
+  }
+  return (*opt_proxy_groups_)[opt_proxy_groups_current_][0];
 }
 
 
@@ -449,12 +764,19 @@ static void SetUrlOptions(JobInfo *info) {
   string url_prefix;
 
   pthread_mutex_lock(&lock_options_);
-  if (!opt_proxy_groups_ ||
-      ((*opt_proxy_groups_)[opt_proxy_groups_current_][0] == "DIRECT"))
-  {
+  if (!opt_proxy_groups_) {
     info->proxy = "";
   } else {
-    info->proxy = (*opt_proxy_groups_)[opt_proxy_groups_current_][0];
+    if (opt_proxy_shard_ &&
+        ((*opt_proxy_groups_)[opt_proxy_groups_current_].size() > 1))
+    {
+      info->proxy = SelectShardProxy(info);
+    } else {
+      info->proxy = (*opt_proxy_groups_)[opt_proxy_groups_current_][0];
+    }
+    info->proxy_group = opt_proxy_groups_current_;
+    if (info->proxy == "DIRECT")
+      info->proxy = "";
   }
   curl_easy_setopt(info->curl_handle, CURLOPT_PROXY, info->proxy.c_str());
   if (info->proxy != "") {
@@ -479,13 +801,196 @@ static void SetUrlOptions(JobInfo *info) {
 
 
 /**
- * Adds transfer time and downloaded bytes to the global counters.
+ * Estimated time to fetch kScoreObjectSize bytes.  Without measurements from
+ * real transfers, the probed round trip time is used.  Hosts that are down are
+ * sorted last.
  */
-static void UpdateStatistics(CURL *handle) {
+static double ExpectedMs(const TransferScore &score, const int rtt) {
+  if (rtt == -2)
+    return kScoreDownMs;
+  double result;
+  if (score.latency_ms >= 0.0)
+    result = score.latency_ms;
+  else if (rtt >= 0)
+    result = rtt;
+  else
+    return kScoreUnknownMs;
+  if (score.throughput_kbs > 0.0)
+    result += 1000.0 * (kScoreObjectSize / 1024) / score.throughput_kbs;
+  return result;
+}
+
+
+static void AddScoreSample(const double latency_ms, const double throughput_kbs,
+                           TransferScore *score)
+{
+  if (score->latency_ms < 0.0) {
+    score->latency_ms = latency_ms;
+  } else {
+    score->latency_ms = kScoreWeight * latency_ms +
+                        (1.0 - kScoreWeight) * score->latency_ms;
+  }
+  if (throughput_kbs >= 0.0) {
+    if (score->throughput_kbs < 0.0) {
+      score->throughput_kbs = throughput_kbs;
+    } else {
+      score->throughput_kbs = kScoreWeight * throughput_kbs +
+                              (1.0 - kScoreWeight) * score->throughput_kbs;
+    }
+  }
+  score->num_samples++;
+}
+
+
+/**
+ * Sorts the host chain by expected completion time and makes the fastest host
+ * the active one.  Unless forced, nothing changes as long as the active host
+ * is within kScoreHysteresis of the best one.
+ * Needs to be called with lock_options_ held.
+ */
+static void ReorderHosts(const bool force) {
+  if (!opt_host_chain_)
+    return;
+
+  const unsigned num_hosts = opt_host_chain_->size();
+  vector< pair<double, unsigned> > order;
+  for (unsigned i = 0; i < num_hosts; ++i) {
+    TransferScore *score = &((*opt_host_chain_score_)[i]);
+    score->expected_ms = ExpectedMs(*score, (*opt_host_chain_rtt_)[i]);
+    order.push_back(make_pair(score->expected_ms, i));
+  }
+  if (num_hosts < 2)
+    return;
+  sort(order.begin(), order.end());
+
+  const double active_ms =
+    (*opt_host_chain_score_)[opt_host_chain_current_].expected_ms;
+  if (!force && (active_ms <= order[0].first * kScoreHysteresis))
+    return;
+
+  vector<string> *host_chain = new vector<string>();
+  vector<int> *host_rtt = new vector<int>();
+  vector<TransferScore> *host_score = new vector<TransferScore>();
+  for (unsigned i = 0; i < num_hosts; ++i) {
+    host_chain->push_back((*opt_host_chain_)[order[i].second]);
+    host_rtt->push_back((*opt_host_chain_rtt_)[order[i].second]);
+    host_score->push_back((*opt_host_chain_score_)[order[i].second]);
+  }
+  delete opt_host_chain_;
+  delete opt_host_chain_rtt_;
+  delete opt_host_chain_score_;
+  opt_host_chain_ = host_chain;
+  opt_host_chain_rtt_ = host_rtt;
+  opt_host_chain_score_ = host_score;
+  if (opt_host_chain_current_ != 0) {
+    LogCvmfs(kLogDownload, kLogDebug, "switching host to %s (%.1f ms "
+             "expected)", (*opt_host_chain_)[0].c_str(), order[0].first);
+  }
+  opt_host_chain_current_ = 0;
+}
+
+
+/**
+ * Sorts the active load-balancing group by expected completion time.  Only
+ * done while no proxy of the group has failed, because SwitchProxy() keeps
+ * the failed proxies at the end of the group.  Not used for sharding, where
+ * the ring determines the proxy.
+ * Needs to be called with lock_options_ held.
+ */
+static void ReorderProxies() {
+  if (!opt_proxy_groups_ || opt_proxy_shard_ ||
+      (opt_proxy_groups_current_burned_ > 0))
+  {
+    return;
+  }
+
+  vector<string> *group = &((*opt_proxy_groups_)[opt_proxy_groups_current_]);
+  if (group->size() < 2)
+    return;
+  vector< pair<double, unsigned> > order;
+  for (unsigned i = 0; i < group->size(); ++i) {
+    TransferScore *score = &((*opt_proxy_score_)[(*group)[i]]);
+    score->expected_ms = ExpectedMs(*score, -1);
+    order.push_back(make_pair(score->expected_ms, i));
+  }
+  sort(order.begin(), order.end());
+  if (order[0].second == 0)
+    return;
+  const double active_ms = (*opt_proxy_score_)[(*group)[0]].expected_ms;
+  if (active_ms <= order[0].first * kScoreHysteresis)
+    return;
+
+  vector<string> sorted_group;
+  for (unsigned i = 0; i < order.size(); ++i)
+    sorted_group.push_back((*group)[order[i].second]);
+  *group = sorted_group;
+  LogCvmfs(kLogDownload, kLogDebug, "switching proxy to %s (%.1f ms expected)",
+           (*group)[0].c_str(), order[0].first);
+}
+
+
+/**
+ * Feeds latency and throughput of a successful transfer into the scores of
+ * the host and the proxy.  Every kScoreReorderInterval transfers, hosts and
+ * proxies are reordered accordingly.
+ */
+static void UpdateScores(const JobInfo *info) {
+  double time_start;
+  double time_total;
+  double bytes;
+  char *effective_url;
+  if ((curl_easy_getinfo(info->curl_handle, CURLINFO_STARTTRANSFER_TIME,
+                         &time_start) != CURLE_OK) ||
+      (curl_easy_getinfo(info->curl_handle, CURLINFO_TOTAL_TIME,
+                         &time_total) != CURLE_OK) ||
+      (curl_easy_getinfo(info->curl_handle, CURLINFO_SIZE_DOWNLOAD,
+                         &bytes) != CURLE_OK) ||
+      (curl_easy_getinfo(info->curl_handle, CURLINFO_EFFECTIVE_URL,
+                         &effective_url) != CURLE_OK))
+  {
+    return;
+  }
+  const double latency_ms = time_start * 1000.0;
+  double throughput_kbs = -1.0;
+  if ((bytes >= kScoreMinThroughputSize) && (time_total > time_start))
+    throughput_kbs = (bytes / 1024.0) / (time_total - time_start);
+
+  pthread_mutex_lock(&lock_options_);
+  if (info->probe_hosts && opt_host_chain_) {
+    for (unsigned i = 0; i < opt_host_chain_->size(); ++i) {
+      if (HasPrefix(effective_url, (*opt_host_chain_)[i], false)) {
+        AddScoreSample(latency_ms, throughput_kbs,
+                       &((*opt_host_chain_score_)[i]));
+        // The host served a transfer, it is not down anymore.  Without
+        // probing, nothing else clears the mark.
+        if ((*opt_host_chain_rtt_)[i] == -2)
+          (*opt_host_chain_rtt_)[i] = -1;
+        break;
+      }
+    }
+  }
+  if (info->proxy != "") {
+    AddScoreSample(latency_ms, throughput_kbs,
+                   &((*opt_proxy_score_)[info->proxy]));
+  }
+
+  opt_num_scored_++;
+  if ((opt_num_scored_ % kScoreReorderInterval) == 0) {
+    ReorderHosts(false);
+    ReorderProxies();
+  }
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Adds downloaded bytes to the counters of the worker.
+ */
+static void UpdateStatistics(Worker *worker, CURL *handle) {
   double val;
 
   if (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &val) == CURLE_OK)
-    stat_transferred_bytes_ += val;
+    worker->stat_transferred_bytes += val;
 }
 
 
@@ -495,10 +1000,14 @@ static void UpdateStatistics(CURL *handle) {
  *
  * \return true if another download should be performed, false otherwise
  */
-static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
+static bool VerifyAndFinalize(const int curl_error, JobInfo *info,
+                              Worker *worker)
+{
   //LogCvmfs(kLogDownload, kLogDebug, "Verify Download (curl error %d)",
   //         curl_error);
-  UpdateStatistics(info->curl_handle);
+  // A transfer can fail or be aborted while it is paused
+  ClearPaused(info);
+  UpdateStatistics(worker, info->curl_handle);
 
   // Verification and error classification
   switch (curl_error) {
@@ -531,6 +1040,7 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
         }
       }
 
+      UpdateScores(info);
       info->error_code = kFailOk;
       break;
     case CURLE_UNSUPPORTED_PROTOCOL:
@@ -545,6 +1055,10 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
       break;
     case CURLE_COULDNT_CONNECT:
     case CURLE_OPERATION_TIMEDOUT:
+    // The connection broke down in the middle of the transfer
+    case CURLE_PARTIAL_FILE:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
       if (info->proxy != "")
         info->error_code = kFailProxyConnection;
       else
@@ -582,22 +1096,38 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
   }
 
   if (try_again) {
-    // Reset internal state and destination
-    if ((info->destination == kDestinationMem) && info->destination_mem.data) {
-      free(info->destination_mem.data);
-      info->destination_mem.data = NULL;
-      info->destination_mem.size = 0;
-      info->destination_mem.pos = 0;
-    }
-    if ((info->destination == kDestinationFile) ||
-        (info->destination == kDestinationPath))
-    {
-      if ((fflush(info->destination_file) != 0) ||
-          (ftruncate(fileno(info->destination_file), 0) != 0))
+    // Continue with a range request if the connection broke down while
+    // receiving a file whose integrity can be verified in the end.  Otherwise
+    // reset internal state and destination.
+    const bool resume = (info->range_offset > 0) && !info->range_disabled &&
+      info->expected_hash &&
+      ((info->error_code == kFailHostConnection) ||
+       (info->error_code == kFailProxyConnection)) &&
+      ((info->destination == kDestinationFile) ||
+       (info->destination == kDestinationPath) ||
+       (info->destination == kDestinationFd));
+    if (resume) {
+      // The write buffer of kDestinationFd simply continues
+      if ((info->destination != kDestinationFd) &&
+          (fflush(info->destination_file) != 0))
       {
         info->error_code = kFailLocalIO;
         goto verify_and_finalize_stop;
       }
+      char range[32];
+      snprintf(range, sizeof(range), "%"PRIu64"-", info->range_offset);
+      curl_easy_setopt(info->curl_handle, CURLOPT_RANGE, range);
+      info->range_resumed = true;
+      LogCvmfs(kLogDownload, kLogDebug, "resuming download of %s at byte "
+               "%"PRIu64, info->url->c_str(), info->range_offset);
+    } else {
+      if (!ResetDestination(info)) {
+        info->error_code = kFailLocalIO;
+        goto verify_and_finalize_stop;
+      }
+      curl_easy_setopt(info->curl_handle, CURLOPT_RANGE, NULL);
+      info->range_resumed = false;
+      info->range_disabled = false;
     }
 
     // Failure handling
@@ -628,6 +1158,10 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
     if (fclose(info->destination_file) != 0)
       info->error_code = kFailLocalIO;
     info->destination_file = NULL;
+  } else if ((info->destination == kDestinationFd) &&
+             !zlib::FlushFdSink(&info->destination_fd))
+  {
+    info->error_code = kFailLocalIO;
   }
 
   if (info->compressed)
@@ -637,6 +1171,23 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
 }
 
 
+/**
+ * Removes the partial result of a failed download.
+ */
+static void CleanupFailedJob(JobInfo *info) {
+  if (info->destination == kDestinationPath)
+    unlink(info->destination_path->c_str());
+  if (info->destination_mem.data) {
+    free(info->destination_mem.data);
+    info->destination_mem.data = NULL;
+    info->destination_mem.size = 0;
+  }
+
+  LogCvmfs(kLogDownload, kLogDebug, "download failed (error %d)",
+           info->error_code);
+}
+
+
 static Failures PrepareDownloadDestination(JobInfo *info) {
   info->destination_mem.size = 0;
   info->destination_mem.pos = 0;
@@ -652,10 +1203,55 @@ static Failures PrepareDownloadDestination(JobInfo *info) {
       return kFailLocalIO;
   }
 
+  if (info->destination == kDestinationFd) {
+    assert(info->destination_fd.fd >= 0);
+    // The buffer is kept by the job for the next download
+    if (info->destination_fd.buffer == NULL) {
+      void *buffer;
+      if (posix_memalign(&buffer, kFdBufferAlignment, kFdBufferSize) != 0)
+        return kFailLocalIO;
+      info->destination_fd.buffer = static_cast<unsigned char *>(buffer);
+      info->destination_fd.size = kFdBufferSize;
+    }
+    info->destination_fd.offset = 0;
+    info->destination_fd.pos = 0;
+  }
+
   return kFailOk;
 }
 
 
+/**
+ * Picks the I/O thread for a job.  Jobs for the same object go to the same
+ * worker, unless that worker has kMaxWorkerImbalance more jobs in flight than
+ * the least loaded worker.
+ */
+static Worker *SelectWorker(const JobInfo *info) {
+  if (num_workers_ == 1)
+    return (*workers_)[0];
+
+  unsigned preferred;
+  if (info->expected_hash)
+    preferred = info->expected_hash->digest[0] % num_workers_;
+  else
+    preferred = unsigned(atomic_xadd32(&next_worker_, 1)) % num_workers_;
+
+  unsigned least_loaded = preferred;
+  int32_t min_jobs = atomic_read32(&(*workers_)[preferred]->num_jobs);
+  const int32_t preferred_jobs = min_jobs;
+  for (unsigned i = 0; i < num_workers_; ++i) {
+    const int32_t jobs = atomic_read32(&(*workers_)[i]->num_jobs);
+    if (jobs < min_jobs) {
+      min_jobs = jobs;
+      least_loaded = i;
+    }
+  }
+  if (preferred_jobs - min_jobs > kMaxWorkerImbalance)
+    return (*workers_)[least_loaded];
+  return (*workers_)[preferred];
+}
+
+
 /**
  * Downloads data from an unsecure outside channel (currently HTTP or file).
  */
@@ -676,17 +1272,21 @@ Failures Fetch(JobInfo *info) {
   }
 
   if (atomic_xadd32(&multi_threaded_, 0) == 1) {
+    info->callback = NULL;
     if (info->wait_at[0] == -1) {
       MakePipe(info->wait_at);
     }
 
     //LogCvmfs(kLogDownload, kLogDebug, "send job to thread, pipe %d %d",
     //         info->wait_at[0], info->wait_at[1]);
-    WritePipe(pipe_jobs_[1], &info, sizeof(info));
+    Worker *worker = SelectWorker(info);
+    atomic_inc32(&worker->num_jobs);
+    WritePipe(worker->pipe_jobs[1], &info, sizeof(info));
     ReadPipe(info->wait_at[0], &result, sizeof(result));
     //LogCvmfs(kLogDownload, kLogDebug, "got result %d", result);
   } else {
-    CURL *handle = AcquireCurlHandle();
+    Worker *worker = (*workers_)[0];
+    CURL *handle = AcquireCurlHandle(worker);
     InitializeRequest(info, handle);
     SetUrlOptions(info);
     //curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
@@ -695,25 +1295,54 @@ Failures Fetch(JobInfo *info) {
       retval = curl_easy_perform(handle);
       double elapsed;
       if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &elapsed) == CURLE_OK)
-        stat_transfer_time_ += elapsed;
-    } while (VerifyAndFinalize(retval, info));
+        worker->stat_transfer_time += elapsed;
+    } while (VerifyAndFinalize(retval, info, worker));
     result = info->error_code;
-    ReleaseCurlHandle(info->curl_handle);
+    ReleaseCurlHandle(worker, info->curl_handle);
   }
 
-  if ((info->destination == kDestinationPath) && (result != kFailOk))
-    unlink(info->destination_path->c_str());
-  if ((info->destination_mem.data) && (result != kFailOk)) {
-    free(info->destination_mem.data);
-    info->destination_mem.data = NULL;
-    info->destination_mem.size = 0;
-  }
+  if (result != kFailOk)
+    CleanupFailedJob(info);
+  return result;
+}
 
-  if (result != kFailOk) {
-    LogCvmfs(kLogDownload, kLogDebug, "download failed (error %d)", result);
+
+/**
+ * Hands the job over to an I/O thread and returns right away.  When the
+ * download is done, the I/O thread calls callback with the finished job and
+ * data.  The job is not touched by the download manager afterwards, so that
+ * the callback may free it.  The callback runs in the I/O thread and must not
+ * block, in particular it must not download.
+ *
+ * \return false if the job could not be started, the callback is not called
+ *         in that case
+ */
+bool FetchAsync(JobInfo *info, void (*callback)(JobInfo *info, void *data),
+                void *data)
+{
+  assert(info != NULL);
+  assert(info->url != NULL);
+  assert(callback != NULL);
+
+  if (atomic_xadd32(&multi_threaded_, 0) != 1)
+    return false;
+  if (PrepareDownloadDestination(info) != kFailOk)
+    return false;
+
+  // Outlives this stack frame, freed by the I/O thread
+  if (info->expected_hash) {
+    const hash::Algorithms algorithm = info->expected_hash->algorithm;
+    info->hash_context.algorithm = algorithm;
+    info->hash_context.size = hash::GetContextSize(algorithm);
+    info->hash_context.buffer = smalloc(info->hash_context.size);
   }
+  info->callback = callback;
+  info->callback_data = data;
 
-  return result;
+  Worker *worker = SelectWorker(info);
+  atomic_inc32(&worker->num_jobs);
+  WritePipe(worker->pipe_jobs[1], &info, sizeof(info));
+  return true;
 }
 
 
@@ -727,52 +1356,52 @@ static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
   //         "handle %p, socket %d, action %d", easy, s, action);
   if (action == CURL_POLL_NONE)
     return 0;
+  Worker *worker = static_cast<Worker *>(userp);
 
-  // Find s in watch_fds_
+  // Find s in watch_fds
   unsigned index;
-  for (index = 0; index < watch_fds_inuse_; ++index) {
-    if (watch_fds_[index].fd == s)
+  for (index = 0; index < worker->watch_fds_inuse; ++index) {
+    if (worker->watch_fds[index].fd == s)
       break;
   }
   // Or create newly
-  if (index == watch_fds_inuse_) {
+  if (index == worker->watch_fds_inuse) {
     // Extend array if necessary
-    if (watch_fds_inuse_ == watch_fds_size_) {
-      watch_fds_size_ *= 2;
-      //LogCvmfs(kLogDownload, kLogDebug, "extending watch_fds_ (%d)", watch_fds_size_);
-      watch_fds_ = static_cast<struct pollfd *>(
-                   srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
-      //LogCvmfs(kLogDownload, kLogDebug, "extending watch_fds_ done (%d)", watch_fds_size_);
+    if (worker->watch_fds_inuse == worker->watch_fds_size) {
+      worker->watch_fds_size *= 2;
+      worker->watch_fds = static_cast<struct pollfd *>(
+        srealloc(worker->watch_fds,
+                 worker->watch_fds_size * sizeof(struct pollfd)));
     }
-    watch_fds_[watch_fds_inuse_].fd = s;
-    watch_fds_[watch_fds_inuse_].events = 0;
-    watch_fds_[watch_fds_inuse_].revents = 0;
-    watch_fds_inuse_++;
+    worker->watch_fds[worker->watch_fds_inuse].fd = s;
+    worker->watch_fds[worker->watch_fds_inuse].events = 0;
+    worker->watch_fds[worker->watch_fds_inuse].revents = 0;
+    worker->watch_fds_inuse++;
   }
 
   switch (action) {
     case CURL_POLL_IN:
-      watch_fds_[index].events |= POLLIN | POLLPRI;
+      worker->watch_fds[index].events |= POLLIN | POLLPRI;
       break;
     case CURL_POLL_OUT:
-      watch_fds_[index].events |= POLLOUT | POLLWRBAND;
+      worker->watch_fds[index].events |= POLLOUT | POLLWRBAND;
       break;
     case CURL_POLL_INOUT:
-      watch_fds_[index].events |= POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
+      worker->watch_fds[index].events |=
+        POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
       break;
     case CURL_POLL_REMOVE:
-      if (index < watch_fds_inuse_-1)
-        watch_fds_[index] = watch_fds_[watch_fds_inuse_-1];
-      watch_fds_inuse_--;
+      if (index < worker->watch_fds_inuse-1)
+        worker->watch_fds[index] = worker->watch_fds[worker->watch_fds_inuse-1];
+      worker->watch_fds_inuse--;
       // Shrink array if necessary
-      if ((watch_fds_inuse_ > watch_fds_max_) &&
-          (watch_fds_inuse_ < watch_fds_size_/2))
+      if ((worker->watch_fds_inuse > watch_fds_max_) &&
+          (worker->watch_fds_inuse < worker->watch_fds_size/2))
       {
-        watch_fds_size_ /= 2;
-        //LogCvmfs(kLogDownload, kLogDebug, "shrinking watch_fds_ (%d)", watch_fds_size_);
-        watch_fds_ = static_cast<struct pollfd *>(
-                   srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
-        //LogCvmfs(kLogDownload, kLogDebug, "shrinking watch_fds_ done", watch_fds_size_);
+        worker->watch_fds_size /= 2;
+        worker->watch_fds = static_cast<struct pollfd *>(
+          srealloc(worker->watch_fds,
+                   worker->watch_fds_size * sizeof(struct pollfd)));
       }
       break;
     default:
@@ -784,133 +1413,283 @@ static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
 
 
 /**
- * Worker thread event loop. Waits on new JobInfo structs on a pipe.
+ * Reserves a transfer slot in the given priority class.
+ */
+static bool AcquireSlot(const Priority priority) {
+  pthread_mutex_lock(&lock_options_);
+  const int32_t limit = opt_max_active_[priority];
+  pthread_mutex_unlock(&lock_options_);
+  const int32_t active = atomic_xadd32(&num_active_[priority], 1);
+  if ((limit > 0) && (active >= limit)) {
+    atomic_dec32(&num_active_[priority]);
+    return false;
+  }
+  return true;
+}
+
+
+static void StartJob(Worker *worker, JobInfo *info, int *still_running) {
+  CURL *handle = AcquireCurlHandle(worker);
+  InitializeRequest(info, handle);
+  SetUrlOptions(info);
+  info->pausable = true;
+  curl_multi_add_handle(worker->curl_multi, handle);
+  curl_multi_socket_action(worker->curl_multi, CURL_SOCKET_TIMEOUT, 0,
+                           still_running);
+}
+
+
+/**
+ * Starts queued jobs as long as there are free slots, higher priority classes
+ * first.
+ *
+ * \return true if there are still jobs waiting
  */
-static void *MainDownload(void *data __attribute__((unused))) {
-  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread started");
-
-  watch_fds_ = static_cast<struct pollfd *>(smalloc(2 * sizeof(struct pollfd)));
-  watch_fds_size_ = 2;
-  watch_fds_[0].fd = pipe_terminate_[0];
-  watch_fds_[0].events = POLLIN | POLLPRI;
-  watch_fds_[0].revents = 0;
-  watch_fds_[1].fd = pipe_jobs_[0];
-  watch_fds_[1].events = POLLIN | POLLPRI;
-  watch_fds_[1].revents = 0;
-  watch_fds_inuse_ = 2;
+static bool DispatchJobs(Worker *worker, int *still_running) {
+  bool waiting = false;
+  for (unsigned p = 0; p < kNumPriorities; ++p) {
+    deque<JobInfo *> *queue = &worker->queues[p];
+    while (!queue->empty() && AcquireSlot(Priority(p))) {
+      JobInfo *info = queue->front();
+      queue->pop_front();
+      StartJob(worker, info, still_running);
+    }
+    if (!queue->empty())
+      waiting = true;
+  }
+  return waiting;
+}
 
+
+/**
+ * Continues transfers that were paused by the bandwidth limit, higher priority
+ * classes first, as long as there are tokens in the bucket.
+ */
+static void ResumeTransfers(Worker *worker, int *still_running) {
+  vector<JobInfo *> paused[kNumPriorities];
+  for (set<CURL *>::const_iterator i = worker->pool_handles_inuse->begin(),
+       iEnd = worker->pool_handles_inuse->end(); i != iEnd; ++i)
+  {
+    JobInfo *info;
+    curl_easy_getinfo(*i, CURLINFO_PRIVATE, &info);
+    if (info->paused)
+      paused[info->priority].push_back(info);
+  }
+
+  bool resumed = false;
+  for (unsigned p = 0; p < kNumPriorities; ++p) {
+    for (unsigned i = 0; i < paused[p].size(); ++i) {
+      if (!HasBandwidth())
+        goto resume_transfers_stop;
+      ClearPaused(paused[p][i]);
+      curl_easy_pause(paused[p][i]->curl_handle, CURLPAUSE_CONT);
+      resumed = true;
+    }
+  }
+
+ resume_transfers_stop:
+  // The socket of a paused transfer is removed from the watch list.  Only
+  // running all handles makes curl register it again, otherwise the transfer
+  // idles until its next timer expires.
+  if (resumed)
+    curl_multi_socket_all(worker->curl_multi, still_running);
+}
+
+
+/**
+ * Worker thread event loop. Waits on new JobInfo structs on a pipe.
+ */
+static void *MainDownload(void *data) {
+  Worker *worker = static_cast<Worker *>(data);
+  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread %u started",
+           worker->id);
+
+  worker->watch_fds =
+    static_cast<struct pollfd *>(smalloc(2 * sizeof(struct pollfd)));
+  worker->watch_fds_size = 2;
+  worker->watch_fds[0].fd = worker->pipe_terminate[0];
+  worker->watch_fds[0].events = POLLIN | POLLPRI;
+  worker->watch_fds[0].revents = 0;
+  worker->watch_fds[1].fd = worker->pipe_jobs[0];
+  worker->watch_fds[1].events = POLLIN | POLLPRI;
+  worker->watch_fds[1].revents = 0;
+  worker->watch_fds_inuse = 2;
+
+  CURLM *curl_multi = worker->curl_multi;
   int still_running = 0;
+  bool jobs_waiting = false;
   struct timeval timeval_start, timeval_stop;
   gettimeofday(&timeval_start, NULL);
   while (true) {
     int timeout;
-    if (still_running) {
+    if (still_running || jobs_waiting) {
       timeout = 1;
     } else {
       timeout = -1;
       gettimeofday(&timeval_stop, NULL);
-      stat_transfer_time_ += DiffTimeSeconds(timeval_start, timeval_stop);
+      worker->stat_transfer_time +=
+        DiffTimeSeconds(timeval_start, timeval_stop);
     }
-    int retval = poll(watch_fds_, watch_fds_inuse_, timeout);
+    int retval = poll(worker->watch_fds, worker->watch_fds_inuse, timeout);
     if (errno == -1) {
       continue;
     }
 
     // Handle timeout
     if (retval == 0) {
-      retval = curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
+      retval = curl_multi_socket_action(curl_multi, CURL_SOCKET_TIMEOUT, 0,
                                         &still_running);
     }
 
     // Terminate I/O thread
-    if (watch_fds_[0].revents)
+    if (worker->watch_fds[0].revents)
       break;
 
     // New job arrives
-    if (watch_fds_[1].revents) {
-      watch_fds_[1].revents = 0;
+    if (worker->watch_fds[1].revents) {
+      worker->watch_fds[1].revents = 0;
       JobInfo *info;
-      ReadPipe(pipe_jobs_[0], &info, sizeof(info));
-      //LogCvmfs(kLogDownload, kLogDebug, "IO thread, got job: url %s, compressed %d, nocache %d, destination %d, file %p, expected hash %p, wait at %d", info->url->c_str(), info->compressed, info->nocache,
-      //         info->destination, info->destination_file, info->expected_hash, info->wait_at[1]);
+      ReadPipe(worker->pipe_jobs[0], &info, sizeof(info));
 
       if (!still_running)
         gettimeofday(&timeval_start, NULL);
-      CURL *handle = AcquireCurlHandle();
-      InitializeRequest(info, handle);
-      SetUrlOptions(info);
-      curl_multi_add_handle(curl_multi_, handle);
-      retval = curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
-                                        &still_running);
-      //LogCvmfs(kLogDownload, kLogDebug, "socket action returned with %d, still_running %d", retval, still_running);
+      worker->queues[info->priority].push_back(info);
     }
+    jobs_waiting = DispatchJobs(worker, &still_running);
+    if (atomic_read32(&num_paused_) > 0)
+      ResumeTransfers(worker, &still_running);
 
     // Activity on curl sockets
-    for (unsigned i = 2; i < watch_fds_inuse_; ++i) {
-      if (watch_fds_[i].revents) {
+    for (unsigned i = 2; i < worker->watch_fds_inuse; ++i) {
+      if (worker->watch_fds[i].revents) {
         int ev_bitmask = 0;
-        if (watch_fds_[i].revents & (POLLIN | POLLPRI))
+        if (worker->watch_fds[i].revents & (POLLIN | POLLPRI))
           ev_bitmask |= CURL_CSELECT_IN;
-        if (watch_fds_[i].revents & (POLLOUT | POLLWRBAND))
+        if (worker->watch_fds[i].revents & (POLLOUT | POLLWRBAND))
           ev_bitmask |= CURL_CSELECT_IN;
-        if (watch_fds_[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+        if (worker->watch_fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
           ev_bitmask |= CURL_CSELECT_ERR;
-        watch_fds_[i].revents = 0;
+        worker->watch_fds[i].revents = 0;
 
-        retval = curl_multi_socket_action(curl_multi_, watch_fds_[i].fd,
+        retval = curl_multi_socket_action(curl_multi, worker->watch_fds[i].fd,
                                           ev_bitmask, &still_running);
-        //LogCvmfs(kLogDownload, kLogDebug, "socket action on socket %d, returned with %d, still_running %d", watch_fds_[i].fd, retval, still_running);
       }
     }
 
     // Check if transfers are completed
     CURLMsg *curl_msg;
     int msgs_in_queue;
-    while ((curl_msg = curl_multi_info_read(curl_multi_, &msgs_in_queue))) {
+    while ((curl_msg = curl_multi_info_read(curl_multi, &msgs_in_queue))) {
       if (curl_msg->msg == CURLMSG_DONE) {
         JobInfo *info;
         CURL *easy_handle = curl_msg->easy_handle;
         int curl_error = curl_msg->data.result;
         curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info);
-        //LogCvmfs(kLogDownload, kLogDebug, "Done message for %s", info->url->c_str());
 
-        curl_multi_remove_handle(curl_multi_, easy_handle);
-        if (VerifyAndFinalize(curl_error, info)) {
-          curl_multi_add_handle(curl_multi_, easy_handle);
-          retval = curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
+        curl_multi_remove_handle(curl_multi, easy_handle);
+        if (VerifyAndFinalize(curl_error, info, worker)) {
+          curl_multi_add_handle(curl_multi, easy_handle);
+          retval = curl_multi_socket_action(curl_multi, CURL_SOCKET_TIMEOUT, 0,
                                             &still_running);
         } else {
           // Return easy handle into pool and write result back
-          ReleaseCurlHandle(easy_handle);
-
-          WritePipe(info->wait_at[1], &info->error_code,
-                    sizeof(info->error_code));
+          ReleaseCurlHandle(worker, easy_handle);
+          atomic_dec32(&num_active_[info->priority]);
+          atomic_dec32(&worker->num_jobs);
+
+          if (info->callback == NULL) {
+            WritePipe(info->wait_at[1], &info->error_code,
+                      sizeof(info->error_code));
+          } else {
+            // Started by FetchAsync()
+            if (info->error_code != kFailOk)
+              CleanupFailedJob(info);
+            if (info->expected_hash)
+              free(info->hash_context.buffer);
+            info->callback(info, info->callback_data);
+          }
         }
       }
     }
   }
 
-  for (set<CURL *>::iterator i = pool_handles_inuse_->begin(),
-       iEnd = pool_handles_inuse_->end(); i != iEnd; ++i)
+  for (set<CURL *>::iterator i = worker->pool_handles_inuse->begin(),
+       iEnd = worker->pool_handles_inuse->end(); i != iEnd; ++i)
   {
-    curl_multi_remove_handle(curl_multi_, *i);
-    curl_multi_cleanup(*i);
+    curl_multi_remove_handle(curl_multi, *i);
+    curl_easy_cleanup(*i);
   }
-  pool_handles_inuse_->clear();
+  worker->pool_handles_inuse->clear();
+  free(worker->watch_fds);
+  worker->watch_fds = NULL;
 
-  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread terminated");
+  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread %u terminated",
+           worker->id);
   return NULL;
 }
 
 
+/**
+ * Creates the handle pool and the multi handle of a worker.  The thread is
+ * started by Spawn().
+ */
+static Worker *CreateWorker(const unsigned id) {
+  Worker *worker = new Worker();
+  worker->id = id;
+  worker->pool_handles_idle = new set<CURL *>;
+  worker->pool_handles_inuse = new set<CURL *>;
+  worker->watch_fds = NULL;
+  worker->watch_fds_size = 0;
+  worker->watch_fds_inuse = 0;
+  atomic_init32(&worker->num_jobs);
+  worker->stat_transferred_bytes = 0.0;
+  worker->stat_transfer_time = 0.0;
+
+  worker->curl_multi = curl_multi_init();
+  assert(worker->curl_multi != NULL);
+  curl_multi_setopt(worker->curl_multi, CURLMOPT_SOCKETFUNCTION,
+                    CallbackCurlSocket);
+  curl_multi_setopt(worker->curl_multi, CURLMOPT_SOCKETDATA,
+                    static_cast<void *>(worker));
+  curl_multi_setopt(worker->curl_multi, CURLMOPT_MAXCONNECTS, watch_fds_max_);
+  //curl_multi_setopt(worker->curl_multi, CURLMOPT_PIPELINING, 1);
+  return worker;
+}
+
+
+static void DestroyWorker(Worker *worker) {
+  for (set<CURL *>::iterator i = worker->pool_handles_idle->begin(),
+       iEnd = worker->pool_handles_idle->end(); i != iEnd; ++i)
+  {
+    curl_easy_cleanup(*i);
+  }
+  delete worker->pool_handles_idle;
+  delete worker->pool_handles_inuse;
+  curl_multi_cleanup(worker->curl_multi);
+  free(worker->watch_fds);
+  delete worker;
+}
+
+
 void Init(const unsigned max_pool_handles) {
   atomic_init32(&multi_threaded_);
+  atomic_init32(&next_worker_);
+  atomic_init32(&num_paused_);
+  for (unsigned i = 0; i < kNumPriorities; ++i) {
+    atomic_init32(&num_active_[i]);
+    opt_max_active_[i] = 0;
+  }
+  opt_max_active_[kPriorityPrefetch] = kDefaultMaxPrefetch;
+  opt_max_bandwidth_ = 0;
+  bucket_tokens_ = 0.0;
+  gettimeofday(&bucket_timestamp_, NULL);
   int retval = curl_global_init(CURL_GLOBAL_ALL);
   assert(retval == CURLE_OK);
-  pool_handles_idle_ = new set<CURL *>;
-  pool_handles_inuse_ = new set<CURL *>;
   pool_max_handles_ = max_pool_handles;
   watch_fds_max_ = 4*pool_max_handles_;
+  workers_ = new vector<Worker *>();
+  workers_->push_back(CreateWorker(0));
+  num_workers_ = 1;
 
   opt_timeout_proxy_ = 5;
   opt_timeout_direct_ = 10;
@@ -918,9 +1697,9 @@ void Init(const unsigned max_pool_handles) {
   opt_proxy_groups_current_burned_ = 0;
   opt_num_proxies_ = 0;
   opt_host_chain_current_ = 0;
-
-  stat_transferred_bytes_ = 0.0;
-  stat_transfer_time_ = 0.0;
+  opt_proxy_score_ = new map<string, TransferScore>();
+  opt_num_scored_ = 0;
+  opt_probe_interval_ = 0;
 
   // Prepare HTTP headers
   string custom_header;
@@ -940,12 +1719,6 @@ void Init(const unsigned max_pool_handles) {
   http_headers_nocache_ = curl_slist_append(http_headers_nocache_,
                                             custom_header.c_str());
 
-  curl_multi_ = curl_multi_init();
-  assert(curl_multi_ != NULL);
-  curl_multi_setopt(curl_multi_, CURLMOPT_SOCKETFUNCTION, CallbackCurlSocket);
-  curl_multi_setopt(curl_multi_, CURLMOPT_MAXCONNECTS, watch_fds_max_);
-  //curl_multi_setopt(curl_multi_, CURLMOPT_PIPELINING, 1);
-
   // Initialize random number engine with system time
   struct timeval tv_now;
   gettimeofday(&tv_now, NULL);
@@ -954,55 +1727,118 @@ void Init(const unsigned max_pool_handles) {
 
 
 void Fini() {
-  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
-    // Shutdown I/O thread
+  if (probe_running_) {
     char buf = 'T';
-    WritePipe(pipe_terminate_[1], &buf, 1);
-    pthread_join(thread_download_, NULL);
-    // All handles are removed from the multi stack
-    close(pipe_terminate_[1]);
-    close(pipe_terminate_[0]);
+    WritePipe(pipe_probe_terminate_[1], &buf, 1);
+    pthread_join(thread_probe_, NULL);
+    ClosePipe(pipe_probe_terminate_);
+    probe_running_ = false;
   }
 
-  for (set<CURL *>::iterator i = pool_handles_idle_->begin(),
-       iEnd = pool_handles_idle_->end(); i != iEnd; ++i)
-  {
-    curl_easy_cleanup(*i);
+  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
+    // Shutdown I/O threads
+    for (unsigned i = 0; i < workers_->size(); ++i) {
+      Worker *worker = (*workers_)[i];
+      char buf = 'T';
+      WritePipe(worker->pipe_terminate[1], &buf, 1);
+      pthread_join(worker->thread, NULL);
+      // All handles are removed from the multi stack
+      ClosePipe(worker->pipe_terminate);
+      ClosePipe(worker->pipe_jobs);
+    }
   }
-  delete pool_handles_idle_;
-  delete pool_handles_inuse_;
+
+  for (unsigned i = 0; i < workers_->size(); ++i)
+    DestroyWorker((*workers_)[i]);
+  delete workers_;
+  workers_ = NULL;
   curl_slist_free_all(http_headers_);
   curl_slist_free_all(http_headers_nocache_);
-  curl_multi_cleanup(curl_multi_);
-  pool_handles_idle_ = NULL;
-  pool_handles_inuse_ = NULL;
   http_headers_ = NULL;
   http_headers_nocache_ = NULL;
-  curl_multi_ = NULL;
 
   delete opt_host_chain_;
   delete opt_host_chain_rtt_;
+  delete opt_host_chain_score_;
   delete opt_proxy_groups_;
+  delete opt_proxy_ring_;
+  delete opt_proxy_score_;
   opt_host_chain_ = NULL;
   opt_host_chain_rtt_ = NULL;
+  opt_host_chain_score_ = NULL;
   opt_proxy_groups_ = NULL;
+  opt_proxy_ring_ = NULL;
+  opt_proxy_score_ = NULL;
 
   curl_global_cleanup();
 }
 
 
 /**
- * Spawns the I/O worker thread and switches the module in multi-threaded mode.
- * No way back except Fini(); Init();
+ * Sets the number of I/O threads started by Spawn().  Has to be called before
+ * Spawn().
  */
-void Spawn() {
-  MakePipe(pipe_terminate_);
-  MakePipe(pipe_jobs_);
+void SetNumWorkers(const unsigned num_workers) {
+  assert(atomic_xadd32(&multi_threaded_, 0) == 0);
+  num_workers_ = (num_workers > 0) ? num_workers : 1;
+}
+
+
+/**
+ * Limits the number of concurrent transfers of a priority class.  Zero means
+ * unlimited.
+ */
+void SetPriorityLimit(const Priority priority, const unsigned max_transfers) {
+  pthread_mutex_lock(&lock_options_);
+  opt_max_active_[priority] = max_transfers;
+  pthread_mutex_unlock(&lock_options_);
+}
 
-  int retval = pthread_create(&thread_download_, NULL, MainDownload, NULL);
-  assert(retval == 0);
+
+/**
+ * Limits the overall download bandwidth, including transfers in flight.  Zero
+ * means unlimited.  Throttling only applies in multi-threaded mode.
+ */
+void SetMaxBandwidth(const uint64_t bytes_per_second) {
+  pthread_mutex_lock(&lock_bandwidth_);
+  opt_max_bandwidth_ = bytes_per_second;
+  bucket_tokens_ = double(bytes_per_second);
+  gettimeofday(&bucket_timestamp_, NULL);
+  pthread_mutex_unlock(&lock_bandwidth_);
+}
+
+
+static void *MainProbe(void *data);
+
+
+/**
+ * Spawns the I/O worker threads and switches the module in multi-threaded
+ * mode.  No way back except Fini(); Init();
+ */
+void Spawn() {
+  while (workers_->size() < num_workers_)
+    workers_->push_back(CreateWorker(workers_->size()));
+
+  int retval;
+  for (unsigned i = 0; i < workers_->size(); ++i) {
+    Worker *worker = (*workers_)[i];
+    MakePipe(worker->pipe_terminate);
+    MakePipe(worker->pipe_jobs);
+    retval = pthread_create(&worker->thread, NULL, MainDownload, worker);
+    assert(retval == 0);
+  }
 
   atomic_inc32(&multi_threaded_);
+
+  pthread_mutex_lock(&lock_options_);
+  const bool start_probe = opt_probe_interval_ > 0;
+  pthread_mutex_unlock(&lock_options_);
+  if (start_probe) {
+    MakePipe(pipe_probe_terminate_);
+    retval = pthread_create(&thread_probe_, NULL, MainProbe, NULL);
+    assert(retval == 0);
+    probe_running_ = true;
+  }
 }
 
 
@@ -1047,19 +1883,26 @@ void GetTimeout(unsigned *seconds_proxy, unsigned *seconds_direct) {
 
 
 /**
- * Overall number of bytes received through downloads.
+ * Overall number of bytes received through downloads, summed over all I/O
+ * threads.
  */
 uint64_t GetTransferredBytes() {
-  return uint64_t(stat_transferred_bytes_);
+  double result = 0.0;
+  for (unsigned i = 0; i < workers_->size(); ++i)
+    result += (*workers_)[i]->stat_transferred_bytes;
+  return uint64_t(result);
 }
 
 
 /**
- * Overall time spend in receiving data.
+ * Overall time spend in receiving data, summed over all I/O threads.
  */
 uint64_t GetTransferTime() {
-  LogCvmfs(kLogDownload, kLogDebug, "Transfer time %lf", stat_transfer_time_);
-  return uint64_t(stat_transfer_time_);
+  double result = 0.0;
+  for (unsigned i = 0; i < workers_->size(); ++i)
+    result += (*workers_)[i]->stat_transfer_time;
+  LogCvmfs(kLogDownload, kLogDebug, "Transfer time %lf", result);
+  return uint64_t(result);
 }
 
 
@@ -1071,11 +1914,13 @@ void SetHostChain(const string &host_list) {
   pthread_mutex_lock(&lock_options_);
   delete opt_host_chain_;
   delete opt_host_chain_rtt_;
+  delete opt_host_chain_score_;
   opt_host_chain_current_ = 0;
 
   if (host_list == "") {
     opt_host_chain_ = NULL;
     opt_host_chain_rtt_ = NULL;
+    opt_host_chain_score_ = NULL;
     pthread_mutex_unlock(&lock_options_);
     return;
   }
@@ -1084,22 +1929,28 @@ void SetHostChain(const string &host_list) {
   opt_host_chain_rtt_ = new vector<int>();
   for (unsigned i = 0, s = opt_host_chain_->size(); i < s; ++i)
     opt_host_chain_rtt_->push_back(-1);
+  opt_host_chain_score_ =
+    new vector<TransferScore>(opt_host_chain_->size(), TransferScore());
   pthread_mutex_unlock(&lock_options_);
 }
 
 
 /**
- * Retrieves the currently set chain of hosts, their round trip times, and the
- * currently used host.
+ * Retrieves the currently set chain of hosts, their round trip times, their
+ * transfer scores, and the currently used host.
  */
 void GetHostInfo(std::vector<std::string> *host_chain,
-                 std::vector<int> *rtt, unsigned *current_host)
+                 std::vector<int> *rtt, std::vector<TransferScore> *scores,
+                 unsigned *current_host)
 {
   pthread_mutex_lock(&lock_options_);
   if (opt_host_chain_) {
     *current_host = opt_host_chain_current_;
     *host_chain = *opt_host_chain_;
     *rtt = *opt_host_chain_rtt_;
+    *scores = *opt_host_chain_score_;
+    for (unsigned i = 0; i < scores->size(); ++i)
+      (*scores)[i].expected_ms = ExpectedMs((*scores)[i], (*rtt)[i]);
   }
   pthread_mutex_unlock(&lock_options_);
 }
@@ -1113,6 +1964,8 @@ void SetProxyChain(const std::string &proxy_list) {
   pthread_mutex_lock(&lock_options_);
 
   delete opt_proxy_groups_;
+  delete opt_proxy_ring_;
+  opt_proxy_ring_ = NULL;
   if (proxy_list == "") {
     opt_proxy_groups_ = NULL;
     opt_proxy_groups_current_ = 0;
@@ -1166,66 +2019,199 @@ void GetProxyInfo(vector< vector<string> > *proxy_chain,
 
 
 /**
- * Orders the hostlist according to RTT of downloading .cvmfschecksum.
- * Sets the current host to the best-responsive host.
- * If you change the host list in between by SetHostChain(), it will be
- * overwritten by this function.
+ * Switches between random selection of a proxy inside a load-balancing group
+ * and consistent hashing of the content over all the proxies of the group.
  */
-void ProbeHosts() {
+void SetProxySharding(const bool enabled) {
+  pthread_mutex_lock(&lock_options_);
+  opt_proxy_shard_ = enabled;
+  delete opt_proxy_ring_;
+  opt_proxy_ring_ = NULL;
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+bool GetProxySharding() {
+  pthread_mutex_lock(&lock_options_);
+  const bool result = opt_proxy_shard_;
+  pthread_mutex_unlock(&lock_options_);
+  return result;
+}
+
+
+/**
+ * Retrieves the transfer scores of all the proxies used so far.
+ */
+void GetProxyScores(map<string, TransferScore> *scores) {
+  pthread_mutex_lock(&lock_options_);
+  *scores = *opt_proxy_score_;
+  for (map<string, TransferScore>::iterator i = scores->begin(),
+       iEnd = scores->end(); i != iEnd; ++i)
+  {
+    i->second.expected_ms = ExpectedMs(i->second, -1);
+  }
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Measures the time to download .cvmfspublished from a host.  The first
+ * download fills the caches, the second one is measured.
+ *
+ * \return round trip time in ms or -2 on failure
+ */
+static int ProbeHost(const string &host) {
+  string url = host + "/.cvmfspublished";
+  JobInfo info(&url, false, false, NULL);
+  int rtt = -2;
+  for (unsigned retries = 0; retries < 2; ++retries) {
+    struct timeval tv_start, tv_end;
+    gettimeofday(&tv_start, NULL);
+    Failures result = Fetch(&info);
+    gettimeofday(&tv_end, NULL);
+    if (info.destination_mem.data)
+      free(info.destination_mem.data);
+    if (result == kFailOk) {
+      rtt = int(DiffTimeSeconds(tv_start, tv_end) * 1000.0);
+      LogCvmfs(kLogDownload, kLogDebug, "probing host %s had %dms rtt",
+               url.c_str(), rtt);
+    } else {
+      LogCvmfs(kLogDownload, kLogDebug, "error while probing host %s: %d",
+               url.c_str(), result);
+      rtt = -2;
+    }
+  }
+  return rtt;
+}
+
+
+struct HostProbe {
+  string host;
+  int rtt;
+  pthread_t thread;
+};
+
+
+static void *MainProbeHost(void *data) {
+  HostProbe *probe = static_cast<HostProbe *>(data);
+  probe->rtt = ProbeHost(probe->host);
+  return NULL;
+}
+
+
+/**
+ * Measures the RTT of all hosts and orders the host chain according to the
+ * expected completion time.  The RTT serves as latency estimate for hosts that
+ * have no measurements from real transfers yet.  In multi-threaded mode, all
+ * hosts are probed in parallel.  Unless forced, the active host only changes
+ * if another one is better by more than kScoreHysteresis.
+ */
+static void ProbeAndReorderHosts(const bool force) {
   vector<string> host_chain;
   vector<int> host_rtt;
+  vector<TransferScore> host_score;
   unsigned current_host;
 
-  GetHostInfo(&host_chain, &host_rtt, &current_host);
+  GetHostInfo(&host_chain, &host_rtt, &host_score, &current_host);
+  if (host_chain.empty())
+    return;
 
-  // Stopwatch, two times to fill caches first
-  unsigned i, retries;
-  string url;
-  JobInfo info(&url, false, false, NULL);
-  for (retries = 0; retries < 2; ++retries) {
-    for (i = 0; i < host_chain.size(); ++i) {
-      url = host_chain[i] + "/.cvmfspublished";
-
-      struct timeval tv_start, tv_end;
-      gettimeofday(&tv_start, NULL);
-      Failures result = Fetch(&info);
-      gettimeofday(&tv_end, NULL);
-      if (info.destination_mem.data)
-        free(info.destination_mem.data);
-      if (result == kFailOk) {
-        host_rtt[i] = int(DiffTimeSeconds(tv_start, tv_end));
-        LogCvmfs(kLogDownload, kLogDebug, "probing host %s had %dms rtt",
-                 url.c_str(), host_rtt[i]);
-      } else {
-        LogCvmfs(kLogDownload, kLogDebug, "error while probing host %s: %d",
-                 url.c_str(), result);
-        host_rtt[i] = INT_MAX;
+  vector<HostProbe> probes(host_chain.size());
+  for (unsigned i = 0; i < host_chain.size(); ++i)
+    probes[i].host = host_chain[i];
+  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
+    vector<bool> spawned(probes.size(), false);
+    for (unsigned i = 0; i < probes.size(); ++i) {
+      spawned[i] = (pthread_create(&probes[i].thread, NULL, MainProbeHost,
+                                   &probes[i]) == 0);
+    }
+    // Without a thread, the host is probed in this one
+    for (unsigned i = 0; i < probes.size(); ++i) {
+      if (!spawned[i]) {
+        LogCvmfs(kLogDownload, kLogDebug, "failed to start probe thread for "
+                 "%s, probing serially", probes[i].host.c_str());
+        probes[i].rtt = ProbeHost(probes[i].host);
       }
     }
+    for (unsigned i = 0; i < probes.size(); ++i) {
+      if (spawned[i])
+        pthread_join(probes[i].thread, NULL);
+    }
+  } else {
+    for (unsigned i = 0; i < probes.size(); ++i)
+      probes[i].rtt = ProbeHost(probes[i].host);
   }
 
-  // Sort entries, insertion sort on both, rtt and hosts
-  for (i = 1; i < host_chain.size(); ++i) {
-    int val_rtt = host_rtt[i];
-    string val_host = host_chain[i];
-    int pos;
-    for (pos = i-1; (pos >= 0) && (host_rtt[pos] > val_rtt); --pos) {
-      host_rtt[pos+1] = host_rtt[pos];
-      host_chain[pos+1] = host_chain[pos];
+  // The host chain might have been changed in the meantime
+  pthread_mutex_lock(&lock_options_);
+  if (opt_host_chain_) {
+    for (unsigned i = 0; i < probes.size(); ++i) {
+      for (unsigned j = 0; j < opt_host_chain_->size(); ++j) {
+        if ((*opt_host_chain_)[j] == probes[i].host) {
+          (*opt_host_chain_rtt_)[j] = probes[i].rtt;
+          break;
+        }
+      }
     }
-    host_rtt[pos+1] = val_rtt;
-    host_chain[pos+1] = val_host;
+    ReorderHosts(force);
   }
-  for (i = 0; i < host_chain.size(); ++i) {
-    if (host_rtt[i] == INT_MAX) host_rtt[i] = -2;
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Probes all hosts and sets the current host to the best-responsive host.
+ */
+void ProbeHosts() {
+  ProbeAndReorderHosts(true);
+}
+
+
+/**
+ * Background thread that probes the hosts every opt_probe_interval_ seconds,
+ * so that hosts marked as down can recover and changes in the network are
+ * picked up.
+ */
+static void *MainProbe(void *data __attribute__((unused))) {
+  LogCvmfs(kLogDownload, kLogDebug, "host probing thread started");
+
+  struct pollfd watch_term;
+  watch_term.fd = pipe_probe_terminate_[0];
+  watch_term.events = POLLIN | POLLPRI;
+  bool initial = true;
+  while (true) {
+    pthread_mutex_lock(&lock_options_);
+    const int timeout_ms = opt_probe_interval_ * 1000;
+    pthread_mutex_unlock(&lock_options_);
+
+    watch_term.revents = 0;
+    int retval = poll(&watch_term, 1, timeout_ms);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (retval > 0)
+      break;
+
+    // After the initial probe, a noisy sample must not make the active host
+    // flap between hosts of about the same speed
+    ProbeAndReorderHosts(initial);
+    initial = false;
   }
 
+  LogCvmfs(kLogDownload, kLogDebug, "host probing thread terminated");
+  return NULL;
+}
+
+
+/**
+ * Sets the interval of the background host probing.  Has to be called before
+ * Spawn().  Zero turns background probing off.
+ */
+void SetProbeInterval(const unsigned seconds) {
   pthread_mutex_lock(&lock_options_);
-  delete opt_host_chain_;
-  delete opt_host_chain_rtt_;
-  opt_host_chain_ = new vector<string>(host_chain);
-  opt_host_chain_rtt_ = new vector<int>(host_rtt);
-  opt_host_chain_current_ = 0;
+  opt_probe_interval_ = seconds;
   pthread_mutex_unlock(&lock_options_);
 }
 
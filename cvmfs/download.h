@@ -7,8 +7,10 @@
 
 #include <stdint.h>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <vector>
+#include <map>
 
 #include "duplex_curl.h"
 #include "compression.h"
@@ -22,7 +24,8 @@ namespace download {
 enum Destination {
   kDestinationMem = 1,
   kDestinationFile,
-  kDestinationPath
+  kDestinationPath,
+  kDestinationFd,  /**< Buffered writes to a file descriptor */
 };
 
 /**
@@ -38,6 +41,35 @@ enum Failures {
   kFailOther,
 };
 
+/**
+ * Priority classes of download jobs.  When transfers have to wait for a slot
+ * or for bandwidth, higher classes go first.
+ */
+enum Priority {
+  kPriorityCatalog = 0,  /**< File catalogs and repository meta data */
+  kPriorityDemand,  /**< Files requested by open() */
+  kPriorityPrefetch,  /**< Background transfers */
+  kNumPriorities,
+};
+
+
+/**
+ * Exponentially weighted moving averages of the time to first byte and of the
+ * throughput observed in real transfers through a host or a proxy.  Negative
+ * values mean that there is no measurement yet.  The expected time is the
+ * estimated time to fetch a typical object and is used to order hosts and
+ * proxies.
+ */
+struct TransferScore {
+  TransferScore() : latency_ms(-1.0), throughput_kbs(-1.0), expected_ms(-1.0),
+                    num_samples(0) { }
+  double latency_ms;
+  double throughput_kbs;
+  double expected_ms;
+  uint64_t num_samples;
+};
+
+
 /**
  * Contains all the information to specify a download job.
  */
@@ -53,31 +85,45 @@ struct JobInfo {
   } destination_mem;
   FILE *destination_file;
   const std::string *destination_path;
+  zlib::FdSink destination_fd;  /**< Set destination_fd.fd only */
   const hash::Any *expected_hash;
+  Priority priority;
 
   // One constructor per destination
-  JobInfo() { wait_at[0] = wait_at[1] = -1; }
+  JobInfo() : priority(kPriorityDemand) {
+    wait_at[0] = wait_at[1] = -1;
+    destination_fd.buffer = NULL;
+    paused = false;
+  }
   JobInfo(const std::string *u, const bool c, const bool ph,
           const std::string *p, const hash::Any *h) : url(u), compressed(c),
           probe_hosts(ph), destination(kDestinationPath), destination_path(p),
-          expected_hash(h)
-          { wait_at[0] = wait_at[1] = -1; }
+          expected_hash(h), priority(kPriorityDemand)
+          { wait_at[0] = wait_at[1] = -1; destination_fd.buffer = NULL;
+            paused = false; }
   JobInfo(const std::string *u, const bool c, const bool ph, FILE *f,
           const hash::Any *h) : url(u), compressed(c), probe_hosts(ph),
-          destination(kDestinationFile), destination_file(f), expected_hash(h)
-          { wait_at[0] = wait_at[1] = -1; }
+          destination(kDestinationFile), destination_file(f), expected_hash(h),
+          priority(kPriorityDemand)
+          { wait_at[0] = wait_at[1] = -1; destination_fd.buffer = NULL;
+            paused = false; }
   JobInfo(const std::string *u, const bool c, const bool ph,
           const hash::Any *h) : url(u), compressed(c), probe_hosts(ph),
-          destination(kDestinationMem), expected_hash(h)
-          { wait_at[0] = wait_at[1] = -1; }
+          destination(kDestinationMem), expected_hash(h),
+          priority(kPriorityDemand)
+          { wait_at[0] = wait_at[1] = -1; destination_fd.buffer = NULL;
+            paused = false; }
   ~JobInfo() {
     if (wait_at[0] >= 0) {
       close(wait_at[0]);
       close(wait_at[1]);
     }
+    free(destination_fd.buffer);
   }
 
   // Internal state, don't touch
+  void (*callback)(JobInfo *info, void *data);  /**< Set by FetchAsync() */
+  void *callback_data;
   CURL *curl_handle;
   z_stream zstream;
   hash::ContextPtr hash_context;
@@ -87,13 +133,25 @@ struct JobInfo {
   Failures error_code;
   unsigned char num_failed_proxies;
   unsigned char num_failed_hosts;
+  unsigned char proxy_ring_offset;  /**< Skipped members of the proxy ring */
+  unsigned proxy_group;  /**< Load-balancing group used for the transfer */
+  uint64_t range_offset;  /**< Bytes received and written to destination */
+  bool range_resumed;  /**< Current attempt continues at range_offset */
+  bool range_disabled;  /**< Server failed the range request, restart */
+  bool pausable;  /**< Run by an I/O thread that resumes paused transfers */
+  bool paused;  /**< Waits for bandwidth */
 };
 
 
 void Init(const unsigned max_pool_handles);
 void Fini();
+void SetNumWorkers(const unsigned num_workers);
+void SetPriorityLimit(const Priority priority, const unsigned max_transfers);
+void SetMaxBandwidth(const uint64_t bytes_per_second);
 void Spawn();
 Failures Fetch(JobInfo *info);
+bool FetchAsync(JobInfo *info, void (*callback)(JobInfo *info, void *data),
+                void *data);
 
 void SetDnsServer(const std::string &address);
 void SetTimeout(const unsigned seconds_proxy, const unsigned seconds_direct);
@@ -102,12 +160,17 @@ uint64_t GetTransferredBytes();
 uint64_t GetTransferTime();
 void SetHostChain(const std::string &host_list);
 void GetHostInfo(std::vector<std::string> *host_chain,
-                 std::vector<int> *rtt, unsigned *current_host);
+                 std::vector<int> *rtt, std::vector<TransferScore> *scores,
+                 unsigned *current_host);
 void ProbeHosts();
+void SetProbeInterval(const unsigned seconds);
 void SwitchHost();
 void SetProxyChain(const std::string &proxy_list);
 void GetProxyInfo(std::vector< std::vector<std::string> > *proxy_chain,
                   unsigned *current_group);
+void SetProxySharding(const bool enabled);
+bool GetProxySharding();
+void GetProxyScores(std::map<std::string, TransferScore> *scores);
 void RebalanceProxies();
 void SwitchProxyGroup();
 void RestartNetwork();
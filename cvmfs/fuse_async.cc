@@ -0,0 +1,266 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Fuse requests that would block on a download, i.e. opening a file that is
+ * not in the cache or a lookup that has to load a nested catalog, are handed
+ * over to a fixed pool of worker threads.  The fuse thread returns
+ * immediately and the worker replies to the request once the download is
+ * done.  That way, slow downloads do not hold the threads of the fuse session
+ * loop, which keep serving cached requests.
+ *
+ * Opens do not need a worker for the download itself.  They start the
+ * download without waiting and reply from its completion in the download
+ * I/O thread.  Such continuations are counted between BeginContinuation() and
+ * EndContinuation(), so that many more downloads than workers are in flight.
+ * The workers block on the rest: lookups that load a nested catalog, whose
+ * chain of dependent downloads and signature checks runs under the catalog
+ * manager's lock, and opens of files that are downloaded by another thread
+ * or that go to the pack store.
+ *
+ * The number of pending requests and of continuations is bounded.  If the
+ * queue is full, Dispatch() fails and the request is handled in the fuse
+ * thread as before.
+ */
+
+#include "cvmfs_config.h"
+#include "fuse_async.h"
+
+#include <pthread.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include <string>
+
+#include "atomic.h"
+#include "logging.h"
+#include "util.h"
+#include "smalloc.h"
+
+using namespace std;  // NOLINT
+
+namespace fuse_async {
+
+const unsigned kDefaultMaxPending = 256;
+
+struct Job {
+  Handler handler;
+  void *data;
+};
+
+struct Statistics {
+  atomic_int64 num_dispatched;
+  atomic_int64 num_rejected;  /**< Handled in the fuse thread, queue full */
+  atomic_int64 num_continued;
+};
+
+unsigned num_threads_ = 0;
+pthread_t *threads_ = NULL;
+bool spawned_ = false;
+bool terminate_ = false;
+Statistics statistics_;
+
+/**
+ * Pending jobs as ring buffer of max_pending_ jobs.
+ */
+Job *queue_ = NULL;
+unsigned max_pending_ = 0;
+unsigned head_ = 0;
+unsigned num_pending_ = 0;
+unsigned peak_pending_ = 0;
+pthread_mutex_t lock_queue_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_queue_ = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Requests that reply from a download completion, up to max_pending_.
+ */
+unsigned num_continuations_ = 0;
+unsigned peak_continuations_ = 0;
+pthread_cond_t cond_continuations_ = PTHREAD_COND_INITIALIZER;
+
+
+/**
+ * Works on the queue until it is empty after Terminate().
+ */
+static void *MainWorker(void *data __attribute__((unused))) {
+  LogCvmfs(kLogCvmfs, kLogDebug, "async fuse worker started");
+
+  while (true) {
+    pthread_mutex_lock(&lock_queue_);
+    while ((num_pending_ == 0) && !terminate_)
+      pthread_cond_wait(&cond_queue_, &lock_queue_);
+    if (num_pending_ == 0) {
+      pthread_mutex_unlock(&lock_queue_);
+      break;
+    }
+    const Job job = queue_[head_];
+    head_ = (head_ + 1) % max_pending_;
+    num_pending_--;
+    pthread_mutex_unlock(&lock_queue_);
+
+    job.handler(job.data);
+  }
+
+  LogCvmfs(kLogCvmfs, kLogDebug, "async fuse worker stopped");
+  return NULL;
+}
+
+
+/**
+ * With num_threads == 0, all requests are handled in the fuse threads.  With
+ * max_pending == 0, up to kDefaultMaxPending requests are queued.
+ */
+bool Init(const unsigned num_threads, const unsigned max_pending) {
+  atomic_init64(&statistics_.num_dispatched);
+  atomic_init64(&statistics_.num_rejected);
+  atomic_init64(&statistics_.num_continued);
+  num_threads_ = num_threads;
+  if (num_threads_ == 0)
+    return true;
+
+  max_pending_ = (max_pending > 0) ? max_pending : kDefaultMaxPending;
+  queue_ = static_cast<Job *>(smalloc(max_pending_ * sizeof(Job)));
+  threads_ = new pthread_t[num_threads_];
+  head_ = num_pending_ = peak_pending_ = 0;
+  num_continuations_ = peak_continuations_ = 0;
+  terminate_ = false;
+  LogCvmfs(kLogCvmfs, kLogDebug, "%u async fuse workers, up to %u pending "
+           "requests", num_threads_, max_pending_);
+  return true;
+}
+
+
+/**
+ * Starts the worker threads, has to run after daemonizing.
+ */
+void Spawn() {
+  for (unsigned i = 0; i < num_threads_; ++i) {
+    int retval = pthread_create(&threads_[i], NULL, MainWorker, NULL);
+    assert(retval == 0);
+  }
+  spawned_ = (num_threads_ > 0);
+}
+
+
+/**
+ * Waits for the continuations, finishes the pending requests and stops the
+ * workers.  Has to run before the fuse session is destroyed.
+ */
+void Terminate() {
+  if (!spawned_)
+    return;
+  pthread_mutex_lock(&lock_queue_);
+  terminate_ = true;
+  while (num_continuations_ > 0)
+    pthread_cond_wait(&cond_continuations_, &lock_queue_);
+  pthread_cond_broadcast(&cond_queue_);
+  pthread_mutex_unlock(&lock_queue_);
+  for (unsigned i = 0; i < num_threads_; ++i)
+    pthread_join(threads_[i], NULL);
+  spawned_ = false;
+}
+
+
+void Fini() {
+  Terminate();
+  free(queue_);
+  delete[] threads_;
+  queue_ = NULL;
+  threads_ = NULL;
+  num_threads_ = max_pending_ = 0;
+}
+
+
+bool IsEnabled() {
+  return num_threads_ > 0;
+}
+
+
+/**
+ * Queues a handler for a worker thread.
+ *
+ * \return false if asynchronous requests are disabled or the queue is full,
+ *         the caller has to handle the request itself
+ */
+bool Dispatch(Handler handler, void *data) {
+  if (num_threads_ == 0)
+    return false;
+
+  pthread_mutex_lock(&lock_queue_);
+  if (!spawned_ || terminate_ || (num_pending_ == max_pending_)) {
+    pthread_mutex_unlock(&lock_queue_);
+    atomic_inc64(&statistics_.num_rejected);
+    return false;
+  }
+  Job *job = &queue_[(head_ + num_pending_) % max_pending_];
+  job->handler = handler;
+  job->data = data;
+  num_pending_++;
+  if (num_pending_ > peak_pending_)
+    peak_pending_ = num_pending_;
+  pthread_cond_signal(&cond_queue_);
+  pthread_mutex_unlock(&lock_queue_);
+  atomic_inc64(&statistics_.num_dispatched);
+  return true;
+}
+
+
+/**
+ * Registers a request that is replied to from the completion of a download
+ * instead of by a worker.  Has to be matched by EndContinuation() after the
+ * reply.
+ *
+ * \return false if asynchronous requests are disabled or too many
+ *         continuations are in flight
+ */
+bool BeginContinuation() {
+  if (num_threads_ == 0)
+    return false;
+
+  pthread_mutex_lock(&lock_queue_);
+  if (!spawned_ || terminate_ || (num_continuations_ == max_pending_)) {
+    pthread_mutex_unlock(&lock_queue_);
+    return false;
+  }
+  num_continuations_++;
+  if (num_continuations_ > peak_continuations_)
+    peak_continuations_ = num_continuations_;
+  pthread_mutex_unlock(&lock_queue_);
+  atomic_inc64(&statistics_.num_continued);
+  return true;
+}
+
+
+void EndContinuation() {
+  pthread_mutex_lock(&lock_queue_);
+  assert(num_continuations_ > 0);
+  num_continuations_--;
+  if (num_continuations_ == 0)
+    pthread_cond_broadcast(&cond_continuations_);
+  pthread_mutex_unlock(&lock_queue_);
+}
+
+
+string GetStatistics() {
+  if (num_threads_ == 0)
+    return "Asynchronous requests disabled\n";
+
+  pthread_mutex_lock(&lock_queue_);
+  const unsigned num_pending = num_pending_;
+  const unsigned peak_pending = peak_pending_;
+  const unsigned num_continuations = num_continuations_;
+  const unsigned peak_continuations = peak_continuations_;
+  pthread_mutex_unlock(&lock_queue_);
+  return "Asynchronous requests: " + StringifyInt(num_threads_) +
+    " workers, " + StringifyInt(num_pending) + " pending (peak " +
+    StringifyInt(peak_pending) + " of " + StringifyInt(max_pending_) + "), " +
+    StringifyInt(atomic_read64(&statistics_.num_dispatched)) + " dispatched, " +
+    StringifyInt(atomic_read64(&statistics_.num_rejected)) +
+    " handled synchronously\n" +
+    "Continued from downloads: " + StringifyInt(num_continuations) +
+    " in flight (peak " + StringifyInt(peak_continuations) + " of " +
+    StringifyInt(max_pending_) + "), " +
+    StringifyInt(atomic_read64(&statistics_.num_continued)) + " total\n";
+}
+
+}  // namespace fuse_async
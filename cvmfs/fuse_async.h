@@ -0,0 +1,31 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_FUSE_ASYNC_H_
+#define CVMFS_FUSE_ASYNC_H_
+
+#include <string>
+
+namespace fuse_async {
+
+/**
+ * Runs in a worker thread and has to reply to the fuse request in data.
+ */
+typedef void (*Handler)(void *data);
+
+bool Init(const unsigned num_threads, const unsigned max_pending);
+void Spawn();
+void Terminate();
+void Fini();
+
+bool IsEnabled();
+bool Dispatch(Handler handler, void *data);
+bool BeginContinuation();
+void EndContinuation();
+
+std::string GetStatistics();
+
+}  // namespace fuse_async
+
+#endif  // CVMFS_FUSE_ASYNC_H_
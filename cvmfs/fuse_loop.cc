@@ -0,0 +1,276 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Replaces the multi-threaded session loop of libfuse by a fixed number of
+ * worker threads.  Every worker reads requests from the fuse device and
+ * processes them in place.  Where the kernel supports it, every worker gets
+ * its own clone of the fuse device file descriptor, so that the workers do
+ * not contend for the channel of the session.  Otherwise, all workers read
+ * from the session channel.  Workers can be pinned to cpus, worker i runs on
+ * cpu i modulo the number of cpus.
+ *
+ * As in libfuse, signals are handled by the main thread, which cancels the
+ * workers once the session is exited.
+ */
+
+#include "cvmfs_config.h"
+#include "fuse_loop.h"
+
+#include <fuse/fuse_lowlevel.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+
+#include "platform.h"
+#include "atomic.h"
+#include "logging.h"
+#include "util.h"
+#include "smalloc.h"
+
+using namespace std;  // NOLINT
+
+namespace fuse_loop {
+
+struct Worker {
+  unsigned id;
+  pthread_t thread;
+  bool running;
+  struct fuse_chan *channel;
+  bool cloned;  /**< Channel on an own device file descriptor */
+  int cpu;  /**< -1 if not pinned */
+  char *buffer;
+  atomic_int64 num_requests;
+};
+
+struct fuse_session *session_ = NULL;
+size_t bufsize_ = 0;
+Worker *workers_ = NULL;
+unsigned num_workers_ = 0;
+sem_t sem_finished_;  /**< Posted by every worker that stops */
+/**
+ * Protects workers_ against GetStatistics() from the talk thread.
+ */
+pthread_mutex_t lock_workers_ = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Reads from the cloned device file descriptor.  Unmounting the file system
+ * results in ENODEV.
+ *
+ * \return Number of bytes, 0 to exit, or -errno to retry
+ */
+static int ReceiveClone(struct fuse_chan **chp, char *buf, size_t size) {
+  const ssize_t retval = read(fuse_chan_fd(*chp), buf, size);
+  if (retval < 0) {
+    if (errno == ENODEV)
+      return 0;
+    if ((errno != EINTR) && (errno != EAGAIN) && (errno != ENOENT)) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "failed to read from cloned fuse device (%d)", errno);
+    }
+    return -errno;
+  }
+  return retval;
+}
+
+
+/**
+ * Writes a reply.  ENOENT means the request was interrupted meanwhile.
+ */
+static int SendClone(struct fuse_chan *ch, const struct iovec iov[],
+                     size_t count)
+{
+  if (writev(fuse_chan_fd(ch), iov, count) < 0) {
+    const int error_code = errno;
+    if ((error_code != ENOENT) && (error_code != ENODEV)) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "failed to write to cloned fuse device (%d)", error_code);
+    }
+    return -error_code;
+  }
+  return 0;
+}
+
+
+static void DestroyClone(struct fuse_chan *ch) {
+  close(fuse_chan_fd(ch));
+}
+
+
+/**
+ * A channel for a clone of the device file descriptor of channel.  It is not
+ * added to the session, requests from it are passed explicitly.
+ *
+ * \return NULL if cloning is not supported
+ */
+static struct fuse_chan *CloneChannel(struct fuse_chan *channel) {
+  const int clone_fd = platform_clone_fuse_fd(fuse_chan_fd(channel));
+  if (clone_fd < 0)
+    return NULL;
+
+  struct fuse_chan_ops clone_ops;
+  memset(&clone_ops, 0, sizeof(clone_ops));
+  clone_ops.receive = ReceiveClone;
+  clone_ops.send = SendClone;
+  clone_ops.destroy = DestroyClone;
+  struct fuse_chan *clone = fuse_chan_new(&clone_ops, clone_fd, bufsize_,
+                                          NULL);
+  if (clone == NULL)
+    close(clone_fd);
+  return clone;
+}
+
+
+static void *MainWorker(void *data) {
+  Worker *worker = reinterpret_cast<Worker *>(data);
+  LogCvmfs(kLogCvmfs, kLogDebug, "fuse worker %u started", worker->id);
+  if ((worker->cpu >= 0) && !platform_pin_thread(worker->cpu)) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "failed to pin fuse worker %u to cpu %d",
+             worker->id, worker->cpu);
+    worker->cpu = -1;
+  }
+
+  while (!fuse_session_exited(session_)) {
+    struct fuse_chan *channel = worker->channel;
+    const int retval = fuse_chan_recv(&channel, worker->buffer, bufsize_);
+    if ((retval == -EINTR) || (retval == -EAGAIN) || (retval == -ENOENT))
+      continue;
+    if (retval <= 0) {
+      fuse_session_exit(session_);
+      break;
+    }
+
+    // Requests are not cancelled halfway
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    fuse_session_process(session_, worker->buffer, retval, channel);
+    atomic_inc64(&worker->num_requests);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  }
+
+  sem_post(&sem_finished_);
+  return NULL;
+}
+
+
+static void FreeWorkers() {
+  pthread_mutex_lock(&lock_workers_);
+  for (unsigned i = 0; i < num_workers_; ++i) {
+    if (workers_[i].cloned)
+      fuse_chan_destroy(workers_[i].channel);
+    free(workers_[i].buffer);
+  }
+  delete[] workers_;
+  workers_ = NULL;
+  num_workers_ = 0;
+  pthread_mutex_unlock(&lock_workers_);
+}
+
+
+/**
+ * Processes requests of session with num_workers threads until the session
+ * is exited or the file system is unmounted.
+ *
+ * \return 0 on normal exit, -1 if workers could not be started
+ */
+int Run(struct fuse_session *session, struct fuse_chan *channel,
+        const unsigned num_workers, const bool pin_workers)
+{
+  session_ = session;
+  bufsize_ = fuse_chan_bufsize(channel);
+  const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);  // NOLINT
+  sem_init(&sem_finished_, 0, 0);
+
+  pthread_mutex_lock(&lock_workers_);
+  workers_ = new Worker[num_workers];
+  num_workers_ = num_workers;
+  unsigned num_cloned = 0;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    Worker *worker = &workers_[i];
+    worker->id = i;
+    worker->running = false;
+    // The first worker keeps the session channel
+    worker->channel = (i > 0) ? CloneChannel(channel) : NULL;
+    worker->cloned = (worker->channel != NULL);
+    if (!worker->cloned)
+      worker->channel = channel;
+    else
+      num_cloned++;
+    worker->cpu = (pin_workers && (num_cpus > 0)) ? int(i % num_cpus) : -1;
+    worker->buffer = static_cast<char *>(smalloc(bufsize_));
+    atomic_init64(&worker->num_requests);
+  }
+  pthread_mutex_unlock(&lock_workers_);
+  LogCvmfs(kLogCvmfs, kLogDebug, "starting %u fuse workers, %u with cloned "
+           "device", num_workers, num_cloned);
+
+  // Signals go to the main thread
+  sigset_t block_all;
+  sigset_t old_mask;
+  sigfillset(&block_all);
+  pthread_sigmask(SIG_BLOCK, &block_all, &old_mask);
+  unsigned num_started = 0;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    if (pthread_create(&workers_[i].thread, NULL, MainWorker, &workers_[i])
+        != 0)
+    {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "failed to start fuse worker %u", i);
+      break;
+    }
+    workers_[i].running = true;
+    num_started++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  if (num_started == 0) {
+    FreeWorkers();
+    sem_destroy(&sem_finished_);
+    return -1;
+  }
+
+  // Returns on a stopped worker or on a signal
+  while (!fuse_session_exited(session_))
+    sem_wait(&sem_finished_);
+
+  for (unsigned i = 0; i < num_workers; ++i) {
+    if (workers_[i].running)
+      pthread_cancel(workers_[i].thread);
+  }
+  for (unsigned i = 0; i < num_workers; ++i) {
+    if (workers_[i].running)
+      pthread_join(workers_[i].thread, NULL);
+  }
+  FreeWorkers();
+  sem_destroy(&sem_finished_);
+  fuse_session_reset(session_);
+  return 0;
+}
+
+
+string GetStatistics() {
+  pthread_mutex_lock(&lock_workers_);
+  if (num_workers_ == 0) {
+    pthread_mutex_unlock(&lock_workers_);
+    return "";
+  }
+  string result = "Fuse workers:\n";
+  for (unsigned i = 0; i < num_workers_; ++i) {
+    result += "  worker " + StringifyInt(i) + ": " +
+      StringifyInt(atomic_read64(&workers_[i].num_requests)) + " requests" +
+      (workers_[i].cloned ? ", cloned device" : "") +
+      ((workers_[i].cpu >= 0) ?
+        ", cpu " + StringifyInt(workers_[i].cpu) : "") + "\n";
+  }
+  pthread_mutex_unlock(&lock_workers_);
+  return result;
+}
+
+}  // namespace fuse_loop
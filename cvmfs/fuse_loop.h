@@ -0,0 +1,22 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_FUSE_LOOP_H_
+#define CVMFS_FUSE_LOOP_H_
+
+#include <string>
+
+struct fuse_session;
+struct fuse_chan;
+
+namespace fuse_loop {
+
+int Run(struct fuse_session *session, struct fuse_chan *channel,
+        const unsigned num_workers, const bool pin_workers);
+
+std::string GetStatistics();
+
+}  // namespace fuse_loop
+
+#endif  // CVMFS_FUSE_LOOP_H_
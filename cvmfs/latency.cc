@@ -0,0 +1,167 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Latency histograms of the fuse callbacks and of the time spent in the file
+ * catalogs, in the cache, and in downloads.  Bucket i counts operations that
+ * took less than 2^i microseconds (and at least 2^(i-1)), the last bucket
+ * takes everything above.  Recording is a few atomic increments, there is no
+ * lock.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "latency.h"
+
+#include <sys/time.h>
+#include <inttypes.h>
+
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "metrics.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace latency {
+
+const unsigned kNumBuckets = 32;
+
+struct Histogram {
+  atomic_int64 buckets[kNumBuckets];
+  atomic_int64 sum;  /**< Microseconds */
+};
+
+const char *kOperationNames[] = {
+  "lookup",
+  "getattr",
+  "readlink",
+  "opendir",
+  "readdir",
+  "releasedir",
+  "open",
+  "read",
+  "release",
+  "statfs",
+  "getxattr",
+  "listxattr",
+  "lookup_async",
+  "open_async",
+  "catalog",
+  "cache_fetch",
+  "download",
+};
+
+Histogram histograms_[kNumOperations];
+
+
+/**
+ * Microseconds since the epoch.
+ */
+uint64_t Now() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return uint64_t(now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+
+static unsigned GetBucket(const uint64_t microseconds) {
+  if (microseconds == 0)
+    return 0;
+  const unsigned bucket = 64 - __builtin_clzll(microseconds);
+  return (bucket < kNumBuckets) ? bucket : kNumBuckets - 1;
+}
+
+
+/**
+ * Records the time since start, which was taken by Now().
+ *
+ * \return The recorded time in microseconds
+ */
+uint64_t Record(const Operation operation, const uint64_t start) {
+  const uint64_t now = Now();
+  // The wall clock may jump backwards
+  const uint64_t microseconds = (now > start) ? now - start : 0;
+  Histogram *histogram = &histograms_[operation];
+  atomic_inc64(&histogram->buckets[GetBucket(microseconds)]);
+  atomic_xadd64(&histogram->sum, microseconds);
+  return microseconds;
+}
+
+
+void Reset() {
+  for (unsigned i = 0; i < kNumOperations; ++i) {
+    for (unsigned j = 0; j < kNumBuckets; ++j)
+      atomic_init64(&histograms_[i].buckets[j]);
+    atomic_init64(&histograms_[i].sum);
+  }
+}
+
+
+/**
+ * Upper bound of the bucket that contains the given fraction of operations.
+ */
+static string PrintPercentile(const int64_t counts[kNumBuckets],
+                              const int64_t total, const double fraction)
+{
+  int64_t sum = 0;
+  for (unsigned i = 0; i < kNumBuckets - 1; ++i) {
+    sum += counts[i];
+    if (sum >= fraction * total)
+      return "< " + StringifyInt(int64_t(1) << i) + " us";
+  }
+  return ">= " + StringifyInt(int64_t(1) << (kNumBuckets - 2)) + " us";
+}
+
+
+/**
+ * One line per operation with samples, followed by the non-empty buckets.
+ */
+string Print() {
+  string result;
+  for (unsigned i = 0; i < kNumOperations; ++i) {
+    int64_t counts[kNumBuckets];
+    int64_t total = 0;
+    for (unsigned j = 0; j < kNumBuckets; ++j) {
+      counts[j] = atomic_read64(&histograms_[i].buckets[j]);
+      total += counts[j];
+    }
+    if (total == 0)
+      continue;
+
+    const int64_t sum = atomic_read64(&histograms_[i].sum);
+    result += string(kOperationNames[i]) + ": " + StringifyInt(total) +
+      " operations, mean " + StringifyInt(sum / total) + " us, median " +
+      PrintPercentile(counts, total, 0.5) + ", 90% " +
+      PrintPercentile(counts, total, 0.9) + ", 99% " +
+      PrintPercentile(counts, total, 0.99) + "\n ";
+    for (unsigned j = 0; j < kNumBuckets; ++j) {
+      if (counts[j] == 0)
+        continue;
+      result += ((j < kNumBuckets - 1) ? " <" : " >=") +
+        StringifyInt(int64_t(1) << ((j < kNumBuckets - 1) ? j : j - 1)) +
+        ":" + StringifyInt(counts[j]);
+    }
+    result += "\n";
+  }
+  if (result == "")
+    return "No samples\n";
+  return result;
+}
+
+
+void CollectMetrics(metrics::Collection *collection) {
+  for (unsigned i = 0; i < kNumOperations; ++i) {
+    vector<int64_t> buckets(kNumBuckets);
+    for (unsigned j = 0; j < kNumBuckets; ++j)
+      buckets[j] = atomic_read64(&histograms_[i].buckets[j]);
+    collection->AddHistogram("cvmfs_latency_microseconds",
+      "operation=\"" + string(kOperationNames[i]) + "\"",
+      "Duration of file system calls and of their phases",
+      buckets, atomic_read64(&histograms_[i].sum));
+  }
+}
+
+}  // namespace latency
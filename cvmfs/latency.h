@@ -0,0 +1,50 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_LATENCY_H_
+#define CVMFS_LATENCY_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace metrics {
+class Collection;
+}
+
+namespace latency {
+
+/**
+ * Fuse callbacks, followed by the phases they spend time in.
+ */
+enum Operation {
+  kLookup = 0,
+  kGetattr,
+  kReadlink,
+  kOpendir,
+  kReaddir,
+  kReleasedir,
+  kOpen,
+  kRead,
+  kRelease,
+  kStatfs,
+  kGetxattr,
+  kListxattr,
+  kLookupAsync,  /**< From the callback to the reply of the async worker */
+  kOpenAsync,
+  kCatalog,
+  kCacheFetch,
+  kDownload,
+  kNumOperations,
+};
+
+uint64_t Now();
+uint64_t Record(const Operation operation, const uint64_t start);
+void Reset();
+std::string Print();
+void CollectMetrics(metrics::Collection *collection);
+
+}  // namespace latency
+
+#endif  // CVMFS_LATENCY_H_
@@ -577,7 +577,7 @@ void cvmfs_int_spawn() {
   quota::Spawn();
 
   if (*tracefile_ != "")
-    tracer::Init(8192, 7000, *tracefile_);
+    tracer::Init(1024, *tracefile_);
   else
     tracer::InitNull();
 
@@ -625,7 +625,8 @@ int cvmfs_open(const char *c_path)
     return -ENOENT;
   }
 
-  fd = cache::Fetch(dirent, string(path.GetChars(), path.GetLength()));  // TODO
+  fd = cache::Fetch(dirent, string(path.GetChars(), path.GetLength()),  // TODO
+                    download::kPriorityDemand);
   atomic_inc64(&num_fs_open_);
 
   if (fd >= 0) {
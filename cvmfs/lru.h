@@ -47,6 +47,7 @@
 #include <cassert>
 
 #include <map>
+#include <vector>
 #include <algorithm>
 #include <functional>
 #include <string>
@@ -264,13 +265,21 @@ class LruCache {
   typedef struct {
     ListEntryContent<Key> *list_entry;
     Value value;
+    bool cold;  /**< Inserted by InsertCold() and not used since */
   } CacheEntry;
 
   //static uint64_t GetEntrySize() { return sizeof(Key) + sizeof(Value); }
 
+  /**
+   * Cold entries evict warm entries as long as they take less than 1/kColdShare
+   * of the cache, older cold entries afterwards.
+   */
+  static const unsigned kColdShare = 4;
+
   // Internal data fields
   unsigned int cache_gauge_;
   unsigned int cache_size_;
+  unsigned int num_cold_;
   static ConcreteMemoryAllocator *allocator_;
 
   /**
@@ -281,6 +290,11 @@ class LruCache {
    * deleted to obtain some space.
    */
   ListEntryHead<Key> *lru_list_;
+  /**
+   * Cold entries are kept at the front of the LRU list in the order of
+   * insertion, this is the last one (the list head if there are none).
+   */
+  ListEntry<Key> *cold_tail_;
   SmallHash<Key, CacheEntry> cache_;
 #ifdef LRU_CACHE_THREAD_SAFE
   pthread_mutex_t lock_;  /**< Mutex to make cache thread safe. */
@@ -603,6 +617,21 @@ class LruCache {
       return new_entry;
     }
 
+    /**
+     * Insert a new data object after an entry of this list.
+     * @param position the list head or an entry of this list
+     * @param the data object to insert
+     * @return the ListEntryContent structure wrapped around the data object
+     */
+    inline ListEntryContent<T>* PushAfter(ListEntry<T> *position, T content) {
+      ListEntryContent<T> *new_entry = new ListEntryContent<T>(content);
+      new_entry->next = position->next;
+      new_entry->prev = position;
+      position->next->prev = new_entry;
+      position->next = new_entry;
+      return new_entry;
+    }
+
     /**
      * Pop the first object of the list.
      * The object is returned and removed from the list
@@ -662,12 +691,14 @@ class LruCache {
 
     cache_gauge_ = 0;
     cache_size_ = cache_size;
+    num_cold_ = 0;
     statistics_.size = cache_size_;
     //cache_ = Cache(cache_size_);
     cache_.Init(cache_size_, empty_key, hasher);
     atomic_xadd64(&statistics_.allocated, allocator_->bytes_allocated() +
                   cache_.bytes_allocated());
     lru_list_ = new ListEntryHead<Key>();
+    cold_tail_ = lru_list_;
     pause_ = false;
 
 #ifdef LRU_CACHE_THREAD_SAFE
@@ -710,6 +741,7 @@ class LruCache {
     // Check if we have to update an existent entry
     if (this->DoLookup(key, entry)) {
       atomic_inc64(&statistics_.num_update);
+      this->MarkWarm(&entry);
       entry.value = value;
       cache_.Insert(key, entry);
       this->Touch(entry);
@@ -724,6 +756,7 @@ class LruCache {
 
     entry.list_entry = lru_list_->PushBack(key);
     entry.value = value;
+    entry.cold = false;
 
     cache_.Insert(key, entry);
     cache_gauge_++;
@@ -732,6 +765,51 @@ class LruCache {
     return true;
   }
 
+  /**
+   * Insert a new key-value pair as a cold entry, which suits entries that are
+   * loaded speculatively.  Cold entries are evicted before all other entries,
+   * in the order of insertion, unless they are looked up in the meantime.
+   * While they take less than 1/kColdShare of the cache, they make space by
+   * evicting the least recently used other entry.  Present entries are neither
+   * updated nor touched.
+   * @param key the key where the value is saved
+   * @param value the value of the cache entry
+   * @return true on insert, false if the key is present
+   */
+  virtual bool InsertCold(const Key &key, const Value &value) {
+    this->Lock();
+    if (pause_) {
+      this->Unlock();
+      return false;
+    }
+
+    CacheEntry entry;
+    if (this->DoLookup(key, entry)) {
+      this->Unlock();
+      return false;
+    }
+
+    atomic_inc64(&statistics_.num_insert);
+    if (this->IsFull()) {
+      if (num_cold_ >= cache_size_ / kColdShare)
+        this->DeleteOldest();
+      else
+        this->DeleteOldestWarm();
+    }
+
+    entry.list_entry = lru_list_->PushAfter(cold_tail_, key);
+    entry.value = value;
+    entry.cold = true;
+    cold_tail_ = entry.list_entry;
+    num_cold_++;
+
+    cache_.Insert(key, entry);
+    cache_gauge_++;
+
+    this->Unlock();
+    return true;
+  }
+
   /**
    * Retrieve an element from the cache.
    * If the element was found, it will be marked as 'recently used' and returned
@@ -751,6 +829,10 @@ class LruCache {
     if (DoLookup(key, entry)) {
       // Hit
       atomic_inc64(&statistics_.num_hit);
+      if (entry.cold) {
+        MarkWarm(&entry);
+        cache_.Insert(key, entry);
+      }
       Touch(entry);
       *value = entry.value;
       found = true;
@@ -780,6 +862,7 @@ class LruCache {
       found = true;
       atomic_inc64(&statistics_.num_forget);
 
+      this->MarkWarm(&entry);
       entry.list_entry->RemoveFromList();
       delete entry.list_entry;
       cache_.Erase(key);
@@ -799,7 +882,9 @@ class LruCache {
     this->Lock();
 
     cache_gauge_ = 0;
+    num_cold_ = 0;
     lru_list_->clear();
+    cold_tail_ = lru_list_;
     cache_.Clear();
     atomic_inc64(&statistics_.num_drop);
     atomic_init64(&statistics_.allocated);
@@ -809,6 +894,25 @@ class LruCache {
     this->Unlock();
   }
 
+  /**
+   * Copies all entries without touching them, the least recently used entry
+   * comes first.  Inserting them in this order restores the LRU order.
+   */
+  void GetEntries(std::vector<Key> *keys, std::vector<Value> *values) {
+    Lock();
+    keys->reserve(cache_gauge_);
+    values->reserve(cache_gauge_);
+    for (ListEntry<Key> *e = lru_list_->next; !e->IsListHead(); e = e->next) {
+      const Key key = static_cast<ConcreteListEntryContent *>(e)->content();
+      CacheEntry entry;
+      if (DoLookup(key, entry)) {
+        keys->push_back(key);
+        values->push_back(entry.value);
+      }
+    }
+    Unlock();
+  }
+
   void Pause() {
     Lock();
     pause_ = true;
@@ -858,18 +962,58 @@ class LruCache {
   }
 
   /**
-   * Deletes the least recently used entry from the cache.
+   * Takes an entry out of the cold entries.  The caller stores the entry.
+   * @param entry the CacheEntry, still at its place in the LRU list
+   */
+  inline void MarkWarm(CacheEntry *entry) {
+    if (!entry->cold)
+      return;
+    // Cold entries form the front of the list, the predecessor is cold, too
+    if (entry->list_entry == cold_tail_)
+      cold_tail_ = cold_tail_->prev;
+    --num_cold_;
+    entry->cold = false;
+  }
+
+  /**
+   * Deletes the least recently used entry from the cache, cold entries first.
    */
   inline void DeleteOldest() {
     assert(!this->IsEmpty());
 
     atomic_inc64(&statistics_.num_replace);
+    if (num_cold_ > 0) {
+      if (lru_list_->next == cold_tail_)
+        cold_tail_ = lru_list_;
+      --num_cold_;
+    }
     Key delete_me = lru_list_->PopFront();
     cache_.Erase(delete_me);
 
     --cache_gauge_;
   }
 
+  /**
+   * Deletes the least recently used entry that is not cold, or the oldest
+   * cold entry if all entries are cold.
+   */
+  inline void DeleteOldestWarm() {
+    if (cold_tail_->next->IsListHead()) {
+      DeleteOldest();
+      return;
+    }
+
+    atomic_inc64(&statistics_.num_replace);
+    ListEntryContent<Key> *oldest_warm =
+      static_cast<ListEntryContent<Key> *>(cold_tail_->next);
+    const Key delete_me = oldest_warm->content();
+    oldest_warm->RemoveFromList();
+    delete oldest_warm;
+    cache_.Erase(delete_me);
+
+    --cache_gauge_;
+  }
+
   /**
    * Locks the cache (thread safety).
    */
@@ -918,6 +1062,15 @@ class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
     return result;
   }
 
+  bool InsertCold(const fuse_ino_t inode,
+                  const catalog::DirectoryEntry &dirent)
+  {
+    LogCvmfs(kLogLru, kLogDebug, "insert cold inode --> dirent: %d -> '%s'",
+             inode, dirent.name().c_str());
+    return LruCache<fuse_ino_t, catalog::DirectoryEntry>::InsertCold(inode,
+                                                                     dirent);
+  }
+
   bool Lookup(const fuse_ino_t inode, catalog::DirectoryEntry *dirent) {
     const bool result =
       LruCache<fuse_ino_t, catalog::DirectoryEntry>::Lookup(inode, dirent);
@@ -982,6 +1135,15 @@ class Md5PathCache :
     return result;
   }
 
+  bool InsertCold(const hash::Md5 &hash,
+                  const catalog::DirectoryEntry &dirent)
+  {
+    LogCvmfs(kLogLru, kLogDebug, "insert cold md5 --> dirent: %s -> '%s'",
+             hash.ToString().c_str(), dirent.name().c_str());
+    return LruCache<hash::Md5, catalog::DirectoryEntry>::InsertCold(hash,
+                                                                    dirent);
+  }
+
   bool InsertNegative(const hash::Md5 &hash) {
     const bool result = Insert(hash, dirent_negative_);
     if (result)
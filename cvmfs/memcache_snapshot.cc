@@ -0,0 +1,365 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Saves the inode cache, the path cache and the md5path cache together with
+ * the list of attached catalogs when cvmfs2 is unmounted and bulk-loads them
+ * on the next mount.  After a restart, the mount does not start with cold
+ * caches and lazily loaded nested catalogs.
+ *
+ * Inodes depend on the order in which catalogs are attached.  A snapshot is
+ * only restored if it was taken for the same root catalog and if attaching
+ * the catalogs in the saved order results in the saved inode offsets.
+ * Otherwise the caches stay empty.
+ *
+ * The snapshot is a binary file in the cache directory:
+ * a SnapshotHeader followed by the catalog, inode, path, and md5path
+ * records.  Integers are in host byte order.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "memcache_snapshot.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "logging.h"
+#include "hash.h"
+#include "util.h"
+#include "shortstring.h"
+#include "dirent.h"
+#include "catalog_mgr.h"
+#include "lru.h"
+
+using namespace std;  // NOLINT
+
+namespace memcache_snapshot {
+
+const uint32_t kMagic = 0x4d454d53;  // "MEMS"
+const uint32_t kVersion = 1;
+
+struct SnapshotHeader {
+  uint32_t magic;
+  uint32_t version;
+  unsigned char root_hash[hash::kMaxDigestSize];
+  uint32_t num_catalogs;
+  uint32_t num_inodes;
+  uint32_t num_paths;
+  uint32_t num_md5paths;
+};
+
+const uint8_t kFlagNegative = 0x01;
+const uint8_t kFlagNestedRoot = 0x02;
+const uint8_t kFlagNestedMountpoint = 0x04;
+
+
+/**
+ * Bounds checked reading from the snapshot buffer.  After the first short
+ * read, ok is false and all further reads return zeros.
+ */
+struct Reader {
+  Reader(const unsigned char *b, const uint64_t s) :
+    buffer(b), size(s), pos(0), ok(true) { }
+
+  void Get(void *to, const uint64_t num_bytes) {
+    if (!ok || (pos + num_bytes > size)) {
+      ok = false;
+      memset(to, 0, num_bytes);
+      return;
+    }
+    memcpy(to, buffer + pos, num_bytes);
+    pos += num_bytes;
+  }
+
+  template <typename T> T Get() {
+    T value;
+    Get(&value, sizeof(value));
+    return value;
+  }
+
+  template <class StringT> void GetString(StringT *value) {
+    const uint32_t length = Get<uint32_t>();
+    if (!ok || (pos + length > size)) {
+      ok = false;
+      return;
+    }
+    value->Assign(reinterpret_cast<const char *>(buffer + pos), length);
+    pos += length;
+  }
+
+  const unsigned char *buffer;
+  uint64_t size;
+  uint64_t pos;
+  bool ok;
+};
+
+
+template <typename T> static void Put(const T value, string *buffer) {
+  buffer->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+
+template <class StringT>
+static void PutString(const StringT &value, string *buffer) {
+  Put<uint32_t>(value.GetLength(), buffer);
+  buffer->append(value.GetChars(), value.GetLength());
+}
+
+
+/**
+ * Has access to the private fields of DirectoryEntry.  The catalog pointer
+ * is not saved, it only matters for negative entries.
+ */
+class DirentSerializer {
+ public:
+  static void Serialize(const catalog::DirectoryEntry &dirent,
+                        string *buffer)
+  {
+    const bool negative =
+      (dirent.catalog_ == reinterpret_cast<catalog::Catalog *>(-1));
+    uint8_t flags = 0;
+    if (negative) flags |= kFlagNegative;
+    if (dirent.is_nested_catalog_root_) flags |= kFlagNestedRoot;
+    if (dirent.is_nested_catalog_mountpoint_) flags |= kFlagNestedMountpoint;
+    Put<uint8_t>(flags, buffer);
+    if (negative)
+      return;
+
+    Put<uint64_t>(dirent.inode_, buffer);
+    Put<uint64_t>(dirent.parent_inode_, buffer);
+    Put<uint64_t>(dirent.hardlinks_, buffer);
+    Put<uint32_t>(dirent.mode_, buffer);
+    Put<uint32_t>(dirent.uid_, buffer);
+    Put<uint32_t>(dirent.gid_, buffer);
+    Put<uint64_t>(dirent.size_, buffer);
+    Put<int64_t>(dirent.mtime_, buffer);
+    Put<int64_t>(dirent.cached_mtime_, buffer);
+    Put<uint8_t>(dirent.checksum_.algorithm, buffer);
+    buffer->append(reinterpret_cast<const char *>(dirent.checksum_.digest),
+                   hash::kMaxDigestSize);
+    PutString(dirent.name_, buffer);
+    PutString(dirent.symlink_, buffer);
+  }
+
+  static void Deserialize(Reader *reader, catalog::DirectoryEntry *dirent) {
+    const uint8_t flags = reader->Get<uint8_t>();
+    if (flags & kFlagNegative) {
+      *dirent = catalog::DirectoryEntry(catalog::kDirentNegative);
+      return;
+    }
+
+    *dirent = catalog::DirectoryEntry();
+    dirent->is_nested_catalog_root_ = flags & kFlagNestedRoot;
+    dirent->is_nested_catalog_mountpoint_ = flags & kFlagNestedMountpoint;
+    dirent->inode_ = reader->Get<uint64_t>();
+    dirent->parent_inode_ = reader->Get<uint64_t>();
+    dirent->hardlinks_ = reader->Get<uint64_t>();
+    dirent->mode_ = reader->Get<uint32_t>();
+    dirent->uid_ = reader->Get<uint32_t>();
+    dirent->gid_ = reader->Get<uint32_t>();
+    dirent->size_ = reader->Get<uint64_t>();
+    dirent->mtime_ = reader->Get<int64_t>();
+    dirent->cached_mtime_ = reader->Get<int64_t>();
+    const uint8_t algorithm = reader->Get<uint8_t>();
+    if (algorithm > hash::kAny) {
+      reader->ok = false;
+      return;
+    }
+    dirent->checksum_.algorithm = static_cast<hash::Algorithms>(algorithm);
+    reader->Get(dirent->checksum_.digest, hash::kMaxDigestSize);
+    reader->GetString(&dirent->name_);
+    reader->GetString(&dirent->symlink_);
+  }
+};
+
+
+/**
+ * Writes the snapshot to a temporary file first, so that an interrupted save
+ * does not leave a truncated snapshot behind.
+ */
+bool Save(const string &path, const hash::Any &root_hash,
+          catalog::AbstractCatalogManager *catalog_manager,
+          lru::InodeCache *inode_cache, lru::PathCache *path_cache,
+          lru::Md5PathCache *md5path_cache)
+{
+  vector<PathString> mountpoints;
+  vector<uint64_t> inode_offsets;
+  catalog_manager->ListAttached(&mountpoints, &inode_offsets);
+  vector<fuse_ino_t> inodes;
+  vector<catalog::DirectoryEntry> inode_dirents;
+  inode_cache->GetEntries(&inodes, &inode_dirents);
+  vector<fuse_ino_t> path_inodes;
+  vector<PathString> paths;
+  path_cache->GetEntries(&path_inodes, &paths);
+  vector<hash::Md5> md5paths;
+  vector<catalog::DirectoryEntry> md5path_dirents;
+  md5path_cache->GetEntries(&md5paths, &md5path_dirents);
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kMagic;
+  header.version = kVersion;
+  memcpy(header.root_hash, root_hash.digest, hash::kMaxDigestSize);
+  header.num_catalogs = mountpoints.size();
+  header.num_inodes = inodes.size();
+  header.num_paths = paths.size();
+  header.num_md5paths = md5paths.size();
+
+  string buffer(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (unsigned i = 0; i < mountpoints.size(); ++i) {
+    Put<uint64_t>(inode_offsets[i], &buffer);
+    PutString(mountpoints[i], &buffer);
+  }
+  for (unsigned i = 0; i < inodes.size(); ++i) {
+    Put<uint64_t>(inodes[i], &buffer);
+    DirentSerializer::Serialize(inode_dirents[i], &buffer);
+  }
+  for (unsigned i = 0; i < paths.size(); ++i) {
+    Put<uint64_t>(path_inodes[i], &buffer);
+    PutString(paths[i], &buffer);
+  }
+  for (unsigned i = 0; i < md5paths.size(); ++i) {
+    buffer.append(reinterpret_cast<const char *>(md5paths[i].digest),
+                  hash::kDigestSizes[hash::kMd5]);
+    DirentSerializer::Serialize(md5path_dirents[i], &buffer);
+  }
+
+  const string tmp_path = CreateTempPath(path + ".tmp", 0600);
+  if (tmp_path == "")
+    return false;
+  FILE *f = fopen(tmp_path.c_str(), "w");
+  if (f == NULL) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  const bool written =
+    (fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size());
+  if ((fclose(f) != 0) || !written ||
+      (rename(tmp_path.c_str(), path.c_str()) != 0))
+  {
+    LogCvmfs(kLogCvmfs, kLogDebug, "failed to write memory cache snapshot %s",
+             path.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  LogCvmfs(kLogCvmfs, kLogDebug, "saved memory cache snapshot: %u catalogs, "
+           "%u inodes, %u paths, %u md5paths (%"PRIu64" bytes)",
+           header.num_catalogs, header.num_inodes, header.num_paths,
+           header.num_md5paths, uint64_t(buffer.size()));
+  return true;
+}
+
+
+/**
+ * Attaches the catalogs of the snapshot in order and checks their inode
+ * offsets.
+ */
+static bool RestoreCatalogs(Reader *reader, const unsigned num_catalogs,
+                            catalog::AbstractCatalogManager *catalog_manager)
+{
+  for (unsigned i = 0; i < num_catalogs; ++i) {
+    const uint64_t saved_offset = reader->Get<uint64_t>();
+    PathString mountpoint;
+    reader->GetString(&mountpoint);
+    if (!reader->ok)
+      return false;
+
+    uint64_t inode_offset;
+    if (!catalog_manager->MountPath(mountpoint, &inode_offset) ||
+        (inode_offset != saved_offset))
+    {
+      LogCvmfs(kLogCvmfs, kLogDebug, "catalog %s does not match the memory "
+               "cache snapshot", mountpoint.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Restores the snapshot, if it was taken for root_hash.  Should be called
+ * right after the root catalog was loaded, before any other catalog is
+ * attached.
+ */
+bool Restore(const string &path, const hash::Any &root_hash,
+             catalog::AbstractCatalogManager *catalog_manager,
+             lru::InodeCache *inode_cache, lru::PathCache *path_cache,
+             lru::Md5PathCache *md5path_cache)
+{
+  const int64_t file_size = GetFileSize(path);
+  if (file_size < static_cast<int64_t>(sizeof(SnapshotHeader)))
+    return false;
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == NULL)
+    return false;
+  vector<unsigned char> buffer(file_size);
+  const bool read_ok = (fread(&buffer[0], 1, file_size, f) == buffer.size());
+  fclose(f);
+  if (!read_ok)
+    return false;
+
+  Reader reader(&buffer[0], buffer.size());
+  SnapshotHeader header;
+  reader.Get(&header, sizeof(header));
+  if ((header.magic != kMagic) || (header.version != kVersion)) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "invalid memory cache snapshot %s",
+             path.c_str());
+    return false;
+  }
+  if (memcmp(header.root_hash, root_hash.digest, hash::kMaxDigestSize) != 0) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "memory cache snapshot %s is for another "
+             "root catalog", path.c_str());
+    return false;
+  }
+  if (!RestoreCatalogs(&reader, header.num_catalogs, catalog_manager))
+    return false;
+
+  catalog::DirectoryEntry dirent;
+  for (unsigned i = 0; (i < header.num_inodes) && reader.ok; ++i) {
+    const uint64_t inode = reader.Get<uint64_t>();
+    DirentSerializer::Deserialize(&reader, &dirent);
+    if (reader.ok)
+      inode_cache->Insert(inode, dirent);
+  }
+  PathString cvmfs_path;
+  for (unsigned i = 0; (i < header.num_paths) && reader.ok; ++i) {
+    const uint64_t inode = reader.Get<uint64_t>();
+    reader.GetString(&cvmfs_path);
+    if (reader.ok)
+      path_cache->Insert(inode, cvmfs_path);
+  }
+  hash::Md5 md5path;
+  for (unsigned i = 0; (i < header.num_md5paths) && reader.ok; ++i) {
+    reader.Get(md5path.digest, hash::kDigestSizes[hash::kMd5]);
+    DirentSerializer::Deserialize(&reader, &dirent);
+    if (reader.ok)
+      md5path_cache->Insert(md5path, dirent);
+  }
+  if (!reader.ok) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "truncated memory cache snapshot %s",
+             path.c_str());
+    inode_cache->Drop();
+    path_cache->Drop();
+    md5path_cache->Drop();
+    return false;
+  }
+
+  LogCvmfs(kLogCvmfs, kLogDebug, "restored memory cache snapshot: "
+           "%u catalogs, %u inodes, %u paths, %u md5paths",
+           header.num_catalogs, header.num_inodes, header.num_paths,
+           header.num_md5paths);
+  return true;
+}
+
+}  // namespace memcache_snapshot
@@ -0,0 +1,138 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A registry of functions that collect the statistics of the modules of the
+ * client in a machine-readable format.  The talk command "metrics" prints all
+ * of them in one go.
+ */
+
+#include "cvmfs_config.h"
+#include "metrics.h"
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace metrics {
+
+vector<Collector> collectors_;
+pthread_mutex_t lock_collectors_ = PTHREAD_MUTEX_INITIALIZER;
+
+
+Collection::Family *Collection::GetFamily(const string &name,
+                                          const string &type,
+                                          const string &help)
+{
+  map<string, Family>::iterator i = families_.find(name);
+  if (i != families_.end())
+    return &i->second;
+
+  names_.push_back(name);
+  Family *family = &families_[name];
+  family->help = help;
+  family->type = type;
+  return family;
+}
+
+
+static string PrintLabels(const string &labels) {
+  return (labels == "") ? "" : "{" + labels + "}";
+}
+
+
+void Collection::AddCounter(const string &name, const string &labels,
+                            const string &help, const int64_t value)
+{
+  GetFamily(name, "counter", help)->samples +=
+    name + PrintLabels(labels) + " " + StringifyInt(value) + "\n";
+}
+
+
+void Collection::AddGauge(const string &name, const string &labels,
+                          const string &help, const int64_t value)
+{
+  GetFamily(name, "gauge", help)->samples +=
+    name + PrintLabels(labels) + " " + StringifyInt(value) + "\n";
+}
+
+
+void Collection::AddHistogram(const string &name, const string &labels,
+                              const string &help,
+                              const vector<int64_t> &buckets,
+                              const int64_t sum)
+{
+  Family *family = GetFamily(name, "histogram", help);
+  const string separator = (labels == "") ? "" : ",";
+  int64_t count = 0;
+  for (unsigned i = 0; i < buckets.size(); ++i) {
+    count += buckets[i];
+    // The upper bound of the last bucket is infinity
+    if (i == buckets.size() - 1)
+      break;
+    // Bounds are inclusive in Prometheus, values are integers
+    family->samples += name + "_bucket{" + labels + separator + "le=\"" +
+      StringifyInt((int64_t(1) << i) - 1) + "\"} " + StringifyInt(count) +
+      "\n";
+  }
+  family->samples += name + "_bucket{" + labels + separator +
+    "le=\"+Inf\"} " + StringifyInt(count) + "\n";
+  family->samples += name + "_sum" + PrintLabels(labels) + " " +
+    StringifyInt(sum) + "\n";
+  family->samples += name + "_count" + PrintLabels(labels) + " " +
+    StringifyInt(count) + "\n";
+}
+
+
+string Collection::Print() const {
+  string result;
+  for (unsigned i = 0; i < names_.size(); ++i) {
+    const Family &family = families_.find(names_[i])->second;
+    result += "# HELP " + names_[i] + " " + family.help + "\n";
+    result += "# TYPE " + names_[i] + " " + family.type + "\n";
+    result += family.samples;
+  }
+  return result;
+}
+
+
+void Register(Collector collector) {
+  pthread_mutex_lock(&lock_collectors_);
+  collectors_.push_back(collector);
+  pthread_mutex_unlock(&lock_collectors_);
+}
+
+
+void Unregister(Collector collector) {
+  pthread_mutex_lock(&lock_collectors_);
+  for (vector<Collector>::iterator i = collectors_.begin(),
+       iEnd = collectors_.end(); i != iEnd; ++i)
+  {
+    if (*i == collector) {
+      collectors_.erase(i);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock_collectors_);
+}
+
+
+/**
+ * Runs all registered collectors.  The lock keeps modules from unregistering
+ * while their collector runs.
+ */
+string Print() {
+  Collection collection;
+  pthread_mutex_lock(&lock_collectors_);
+  for (unsigned i = 0; i < collectors_.size(); ++i)
+    collectors_[i](&collection);
+  pthread_mutex_unlock(&lock_collectors_);
+  return collection.Print();
+}
+
+}  // namespace metrics
@@ -0,0 +1,64 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_METRICS_H_
+#define CVMFS_METRICS_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace metrics {
+
+/**
+ * Samples of counters, gauges, and histograms that print in the Prometheus
+ * text format.  Labels are given without braces, e.g. cache="inode".  Samples
+ * of the same name are grouped under a single HELP and TYPE line, the help
+ * text and the type of the first sample count.
+ */
+class Collection {
+ public:
+  void AddCounter(const std::string &name, const std::string &labels,
+                  const std::string &help, const int64_t value);
+  void AddGauge(const std::string &name, const std::string &labels,
+                const std::string &help, const int64_t value);
+  /**
+   * Bucket i holds the number of values smaller than 2^i (and not smaller
+   * than 2^(i-1)), the last bucket holds all larger values.
+   */
+  void AddHistogram(const std::string &name, const std::string &labels,
+                    const std::string &help,
+                    const std::vector<int64_t> &buckets, const int64_t sum);
+  std::string Print() const;
+
+ private:
+  struct Family {
+    std::string help;
+    std::string type;
+    std::string samples;
+  };
+
+  Family *GetFamily(const std::string &name, const std::string &type,
+                    const std::string &help);
+
+  std::vector<std::string> names_;  /**< Families in the order of creation */
+  std::map<std::string, Family> families_;
+};
+
+
+/**
+ * Adds the current values of a module to the collection.  Called from the
+ * talk thread, so it has to be thread-safe.
+ */
+typedef void (*Collector)(Collection *collection);
+
+void Register(Collector collector);
+void Unregister(Collector collector);
+std::string Print();
+
+}  // namespace metrics
+
+#endif  // CVMFS_METRICS_H_
@@ -0,0 +1,601 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A self-contained web server and proxy for tests and benchmarks of the
+ * download code that should not depend on Apache, Squid, or the network.
+ * Latency, bandwidth limits, errors, and broken connections are injected
+ * according to the server's Config, which can be changed while the server
+ * runs.
+ */
+
+#include "cvmfs_config.h"
+#include "mock_server.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <string>
+#include <vector>
+
+#include "logging.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace mock_server {
+
+const unsigned kMaxHeaderSize = 64*1024;
+const unsigned kBlockSize = 64*1024;
+const unsigned kSlicesPerSecond = 100;  /**< Granularity of bandwidth limits */
+
+struct ConnectionInfo {
+  Server *server;
+  int fd;
+};
+
+
+static void SleepMs(const unsigned ms) {
+  struct timespec wait;
+  wait.tv_sec = ms / 1000;
+  wait.tv_nsec = (ms % 1000) * 1000000;
+  while ((nanosleep(&wait, &wait) == -1) && (errno == EINTR)) { }
+}
+
+
+static bool SendAll(const int fd, const char *buf, uint64_t size) {
+  while (size > 0) {
+    const ssize_t retval = send(fd, buf, size, MSG_NOSIGNAL);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += retval;
+    size -= retval;
+  }
+  return true;
+}
+
+
+static string Trim(const string &str) {
+  const size_t first = str.find_first_not_of(" \t");
+  if (first == string::npos)
+    return "";
+  const size_t last = str.find_last_not_of(" \t\r");
+  return str.substr(first, last - first + 1);
+}
+
+
+Server::Server(const Config &config) {
+  config_ = config;
+  memset(&statistics_, 0, sizeof(statistics_));
+  port_ = 0;
+  fd_listen_ = -1;
+  running_ = false;
+  random_state_ = config.seed;
+  int retval = pthread_mutex_init(&lock_, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&cond_connections_, NULL);
+  assert(retval == 0);
+}
+
+
+Server::~Server() {
+  Stop();
+  pthread_cond_destroy(&cond_connections_);
+  pthread_mutex_destroy(&lock_);
+}
+
+
+/**
+ * Listens on 127.0.0.1.  With port 0, the kernel picks a free port, which is
+ * available from port() afterwards.
+ */
+bool Server::Start(const uint16_t port) {
+  assert(!running_);
+  fd_listen_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_listen_ < 0)
+    return false;
+  const int on = 1;
+  setsockopt(fd_listen_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  socklen_t address_len = sizeof(address);
+  if ((bind(fd_listen_, reinterpret_cast<struct sockaddr *>(&address),
+            sizeof(address)) != 0) ||
+      (listen(fd_listen_, 128) != 0) ||
+      (getsockname(fd_listen_, reinterpret_cast<struct sockaddr *>(&address),
+                   &address_len) != 0))
+  {
+    LogCvmfs(kLogCvmfs, kLogDebug, "failed to listen on port %u (%d)",
+             port, errno);
+    close(fd_listen_);
+    fd_listen_ = -1;
+    return false;
+  }
+  port_ = ntohs(address.sin_port);
+
+  MakePipe(pipe_terminate_);
+  int retval = pthread_create(&thread_accept_, NULL, MainAccept, this);
+  assert(retval == 0);
+  running_ = true;
+  LogCvmfs(kLogCvmfs, kLogDebug, "mock server listening on port %u", port_);
+  return true;
+}
+
+
+/**
+ * Stops accepting connections, breaks the open ones, and waits for their
+ * threads to finish.
+ */
+void Server::Stop() {
+  if (!running_)
+    return;
+
+  char buf = 'T';
+  WritePipe(pipe_terminate_[1], &buf, 1);
+  pthread_join(thread_accept_, NULL);
+  ClosePipe(pipe_terminate_);
+  close(fd_listen_);
+  fd_listen_ = -1;
+
+  pthread_mutex_lock(&lock_);
+  for (set<int>::const_iterator i = connections_.begin(),
+       iEnd = connections_.end(); i != iEnd; ++i)
+  {
+    shutdown(*i, SHUT_RDWR);
+  }
+  while (!connections_.empty())
+    pthread_cond_wait(&cond_connections_, &lock_);
+  pthread_mutex_unlock(&lock_);
+  running_ = false;
+}
+
+
+void Server::SetConfig(const Config &config) {
+  pthread_mutex_lock(&lock_);
+  config_ = config;
+  pthread_mutex_unlock(&lock_);
+}
+
+
+Config Server::GetConfig() {
+  pthread_mutex_lock(&lock_);
+  Config result = config_;
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+string Server::url() const {
+  return "http://127.0.0.1:" + StringifyInt(port_);
+}
+
+
+unsigned Server::Random() {
+  pthread_mutex_lock(&lock_);
+  const unsigned result = rand_r(&random_state_);
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+void *Server::MainAccept(void *data) {
+  Server *server = static_cast<Server *>(data);
+  struct pollfd watch_fds[2];
+  watch_fds[0].fd = server->pipe_terminate_[0];
+  watch_fds[0].events = POLLIN | POLLPRI;
+  watch_fds[1].fd = server->fd_listen_;
+  watch_fds[1].events = POLLIN | POLLPRI;
+
+  while (true) {
+    watch_fds[0].revents = watch_fds[1].revents = 0;
+    const int retval = poll(watch_fds, 2, -1);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (watch_fds[0].revents)
+      break;
+    if (!watch_fds[1].revents)
+      continue;
+
+    const int fd_client = accept(server->fd_listen_, NULL, NULL);
+    if (fd_client < 0)
+      continue;
+    const int on = 1;
+    setsockopt(fd_client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    ConnectionInfo *info = new ConnectionInfo();
+    info->server = server;
+    info->fd = fd_client;
+    pthread_mutex_lock(&server->lock_);
+    server->connections_.insert(fd_client);
+    pthread_mutex_unlock(&server->lock_);
+    pthread_t thread_connection;
+    if (pthread_create(&thread_connection, NULL, MainConnection, info) != 0) {
+      pthread_mutex_lock(&server->lock_);
+      server->connections_.erase(fd_client);
+      pthread_mutex_unlock(&server->lock_);
+      close(fd_client);
+      delete info;
+      continue;
+    }
+    pthread_detach(thread_connection);
+  }
+  return NULL;
+}
+
+
+void *Server::MainConnection(void *data) {
+  ConnectionInfo *info = static_cast<ConnectionInfo *>(data);
+  Server *server = info->server;
+  const int fd = info->fd;
+  delete info;
+
+  server->HandleConnection(fd);
+
+  pthread_mutex_lock(&server->lock_);
+  server->connections_.erase(fd);
+  close(fd);
+  pthread_cond_broadcast(&server->cond_connections_);
+  pthread_mutex_unlock(&server->lock_);
+  return NULL;
+}
+
+
+/**
+ * Serves requests until the client or a fault closes the connection.
+ */
+void Server::HandleConnection(const int fd_client) {
+  string buffer;
+  Request request;
+  while (ReadRequest(fd_client, &buffer, &request)) {
+    const Config config = GetConfig();
+    atomic_inc64(&statistics_.num_requests);
+    if (config.latency_ms > 0)
+      SleepMs(config.latency_ms);
+
+    bool keep_open;
+    if ((config.error_rate > 0) && (Random() % 100 < config.error_rate)) {
+      keep_open = SendError(fd_client, 503, "Service Unavailable",
+                            request.keep_alive);
+    } else if ((request.method != "GET") && (request.method != "HEAD")) {
+      keep_open = SendError(fd_client, 405, "Method Not Allowed",
+                            request.keep_alive);
+    } else if (HasPrefix(request.target, "http://", true)) {
+      atomic_inc64(&statistics_.num_proxied);
+      keep_open = Forward(fd_client, request, config);
+    } else {
+      keep_open = ServeFile(fd_client, request, config);
+    }
+    if (!keep_open || !request.keep_alive)
+      break;
+  }
+}
+
+
+/**
+ * Reads the next request header from the connection.  Bytes past the header
+ * remain in buffer for the next request.
+ */
+bool Server::ReadRequest(const int fd, string *buffer, Request *request) {
+  size_t end_header;
+  while ((end_header = buffer->find("\r\n\r\n")) == string::npos) {
+    if (buffer->length() > kMaxHeaderSize)
+      return false;
+    char buf[4096];
+    const ssize_t num_bytes = recv(fd, buf, sizeof(buf), 0);
+    if (num_bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (num_bytes == 0)
+      return false;
+    buffer->append(buf, num_bytes);
+  }
+  const vector<string> lines =
+    SplitString(buffer->substr(0, end_header), '\n');
+  buffer->erase(0, end_header + 4);
+
+  const vector<string> request_line = SplitString(Trim(lines[0]), ' ');
+  if (request_line.size() != 3)
+    return false;
+  request->method = request_line[0];
+  request->target = request_line[1];
+  request->keep_alive = (request_line[2] == "HTTP/1.1");
+  request->has_range = false;
+  request->range_first = request->range_last = -1;
+
+  for (unsigned i = 1; i < lines.size(); ++i) {
+    const size_t colon = lines[i].find(':');
+    if (colon == string::npos)
+      continue;
+    const string value = Trim(lines[i].substr(colon + 1));
+    if (HasPrefix(lines[i], "connection:", true)) {
+      if (HasPrefix(value, "close", true))
+        request->keep_alive = false;
+      else if (HasPrefix(value, "keep-alive", true))
+        request->keep_alive = true;
+    } else if (HasPrefix(lines[i], "range:", true) &&
+               HasPrefix(value, "bytes=", true) &&
+               (value.find(',') == string::npos))
+    {
+      // Multiple ranges are not supported, the entire file is sent instead
+      const string range = value.substr(6);
+      const size_t dash = range.find('-');
+      if ((dash == string::npos) || (range.length() == 1))
+        continue;
+      const string first = range.substr(0, dash);
+      const string last = range.substr(dash + 1);
+      request->has_range = true;
+      if (first == "") {
+        request->range_last = String2Int64(last);
+      } else {
+        request->range_first = String2Int64(first);
+        if (last != "")
+          request->range_last = String2Int64(last);
+      }
+    }
+  }
+  return true;
+}
+
+
+bool Server::SendError(const int fd, const int status, const string &reason,
+                       const bool keep_alive)
+{
+  atomic_inc64(&statistics_.num_errors);
+  const string body = StringifyInt(status) + " " + reason + "\n";
+  const string response = "HTTP/1.1 " + StringifyInt(status) + " " + reason +
+    "\r\nContent-Type: text/plain\r\nContent-Length: " +
+    StringifyInt(body.length()) + "\r\nConnection: " +
+    (keep_alive ? "keep-alive" : "close") + "\r\n\r\n" + body;
+  return SendAll(fd, response.data(), response.length());
+}
+
+
+/**
+ * Writes at most config.bandwidth bytes per second, in slices of a hundredth
+ * of a second.
+ */
+bool Server::SendThrottled(const int fd, const char *buf, const uint64_t size,
+                           const Config &config)
+{
+  if (config.bandwidth == 0) {
+    if (!SendAll(fd, buf, size))
+      return false;
+    atomic_xadd64(&statistics_.num_bytes, size);
+    return true;
+  }
+
+  const uint64_t slice = (config.bandwidth > kSlicesPerSecond) ?
+                         config.bandwidth / kSlicesPerSecond : 1;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  uint64_t pos = 0;
+  while (pos < size) {
+    const uint64_t num_bytes = (size - pos < slice) ? size - pos : slice;
+    if (!SendAll(fd, buf + pos, num_bytes))
+      return false;
+    pos += num_bytes;
+    atomic_xadd64(&statistics_.num_bytes, num_bytes);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const int64_t due_ms = pos * 1000 / config.bandwidth;
+    const int64_t elapsed_ms =
+      static_cast<int64_t>(DiffTimeSeconds(start, now) * 1000.0);
+    if (due_ms > elapsed_ms)
+      SleepMs(due_ms - elapsed_ms);
+  }
+  return true;
+}
+
+
+/**
+ * Sends a file below the root directory or a range of it.  Returns false if
+ * the connection has to be closed.
+ */
+bool Server::ServeFile(const int fd, const Request &request,
+                       const Config &config)
+{
+  string path = request.target.substr(0, request.target.find('?'));
+  if ((config.root == "") || (path == "") || (path[0] != '/') ||
+      (path.find("/../") != string::npos) ||
+      (path.length() >= 3 && path.substr(path.length() - 3) == "/.."))
+  {
+    return SendError(fd, 404, "Not Found", request.keep_alive);
+  }
+  path = config.root + path;
+
+  const int fd_file = open(path.c_str(), O_RDONLY);
+  if (fd_file < 0)
+    return SendError(fd, 404, "Not Found", request.keep_alive);
+  struct stat info;
+  if ((fstat(fd_file, &info) != 0) || !S_ISREG(info.st_mode)) {
+    close(fd_file);
+    return SendError(fd, 404, "Not Found", request.keep_alive);
+  }
+  const int64_t size = info.st_size;
+
+  int64_t first = 0;
+  int64_t last = size - 1;
+  string status = "200 OK";
+  string content_range;
+  if (request.has_range) {
+    if (request.range_first < 0) {
+      first = (request.range_last > size) ? 0 : size - request.range_last;
+    } else {
+      first = request.range_first;
+      if ((request.range_last >= 0) && (request.range_last < last))
+        last = request.range_last;
+    }
+    if ((first >= size) || (first > last)) {
+      close(fd_file);
+      atomic_inc64(&statistics_.num_errors);
+      const string response = "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */" + StringifyInt(size) + "\r\n"
+        "Content-Length: 0\r\nConnection: " +
+        (request.keep_alive ? "keep-alive" : "close") + "\r\n\r\n";
+      return SendAll(fd, response.data(), response.length());
+    }
+    status = "206 Partial Content";
+    content_range = "Content-Range: bytes " + StringifyInt(first) + "-" +
+      StringifyInt(last) + "/" + StringifyInt(size) + "\r\n";
+    atomic_inc64(&statistics_.num_ranges);
+  }
+  const int64_t length = (size == 0) ? 0 : last - first + 1;
+
+  const string header = "HTTP/1.1 " + status + "\r\n" +
+    "Content-Type: application/octet-stream\r\n" +
+    "Content-Length: " + StringifyInt(length) + "\r\n" + content_range +
+    "Connection: " + (request.keep_alive ? "keep-alive" : "close") +
+    "\r\n\r\n";
+  if (!SendAll(fd, header.data(), header.length()) ||
+      (request.method == "HEAD"))
+  {
+    close(fd_file);
+    return request.method == "HEAD";
+  }
+
+  // A dropped connection breaks off after half of the body
+  int64_t num_send = length;
+  bool drop = false;
+  if ((config.drop_rate > 0) && (Random() % 100 < config.drop_rate)) {
+    num_send = length / 2;
+    drop = true;
+  }
+
+  char *buf = static_cast<char *>(malloc(kBlockSize));
+  assert(buf);
+  bool result = true;
+  int64_t pos = 0;
+  while (pos < num_send) {
+    const int64_t num_bytes = ((num_send - pos) < kBlockSize) ?
+                              num_send - pos : kBlockSize;
+    const ssize_t num_read = pread(fd_file, buf, num_bytes, first + pos);
+    if ((num_read <= 0) || !SendThrottled(fd, buf, num_read, config)) {
+      result = false;
+      break;
+    }
+    pos += num_read;
+  }
+  free(buf);
+  close(fd_file);
+
+  if (drop) {
+    atomic_inc64(&statistics_.num_drops);
+    return false;
+  }
+  return result;
+}
+
+
+/**
+ * Forwards a proxy request to the origin with HTTP/1.0 and relays the
+ * response.  The client connection is closed afterwards because the length of
+ * the relayed response is not tracked.
+ */
+bool Server::Forward(const int fd, const Request &request,
+                     const Config &config)
+{
+  const string url = request.target.substr(7);
+  const size_t slash = url.find('/');
+  const string host_port = url.substr(0, slash);
+  const string path = (slash == string::npos) ? "/" : url.substr(slash);
+  const size_t colon = host_port.rfind(':');
+  const string host = host_port.substr(0, colon);
+  const string port = (colon == string::npos) ?
+                      "80" : host_port.substr(colon + 1);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = NULL;
+  int fd_origin = -1;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) == 0) {
+    fd_origin = socket(AF_INET, SOCK_STREAM, 0);
+    if ((fd_origin >= 0) &&
+        (connect(fd_origin, addresses->ai_addr, addresses->ai_addrlen) != 0))
+    {
+      close(fd_origin);
+      fd_origin = -1;
+    }
+    freeaddrinfo(addresses);
+  }
+  if (fd_origin < 0) {
+    SendError(fd, 502, "Bad Gateway", false);
+    return false;
+  }
+
+  string upstream_request = request.method + " " + path + " HTTP/1.0\r\n" +
+    "Host: " + host_port + "\r\n";
+  if (request.has_range) {
+    upstream_request += "Range: bytes=" +
+      ((request.range_first >= 0) ? StringifyInt(request.range_first) : "") +
+      "-" +
+      ((request.range_last >= 0) ? StringifyInt(request.range_last) : "") +
+      "\r\n";
+  }
+  upstream_request += "Connection: close\r\n\r\n";
+  if (!SendAll(fd_origin, upstream_request.data(), upstream_request.length()))
+  {
+    close(fd_origin);
+    SendError(fd, 502, "Bad Gateway", false);
+    return false;
+  }
+
+  // A dropped connection breaks off after the first relayed block that carries
+  // a part of the body
+  const bool drop =
+    (config.drop_rate > 0) && (Random() % 100 < config.drop_rate);
+  string header;
+  bool in_body = false;
+  char *buf = static_cast<char *>(malloc(kBlockSize));
+  assert(buf);
+  while (true) {
+    const ssize_t num_bytes = recv(fd_origin, buf, kBlockSize, 0);
+    if ((num_bytes < 0) && (errno == EINTR))
+      continue;
+    if ((num_bytes <= 0) || !SendThrottled(fd, buf, num_bytes, config))
+      break;
+    if (!in_body) {
+      header.append(buf, num_bytes);
+      const size_t end_header = header.find("\r\n\r\n");
+      in_body = (end_header != string::npos) &&
+                (end_header + 4 < header.length());
+    }
+    if (drop && in_body) {
+      atomic_inc64(&statistics_.num_drops);
+      break;
+    }
+  }
+  free(buf);
+  close(fd_origin);
+  return false;
+}
+
+}  // namespace mock_server
@@ -0,0 +1,102 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_MOCK_SERVER_H_
+#define CVMFS_MOCK_SERVER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <set>
+#include <string>
+
+#include "atomic.h"
+
+namespace mock_server {
+
+/**
+ * Faults injected into the responses.  Rates are in percent of the requests.
+ */
+struct Config {
+  Config() : latency_ms(0), bandwidth(0), error_rate(0), drop_rate(0),
+             seed(1) { }
+  std::string root;  /**< Directory served to path requests, may be empty */
+  unsigned latency_ms;  /**< Delay before every response */
+  uint64_t bandwidth;  /**< Bytes per second per connection, 0 = unlimited */
+  unsigned error_rate;  /**< Answered with 503 Service Unavailable */
+  unsigned drop_rate;  /**< Connection closed in the middle of the body */
+  unsigned seed;  /**< Makes the injected faults reproducible */
+};
+
+
+struct Statistics {
+  atomic_int64 num_requests;
+  atomic_int64 num_proxied;  /**< Requests with an absolute URL */
+  atomic_int64 num_ranges;  /**< Answered with 206 Partial Content */
+  atomic_int64 num_errors;  /**< Injected and real errors */
+  atomic_int64 num_drops;
+  atomic_int64 num_bytes;  /**< Bodies and relayed responses to clients */
+};
+
+
+/**
+ * A minimal HTTP/1.1 server on localhost that stands in for a Stratum 1 and
+ * for a proxy.  Requests for a path are served from the root directory,
+ * supporting single byte ranges and keep-alive connections.  Requests for an
+ * absolute URL (proxy requests) are forwarded to the named host.  Every
+ * connection is handled by its own thread.
+ */
+class Server {
+ public:
+  explicit Server(const Config &config);
+  ~Server();
+
+  bool Start(const uint16_t port);
+  void Stop();
+  void SetConfig(const Config &config);
+  Config GetConfig();
+
+  uint16_t port() const { return port_; }
+  std::string url() const;
+  Statistics *statistics() { return &statistics_; }
+
+ private:
+  struct Request {
+    std::string method;
+    std::string target;
+    bool keep_alive;
+    bool has_range;
+    int64_t range_first;  /**< Negative for suffix ranges */
+    int64_t range_last;  /**< Negative for open ranges */
+  };
+
+  static void *MainAccept(void *data);
+  static void *MainConnection(void *data);
+
+  void HandleConnection(const int fd_client);
+  bool ReadRequest(const int fd, std::string *buffer, Request *request);
+  bool ServeFile(const int fd, const Request &request, const Config &config);
+  bool Forward(const int fd, const Request &request, const Config &config);
+  bool SendError(const int fd, const int status, const std::string &reason,
+                 const bool keep_alive);
+  bool SendThrottled(const int fd, const char *buf, const uint64_t size,
+                     const Config &config);
+  unsigned Random();
+
+  Config config_;
+  Statistics statistics_;
+  uint16_t port_;
+  int fd_listen_;
+  int pipe_terminate_[2];
+  bool running_;
+  pthread_t thread_accept_;
+  pthread_mutex_t lock_;  /**< Protects config_, the seed and connections_ */
+  pthread_cond_t cond_connections_;
+  std::set<int> connections_;
+  unsigned random_state_;
+};
+
+}  // namespace mock_server
+
+#endif  // CVMFS_MOCK_SERVER_H_
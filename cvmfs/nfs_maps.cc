@@ -12,6 +12,14 @@
  * cvmfs restarts.  Also, leveldb allows for restricting the memory consumption.
  *
  * The maps are not accounted for by the cache quota.
+ *
+ * Recently used mappings are kept in memory in front of leveldb.  New
+ * mappings are collected per shard of the path hash space and written in
+ * batches by the first thread that waits for them (group commit), so that
+ * every mapping is stored before its inode is handed out.  Threads take
+ * inodes from their own block of the sequence, so that only the shard is
+ * locked while a new path is mapped.  The end of every block is stored before
+ * the block is used, so that no inode is issued twice after a crash.
  */
 
 #define __STDC_FORMAT_MACROS
@@ -25,12 +33,19 @@
 #include <cassert>
 #include <cstdlib>
 
+#include <map>
+#include <string>
+
 #include "leveldb/db.h"
 #include "leveldb/cache.h"
 #include "leveldb/filter_policy.h"
 #include "leveldb/env.h"
+#include "leveldb/write_batch.h"
 
+#include "MurmurHash2.h"
+#include "atomic.h"
 #include "logging.h"
+#include "lru.h"
 #include "util.h"
 
 using namespace std;  // NOLINT
@@ -46,10 +61,49 @@ const leveldb::FilterPolicy *filter_path2inode_ = NULL;
 leveldb::ReadOptions leveldb_read_options_;
 leveldb::WriteOptions leveldb_write_options_;
 uint64_t root_inode_;
-uint64_t seq_;
-pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+atomic_int64 seq_;  /**< Next inode that is not reserved by any thread */
+pthread_mutex_t lock_seq_ = PTHREAD_MUTEX_INITIALIZER;  /**< Reserves blocks */
 bool spawned_ = false;  // Set to true after fork()
 
+const unsigned kNumShards = 16;
+const uint64_t kInodeBlockSize = 64;
+/**
+ * Entries of the memory caches in front of leveldb, large enough for the
+ * listing of a directory with 100k entries.  Takes some 10MB per cache.
+ */
+const unsigned kFrontCacheSize = 131072;
+
+/**
+ * New mappings of a range of path hashes that are not yet written to leveldb.
+ * Mappings are numbered as they are added; they are removed from the pending
+ * maps only after they are written.
+ */
+struct Shard {
+  pthread_mutex_t lock;
+  pthread_mutex_t lock_write;  /**< Held by the thread writing a batch */
+  std::map<hash::Md5, uint64_t> pending_path2inode;
+  std::map<uint64_t, std::string> pending_inode2path;
+  uint64_t num_added;
+  uint64_t num_written;
+};
+Shard *shards_ = NULL;
+
+/**
+ * Inodes reserved by a thread.
+ */
+struct InodeBlock {
+  uint64_t next;
+  uint64_t end;
+};
+pthread_key_t key_inode_block_;
+
+typedef lru::LruCache<hash::Md5, uint64_t> Path2InodeCache;
+// The path cache of the file system has PathString values already.  Caches
+// of the same type share the memory allocator, so the paths are strings here.
+typedef lru::LruCache<uint64_t, std::string> Inode2PathCache;
+Path2InodeCache *path2inode_cache_ = NULL;
+Inode2PathCache *inode2path_cache_ = NULL;
+
 
 // Leveldb's background threads must not be started before cvmfs has forked.
 // Before forking, we run the processes in specially created threads.
@@ -133,20 +187,113 @@ static void PutPath2Inode(const hash::Md5 &path, const uint64_t inode) {
 }
 
 
-static void PutInode2Path(const uint64_t inode, const PathString &path) {
-  leveldb::Status status;
-  leveldb::Slice key(reinterpret_cast<const char *>(&inode), sizeof(inode));
-  leveldb::Slice value(path.GetChars(), path.GetLength());
+static uint32_t hasher_inode(const uint64_t &inode) {
+  return MurmurHash2(&inode, sizeof(inode), 0x07387a4f);
+}
+
 
-  status = db_inode2path_->Put(leveldb_write_options_, key, value);
+/**
+ * Writes new mappings in one batch per database.  The inode --> path entries
+ * are written first, so that a stored inode can always be resolved.
+ */
+static void WriteMappings(const map<hash::Md5, uint64_t> &path2inode,
+                          const map<uint64_t, string> &inode2path)
+{
+  leveldb::WriteBatch batch_inode2path;
+  for (map<uint64_t, string>::const_iterator i = inode2path.begin(),
+       iEnd = inode2path.end(); i != iEnd; ++i)
+  {
+    batch_inode2path.Put(
+      leveldb::Slice(reinterpret_cast<const char *>(&i->first),
+                     sizeof(i->first)),
+      leveldb::Slice(i->second));
+  }
+  leveldb::WriteBatch batch_path2inode;
+  for (map<hash::Md5, uint64_t>::const_iterator i = path2inode.begin(),
+       iEnd = path2inode.end(); i != iEnd; ++i)
+  {
+    batch_path2inode.Put(
+      leveldb::Slice(reinterpret_cast<const char *>(i->first.digest),
+                     i->first.GetDigestSize()),
+      leveldb::Slice(reinterpret_cast<const char *>(&i->second),
+                     sizeof(i->second)));
+  }
+
+  leveldb::Status status =
+    db_inode2path_->Write(leveldb_write_options_, &batch_inode2path);
+  if (status.ok())
+    status = db_path2inode_->Write(leveldb_write_options_, &batch_path2inode);
   if (!status.ok()) {
-    LogCvmfs(kLogNfsMaps, kLogSyslog,
-             "failed to write inode2path entry (%"PRIu64" --> %s): %s",
-             inode, path.c_str(), status.ToString().c_str());
+    LogCvmfs(kLogNfsMaps, kLogSyslog, "failed to write %u NFS map entries: %s",
+             unsigned(path2inode.size()), status.ToString().c_str());
     abort();
   }
-  LogCvmfs(kLogNfsMaps, kLogDebug, "stored inode %"PRIu64" --> path  %s",
-           inode, path.c_str());
+  LogCvmfs(kLogNfsMaps, kLogDebug, "stored %u new NFS map entries",
+           unsigned(path2inode.size()));
+}
+
+
+/**
+ * Returns once the mapping with the given number is written.  The first
+ * waiting thread writes all the mappings of the shard added so far, the
+ * threads that waited meanwhile find theirs written, too.
+ */
+static void WaitWritten(Shard *shard, const uint64_t number) {
+  pthread_mutex_lock(&shard->lock_write);
+  pthread_mutex_lock(&shard->lock);
+  if (shard->num_written >= number) {
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_unlock(&shard->lock_write);
+    return;
+  }
+  const map<hash::Md5, uint64_t> path2inode(shard->pending_path2inode);
+  const map<uint64_t, string> inode2path(shard->pending_inode2path);
+  const uint64_t num_added = shard->num_added;
+  pthread_mutex_unlock(&shard->lock);
+
+  // Meanwhile, the mappings can be found in the pending maps
+  WriteMappings(path2inode, inode2path);
+
+  pthread_mutex_lock(&shard->lock);
+  for (map<hash::Md5, uint64_t>::const_iterator i = path2inode.begin(),
+       iEnd = path2inode.end(); i != iEnd; ++i)
+  {
+    shard->pending_path2inode.erase(i->first);
+    shard->pending_inode2path.erase(i->second);
+  }
+  shard->num_written = num_added;
+  pthread_mutex_unlock(&shard->lock);
+  pthread_mutex_unlock(&shard->lock_write);
+}
+
+
+/**
+ * Takes the next inode from the block of the calling thread.  A new block is
+ * reserved from the sequence when the block is used up.
+ */
+static uint64_t IssueInode() {
+  InodeBlock *block =
+    static_cast<InodeBlock *>(pthread_getspecific(key_inode_block_));
+  if (block == NULL) {
+    block = new InodeBlock();
+    block->next = block->end = 0;
+    int retval = pthread_setspecific(key_inode_block_, block);
+    assert(retval == 0);
+  }
+  if (block->next == block->end) {
+    // Sequence numbers are stored in order
+    pthread_mutex_lock(&lock_seq_);
+    block->next = atomic_xadd64(&seq_, kInodeBlockSize);
+    block->end = block->next + kInodeBlockSize;
+    PutPath2Inode(hash::Md5(hash::AsciiPtr("?seq")), block->end);
+    pthread_mutex_unlock(&lock_seq_);
+  }
+  return block->next++;
+}
+
+
+static void FreeInodeBlock(void *data) {
+  delete static_cast<InodeBlock *>(data);
 }
 
 
@@ -180,29 +327,91 @@ static uint64_t FindInode(const hash::Md5 &path) {
 }
 
 
+/**
+ * \return false if the inode is not found in leveldb
+ */
+static bool FindPath(const uint64_t inode, string *path) {
+  leveldb::Status status;
+  leveldb::Slice key(reinterpret_cast<const char *>(&inode), sizeof(inode));
+
+  status = db_inode2path_->Get(leveldb_read_options_, key, path);
+  if (status.IsNotFound())
+    return false;
+  if (!status.ok()) {
+    LogCvmfs(kLogNfsMaps, kLogSyslog,
+             "failed to read from inode2path db inode %"PRIu64": %s",
+             inode, status.ToString().c_str());
+    abort();
+  }
+  return true;
+}
+
+
+/**
+ * Searches the mappings that are not yet written.
+ */
+static bool FindPendingPath(const uint64_t inode, string *path) {
+  for (unsigned i = 0; i < kNumShards; ++i) {
+    pthread_mutex_lock(&shards_[i].lock);
+    map<uint64_t, string>::const_iterator iter =
+      shards_[i].pending_inode2path.find(inode);
+    const bool found = iter != shards_[i].pending_inode2path.end();
+    if (found)
+      *path = iter->second;
+    pthread_mutex_unlock(&shards_[i].lock);
+    if (found)
+      return true;
+  }
+  return false;
+}
+
+
 /**
  * Finds the inode for path or issues a new inode.
  */
 uint64_t GetInode(const PathString &path) {
   const hash::Md5 md5_path(path.GetChars(), path.GetLength());
-  uint64_t inode = FindInode(md5_path);
-  if (inode != 0)
+  uint64_t inode;
+  if (path2inode_cache_->Lookup(md5_path, &inode))
     return inode;
 
-  pthread_mutex_lock(&lock_);
-  // Search again to avoid race
   inode = FindInode(md5_path);
-  if (inode != 0) {
-    pthread_mutex_unlock(&lock_);
-    return inode;
+  if (inode == 0) {
+    Shard *shard = &shards_[md5_path.digest[0] % kNumShards];
+    pthread_mutex_lock(&shard->lock);
+    // Search again to avoid race, mappings are removed from the pending maps
+    // only after they are written
+    map<hash::Md5, uint64_t>::const_iterator iter =
+      shard->pending_path2inode.find(md5_path);
+    const bool is_pending = (iter != shard->pending_path2inode.end());
+    if (is_pending)
+      inode = iter->second;
+    else
+      inode = FindInode(md5_path);
+
+    if (inode == 0) {
+      // Issue new inode
+      inode = IssueInode();
+      shard->pending_path2inode[md5_path] = inode;
+      shard->pending_inode2path[inode] = string(path.GetChars(),
+                                                path.GetLength());
+      const uint64_t number = ++shard->num_added;
+      pthread_mutex_unlock(&shard->lock);
+      WaitWritten(shard, number);
+      // NFS clients ask for the paths of new inodes soon
+      inode2path_cache_->Insert(inode,
+                                string(path.GetChars(), path.GetLength()));
+    } else if (is_pending) {
+      // Pending mappings are not handed out before they are written
+      const uint64_t number = shard->num_added;
+      pthread_mutex_unlock(&shard->lock);
+      WaitWritten(shard, number);
+    } else {
+      pthread_mutex_unlock(&shard->lock);
+    }
   }
 
-  // Issue new inode
-  inode = seq_++;
-  PutPath2Inode(md5_path, inode);
-  PutInode2Path(inode, path);
-  pthread_mutex_unlock(&lock_);
-
+  path2inode_cache_->Insert(md5_path, inode);
   return inode;
 }
 
@@ -214,24 +423,23 @@ uint64_t GetInode(const PathString &path) {
  * \return false if not found
  */
 bool GetPath(const uint64_t inode, PathString *path) {
-  leveldb::Status status;
-  leveldb::Slice key(reinterpret_cast<const char *>(&inode), sizeof(inode));
   string result;
+  if (inode2path_cache_->Lookup(inode, &result)) {
+    path->Assign(result.data(), result.length());
+    return true;
+  }
 
-  status = db_inode2path_->Get(leveldb_read_options_, key, &result);
-  if (status.IsNotFound()) {
+  // A pending mapping might be written in between the lookups
+  if (!FindPath(inode, &result) && !FindPendingPath(inode, &result) &&
+      !FindPath(inode, &result))
+  {
     LogCvmfs(kLogNfsMaps, kLogDebug,
              "failed to find inode %"PRIu64" in NFS maps, returning ESTALE",
              inode);
     return false;
   }
-  if (!status.ok()) {
-    LogCvmfs(kLogNfsMaps, kLogSyslog,
-             "failed to read from inode2path db inode %"PRIu64": %s",
-             inode, status.ToString().c_str());
-    abort();
-  }
 
+  inode2path_cache_->Insert(inode, result);
   path->Assign(result.data(), result.length());
   LogCvmfs(kLogNfsMaps, kLogDebug, "inode %"PRIu64" maps to path %s",
            inode, path->c_str());
@@ -239,9 +447,28 @@ bool GetPath(const uint64_t inode, PathString *path) {
 }
 
 
+/**
+ * Includes the inodes that are reserved by threads but not yet issued.
+ */
+uint64_t GetNumInodes() {
+  return atomic_read64(&seq_) - root_inode_;
+}
+
+
 string GetStatistics() {
   string result = "Total number of issued inodes: " +
-                  StringifyInt(seq_-root_inode_) + "\n";
+                  StringifyInt(GetNumInodes()) + "\n";
+  unsigned num_pending = 0;
+  for (unsigned i = 0; i < kNumShards; ++i) {
+    pthread_mutex_lock(&shards_[i].lock);
+    num_pending += shards_[i].pending_path2inode.size();
+    pthread_mutex_unlock(&shards_[i].lock);
+  }
+  result += "Pending new entries: " + StringifyInt(num_pending) + "\n";
+  result += "path --> inode memory cache: " +
+            path2inode_cache_->statistics().Print();
+  result += "inode --> path memory cache: " +
+            inode2path_cache_->statistics().Print();
 
   string stats;
   db_inode2path_->GetProperty(leveldb::Slice("leveldb.stats"), &stats);
@@ -308,11 +535,27 @@ bool Init(const string &leveldb_dir, const uint64_t root_inode,
   }
   LogCvmfs(kLogNfsMaps, kLogDebug, "path2inode opened");
 
+  shards_ = new Shard[kNumShards];
+  for (unsigned i = 0; i < kNumShards; ++i) {
+    int retval = pthread_mutex_init(&shards_[i].lock, NULL);
+    assert(retval == 0);
+    retval = pthread_mutex_init(&shards_[i].lock_write, NULL);
+    assert(retval == 0);
+    shards_[i].num_added = shards_[i].num_written = 0;
+  }
+  int retval = pthread_key_create(&key_inode_block_, FreeInodeBlock);
+  assert(retval == 0);
+  path2inode_cache_ = new Path2InodeCache(
+    kFrontCacheSize, hash::Md5(hash::AsciiPtr("!")), lru::hasher_md5);
+  inode2path_cache_ = new Inode2PathCache(
+    kFrontCacheSize, uint64_t(-1), hasher_inode);
+
   // Fetch highest issued inode
-  seq_ = FindInode(hash::Md5(hash::AsciiPtr("?seq")));
-  LogCvmfs(kLogNfsMaps, kLogDebug, "Sequence number is %"PRIu64, seq_);
-  if (seq_ == 0) {
-    seq_ = root_inode_;
+  const uint64_t seq = FindInode(hash::Md5(hash::AsciiPtr("?seq")));
+  LogCvmfs(kLogNfsMaps, kLogDebug, "Sequence number is %"PRIu64, seq);
+  atomic_init64(&seq_);
+  atomic_xadd64(&seq_, (seq == 0) ? root_inode_ : seq);
+  if (seq == 0) {
     // Insert root inode
     PathString root_path;
     nfs_maps::GetInode(root_path);
@@ -333,8 +576,24 @@ void Spawn() {
 
 
 void Fini() {
+  for (unsigned i = 0; i < kNumShards; ++i) {
+    assert(shards_[i].pending_path2inode.empty());
+    pthread_mutex_destroy(&shards_[i].lock);
+    pthread_mutex_destroy(&shards_[i].lock_write);
+  }
+  delete[] shards_;
+  shards_ = NULL;
+  // Blocks of other threads are freed when the threads exit
+  FreeInodeBlock(pthread_getspecific(key_inode_block_));
+  pthread_setspecific(key_inode_block_, NULL);
+  pthread_key_delete(key_inode_block_);
+  delete path2inode_cache_;
+  delete inode2path_cache_;
+  path2inode_cache_ = NULL;
+  inode2path_cache_ = NULL;
+
   // Write highest issued sequence number
-  PutPath2Inode(hash::Md5(hash::AsciiPtr("?seq")), seq_);
+  PutPath2Inode(hash::Md5(hash::AsciiPtr("?seq")), atomic_read64(&seq_));
 
   delete db_path2inode_;
   delete cache_path2inode_;
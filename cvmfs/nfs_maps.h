@@ -19,6 +19,7 @@ void Spawn();
 uint64_t GetInode(const PathString &path);
 bool GetPath(const uint64_t inode, PathString *path);
 
+uint64_t GetNumInodes();
 std::string GetStatistics();
 
 }  // namespace nfs_maps
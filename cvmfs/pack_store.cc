@@ -0,0 +1,806 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Small cache objects are not stored as files of their own but appended to
+ * segment files in the packs/ subdirectory of the cache.  A hash table in a
+ * memory mapped index file maps content hashes to segment, offset, and size.
+ * This saves inodes and block slack and turns the open-read-close of a small
+ * file into a single pread.
+ *
+ * Removed objects leave holes in their segments.  Compact() moves the
+ * remaining objects of mostly empty segments into the active segment and
+ * deletes the old segment.  It runs after cache eviction.
+ *
+ * Objects are written to the segment before the index entry is set.  On
+ * start, index entries that point outside the segments are dropped.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "pack_store.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "platform.h"
+#include "atomic.h"
+#include "logging.h"
+#include "hash.h"
+#include "util.h"
+#include "smalloc.h"
+
+using namespace std;  // NOLINT
+
+namespace pack_store {
+
+const uint32_t kIndexMagic = 0x4b434150;  // "PACK"
+const uint32_t kIndexVersion = 1;
+const uint32_t kMinCapacity = 1 << 16;
+const uint32_t kMaxCapacity = 1 << 24;
+const uint64_t kSegmentSize = 32 * 1024 * 1024;
+const uint32_t kSegmentEmpty = 0;
+const uint32_t kSegmentTombstone = uint32_t(-1);
+/**
+ * Segments with less than kCompactRatio of their bytes in use are compacted.
+ */
+const double kCompactRatio = 0.5;
+const unsigned kMaxObjectSize = 1024 * 1024;
+
+/**
+ * The index file starts with the header, padded to 64 bytes, followed by the
+ * hash table.  The table uses linear probing.
+ */
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t padding[13];
+};
+
+struct IndexEntry {
+  unsigned char digest[20];
+  uint32_t segment;  /**< kSegmentEmpty or kSegmentTombstone for free slots */
+  uint32_t offset;
+  uint32_t size;
+};
+
+struct Segment {
+  Segment() : fd(-1), size(0), live(0) { }
+  int fd;
+  uint64_t size;
+  uint64_t live;  /**< Bytes of the segment referenced by the index */
+};
+
+struct Statistics {
+  Statistics() : num_inserts(0), num_rejects(0), num_removes(0),
+    num_compactions(0), bytes_compacted(0)
+  {
+    atomic_init64(&num_hits);
+    atomic_init64(&num_misses);
+  }
+  atomic_int64 num_hits;  /**< Updated under the read lock */
+  atomic_int64 num_misses;
+  uint64_t num_inserts;
+  uint64_t num_rejects;
+  uint64_t num_removes;
+  uint64_t num_compactions;
+  uint64_t bytes_compacted;
+};
+
+unsigned threshold_ = 0;
+string *packs_dir_ = NULL;
+int index_fd_ = -1;
+IndexHeader *index_ = NULL;
+IndexEntry *table_ = NULL;
+uint32_t num_entries_ = 0;
+uint32_t num_tombstones_ = 0;
+map<uint32_t, Segment> *segments_ = NULL;
+uint32_t active_segment_ = 0;
+Statistics *statistics_ = NULL;
+pthread_rwlock_t lock_ = PTHREAD_RWLOCK_INITIALIZER;
+
+
+static string GetIndexPath() {
+  return *packs_dir_ + "/index";
+}
+
+
+static string GetSegmentPath(const uint32_t segment) {
+  return *packs_dir_ + "/segment." + StringifyInt(segment);
+}
+
+
+static uint64_t GetIndexSize(const uint32_t capacity) {
+  return sizeof(IndexHeader) + uint64_t(capacity) * sizeof(IndexEntry);
+}
+
+
+static inline bool IsFree(const IndexEntry &entry) {
+  return (entry.segment == kSegmentEmpty) ||
+         (entry.segment == kSegmentTombstone);
+}
+
+
+/**
+ * Content hashes are uniformly distributed, the first bytes of the digest
+ * are a good enough slot.
+ */
+static inline uint32_t GetSlot(const unsigned char *digest,
+                               const uint32_t capacity)
+{
+  uint32_t value;
+  memcpy(&value, digest, sizeof(value));
+  return value & (capacity - 1);
+}
+
+
+/**
+ * Returns the entry for digest or NULL.  Needs to be called with lock_ held.
+ */
+static IndexEntry *LookupEntry(const unsigned char *digest) {
+  const uint32_t capacity = index_->capacity;
+  uint32_t slot = GetSlot(digest, capacity);
+  for (uint32_t i = 0; i < capacity; ++i) {
+    IndexEntry *entry = &table_[slot];
+    if (entry->segment == kSegmentEmpty)
+      return NULL;
+    if ((entry->segment != kSegmentTombstone) &&
+        (memcmp(entry->digest, digest, sizeof(entry->digest)) == 0))
+    {
+      return entry;
+    }
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return NULL;
+}
+
+
+/**
+ * Returns the first free slot for digest.  The table is never full.
+ */
+static IndexEntry *FindFreeSlot(IndexEntry *table, const uint32_t capacity,
+                                const unsigned char *digest)
+{
+  uint32_t slot = GetSlot(digest, capacity);
+  while (!IsFree(table[slot]))
+    slot = (slot + 1) & (capacity - 1);
+  return &table[slot];
+}
+
+
+static bool MapIndex(const int fd) {
+  platform_stat64 info;
+  if (platform_fstat(fd, &info) != 0)
+    return false;
+  if (uint64_t(info.st_size) < sizeof(IndexHeader))
+    return false;
+  void *mem = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  if (mem == MAP_FAILED)
+    return false;
+  IndexHeader *header = static_cast<IndexHeader *>(mem);
+  const uint32_t capacity = header->capacity;
+  if ((header->magic != kIndexMagic) || (header->version != kIndexVersion) ||
+      (capacity < kMinCapacity) || (capacity > kMaxCapacity) ||
+      ((capacity & (capacity - 1)) != 0) ||
+      (uint64_t(info.st_size) != GetIndexSize(capacity)))
+  {
+    munmap(mem, info.st_size);
+    return false;
+  }
+  index_fd_ = fd;
+  index_ = header;
+  table_ = reinterpret_cast<IndexEntry *>(header + 1);
+  return true;
+}
+
+
+static void UnmapIndex() {
+  if (index_ == NULL)
+    return;
+  munmap(index_, GetIndexSize(index_->capacity));
+  close(index_fd_);
+  index_ = NULL;
+  table_ = NULL;
+  index_fd_ = -1;
+}
+
+
+/**
+ * Creates a zeroed (sparse) index file at path.
+ */
+static int CreateIndexFile(const string &path, const uint32_t capacity) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    return -1;
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kIndexMagic;
+  header.version = kIndexVersion;
+  header.capacity = capacity;
+  if ((ftruncate(fd, GetIndexSize(capacity)) != 0) ||
+      (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)))
+  {
+    close(fd);
+    unlink(path.c_str());
+    return -1;
+  }
+  return fd;
+}
+
+
+/**
+ * Writes the live entries into a new index of the given capacity and
+ * replaces the current index by it.  Drops the tombstones.  Needs to be
+ * called with the write lock held.
+ */
+static bool Rehash(const uint32_t capacity) {
+  const string tmp_path = GetIndexPath() + ".tmp";
+  int fd = CreateIndexFile(tmp_path, capacity);
+  if (fd < 0)
+    return false;
+  const uint64_t size = GetIndexSize(capacity);
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  IndexEntry *table = reinterpret_cast<IndexEntry *>(
+    static_cast<IndexHeader *>(mem) + 1);
+  for (uint32_t i = 0; i < index_->capacity; ++i) {
+    if (!IsFree(table_[i]))
+      *FindFreeSlot(table, capacity, table_[i].digest) = table_[i];
+  }
+  munmap(mem, size);
+  if (rename(tmp_path.c_str(), GetIndexPath().c_str()) != 0) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  UnmapIndex();
+  const bool retval = MapIndex(fd);
+  assert(retval);
+  num_tombstones_ = 0;
+  LogCvmfs(kLogCache, kLogDebug, "rehashed pack index, %u entries, "
+           "capacity %u", num_entries_, capacity);
+  return true;
+}
+
+
+static bool OpenSegment(const uint32_t segment, const bool create) {
+  const string path = GetSegmentPath(segment);
+  int fd = open(path.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR,
+                0600);
+  if (fd < 0)
+    return false;
+  platform_stat64 info;
+  if (platform_fstat(fd, &info) != 0) {
+    close(fd);
+    return false;
+  }
+  Segment seg;
+  seg.fd = fd;
+  seg.size = info.st_size;
+  (*segments_)[segment] = seg;
+  return true;
+}
+
+
+/**
+ * Makes sure that the active segment has room for size more bytes.
+ */
+static bool ReserveSegment(const uint64_t size) {
+  map<uint32_t, Segment>::const_iterator iter =
+    segments_->find(active_segment_);
+  if ((iter != segments_->end()) && (iter->second.size + size <= kSegmentSize))
+    return true;
+  if (!OpenSegment(active_segment_ + 1, true)) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+             "failed to create pack segment %u (%d)",
+             active_segment_ + 1, errno);
+    return false;
+  }
+  active_segment_++;
+  return true;
+}
+
+
+/**
+ * Appends buffer to the active segment and records it in entry.  Needs to be
+ * called with the write lock held.
+ */
+static bool AppendObject(const unsigned char *buffer, const uint64_t size,
+                         IndexEntry *entry)
+{
+  if (!ReserveSegment(size))
+    return false;
+  Segment *seg = &(*segments_)[active_segment_];
+  if (pwrite(seg->fd, buffer, size, seg->size) != int64_t(size)) {
+    // Partially written objects are overwritten by the next append
+    LogCvmfs(kLogCache, kLogDebug, "failed to append to pack segment %u (%d)",
+             active_segment_, errno);
+    return false;
+  }
+  entry->offset = seg->size;
+  entry->size = size;
+  // Set last, a non-empty segment marks the entry valid
+  entry->segment = active_segment_;
+  seg->size += size;
+  seg->live += size;
+  return true;
+}
+
+
+/**
+ * Fills a free slot with an appended object.  The segment is set last, so that
+ * the slot in the mapped index never shows a valid entry with a wrong digest.
+ */
+static void StoreEntry(const unsigned char *digest, const IndexEntry &appended,
+                       IndexEntry *entry)
+{
+  entry->segment = kSegmentEmpty;
+  memcpy(entry->digest, digest, sizeof(entry->digest));
+  entry->offset = appended.offset;
+  entry->size = appended.size;
+  entry->segment = appended.segment;
+}
+
+
+static void ReleaseEntry(IndexEntry *entry) {
+  map<uint32_t, Segment>::iterator iter = segments_->find(entry->segment);
+  if (iter != segments_->end())
+    iter->second.live -= entry->size;
+  entry->segment = kSegmentTombstone;
+  num_entries_--;
+  num_tombstones_++;
+}
+
+
+/**
+ * Opens the segments and checks the index against them.
+ */
+static bool LoadSegments() {
+  DIR *dirp = opendir(packs_dir_->c_str());
+  if (dirp == NULL)
+    return false;
+  platform_dirent64 *d;
+  while ((d = platform_readdir(dirp)) != NULL) {
+    const string name = d->d_name;
+    if (!HasPrefix(name, "segment.", false))
+      continue;
+    const uint64_t segment = String2Uint64(name.substr(8));
+    if ((segment == kSegmentEmpty) || (segment >= kSegmentTombstone))
+      continue;
+    if (!OpenSegment(segment, false)) {
+      closedir(dirp);
+      return false;
+    }
+    if (segment > active_segment_)
+      active_segment_ = segment;
+  }
+  closedir(dirp);
+
+  unsigned num_dangling = 0;
+  for (uint32_t i = 0; i < index_->capacity; ++i) {
+    IndexEntry *entry = &table_[i];
+    if (entry->segment == kSegmentEmpty)
+      continue;
+    if (entry->segment == kSegmentTombstone) {
+      num_tombstones_++;
+      continue;
+    }
+    num_entries_++;
+    map<uint32_t, Segment>::iterator iter = segments_->find(entry->segment);
+    if ((iter == segments_->end()) ||
+        (uint64_t(entry->offset) + entry->size > iter->second.size))
+    {
+      entry->size = 0;
+      ReleaseEntry(entry);
+      num_dangling++;
+      continue;
+    }
+    iter->second.live += entry->size;
+  }
+  if (num_dangling > 0) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+             "dropped %u dangling entries from pack index", num_dangling);
+  }
+  return true;
+}
+
+
+/**
+ * Opens or creates the pack store in cache_dir.  Objects smaller than
+ * threshold bytes go into the pack store.  A threshold of 0 disables it.
+ */
+bool Init(const string &cache_dir, const unsigned threshold) {
+  if (threshold == 0)
+    return true;
+
+  packs_dir_ = new string(cache_dir + "/packs");
+  segments_ = new map<uint32_t, Segment>();
+  statistics_ = new Statistics();
+  num_entries_ = num_tombstones_ = 0;
+  active_segment_ = 0;
+  if (!MkdirDeep(*packs_dir_, 0700))
+    goto init_fail;
+
+  {
+    int fd = open(GetIndexPath().c_str(), O_RDWR);
+    if ((fd < 0) || !MapIndex(fd)) {
+      if (fd >= 0) {
+        LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+                 "pack index corrupted, starting with an empty pack store");
+        close(fd);
+      }
+      // Without an index, the segments are useless
+      RemoveTree(*packs_dir_);
+      if (!MkdirDeep(*packs_dir_, 0700))
+        goto init_fail;
+      fd = CreateIndexFile(GetIndexPath(), kMinCapacity);
+      if ((fd < 0) || !MapIndex(fd))
+        goto init_fail;
+    }
+  }
+  if (!LoadSegments())
+    goto init_fail;
+
+  threshold_ = (threshold > kMaxObjectSize) ? kMaxObjectSize : threshold;
+  LogCvmfs(kLogCache, kLogDebug, "pack store with %u objects in %u segments, "
+           "threshold %u bytes", num_entries_, unsigned(segments_->size()),
+           threshold_);
+  return true;
+
+ init_fail:
+  LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+           "failed to initialize pack store in %s (%d)",
+           packs_dir_->c_str(), errno);
+  Fini();
+  return false;
+}
+
+
+void Fini() {
+  if (segments_ == NULL)
+    return;
+  for (map<uint32_t, Segment>::const_iterator i = segments_->begin(),
+       iEnd = segments_->end(); i != iEnd; ++i)
+  {
+    close(i->second.fd);
+  }
+  UnmapIndex();
+  delete segments_;
+  delete packs_dir_;
+  delete statistics_;
+  segments_ = NULL;
+  packs_dir_ = NULL;
+  statistics_ = NULL;
+  threshold_ = 0;
+}
+
+
+/**
+ * Objects of at least this size are stored as regular cache files.
+ * 0 if the pack store is disabled.
+ */
+unsigned GetThreshold() {
+  return threshold_;
+}
+
+
+/**
+ * Reads an object into a newly allocated buffer.
+ *
+ * \return false if the object is not in the pack store
+ */
+bool Read(const hash::Any &id, unsigned char **buffer, uint64_t *size) {
+  if ((threshold_ == 0) || (id.algorithm != hash::kSha1))
+    return false;
+
+  pthread_rwlock_rdlock(&lock_);
+  IndexEntry *entry = LookupEntry(id.digest);
+  if (entry == NULL) {
+    atomic_inc64(&statistics_->num_misses);
+    pthread_rwlock_unlock(&lock_);
+    return false;
+  }
+  const int fd = segments_->find(entry->segment)->second.fd;
+  *size = entry->size;
+  *buffer = static_cast<unsigned char *>(smalloc(*size > 0 ? *size : 1));
+  const int64_t nbytes = pread(fd, *buffer, *size, entry->offset);
+  pthread_rwlock_unlock(&lock_);
+
+  if (nbytes != int64_t(*size)) {
+    LogCvmfs(kLogCache, kLogDebug, "failed to read %s from pack store (%d)",
+             id.ToString().c_str(), errno);
+    free(*buffer);
+    *buffer = NULL;
+    return false;
+  }
+  atomic_inc64(&statistics_->num_hits);
+  return true;
+}
+
+
+bool Contains(const hash::Any &id) {
+  if ((threshold_ == 0) || (id.algorithm != hash::kSha1))
+    return false;
+
+  pthread_rwlock_rdlock(&lock_);
+  const bool result = LookupEntry(id.digest) != NULL;
+  pthread_rwlock_unlock(&lock_);
+  return result;
+}
+
+
+/**
+ * Appends an object to the pack store.
+ *
+ * \return false if the object should be stored as a regular file instead
+ */
+bool Insert(const hash::Any &id, const unsigned char *buffer,
+            const uint64_t size)
+{
+  if ((threshold_ == 0) || (id.algorithm != hash::kSha1) ||
+      (size >= threshold_))
+  {
+    return false;
+  }
+
+  bool result = false;
+  pthread_rwlock_wrlock(&lock_);
+  if (LookupEntry(id.digest) != NULL) {
+    result = true;
+    goto insert_return;
+  }
+  if (2 * (uint64_t(num_entries_) + 1) > index_->capacity) {
+    if ((index_->capacity >= kMaxCapacity) || !Rehash(index_->capacity * 2)) {
+      statistics_->num_rejects++;
+      goto insert_return;
+    }
+  } else if (4 * (uint64_t(num_entries_ + num_tombstones_) + 1) >
+             3 * uint64_t(index_->capacity))
+  {
+    if (!Rehash(index_->capacity)) {
+      statistics_->num_rejects++;
+      goto insert_return;
+    }
+  }
+
+  {
+    // The slot is only touched once the object is written, a failed append
+    // must not turn a tombstone into an empty slot that breaks probe chains
+    IndexEntry appended;
+    if (!AppendObject(buffer, size, &appended)) {
+      statistics_->num_rejects++;
+      goto insert_return;
+    }
+    IndexEntry *entry = FindFreeSlot(table_, index_->capacity, id.digest);
+    if (entry->segment == kSegmentTombstone)
+      num_tombstones_--;
+    StoreEntry(id.digest, appended, entry);
+    num_entries_++;
+    statistics_->num_inserts++;
+    result = true;
+  }
+
+ insert_return:
+  pthread_rwlock_unlock(&lock_);
+  return result;
+}
+
+
+/**
+ * Marks an object as removed.  Its space is reclaimed by Compact().
+ */
+bool Remove(const hash::Any &id) {
+  if ((threshold_ == 0) || (id.algorithm != hash::kSha1))
+    return false;
+
+  pthread_rwlock_wrlock(&lock_);
+  IndexEntry *entry = LookupEntry(id.digest);
+  if (entry != NULL) {
+    ReleaseEntry(entry);
+    statistics_->num_removes++;
+  }
+  pthread_rwlock_unlock(&lock_);
+  return entry != NULL;
+}
+
+
+/**
+ * Lists all objects with their sizes, used to rebuild the cache database.
+ */
+void ListObjects(vector<hash::Any> *ids, vector<uint64_t> *sizes) {
+  if (threshold_ == 0)
+    return;
+
+  pthread_rwlock_rdlock(&lock_);
+  for (uint32_t i = 0; i < index_->capacity; ++i) {
+    if (IsFree(table_[i]))
+      continue;
+    hash::Any id(hash::kSha1);
+    memcpy(id.digest, table_[i].digest, sizeof(table_[i].digest));
+    ids->push_back(id);
+    sizes->push_back(table_[i].size);
+  }
+  pthread_rwlock_unlock(&lock_);
+}
+
+
+/**
+ * Moves a live object of a compacted segment into the active segment.  The
+ * buffer grows to the largest object moved so far.
+ */
+static bool MoveEntry(const int fd, IndexEntry *entry,
+                      unsigned char **buffer, uint64_t *buffer_size)
+{
+  if (entry->size > kSegmentSize)
+    return false;
+  if (entry->size > *buffer_size) {
+    *buffer = static_cast<unsigned char *>(srealloc(*buffer, entry->size));
+    *buffer_size = entry->size;
+  }
+  if (pread(fd, *buffer, entry->size, entry->offset) != int64_t(entry->size))
+    return false;
+  IndexEntry moved = *entry;
+  if (!AppendObject(*buffer, entry->size, &moved))
+    return false;
+  // Same slot and digest, only the location changes
+  entry->offset = moved.offset;
+  entry->segment = moved.segment;
+  return true;
+}
+
+
+/**
+ * Moves the live objects of a segment into the active segment and deletes
+ * the segment.  The slots are the segment's entries as collected by Compact().
+ * They are verified because the table may have changed in between, the full
+ * table is only scanned if objects of the segment are left afterwards.  Needs
+ * to be called with the write lock held.
+ */
+static bool CompactSegment(const uint32_t segment,
+                           const vector<uint32_t> &slots)
+{
+  Segment *seg = &(*segments_)[segment];
+  const int fd = seg->fd;
+  unsigned char *buffer = NULL;
+  uint64_t buffer_size = 0;
+  uint64_t num_bytes = 0;
+  for (unsigned i = 0; i < slots.size(); ++i) {
+    if (slots[i] >= index_->capacity)
+      continue;
+    IndexEntry *entry = &table_[slots[i]];
+    if (entry->segment != segment)
+      continue;
+    if (!MoveEntry(fd, entry, &buffer, &buffer_size)) {
+      free(buffer);
+      return false;
+    }
+    seg->live -= entry->size;
+    num_bytes += entry->size;
+  }
+  if (seg->live > 0) {
+    for (uint32_t i = 0; i < index_->capacity; ++i) {
+      IndexEntry *entry = &table_[i];
+      if (entry->segment != segment)
+        continue;
+      if (!MoveEntry(fd, entry, &buffer, &buffer_size)) {
+        free(buffer);
+        return false;
+      }
+      seg->live -= entry->size;
+      num_bytes += entry->size;
+    }
+  }
+  free(buffer);
+
+  close(fd);
+  segments_->erase(segment);
+  unlink(GetSegmentPath(segment).c_str());
+  statistics_->num_compactions++;
+  statistics_->bytes_compacted += num_bytes;
+  LogCvmfs(kLogCache, kLogDebug, "compacted pack segment %u, moved %"PRIu64
+           " bytes", segment, num_bytes);
+  return true;
+}
+
+
+/**
+ * Compacts sparsely used segments.  The active segment is left alone.
+ * The entries of all candidates are collected in a single pass over the table.
+ * Segments are compacted one by one so that readers get through in between.
+ * A segment that fails to compact is skipped.
+ */
+void Compact() {
+  if (threshold_ == 0)
+    return;
+
+  map<uint32_t, vector<uint32_t> > candidates;
+  pthread_rwlock_rdlock(&lock_);
+  for (map<uint32_t, Segment>::const_iterator i = segments_->begin(),
+       iEnd = segments_->end(); i != iEnd; ++i)
+  {
+    if ((i->first != active_segment_) &&
+        (double(i->second.live) < kCompactRatio * double(i->second.size)))
+    {
+      candidates[i->first] = vector<uint32_t>();
+    }
+  }
+  if (!candidates.empty()) {
+    for (uint32_t i = 0; i < index_->capacity; ++i) {
+      map<uint32_t, vector<uint32_t> >::iterator iter =
+        candidates.find(table_[i].segment);
+      if (iter != candidates.end())
+        iter->second.push_back(i);
+    }
+  }
+  pthread_rwlock_unlock(&lock_);
+
+  for (map<uint32_t, vector<uint32_t> >::const_iterator i =
+       candidates.begin(), iEnd = candidates.end(); i != iEnd; ++i)
+  {
+    pthread_rwlock_wrlock(&lock_);
+    const bool retval = (i->first == active_segment_) ||
+                        (segments_->find(i->first) == segments_->end()) ||
+                        CompactSegment(i->first, i->second);
+    pthread_rwlock_unlock(&lock_);
+    if (!retval) {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "failed to compact pack segment %u", i->first);
+    }
+  }
+}
+
+
+string GetStatistics() {
+  if (threshold_ == 0)
+    return "Pack store disabled\n";
+
+  pthread_rwlock_rdlock(&lock_);
+  uint64_t size = 0;
+  uint64_t live = 0;
+  for (map<uint32_t, Segment>::const_iterator i = segments_->begin(),
+       iEnd = segments_->end(); i != iEnd; ++i)
+  {
+    size += i->second.size;
+    live += i->second.live;
+  }
+  const string result =
+    "Pack store: " + StringifyInt(num_entries_) + " objects, " +
+    StringifyInt(live / 1024) + " KB in use of " +
+    StringifyInt(size / 1024) + " KB in " + StringifyInt(segments_->size()) +
+    " segments\n" +
+    "  hits: " + StringifyInt(atomic_read64(&statistics_->num_hits)) +
+    "  misses: " + StringifyInt(atomic_read64(&statistics_->num_misses)) +
+    "  inserts: " + StringifyInt(statistics_->num_inserts) +
+    "  rejects: " + StringifyInt(statistics_->num_rejects) +
+    "  removes: " + StringifyInt(statistics_->num_removes) + "\n" +
+    "  compactions: " + StringifyInt(statistics_->num_compactions) +
+    "  compacted: " + StringifyInt(statistics_->bytes_compacted / 1024) +
+    " KB\n";
+  pthread_rwlock_unlock(&lock_);
+  return result;
+}
+
+}  // namespace pack_store
@@ -0,0 +1,35 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_PACK_STORE_H_
+#define CVMFS_PACK_STORE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace hash {
+struct Any;
+}
+
+namespace pack_store {
+
+bool Init(const std::string &cache_dir, const unsigned threshold);
+void Fini();
+unsigned GetThreshold();
+
+bool Contains(const hash::Any &id);
+bool Read(const hash::Any &id, unsigned char **buffer, uint64_t *size);
+bool Insert(const hash::Any &id, const unsigned char *buffer,
+            const uint64_t size);
+bool Remove(const hash::Any &id);
+void ListObjects(std::vector<hash::Any> *ids, std::vector<uint64_t> *sizes);
+void Compact();
+
+std::string GetStatistics();
+
+}  // namespace pack_store
+
+#endif  // CVMFS_PACK_STORE_H_
@@ -0,0 +1,335 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A pin set is a named group of cache objects that are protected from
+ * eviction, e.g. the software release a batch of jobs is going to use.  Pin()
+ * walks the given files and directories in the catalogs, fetches all objects
+ * in parallel, and reserves them in the quota manager.  The set is released
+ * as a whole by Unpin().
+ *
+ * Objects can be part of several sets, they are reference counted and stay
+ * pinned until the last set containing them is unpinned.  Pin sets live in
+ * memory only, they do not survive a restart of cvmfs.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "pin_sets.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "atomic.h"
+#include "logging.h"
+#include "hash.h"
+#include "util.h"
+#include "dirent.h"
+#include "catalog_mgr.h"
+#include "cache.h"
+#include "download.h"
+#include "quota.h"
+#include "pack_store.h"
+
+using namespace std;  // NOLINT
+
+namespace pin_sets {
+
+const unsigned kNumFetchThreads = 8;
+
+struct Object {
+  catalog::DirectoryEntry dirent;
+  string path;
+};
+typedef map<hash::Any, Object> ObjectMap;
+
+struct PinSet {
+  PinSet() : size(0), limit(0) { }
+  vector<hash::Any> objects;
+  uint64_t size;
+  uint64_t limit;
+};
+typedef map<string, PinSet> PinSetMap;
+
+/**
+ * Shared by the fetch threads, every thread takes the next unfetched object.
+ */
+struct FetchQueue {
+  vector<Object> *objects;
+  atomic_int32 next;
+  atomic_int32 num_failed;
+};
+
+catalog::AbstractCatalogManager *catalog_manager_ = NULL;
+PinSetMap *pin_sets_ = NULL;
+map<hash::Any, unsigned> *refcounts_ = NULL;  /**< Number of sets per object */
+/**
+ * Serializes pinning and unpinning, Pin() holds it during the fetch.
+ */
+pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+
+bool Init(catalog::AbstractCatalogManager *catalog_manager) {
+  catalog_manager_ = catalog_manager;
+  pin_sets_ = new PinSetMap();
+  refcounts_ = new map<hash::Any, unsigned>();
+  return true;
+}
+
+
+/**
+ * Objects remain pinned in the quota manager.
+ */
+void Fini() {
+  delete pin_sets_;
+  delete refcounts_;
+  pin_sets_ = NULL;
+  refcounts_ = NULL;
+  catalog_manager_ = NULL;
+}
+
+
+/**
+ * Adds the regular files of path, recursively for directories, to objects.
+ * Symlinks are skipped.
+ *
+ * \return 0 or -ENOENT
+ */
+static int CollectObjects(const string &path, ObjectMap *objects) {
+  catalog::DirectoryEntry dirent;
+  if (!catalog_manager_->LookupPath(path, catalog::kLookupSole, &dirent)) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "pin set: %s not found", path.c_str());
+    return -ENOENT;
+  }
+
+  if (dirent.IsRegular()) {
+    if (objects->find(dirent.checksum()) == objects->end()) {
+      Object *object = &(*objects)[dirent.checksum()];
+      object->dirent = dirent;
+      object->path = path;
+    }
+    return 0;
+  }
+  if (!dirent.IsDirectory())
+    return 0;
+
+  catalog::DirectoryEntryList listing;
+  if (!catalog_manager_->Listing(path, &listing)) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "pin set: failed to list %s",
+             path.c_str());
+    return -ENOENT;
+  }
+  for (unsigned i = 0; i < listing.size(); ++i) {
+    const int retval = CollectObjects(
+      path + "/" + listing[i].name().ToString(), objects);
+    if (retval != 0)
+      return retval;
+  }
+  return 0;
+}
+
+
+static void *MainFetch(void *data) {
+  FetchQueue *queue = reinterpret_cast<FetchQueue *>(data);
+
+  int32_t i;
+  while ((i = atomic_xadd32(&queue->next, 1)) <
+         static_cast<int32_t>(queue->objects->size()))
+  {
+    const Object &object = (*queue->objects)[i];
+    int retval;
+    // Small objects go to the pack store, like on open.  Pin set downloads
+    // are subject to the prefetch transfer limit.
+    if (object.dirent.size() < pack_store::GetThreshold()) {
+      unsigned char *buffer;
+      uint64_t size;
+      retval = cache::Fetch2Mem(object.dirent, object.path,
+                                download::kPriorityPrefetch, &buffer, &size);
+      if (retval == 0)
+        free(buffer);
+    } else {
+      retval = cache::Fetch(object.dirent, object.path,
+                            download::kPriorityPrefetch);
+      if (retval >= 0)
+        close(retval);
+    }
+    if (retval < 0) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "pin set: failed to fetch %s (%d)", object.path.c_str(),
+               retval);
+      atomic_inc32(&queue->num_failed);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * Fetches the objects with kNumFetchThreads threads.
+ *
+ * \return Number of failed fetches
+ */
+static int FetchObjects(vector<Object> *objects) {
+  FetchQueue queue;
+  queue.objects = objects;
+  atomic_init32(&queue.next);
+  atomic_init32(&queue.num_failed);
+
+  pthread_t threads[kNumFetchThreads];
+  unsigned num_threads = 0;
+  for (; (num_threads < kNumFetchThreads) &&
+         (num_threads < objects->size()); ++num_threads)
+  {
+    if (pthread_create(&threads[num_threads], NULL, MainFetch, &queue) != 0)
+      break;
+  }
+  // Fetch in this thread if no thread could be created
+  if (num_threads == 0)
+    MainFetch(&queue);
+  for (unsigned i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+
+  return atomic_read32(&queue.num_failed);
+}
+
+
+/**
+ * Drops a reference of the objects, unpins the ones that are not part of
+ * another set.  Needs to be called with lock_ held.
+ */
+static void Release(const vector<hash::Any> &objects) {
+  for (unsigned i = 0; i < objects.size(); ++i) {
+    map<hash::Any, unsigned>::iterator iter = refcounts_->find(objects[i]);
+    assert(iter != refcounts_->end());
+    if (--iter->second == 0) {
+      quota::Unpin(objects[i]);
+      refcounts_->erase(iter);
+    }
+  }
+}
+
+
+/**
+ * Pins all regular files under paths as the new set name.  The objects are
+ * reserved in the quota manager first, so that fetched objects cannot be
+ * evicted before the set is complete.  On failure, nothing is pinned.
+ *
+ * \return 0, -EEXIST if the set exists, -ENOENT if a path does not exist,
+ *         -EFBIG if the set is larger than limit, -ENOSPC if the quota manager
+ *         refuses to pin, or -EIO if objects could not be fetched.
+ */
+int Pin(const string &name, const uint64_t limit,
+        const vector<string> &paths)
+{
+  int result = 0;
+  ObjectMap objects;
+  PinSet pin_set;
+  pin_set.limit = limit;
+  vector<Object> new_objects;
+
+  pthread_mutex_lock(&lock_);
+  if (pin_sets_->find(name) != pin_sets_->end()) {
+    result = -EEXIST;
+    goto pin_return;
+  }
+
+  for (unsigned i = 0; i < paths.size(); ++i) {
+    // Catalogs keep the root directory as empty path
+    string path = paths[i];
+    while ((path.length() > 0) && (path[path.length()-1] == '/'))
+      path.erase(path.length()-1);
+    if ((result = CollectObjects(path, &objects)) != 0)
+      goto pin_return;
+  }
+
+  for (ObjectMap::const_iterator i = objects.begin(), iEnd = objects.end();
+       i != iEnd; ++i)
+  {
+    pin_set.size += i->second.dirent.size();
+  }
+  if (pin_set.size > limit) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "pin set %s: %"PRIu64" bytes exceed the "
+             "limit of %"PRIu64" bytes", name.c_str(), pin_set.size, limit);
+    result = -EFBIG;
+    goto pin_return;
+  }
+
+  for (ObjectMap::const_iterator i = objects.begin(), iEnd = objects.end();
+       i != iEnd; ++i)
+  {
+    unsigned *refcount = &(*refcounts_)[i->first];
+    if (*refcount == 0) {
+      if (!quota::Reserve(i->first, i->second.dirent.size())) {
+        refcounts_->erase(i->first);
+        result = -ENOSPC;
+        break;
+      }
+      new_objects.push_back(i->second);
+    }
+    (*refcount)++;
+    pin_set.objects.push_back(i->first);
+  }
+
+  // Objects of other sets are already in the cache
+  if ((result == 0) && (FetchObjects(&new_objects) > 0))
+    result = -EIO;
+
+  if (result != 0) {
+    Release(pin_set.objects);
+    goto pin_return;
+  }
+  (*pin_sets_)[name] = pin_set;
+  LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog, "pinned set %s, %u objects "
+           "(%u fetched), %"PRIu64" KB", name.c_str(),
+           unsigned(pin_set.objects.size()), unsigned(new_objects.size()),
+           pin_set.size / 1024);
+
+ pin_return:
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+/**
+ * \return 0 or -ENOENT if there is no such set
+ */
+int Unpin(const string &name) {
+  pthread_mutex_lock(&lock_);
+  PinSetMap::iterator iter = pin_sets_->find(name);
+  if (iter == pin_sets_->end()) {
+    pthread_mutex_unlock(&lock_);
+    return -ENOENT;
+  }
+  Release(iter->second.objects);
+  pin_sets_->erase(iter);
+  pthread_mutex_unlock(&lock_);
+  LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog, "unpinned set %s",
+           name.c_str());
+  return 0;
+}
+
+
+string List() {
+  string result;
+  pthread_mutex_lock(&lock_);
+  for (PinSetMap::const_iterator i = pin_sets_->begin(),
+       iEnd = pin_sets_->end(); i != iEnd; ++i)
+  {
+    result += i->first + ": " + StringifyInt(i->second.objects.size()) +
+              " objects, " + StringifyInt(i->second.size / 1024) + " KB of " +
+              StringifyInt(i->second.limit / 1024) + " KB\n";
+  }
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+}  // namespace pin_sets
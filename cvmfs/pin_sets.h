@@ -0,0 +1,29 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_PIN_SETS_H_
+#define CVMFS_PIN_SETS_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace catalog {
+class AbstractCatalogManager;
+}
+
+namespace pin_sets {
+
+bool Init(catalog::AbstractCatalogManager *catalog_manager);
+void Fini();
+
+int Pin(const std::string &name, const uint64_t limit,
+        const std::vector<std::string> &paths);
+int Unpin(const std::string &name);
+std::string List();
+
+}  // namespace pin_sets
+
+#endif  // CVMFS_PIN_SETS_H_
@@ -7,6 +7,12 @@
 #ifndef CVMFS_PLATFORM_LINUX_H_
 #define CVMFS_PLATFORM_LINUX_H_
 
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
 /**
  * Spinlocks are not necessarily part of pthread on all platforms.
  */
@@ -35,6 +41,25 @@ inline unsigned long platform_gettid() {
 }
 
 
+/**
+ * Futexes on a 32bit word, possibly in shared memory.  Waiting returns on a
+ * wake-up, after the timeout, or immediately if the word does not contain the
+ * expected value.
+ */
+inline void platform_futex_wait(int32_t *addr, const int32_t expected,
+                                const unsigned timeout_ms)
+{
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, addr, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+inline void platform_futex_wake(int32_t *addr, const int num_waiters) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, num_waiters, NULL, NULL, 0);
+}
+
+
 /**
  * File system functions, ensure 64bit versions.
  */
@@ -71,4 +96,47 @@ inline int platform_readahead(int filedes) {
   return readahead(filedes, 0, static_cast<size_t>(-1));
 }
 
+/**
+ * Reserves disk space for a file that is about to be written, the file size
+ * does not change.  Only a hint, not all file systems support it.
+ */
+inline void platform_preallocate(int filedes, const uint64_t size) {
+  fallocate(filedes, FALLOC_FL_KEEP_SIZE, 0, size);
+}
+
+/**
+ * Restricts the calling thread to the given cpu.
+ */
+#include <sched.h>
+inline bool platform_pin_thread(const unsigned cpu) {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+}
+
+/**
+ * Opens another fuse device file descriptor for the mount behind fuse_fd.
+ * Requests of the mount are spread over all of its device file descriptors,
+ * the replies go to the file descriptor a request was read from.  Needs
+ * Linux 4.2.
+ *
+ * \return -1 if cloning is not supported
+ */
+#include <sys/ioctl.h>
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+inline int platform_clone_fuse_fd(const int fuse_fd) {
+  const int clone_fd = open("/dev/fuse", O_RDWR);
+  if (clone_fd < 0)
+    return -1;
+  uint32_t master_fd = fuse_fd;
+  if (ioctl(clone_fd, FUSE_DEV_IOC_CLONE, &master_fd) != 0) {
+    close(clone_fd);
+    return -1;
+  }
+  return clone_fd;
+}
+
 #endif  // CVMFS_PLATFORM_LINUX_H_
@@ -7,6 +7,9 @@
 #ifndef CVMFS_PLATFORM_OSX_H_
 #define CVMFS_PLATFORM_OSX_H_
 
+#include <stdint.h>
+#include <unistd.h>
+
 /**
  * UNIX domain sockets:
  * MSG_NOSIGNAL prevents send() from sending SIGPIPE
@@ -51,6 +54,25 @@ inline unsigned long platform_gettid() {
 }
 
 
+/**
+ * There are no futexes on OS X, waiters poll the word instead.
+ */
+inline void platform_futex_wait(int32_t *addr, const int32_t expected,
+                                const unsigned timeout_ms)
+{
+  const unsigned kPollIntervalMs = 1;
+  unsigned waited_ms = 0;
+  while ((*static_cast<volatile int32_t *>(addr) == expected) &&
+         (waited_ms < timeout_ms))
+  {
+    usleep(kPollIntervalMs * 1000);
+    waited_ms += kPollIntervalMs;
+  }
+}
+
+inline void platform_futex_wake(int32_t *addr, const int num_waiters) { }
+
+
 /**
  * File system functions, Mac OS X has 64bit functions by default.
  */
@@ -87,6 +109,29 @@ inline int platform_readahead(int filedes) {
   return 0;
 }
 
+/**
+ * Reserves disk space, contiguous if possible.  Only a hint.
+ */
+inline void platform_preallocate(int filedes, const uint64_t size) {
+  fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0,
+                    static_cast<off_t>(size), 0};
+  if (fcntl(filedes, F_PREALLOCATE, &store) == -1) {
+    store.fst_flags = F_ALLOCATEALL;
+    fcntl(filedes, F_PREALLOCATE, &store);
+  }
+}
+
+/**
+ * Threads cannot be bound to a cpu on OSX.
+ */
+inline bool platform_pin_thread(const unsigned cpu) {
+  return false;
+}
+
+inline int platform_clone_fuse_fd(const int fuse_fd) {
+  return -1;
+}
+
 /**
  * strdupa does not exist on OSX
  */
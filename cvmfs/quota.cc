@@ -5,8 +5,25 @@
  * This way, we are able to track access times of files in the cache
  * and remove files based on least recently used strategy.
  *
- * We setup another SQLite catalog, a "cache catalog", that helps us
- * in the bookkeeping of files, file sizes and access times.
+ * The bookkeeping of files, file sizes and access times is done in an
+ * in-memory index, a hash table over content hashes plus a list in access
+ * order.  Every change of the index is appended to a journal.  From time to
+ * time, the index is written as a compact snapshot into a SQLite "cache
+ * catalog" and the journal is truncated.  On start, the snapshot is loaded
+ * and the journal is replayed.
+ *
+ * When the cache grows above a high watermark, an eviction thread frees
+ * space down to the cleanup threshold ahead of demand.  A pool of threads
+ * unlinks the evicted files or removes them from the pack store.
+ *
+ * If the cache is striped over several directories, every stripe gets an
+ * equal share of the limit and of the watermarks.  Objects are accounted to
+ * their home stripe.
+ *
+ * Commands reach the cache manager through a ring buffer in memory that is
+ * shared with all cvmfs2 instances in case of the shared cache manager.
+ * Small replies are passed back through reply slots in the same memory,
+ * listings through return pipes.
  *
  * We might choose to not manage the local cache.  This is indicated
  * by limit == 0 and everything succeeds in that case.
@@ -21,7 +38,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/dir.h>
-#include <sys/wait.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -32,13 +50,20 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
 
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 #include <set>
+#include <algorithm>
+
+#include <google/dense_hash_map>
 
 #include "platform.h"
+#include "atomic.h"
 #include "logging.h"
 #include "duplex_sqlite3.h"
 #include "hash.h"
@@ -46,6 +71,9 @@
 #include "smalloc.h"
 #include "cvmfs.h"
 #include "monitor.h"
+#include "pack_store.h"
+#include "stripes.h"
+#include "MurmurHash2.h"
 
 using namespace std;  // NOLINT
 
@@ -74,15 +102,80 @@ enum CommandType {
   kListCatalogs,
   kStatus,
   kLimits,
+  kEvictionStats,
 };
 
 struct LruCommand {
   CommandType command_type;
   uint64_t size;
-  int return_pipe;  // For cleanup, listing, and reservations
+  int return_pipe;  // For listings and if there is no free reply slot
+  int return_slot;  // For cleanup, reservations, and status
+  unsigned char digest[hash::kMaxDigestSize];
+  uint16_t path_length;  // Maximum kRingSlotSize-sizeof(LruCommand) in order
+                         // to fit into a single ring slot
+};
+
+/**
+ * Entry of the in-memory LRU index.  Entries are chained in access order,
+ * the least recently used entry comes first.
+ */
+struct LruEntry {
+  hash::Any hash;
+  uint64_t size;
+  uint64_t acseq;
+  string path;
+  FileTypes type;
+  bool pinned;
+  unsigned stripe;
+  LruEntry *prev;
+  LruEntry *next;
+};
+
+struct hash_any {
+  size_t operator() (const hash::Any &hash) const {
+#ifdef __x86_64__
+    return MurmurHash64A(hash.digest, hash::kDigestSizes[hash::kSha1],
+                         0x9ce603115bba659bLLU);
+#else
+    return MurmurHash2(hash.digest, hash::kDigestSizes[hash::kSha1],
+                       0x07387a4f);
+#endif
+  }
+};
+typedef google::dense_hash_map<hash::Any, LruEntry *, hash_any> LruIndex;
+
+/**
+ * Journal records carry absolute values (size, sequence number), so that
+ * replaying a record that is already part of the snapshot does no harm.
+ * Inserts are followed by path_length bytes of path.
+ */
+struct JournalRecord {
+  CommandType command_type;  // kInsert, kPin, kTouch, or kRemove
   unsigned char digest[hash::kMaxDigestSize];
-  uint16_t path_length;  // Maximum 512-sizeof(LruCommand) in order to guarantee
-                         // atomic pipe operations
+  uint64_t size;
+  uint64_t acseq;
+  uint16_t path_length;
+};
+
+/**
+ * A data chunk found in the cache directory while rebuilding the cache
+ * catalog.
+ */
+struct RebuildEntry {
+  hash::Any hash;
+  uint64_t size;
+  int64_t atime;
+};
+
+/**
+ * Scan threads take the next of the 256 cache subdirectories from next_dir.
+ * With a striped cache, the subdirectories of stripe n are 256*n to
+ * 256*n + 255.
+ */
+struct RebuildScan {
+  atomic_int32 next_dir;
+  atomic_int32 failed;
+  vector<RebuildEntry> entries[256 * stripes::kMaxStripes];
 };
 
 /**
@@ -90,10 +183,91 @@ struct LruCommand {
  */
 const unsigned kSqliteMemPerThread = 2*1024*1024;
 const unsigned kCommandBufferSize = 32;
-const unsigned kMaxCvmfsPath = 512-sizeof(LruCommand);
+const unsigned kRingSize = 512;  /**< Number of command slots, power of 2 */
+const unsigned kRingSlotSize = 512;
+const unsigned kMaxCvmfsPath = kRingSlotSize-sizeof(LruCommand);
+const unsigned kNumReplySlots = 64;
+const unsigned kMaxReplySize = 128;
+/**
+ * The cache manager sleeps at most so long before it checks if the shared
+ * cache manager still has clients.
+ */
+const unsigned kRingWaitMs = 1000;
+const unsigned kSpaceWaitMs = 100;
+/**
+ * A command slot that is claimed but not published for so many seconds
+ * belongs to a client that died in between.  The cache manager skips it.
+ */
+const time_t kStaleSlotTimeout = 10;
+/**
+ * Clients give up on a reply after so many seconds, e.g. if the shared cache
+ * manager died.  The reply is zeroed, which reads as a failure.
+ */
+const time_t kReplyTimeout = 60;
+const int32_t kRingMagic = 0x4c525531;
+
+enum ReplyState {
+  kReplyFree = 0,
+  kReplyPending,
+  kReplyReady,
+  kReplyAbandoned,  /**< Client timed out, freed by the cache manager */
+};
+
+/**
+ * The sequence number of a slot is its position in the ring plus one when
+ * the slot is published and its position plus kRingSize when it is free for
+ * the next round.  A skipped slot goes straight to the next round, so that
+ * its late producer fails to publish it.
+ */
+struct RingSlot {
+  atomic_int32 seq;
+  unsigned char payload[kRingSlotSize];
+};
+
+struct ReplySlot {
+  atomic_int32 state;  /**< One of ReplyState, futex of the waiting client */
+  unsigned char data[kMaxReplySize];
+};
+
+/**
+ * Bounded multi-producer, single-consumer queue of commands.  Producers claim
+ * a position by a compare-and-swap on the tail and publish the slot by
+ * advancing its sequence number.  The cache manager sleeps on the signal futex
+ * when the ring is empty, producers sleep on the space futex when it is full.
+ * Fields written by producers and by the consumer are kept on separate cache
+ * lines.
+ */
+struct CommandRing {
+  int32_t magic;
+  uint32_t size;
+  atomic_int32 terminate;
+  char pad0[52];
+  atomic_int32 tail;
+  atomic_int32 signal;
+  atomic_int32 producers_waiting;
+  atomic_int32 next_reply;
+  char pad1[48];
+  atomic_int32 head;
+  atomic_int32 space;
+  atomic_int32 consumer_waiting;
+  char pad2[52];
+  ReplySlot replies[kNumReplySlots];
+  RingSlot slots[kRingSize];
+};
+/**
+ * Write a new snapshot after so many journal records.
+ */
+const unsigned kJournalMaxRecords = 128*1024;
+const unsigned kEvictBatchSize = 512;  /**< Evicted entries per locked round */
+const unsigned kNumUnlinkers = 4;
+const unsigned kUnlinkBatchSize = 64;
+const unsigned kNumRebuildThreads = 8;
+const int kAllStripes = -1;  /**< Eviction target: the entire cache */
+const int kNoStripe = -2;
 
 pthread_t thread_lru_;
-int pipe_lru_[2];
+int pipe_lru_[2];  /**< FIFO of the shared cache manager, tracks its clients */
+CommandRing *ring_ = NULL;
 bool shared_;
 bool spawned_;
 map<hash::Any, uint64_t> *pinned_chunks_ = NULL;
@@ -105,22 +279,84 @@ uint64_t pinned_;  /**< Size of pinned files (file catalogs). */
 uint64_t cleanup_threshold_;  /**< When cleaning up, stop when size is below
   cleanup_threshold. This way, the current working set stays in cache. */
 uint64_t gauge_;  /**< Current size of cache. */
+unsigned num_stripes_;
+uint64_t stripe_gauge_[stripes::kMaxStripes];
+uint64_t stripe_limit_[stripes::kMaxStripes];
+uint64_t stripe_cleanup_[stripes::kMaxStripes];
+uint64_t stripe_high_watermark_[stripes::kMaxStripes];
 uint64_t seq_;  /**< Current access sequence number.  Gets increased on every
                      access/insert operation. */
 string *cache_dir_ = NULL;
 
-sqlite3 *db_ = NULL;
-sqlite3_stmt *stmt_touch_ = NULL;
-sqlite3_stmt *stmt_unpin_ = NULL;
-sqlite3_stmt *stmt_new_ = NULL;
-sqlite3_stmt *stmt_lru_ = NULL;
-sqlite3_stmt *stmt_size_ = NULL;
-sqlite3_stmt *stmt_rm_ = NULL;
-sqlite3_stmt *stmt_list_ = NULL;
-sqlite3_stmt *stmt_list_pinned_ = NULL;  /**< Loaded catalogs are pinned. */
-sqlite3_stmt *stmt_list_catalogs_ = NULL;
+sqlite3 *db_ = NULL;  /**< Holds the snapshots of the LRU index */
+
+LruIndex *lru_index_ = NULL;
+LruEntry *lru_list_ = NULL;  /**< Sentinel of the list in access order */
+FILE *journal_ = NULL;
+unsigned num_journal_records_;
+uint64_t checkpoint_;  /**< Number of the last snapshot */
+
+/**
+ * Background snapshot: a copy of the index and the journal offset and record
+ * count at the time of the copy.
+ */
+bool checkpoint_spawned_ = false;
+pthread_t thread_checkpoint_;
+vector<LruEntry> *snapshot_ = NULL;
+long checkpoint_cut_;
+unsigned checkpoint_cut_records_;
+atomic_int32 checkpoint_done_;
+bool checkpoint_result_;
+unsigned checkpoint_retry_;  /**< Journal records before the next attempt */
+
+/**
+ * Protects the index, the gauges, the pinned chunks, and the journal between
+ * the command server and the eviction thread.
+ */
+pthread_mutex_t lock_index_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t high_watermark_;  /**< Background eviction starts above */
+EvictionStatistics eviction_stats_;
+
+bool eviction_spawned_ = false;
+pthread_t thread_evict_;
+pthread_mutex_t lock_evict_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_evict_ = PTHREAD_COND_INITIALIZER;
+bool evict_requested_;
+bool evict_terminate_;
+
+pthread_t threads_unlink_[kNumUnlinkers];
+pthread_mutex_t lock_unlink_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_unlink_ = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cond_unlink_idle_ = PTHREAD_COND_INITIALIZER;
+deque<hash::Any> *unlink_queue_ = NULL;
+unsigned num_unlinking_;  /**< Taken from the queue but not yet unlinked */
+bool unlink_terminate_;
+
+bool rebuild_background_ = false;
+bool rebuild_pending_ = false;  /**< Rebuild starts with the cache manager */
+bool rebuild_spawned_ = false;
+pthread_t thread_rebuild_;
+atomic_int32 rebuild_terminate_;
 
  
+/**
+ * Background eviction starts halfway between the cleanup threshold and the
+ * limit.  Stripes get equal shares.
+ */
+static void SetWatermarks() {
+  high_watermark_ = cleanup_threshold_ + (limit_ - cleanup_threshold_) / 2;
+  eviction_stats_.high_watermark = high_watermark_;
+  eviction_stats_.low_watermark = cleanup_threshold_;
+
+  num_stripes_ = stripes::GetNumStripes();
+  for (unsigned i = 0; i < num_stripes_; ++i) {
+    stripe_limit_[i] = limit_ / num_stripes_;
+    stripe_cleanup_[i] = cleanup_threshold_ / num_stripes_;
+    stripe_high_watermark_[i] = high_watermark_ / num_stripes_;
+  }
+}
+
+
 static void MakeReturnPipe(int pipe[2]) {
   if (!shared_) {
     MakePipe(pipe);
@@ -173,169 +409,1179 @@ static void CloseReturnPipe(int pipe[2]) {
     ClosePipe(pipe);
   }
 }
+
+
+static void InitRing(CommandRing *ring) {
+  for (unsigned i = 0; i < kRingSize; ++i)
+    ring->slots[i].seq = i;
+  ring->size = sizeof(CommandRing);
+  __sync_synchronize();
+  ring->magic = kRingMagic;
+}
+
+
+/**
+ * Command ring of a cache manager running as a thread of this process.
+ */
+static bool CreateRing() {
+  void *mem = mmap(NULL, sizeof(CommandRing), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to allocate command ring (%d)",
+             errno);
+    return false;
+  }
+  ring_ = static_cast<CommandRing *>(mem);
+  InitRing(ring_);
+  return true;
+}
+
+
+/**
+ * The shared cache manager creates its command ring as a file in the cache
+ * directory.  A left-over file from a previous cache manager is replaced, its
+ * clients keep their mapping of the old file.
+ */
+static bool CreateSharedRing(const string &path) {
+  unlink(path.c_str());
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to create %s (%d)",
+             path.c_str(), errno);
+    return false;
+  }
+  if (ftruncate(fd, sizeof(CommandRing)) != 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to resize %s (%d)",
+             path.c_str(), errno);
+    close(fd);
+    return false;
+  }
+  void *mem = mmap(NULL, sizeof(CommandRing), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to map %s (%d)",
+             path.c_str(), errno);
+    return false;
+  }
+  ring_ = static_cast<CommandRing *>(mem);
+  InitRing(ring_);
+  return true;
+}
+
+
+/**
+ * Clients of the shared cache manager map the ring once they are connected
+ * to its FIFO.
+ */
+static bool AttachRing(const string &path) {
+  const int fd = open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to open %s (%d)",
+             path.c_str(), errno);
+    return false;
+  }
+  platform_stat64 info;
+  if ((platform_fstat(fd, &info) != 0) ||
+      (static_cast<uint64_t>(info.st_size) != sizeof(CommandRing)))
+  {
+    LogCvmfs(kLogQuota, kLogDebug, "command ring %s has a wrong size",
+             path.c_str());
+    close(fd);
+    return false;
+  }
+  void *mem = mmap(NULL, sizeof(CommandRing), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to map %s (%d)",
+             path.c_str(), errno);
+    return false;
+  }
+  ring_ = static_cast<CommandRing *>(mem);
+  if ((ring_->magic != kRingMagic) || (ring_->size != sizeof(CommandRing))) {
+    LogCvmfs(kLogQuota, kLogDebug, "incompatible command ring in %s",
+             path.c_str());
+    munmap(ring_, sizeof(CommandRing));
+    ring_ = NULL;
+    return false;
+  }
+  return true;
+}
+
+
+static void UnmapRing() {
+  if (ring_ != NULL)
+    munmap(ring_, sizeof(CommandRing));
+  ring_ = NULL;
+}
+
+
+/**
+ * Wakes up the cache manager, so that it notices new commands or departed
+ * clients.
+ */
+static void SignalCommandServer() {
+  atomic_inc32(&ring_->signal);
+  if (atomic_read32(&ring_->consumer_waiting))
+    platform_futex_wake(&ring_->signal, 1);
+}
+
+
+/**
+ * Replaces the write into the command pipe.  Blocks while the ring is full.
+ * The path of inserts and pins follows the command in memory.
+ */
+static void SendCommand(const void *command, const unsigned size) {
+  assert(size <= kRingSlotSize);
+  RingSlot *slot;
+  uint32_t pos;
+  do {
+    while (true) {
+      pos = atomic_read32(&ring_->tail);
+      slot = &ring_->slots[pos & (kRingSize-1)];
+      const int32_t diff = int32_t(atomic_read32(&slot->seq) - pos);
+      if (diff == 0) {
+        if (atomic_cas32(&ring_->tail, pos, pos + 1))
+          break;
+      } else if (diff < 0) {
+        // Ring is full, wait until the cache manager has consumed a slot
+        const int32_t space = atomic_read32(&ring_->space);
+        atomic_inc32(&ring_->producers_waiting);
+        if (int32_t(atomic_read32(&slot->seq) - pos) < 0)
+          platform_futex_wait(&ring_->space, space, kSpaceWaitMs);
+        atomic_dec32(&ring_->producers_waiting);
+      }
+    }
+    memcpy(slot->payload, command, size);
+    // Fails if the cache manager skipped the slot meanwhile, sends again
+  } while (!atomic_cas32(&slot->seq, pos, pos + 1));  // Publishes the slot
+  SignalCommandServer();
+}
+
+
+/**
+ * The in-process cache manager stops when told so by Fini(), the shared
+ * cache manager stops when the last client closed the FIFO.
+ */
+static bool ClientsGone() {
+  if (!shared_)
+    return atomic_read32(&ring_->terminate) != 0;
+  struct pollfd fifo;
+  fifo.fd = pipe_lru_[0];
+  fifo.events = POLLIN;
+  fifo.revents = 0;
+  return (poll(&fifo, 1, 0) == 1) && (fifo.revents & POLLHUP);
+}
+
+
+/**
+ * Moves the head past a consumed or skipped slot and wakes up producers that
+ * wait for space.
+ */
+static void AdvanceHead(const uint32_t pos) {
+  ring_->head = pos + 1;
+  atomic_inc32(&ring_->space);
+  if (atomic_read32(&ring_->producers_waiting))
+    platform_futex_wake(&ring_->space, INT32_MAX);
+}
+
+
+/**
+ * Takes the next command from the ring, sleeps while the ring is empty.
+ * Inserts and pins come with a path that is copied into path.  A slot that
+ * stays claimed but unpublished for kStaleSlotTimeout is skipped.
+ *
+ * \return False if the ring is drained and there are no clients left
+ */
+static bool ReceiveCommand(LruCommand *command, char *path) {
+  uint32_t pos = ring_->head;
+  RingSlot *slot = &ring_->slots[pos & (kRingSize-1)];
+  time_t stalled_since = 0;
+  while (int32_t(atomic_read32(&slot->seq) - (pos + 1)) < 0) {
+    const int32_t signal = atomic_read32(&ring_->signal);
+    atomic_inc32(&ring_->consumer_waiting);
+    // Commands are published before a client disappears
+    const bool clients_gone = ClientsGone();
+    if (int32_t(atomic_read32(&slot->seq) - (pos + 1)) >= 0) {
+      atomic_dec32(&ring_->consumer_waiting);
+      break;
+    }
+    if (clients_gone) {
+      atomic_dec32(&ring_->consumer_waiting);
+      return false;
+    }
+    platform_futex_wait(&ring_->signal, signal, kRingWaitMs);
+    atomic_dec32(&ring_->consumer_waiting);
+
+    if (int32_t(atomic_read32(&ring_->tail) - pos) <= 0) {
+      stalled_since = 0;  // Ring is empty
+      continue;
+    }
+    const time_t now = time(NULL);
+    if (stalled_since == 0) {
+      stalled_since = now;
+    } else if ((now - stalled_since >= kStaleSlotTimeout) &&
+               atomic_cas32(&slot->seq, pos, pos + kRingSize))
+    {
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+               "skipping command slot %u of a stalled client", pos);
+      AdvanceHead(pos);
+      pos++;
+      slot = &ring_->slots[pos & (kRingSize-1)];
+      stalled_since = 0;
+    }
+  }
+
+  memcpy(command, slot->payload, sizeof(LruCommand));
+  if ((command->command_type == kInsert) || (command->command_type == kPin))
+    memcpy(path, slot->payload + sizeof(LruCommand), command->path_length);
+  atomic_xadd32(&slot->seq, kRingSize - 1);  // Frees the slot for producers
+  AdvanceHead(pos);
+  return true;
+}
+
+
+/**
+ * Reply slots are shared by all clients.  If a client dies while waiting, its
+ * slot is lost, so there is a fallback to return pipes.  Slots of clients that
+ * timed out are freed by the cache manager once it replies.
+ */
+static int AcquireReplySlot() {
+  const unsigned start = atomic_xadd32(&ring_->next_reply, 1);
+  for (unsigned i = 0; i < kNumReplySlots; ++i) {
+    const unsigned idx = (start + i) % kNumReplySlots;
+    if (atomic_cas32(&ring_->replies[idx].state, kReplyFree, kReplyPending))
+      return idx;
+  }
+  return -1;
+}
+
+
+/**
+ * Sends a command with a small, fixed-size reply and waits for the reply at
+ * most kReplyTimeout seconds.
+ */
+static void CallCommandServer(LruCommand *command, void *reply,
+                              const unsigned reply_size)
+{
+  assert(reply_size <= kMaxReplySize);
+  int pipe_reply[2];
+  command->return_slot = AcquireReplySlot();
+  if (command->return_slot < 0) {
+    MakeReturnPipe(pipe_reply);
+    command->return_pipe = pipe_reply[1];
+  }
+  SendCommand(command, sizeof(*command));
+
+  if (command->return_slot < 0) {
+    ReadHalfPipe(pipe_reply[0], reply, reply_size);
+    CloseReturnPipe(pipe_reply);
+    return;
+  }
+  ReplySlot *slot = &ring_->replies[command->return_slot];
+  const time_t deadline = time(NULL) + kReplyTimeout;
+  while (atomic_read32(&slot->state) != kReplyReady) {
+    if ((time(NULL) >= deadline) &&
+        atomic_cas32(&slot->state, kReplyPending, kReplyAbandoned))
+    {
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+               "cache manager did not reply to command %d",
+               command->command_type);
+      memset(reply, 0, reply_size);
+      return;
+    }
+    platform_futex_wait(&slot->state, kReplyPending, kRingWaitMs);
+  }
+  memcpy(reply, slot->data, reply_size);
+  atomic_cas32(&slot->state, kReplyReady, kReplyFree);
+}
+
+
+/**
+ * Counterpart of CallCommandServer() in the cache manager.
+ */
+static void SendReply(const LruCommand &command, const void *reply,
+                      const unsigned reply_size)
+{
+  if (command.return_slot < 0) {
+    const int return_pipe = BindReturnPipe(command.return_pipe);
+    WritePipe(return_pipe, reply, reply_size);
+    UnbindReturnPipe(return_pipe);
+    return;
+  }
+  assert(command.return_slot < static_cast<int>(kNumReplySlots));
+  ReplySlot *slot = &ring_->replies[command.return_slot];
+  memcpy(slot->data, reply, reply_size);
+  if (!atomic_cas32(&slot->state, kReplyPending, kReplyReady)) {
+    // Nobody waits for the reply anymore
+    atomic_cas32(&slot->state, kReplyAbandoned, kReplyFree);
+    return;
+  }
+  platform_futex_wake(&slot->state, 1);
+}
   
   
-static bool DoCleanup(const uint64_t leave_size) {
-  if ((limit_ == 0) || (gauge_ <= leave_size))
+static LruEntry *LookupEntry(const hash::Any &hash) {
+  LruIndex::const_iterator iter = lru_index_->find(hash);
+  if (iter == lru_index_->end())
+    return NULL;
+  return iter->second;
+}
+
+
+static void LinkEntry(LruEntry *entry) {
+  entry->prev = lru_list_->prev;
+  entry->next = lru_list_;
+  lru_list_->prev->next = entry;
+  lru_list_->prev = entry;
+}
+
+
+/**
+ * Inserts as least recently used entry.
+ */
+static void LinkEntryFront(LruEntry *entry) {
+  entry->prev = lru_list_;
+  entry->next = lru_list_->next;
+  lru_list_->next->prev = entry;
+  lru_list_->next = entry;
+}
+
+
+static void UnlinkEntry(LruEntry *entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+}
+
+
+static void AppendJournal(const CommandType command_type,
+                          const LruEntry *entry)
+{
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.command_type = command_type;
+  memcpy(record.digest, entry->hash.digest, entry->hash.GetDigestSize());
+  record.size = entry->size;
+  record.acseq = entry->acseq;
+  if ((command_type == kInsert) || (command_type == kPin))
+    record.path_length = entry->path.length();
+
+  size_t written = fwrite(&record, sizeof(record), 1, journal_);
+  if (record.path_length > 0)
+    written += fwrite(entry->path.data(), record.path_length, 1, journal_);
+  if (written != ((record.path_length > 0) ? 2 : 1)) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to write LRU journal (%d)", errno);
+  }
+  num_journal_records_++;
+}
+
+
+static void AddToGauge(const LruEntry *entry) {
+  gauge_ += entry->size;
+  stripe_gauge_[entry->stripe] += entry->size;
+}
+
+
+static void SubtractFromGauge(const LruEntry *entry) {
+  gauge_ -= entry->size;
+  stripe_gauge_[entry->stripe] -= entry->size;
+}
+
+
+/**
+ * File catalogs are always in the cache directory itself.
+ */
+static unsigned GetHomeStripe(const hash::Any &hash, const uint64_t size,
+                              const FileTypes type)
+{
+  return (type == kFileCatalog) ? 0 : stripes::Locate(hash, size);
+}
+
+
+/**
+ * Inserts or replaces an entry.  The entry becomes the most recently used one.
+ */
+static void IndexInsert(const hash::Any &hash, const uint64_t size,
+                        const uint64_t acseq, const string &path,
+                        const FileTypes type, const bool pinned,
+                        const bool journal)
+{
+  LruEntry *entry = LookupEntry(hash);
+  if (entry) {
+    UnlinkEntry(entry);
+    SubtractFromGauge(entry);
+  } else {
+    entry = new LruEntry();
+    entry->hash = hash;
+    (*lru_index_)[hash] = entry;
+  }
+  entry->size = size;
+  entry->acseq = acseq;
+  entry->path = path;
+  entry->type = type;
+  entry->pinned = pinned;
+  entry->stripe = GetHomeStripe(hash, size, type);
+  LinkEntry(entry);
+  AddToGauge(entry);
+
+  if (journal)
+    AppendJournal((type == kFileCatalog) ? kPin : kInsert, entry);
+}
+
+
+static void IndexTouch(LruEntry *entry, const uint64_t acseq,
+                       const bool journal)
+{
+  entry->acseq = acseq;
+  UnlinkEntry(entry);
+  LinkEntry(entry);
+  if (journal)
+    AppendJournal(kTouch, entry);
+}
+
+
+static void IndexRemove(LruEntry *entry, const bool journal) {
+  if (journal)
+    AppendJournal(kRemove, entry);
+  UnlinkEntry(entry);
+  lru_index_->erase(entry->hash);
+  SubtractFromGauge(entry);
+  delete entry;
+}
+
+
+static void SetIndexKeys(LruIndex *index) {
+  hash::Any empty_key(hash::kSha1);
+  hash::Any deleted_key(hash::kSha1);
+  memset(deleted_key.digest, 0xff, sizeof(deleted_key.digest));
+  index->set_empty_key(empty_key);
+  index->set_deleted_key(deleted_key);
+}
+
+
+static void CreateIndex() {
+  lru_index_ = new LruIndex();
+  SetIndexKeys(lru_index_);
+  lru_list_ = new LruEntry();
+  lru_list_->prev = lru_list_->next = lru_list_;
+  gauge_ = 0;
+  memset(stripe_gauge_, 0, sizeof(stripe_gauge_));
+  seq_ = 0;
+}
+
+
+static void DestroyIndex() {
+  if (lru_list_ == NULL)
+    return;
+  LruEntry *entry = lru_list_->next;
+  while (entry != lru_list_) {
+    LruEntry *next = entry->next;
+    delete entry;
+    entry = next;
+  }
+  delete lru_list_;
+  lru_list_ = NULL;
+  delete lru_index_;
+  lru_index_ = NULL;
+}
+
+
+/**
+ * Loads the index from the cache catalog.
+ */
+static bool LoadSnapshot() {
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db_, "SELECT sha1, size, acseq, path, type "
+                     "FROM cache_catalog ORDER BY acseq;", -1, &stmt, NULL);
+  int retval;
+  while ((retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const string hash_str = string(reinterpret_cast<const char *>(
+                                   sqlite3_column_text(stmt, 0)));
+    if (hash_str.length() < 2*hash::kDigestSizes[hash::kSha1]) {
+      LogCvmfs(kLogQuota, kLogDebug, "skipping invalid entry %s",
+               hash_str.c_str());
+      continue;
+    }
+    const hash::Any hash(hash::kSha1, hash::HexPtr(hash_str));
+    string path;
+    if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+      path = string(reinterpret_cast<const char *>(
+                    sqlite3_column_text(stmt, 3)));
+    }
+    const uint64_t acseq = sqlite3_column_int64(stmt, 2);
+    IndexInsert(hash, sqlite3_column_int64(stmt, 1), acseq, path,
+                static_cast<FileTypes>(sqlite3_column_int64(stmt, 4)),
+                false, false);
+    if (acseq >= seq_)
+      seq_ = acseq + 1;
+  }
+  sqlite3_finalize(stmt);
+  if (retval != SQLITE_DONE) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not load cache catalog (%d)",
+             retval);
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Opens the journal for appending.  The journal starts with the number of the
+ * snapshot it belongs to.  A journal of another snapshot, e.g. if the cache
+ * catalog was removed, is not valid.
+ */
+static bool OpenJournal(bool *valid, bool *empty) {
+  const string journal_path = (*cache_dir_) + "/lru_journal";
+  journal_ = fopen(journal_path.c_str(), "a+");
+  if (journal_ == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not open LRU journal (%d)", errno);
+    return false;
+  }
+  num_journal_records_ = 0;
+  checkpoint_retry_ = 0;
+
+  rewind(journal_);
+  uint64_t checkpoint;
+  // The journal of the previous snapshot is still valid if the cache manager
+  // stopped after a background snapshot was committed but before the journal
+  // was cut.  Its records are a superset of the ones missing in the snapshot,
+  // replaying records that are part of the snapshot does no harm.
+  *valid = (fread(&checkpoint, sizeof(checkpoint), 1, journal_) == 1) &&
+           (checkpoint_ > 0) &&
+           ((checkpoint == checkpoint_) || (checkpoint + 1 == checkpoint_));
+  fseek(journal_, 0, SEEK_END);
+  *empty = ftell(journal_) <= static_cast<long>(sizeof(checkpoint));
+  LogCvmfs(kLogQuota, kLogDebug, "LRU journal of snapshot %"PRIu64" is %s",
+           checkpoint_, *valid ? "valid" : "invalid");
+  return true;
+}
+
+
+/**
+ * Applies the records left by a previous run to the index.  A truncated
+ * record at the end stems from a crash and is ignored.
+ */
+static void ReplayJournal() {
+  fseek(journal_, sizeof(checkpoint_), SEEK_SET);
+  JournalRecord record;
+  char path[kMaxCvmfsPath];
+  while (fread(&record, sizeof(record), 1, journal_) == 1) {
+    if ((record.path_length > kMaxCvmfsPath) ||
+        ((record.path_length > 0) &&
+         (fread(path, record.path_length, 1, journal_) != 1)))
+    {
+      break;
+    }
+    const hash::Any hash(hash::kSha1, record.digest, sizeof(record.digest));
+    LruEntry *entry = LookupEntry(hash);
+    switch (record.command_type) {
+      case kInsert:
+      case kPin:
+        IndexInsert(hash, record.size, record.acseq,
+                    string(path, record.path_length),
+                    (record.command_type == kPin) ? kFileCatalog : kFileRegular,
+                    false, false);
+        break;
+      case kTouch:
+        if (entry) IndexTouch(entry, record.acseq, false);
+        break;
+      case kRemove:
+        if (entry) IndexRemove(entry, false);
+        break;
+      default:
+        LogCvmfs(kLogQuota, kLogDebug, "invalid journal record %d",
+                 record.command_type);
+        continue;
+    }
+    if (record.acseq >= seq_)
+      seq_ = record.acseq + 1;
+    num_journal_records_++;
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "replayed %u journal records",
+           num_journal_records_);
+}
+
+
+/**
+ * Writes entries as snapshot number checkpoint into the cache catalog.  Only
+ * touches the cache catalog, so that it can run in the background.
+ */
+static bool WriteSnapshot(const vector<const LruEntry *> &entries,
+                          const uint64_t checkpoint)
+{
+  int retval = sqlite3_exec(db_, "BEGIN; DELETE FROM cache_catalog;",
+                            NULL, NULL, NULL);
+  if (retval != SQLITE_OK) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not clear cache catalog (%d)",
+             retval);
+    sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+    return false;
+  }
+
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db_,
+                     "INSERT INTO cache_catalog "
+                     "(sha1, size, acseq, path, type, pinned) "
+                     "VALUES (:sha1, :s, :seq, :p, :t, 0);", -1, &stmt, NULL);
+  for (unsigned i = 0; i < entries.size(); ++i) {
+    const LruEntry *entry = entries[i];
+    const string hash_str = entry->hash.ToString();
+    sqlite3_bind_text(stmt, 1, &hash_str[0], hash_str.length(),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, entry->size);
+    sqlite3_bind_int64(stmt, 3, entry->acseq);
+    sqlite3_bind_text(stmt, 4, entry->path.data(), entry->path.length(),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, entry->type);
+    retval = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (retval != SQLITE_DONE) {
+      LogCvmfs(kLogQuota, kLogDebug, "could not write snapshot (%d)", retval);
+      sqlite3_finalize(stmt);
+      sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+      return false;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  const string sql = "INSERT OR REPLACE INTO properties (key, value) "
+    "VALUES ('checkpoint', '" + StringifyInt(checkpoint) + "'); COMMIT;";
+  retval = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
+  if (retval != SQLITE_OK) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not commit snapshot (%d)", retval);
+    sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Starts a new journal for snapshot checkpoint_ that keeps the records from
+ * offset cut on, i.e. the ones that are not part of the snapshot.  The new
+ * journal replaces the old one by a rename, so that there is always a valid
+ * journal.
+ */
+static bool ResetJournal(const long cut) {
+  const string journal_path = (*cache_dir_) + "/lru_journal";
+  const string tmp_path = journal_path + ".tmp";
+  FILE *new_journal = fopen(tmp_path.c_str(), "w+");
+  if (new_journal == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not reset LRU journal (%d)", errno);
+    return false;
+  }
+  bool result =
+    fwrite(&checkpoint_, sizeof(checkpoint_), 1, new_journal) == 1;
+  fflush(journal_);
+  fseek(journal_, cut, SEEK_SET);
+  char buffer[64*1024];
+  size_t nbytes;
+  while (result && ((nbytes = fread(buffer, 1, sizeof(buffer), journal_)) > 0))
+    result = fwrite(buffer, 1, nbytes, new_journal) == nbytes;
+  result = result && (fflush(new_journal) == 0) &&
+           (rename(tmp_path.c_str(), journal_path.c_str()) == 0);
+  if (!result) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not reset LRU journal (%d)", errno);
+    fclose(new_journal);
+    unlink(tmp_path.c_str());
+    fseek(journal_, 0, SEEK_END);
+    return false;
+  }
+  fclose(journal_);
+  journal_ = new_journal;
+  return true;
+}
+
+
+/**
+ * Waits for a running background snapshot.  If it is committed, the journal
+ * starts over with the records written in the meantime.  Needs to be called
+ * with lock_index_ held.
+ */
+static void FinishCheckpoint() {
+  if (!checkpoint_spawned_)
+    return;
+  pthread_join(thread_checkpoint_, NULL);
+  checkpoint_spawned_ = false;
+  delete snapshot_;
+  snapshot_ = NULL;
+  if (!checkpoint_result_) {
+    checkpoint_retry_ = num_journal_records_ + kJournalMaxRecords;
+    return;
+  }
+
+  checkpoint_++;
+  checkpoint_retry_ = 0;
+  if (ResetJournal(checkpoint_cut_))
+    num_journal_records_ -= checkpoint_cut_records_;
+  LogCvmfs(kLogQuota, kLogDebug, "LRU snapshot %"PRIu64" committed, %u "
+           "journal records left", checkpoint_, num_journal_records_);
+}
+
+
+static void *MainCheckpoint(void *data __attribute__((unused))) {
+  vector<const LruEntry *> entries;
+  entries.reserve(snapshot_->size());
+  for (unsigned i = 0; i < snapshot_->size(); ++i)
+    entries.push_back(&(*snapshot_)[i]);
+  checkpoint_result_ = WriteSnapshot(entries, checkpoint_ + 1);
+  atomic_inc32(&checkpoint_done_);
+  return NULL;
+}
+
+
+/**
+ * Writes the snapshot of a copy of the index in a background thread.  The
+ * journal keeps growing meanwhile and is only cut by FinishCheckpoint() once
+ * the snapshot is committed.  Needs to be called with lock_index_ held.
+ */
+static void StartCheckpoint() {
+  LogCvmfs(kLogQuota, kLogDebug, "writing LRU snapshot in the background "
+           "(%u journal records)", num_journal_records_);
+  fflush(journal_);
+  checkpoint_cut_ = ftell(journal_);
+  checkpoint_cut_records_ = num_journal_records_;
+  snapshot_ = new vector<LruEntry>();
+  snapshot_->reserve(lru_index_->size());
+  for (LruEntry *entry = lru_list_->next; entry != lru_list_;
+       entry = entry->next)
+  {
+    snapshot_->push_back(*entry);
+  }
+  atomic_init32(&checkpoint_done_);
+  checkpoint_result_ = false;
+  if (pthread_create(&thread_checkpoint_, NULL, MainCheckpoint, NULL) != 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not start snapshot thread");
+    delete snapshot_;
+    snapshot_ = NULL;
+    return;
+  }
+  checkpoint_spawned_ = true;
+}
+
+
+/**
+ * Writes the index as a compact snapshot into the cache catalog and starts
+ * a new journal.  Waits for a background snapshot first.
+ */
+static bool Checkpoint() {
+  FinishCheckpoint();
+  LogCvmfs(kLogQuota, kLogDebug, "writing LRU snapshot (%u journal records)",
+           num_journal_records_);
+  vector<const LruEntry *> entries;
+  entries.reserve(lru_index_->size());
+  for (LruEntry *entry = lru_list_->next; entry != lru_list_;
+       entry = entry->next)
+  {
+    entries.push_back(entry);
+  }
+  if (!WriteSnapshot(entries, checkpoint_ + 1))
+    return false;
+  checkpoint_++;
+
+  fflush(journal_);
+  if (!ResetJournal(ftell(journal_)))
+    return false;
+  num_journal_records_ = 0;
+  checkpoint_retry_ = 0;
+  return true;
+}
+
+
+/**
+ * Makes journal records visible to a restarted cache manager.  Writes a new
+ * snapshot in the background when the journal has grown large.
+ */
+static void SyncJournal() {
+  fflush(journal_);
+  if (checkpoint_spawned_ && atomic_read32(&checkpoint_done_))
+    FinishCheckpoint();
+  if (!checkpoint_spawned_ &&
+      (num_journal_records_ >= max(kJournalMaxRecords, checkpoint_retry_)))
+  {
+    StartCheckpoint();
+  }
+}
+
+
+static uint64_t GetGauge(const int stripe) {
+  return (stripe == kAllStripes) ? gauge_ : stripe_gauge_[stripe];
+}
+
+
+/**
+ * Removes least recently used, unpinned entries of a stripe (or of all
+ * stripes) from the index until the stripe is below leave_size or
+ * max_entries are removed.  The removed objects are appended to trash.
+ * Needs to be called with lock_index_ held.
+ */
+static void EvictEntries(const int stripe, const uint64_t leave_size,
+                         const unsigned max_entries, vector<hash::Any> *trash)
+{
+  unsigned num_evicted = 0;
+  LruEntry *entry = lru_list_->next;
+  while ((GetGauge(stripe) > leave_size) && (entry != lru_list_) &&
+         (num_evicted < max_entries))
+  {
+    LruEntry *next = entry->next;
+    if (entry->pinned ||
+        ((stripe != kAllStripes) && (entry->stripe != unsigned(stripe))) ||
+        (pinned_chunks_->find(entry->hash) != pinned_chunks_->end()))
+    {
+      entry = next;
+      continue;
+    }
+
+    trash->push_back(entry->hash);
+    eviction_stats_.num_files++;
+    eviction_stats_.num_bytes += entry->size;
+    IndexRemove(entry, true);
+    LogCvmfs(kLogQuota, kLogDebug, "lru cleanup %s, new gauge %"PRIu64,
+             trash->back().ToString().c_str(), gauge_);
+    num_evicted++;
+    entry = next;
+  }
+}
+
+
+/**
+ * Removes an object from the pack store or the cache directory.  Objects can
+ * be on a fallback stripe, so all stripes are tried.
+ */
+static void RemoveObject(const hash::Any &hash) {
+  if (pack_store::Remove(hash))
+    return;
+  for (unsigned i = 0; i < num_stripes_; ++i) {
+    const string path = ((i == 0) ? *cache_dir_ : stripes::GetPath(i)) +
+                        hash.MakePath(1, 2);
+    LogCvmfs(kLogQuota, kLogDebug, "unlink %s", path.c_str());
+    unlink(path.c_str());
+  }
+}
+
+
+/**
+ * Unlinker threads remove evicted files in batches.
+ */
+static void *MainUnlink(void *data __attribute__((unused))) {
+  vector<hash::Any> batch;
+  pthread_mutex_lock(&lock_unlink_);
+  while (true) {
+    while (unlink_queue_->empty() && !unlink_terminate_)
+      pthread_cond_wait(&cond_unlink_, &lock_unlink_);
+    if (unlink_queue_->empty())
+      break;
+
+    while (!unlink_queue_->empty() && (batch.size() < kUnlinkBatchSize)) {
+      batch.push_back(unlink_queue_->front());
+      unlink_queue_->pop_front();
+    }
+    num_unlinking_ += batch.size();
+    pthread_mutex_unlock(&lock_unlink_);
+
+    for (unsigned i = 0; i < batch.size(); ++i)
+      RemoveObject(batch[i]);
+
+    pthread_mutex_lock(&lock_unlink_);
+    num_unlinking_ -= batch.size();
+    batch.clear();
+    if (unlink_queue_->empty() && (num_unlinking_ == 0))
+      pthread_cond_broadcast(&cond_unlink_idle_);
+  }
+  pthread_mutex_unlock(&lock_unlink_);
+  return NULL;
+}
+
+
+/**
+ * Hands evicted files over to the unlinker threads.  Before the threads are
+ * spawned, the files are removed right away.
+ */
+static void UnlinkFiles(const vector<hash::Any> &trash) {
+  if (trash.empty())
+    return;
+
+  if (!eviction_spawned_) {
+    for (unsigned i = 0; i < trash.size(); ++i)
+      RemoveObject(trash[i]);
+    return;
+  }
+
+  pthread_mutex_lock(&lock_unlink_);
+  unlink_queue_->insert(unlink_queue_->end(), trash.begin(), trash.end());
+  pthread_cond_broadcast(&cond_unlink_);
+  pthread_mutex_unlock(&lock_unlink_);
+}
+
+
+static void WaitForUnlinks() {
+  pthread_mutex_lock(&lock_unlink_);
+  while (!unlink_queue_->empty() || (num_unlinking_ > 0))
+    pthread_cond_wait(&cond_unlink_idle_, &lock_unlink_);
+  pthread_mutex_unlock(&lock_unlink_);
+}
+
+
+static uint64_t GetNumPendingUnlinks() {
+  if (!eviction_spawned_)
+    return 0;
+  pthread_mutex_lock(&lock_unlink_);
+  const uint64_t result = unlink_queue_->size() + num_unlinking_;
+  pthread_mutex_unlock(&lock_unlink_);
+  return result;
+}
+
+
+/**
+ * Whether the cache or one of its stripes is above the high watermark.
+ * Needs to be called with lock_index_ held.
+ */
+static bool NeedsEviction() {
+  if (gauge_ > high_watermark_)
     return true;
+  for (unsigned i = 0; (i < num_stripes_) && (num_stripes_ > 1); ++i) {
+    if (stripe_gauge_[i] > stripe_high_watermark_[i])
+      return true;
+  }
+  return false;
+}
+
+
+/**
+ * The cache as a whole (kAllStripes) if it is above the low watermark, or
+ * the first stripe above its share of the low watermark, or kNoStripe.
+ * Needs to be called with lock_index_ held.
+ */
+static int GetEvictionTarget() {
+  if (gauge_ > cleanup_threshold_)
+    return kAllStripes;
+  for (unsigned i = 0; (i < num_stripes_) && (num_stripes_ > 1); ++i) {
+    if (stripe_gauge_[i] > stripe_cleanup_[i])
+      return i;
+  }
+  return kNoStripe;
+}
 
-  // TODO transaction
-  LogCvmfs(kLogQuota, kLogSyslog,
-           "cleanup cache until %lu KB are free", leave_size/1024);
-  LogCvmfs(kLogQuota, kLogDebug, "gauge %"PRIu64, gauge_);
 
-  bool result;
-  string hash_str;
-  vector<string> trash;
+/**
+ * Wakes up the eviction thread.  Needs to be called with lock_index_ held.
+ */
+static void RequestEviction() {
+  if (!eviction_spawned_ || eviction_stats_.active)
+    return;
+  pthread_mutex_lock(&lock_evict_);
+  evict_requested_ = true;
+  pthread_cond_signal(&cond_evict_);
+  pthread_mutex_unlock(&lock_evict_);
+}
 
-  do {
-    sqlite3_reset(stmt_lru_);
-    if (sqlite3_step(stmt_lru_) != SQLITE_ROW) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not get lru-entry");
+
+/**
+ * Frees space down to the low watermark in rounds of kEvictBatchSize entries,
+ * so that quota commands are processed in between.
+ */
+static void *MainEvict(void *data __attribute__((unused))) {
+  LogCvmfs(kLogQuota, kLogDebug, "starting eviction thread");
+  vector<hash::Any> trash;
+  while (true) {
+    pthread_mutex_lock(&lock_evict_);
+    while (!evict_requested_ && !evict_terminate_)
+      pthread_cond_wait(&cond_evict_, &lock_evict_);
+    const bool terminate = evict_terminate_;
+    evict_requested_ = false;
+    pthread_mutex_unlock(&lock_evict_);
+    if (terminate)
       break;
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    uint64_t num_files = 0;
+    uint64_t num_bytes = 0;
+    bool finished = false;
+    pthread_mutex_lock(&lock_index_);
+    eviction_stats_.active = true;
+    eviction_stats_.num_runs++;
+    LogCvmfs(kLogQuota, kLogDebug, "eviction from %"PRIu64" to %"PRIu64,
+             gauge_, cleanup_threshold_);
+    pthread_mutex_unlock(&lock_index_);
+    do {
+      pthread_mutex_lock(&lock_index_);
+      const uint64_t gauge = gauge_;
+      const int stripe = GetEvictionTarget();
+      if (stripe != kNoStripe) {
+        EvictEntries(stripe, (stripe == kAllStripes) ?
+                     cleanup_threshold_ : stripe_cleanup_[stripe],
+                     kEvictBatchSize, &trash);
+      }
+      SyncJournal();
+      num_bytes += gauge - gauge_;
+      finished = trash.empty();
+      pthread_mutex_unlock(&lock_index_);
+
+      num_files += trash.size();
+      UnlinkFiles(trash);
+      trash.clear();
+    } while (!finished);
+    WaitForUnlinks();
+    pack_store::Compact();
+    gettimeofday(&end, NULL);
+
+    const double seconds = DiffTimeSeconds(start, end);
+    pthread_mutex_lock(&lock_index_);
+    eviction_stats_.active = false;
+    if (seconds > 0.0) {
+      eviction_stats_.files_per_second = double(num_files) / seconds;
+      eviction_stats_.bytes_per_second = double(num_bytes) / seconds;
     }
+    LogCvmfs(kLogQuota, kLogDebug, "evicted %"PRIu64" files (%"PRIu64
+             " bytes) in %.3f seconds, gauge %"PRIu64,
+             num_files, num_bytes, seconds, gauge_);
+    pthread_mutex_unlock(&lock_index_);
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "stopping eviction thread");
+  return NULL;
+}
 
-    hash_str = string(reinterpret_cast<const char *>(
-                      sqlite3_column_text(stmt_lru_, 0)));
-    LogCvmfs(kLogQuota, kLogDebug, "removing %s", hash_str.c_str());
-    hash::Any hash(hash::kSha1, hash::HexPtr(
-      hash_str.substr(0, 2*hash::kDigestSizes[hash::kSha1])));
-    if (pinned_chunks_->find(hash) != pinned_chunks_->end())
-      continue;
 
-    trash.push_back((*cache_dir_) + hash.MakePath(1, 2));
-    gauge_ -= sqlite3_column_int64(stmt_lru_, 1);
-    LogCvmfs(kLogQuota, kLogDebug, "lru cleanup %s, new gauge %"PRIu64,
-             hash_str.c_str(), gauge_);
+static void SpawnEviction() {
+  unlink_queue_ = new deque<hash::Any>();
+  num_unlinking_ = 0;
+  unlink_terminate_ = false;
+  evict_requested_ = false;
+  evict_terminate_ = false;
+  for (unsigned i = 0; i < kNumUnlinkers; ++i) {
+    int retval = pthread_create(&threads_unlink_[i], NULL, MainUnlink, NULL);
+    assert(retval == 0);
+  }
+  int retval = pthread_create(&thread_evict_, NULL, MainEvict, NULL);
+  assert(retval == 0);
+  eviction_spawned_ = true;
+}
 
-    sqlite3_bind_text(stmt_rm_, 1, &hash_str[0], hash_str.length(),
-                      SQLITE_STATIC);
-    result = (sqlite3_step(stmt_rm_) == SQLITE_DONE);
-    sqlite3_reset(stmt_rm_);
 
-    if (!result) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not remove lru-entry");
-      return false;
-    }
-  } while (gauge_ > leave_size);
-
-  // Double fork avoids zombie, forked removal process must not flush file
-  // buffers
-  if (!trash.empty()) {
-    pid_t pid;
-    int statloc;
-    if ((pid = fork()) == 0) {
-      if (fork() == 0) {
-        for (unsigned i = 0, iEnd = trash.size(); i < iEnd; ++i) {
-          LogCvmfs(kLogQuota, kLogDebug, "unlink %s", trash[i].c_str());
-          unlink(trash[i].c_str());
-        }
-        _exit(0);
-      }
-      _exit(0);
-    } else {
-      if (pid > 0)
-        waitpid(pid, &statloc, 0);
-      else
-        return false;
-    }
-  }
+/**
+ * Stops the eviction thread and waits until all evicted files are unlinked.
+ */
+static void TerminateEviction() {
+  if (!eviction_spawned_)
+    return;
 
-  return gauge_ <= leave_size;
+  pthread_mutex_lock(&lock_evict_);
+  evict_terminate_ = true;
+  pthread_cond_signal(&cond_evict_);
+  pthread_mutex_unlock(&lock_evict_);
+  pthread_join(thread_evict_, NULL);
+
+  pthread_mutex_lock(&lock_unlink_);
+  unlink_terminate_ = true;
+  pthread_cond_broadcast(&cond_unlink_);
+  pthread_mutex_unlock(&lock_unlink_);
+  for (unsigned i = 0; i < kNumUnlinkers; ++i)
+    pthread_join(threads_unlink_[i], NULL);
+
+  eviction_spawned_ = false;
+  delete unlink_queue_;
+  unlink_queue_ = NULL;
 }
 
 
-static bool Contains(const string &hash_str) {
-  bool result = false;
+/**
+ * Synchronous cleanup of a stripe or of the entire cache (kAllStripes), the
+ * files are unlinked in the background.  Needs to be called with lock_index_
+ * held (or before spawning).
+ */
+static bool DoCleanup(const int stripe, const uint64_t leave_size) {
+  if ((limit_ == 0) || (GetGauge(stripe) <= leave_size))
+    return true;
+
+  if (stripe == kAllStripes) {
+    LogCvmfs(kLogQuota, kLogSyslog,
+             "cleanup cache until %lu KB are free", leave_size/1024);
+  } else {
+    LogCvmfs(kLogQuota, kLogSyslog, "cleanup cache stripe %d until %lu KB "
+             "are free", stripe, leave_size/1024);
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "gauge %"PRIu64, GetGauge(stripe));
 
-  sqlite3_bind_text(stmt_size_, 1, &hash_str[0], hash_str.length(),
-                    SQLITE_STATIC);
-  if (sqlite3_step(stmt_size_) == SQLITE_ROW)
-    result = true;
-  sqlite3_reset(stmt_size_);
-  LogCvmfs(kLogQuota, kLogDebug, "contains %s returns %d",
-           hash_str.c_str(), result);
+  vector<hash::Any> trash;
+  EvictEntries(stripe, leave_size, unsigned(-1), &trash);
+  SyncJournal();
+  UnlinkFiles(trash);
 
-  return result;
+  return GetGauge(stripe) <= leave_size;
+}
+
+
+/**
+ * Inserts a file or a pinned catalog into the index.  Does cache cleanup if
+ * necessary.
+ */
+static void DoInsertEntry(const hash::Any &hash, const uint64_t size,
+                          const string &path, const bool pin)
+{
+  // It could already be in, check
+  const bool exists = (LookupEntry(hash) != NULL);
+
+  // Cleanup, move to trash and unlink
+  if (!exists && (gauge_ + size > limit_)) {
+    LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
+             gauge_, size);
+    int retval = DoCleanup(kAllStripes, cleanup_threshold_);
+    assert(retval != 0);
+  }
+  if (!exists && (num_stripes_ > 1)) {
+    const unsigned stripe =
+      GetHomeStripe(hash, size, pin ? kFileCatalog : kFileRegular);
+    if (stripe_gauge_[stripe] + size > stripe_limit_[stripe])
+      DoCleanup(stripe, stripe_cleanup_[stripe]);
+  }
+
+  IndexInsert(hash, size, seq_++, path, pin ? kFileCatalog : kFileRegular,
+              pin, true);
+  LogCvmfs(kLogQuota, kLogDebug, "insert or replace %s, pin %d",
+           hash.ToString().c_str(), pin);
 }
 
 
 static void ProcessCommandBunch(const unsigned num,
                                 const LruCommand *commands, const char *paths)
 {
-  int retval = sqlite3_exec(db_, "BEGIN", NULL, NULL, NULL);
-  assert(retval == SQLITE_OK);
-
+  pthread_mutex_lock(&lock_index_);
   for (unsigned i = 0; i < num; ++i) {
     const hash::Any hash(hash::kSha1, commands[i].digest,
                          sizeof(commands[i].digest));
-    const string hash_str = hash.ToString();
-    const unsigned size = commands[i].size;
     LogCvmfs(kLogQuota, kLogDebug, "processing %s (%d)",
-             hash_str.c_str(), commands[i].command_type);
+             hash.ToString().c_str(), commands[i].command_type);
 
-    bool exists;
+    LruEntry *entry;
     switch (commands[i].command_type) {
       case kTouch:
-        sqlite3_bind_int64(stmt_touch_, 1, seq_++);
-        sqlite3_bind_text(stmt_touch_, 2, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        retval = sqlite3_step(stmt_touch_);
-        LogCvmfs(kLogQuota, kLogDebug, "touching %s (%ld): %d",
-                 hash_str.c_str(), seq_-1, retval);
-        errno = retval;
-        assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-        sqlite3_reset(stmt_touch_);
+        entry = LookupEntry(hash);
+        if (entry)
+          IndexTouch(entry, seq_++, true);
         break;
       case kUnpin:
-        sqlite3_bind_text(stmt_unpin_, 1, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        retval = sqlite3_step(stmt_unpin_);
-        LogCvmfs(kLogQuota, kLogDebug, "unpinning %s: %d",
-                 hash_str.c_str(), retval);
-        errno = retval;
-        assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-        sqlite3_reset(stmt_unpin_);
+        entry = LookupEntry(hash);
+        if (entry)
+          entry->pinned = false;
         break;
       case kPin:
       case kInsert:
-        // It could already be in, check
-        exists = Contains(hash_str);
-
-        // Cleanup, move to trash and unlink
-        if (!exists && (gauge_ + size > limit_)) {
-          LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
-                   gauge_, size);
-          retval = DoCleanup(cleanup_threshold_);
-          assert(retval != 0);
-        }
-
-        // Insert or replace
-        sqlite3_bind_text(stmt_new_, 1, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_new_, 2, size);
-        sqlite3_bind_int64(stmt_new_, 3, seq_++);
-        sqlite3_bind_text(stmt_new_, 4, &paths[i*kMaxCvmfsPath],
-                          commands[i].path_length, SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_new_, 5, (commands[i].command_type == kPin) ?
-                           kFileCatalog : kFileRegular);
-        sqlite3_bind_int64(stmt_new_, 6, (commands[i].command_type == kPin) ?
-                           1 : 0);
-        retval = sqlite3_step(stmt_new_);
-        LogCvmfs(kLogQuota, kLogDebug, "insert or replace %s, pin %d: %d",
-                 hash_str.c_str(), commands[i].command_type, retval);
-        assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-        sqlite3_reset(stmt_new_);
-
-        if (!exists) gauge_ += size;
+        DoInsertEntry(hash, commands[i].size,
+                      string(&paths[i*kMaxCvmfsPath], commands[i].path_length),
+                      commands[i].command_type == kPin);
         break;
       default:
         abort();  // other types should have been taken care of by event loop
     }
   }
 
-  retval = sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
-  assert(retval == SQLITE_OK);
+  SyncJournal();
+  if (NeedsEviction())
+    RequestEviction();
+  pthread_mutex_unlock(&lock_index_);
 }
 
 
@@ -351,31 +1597,24 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
   char path_buffer[kCommandBufferSize*kMaxCvmfsPath];
   unsigned num_commands = 0;
 
-  while (read(pipe_lru_[0], &command_buffer[num_commands],
-              sizeof(command_buffer[0])) == sizeof(command_buffer[0]))
+  // Inserts and pins come with a cvmfs path
+  while (ReceiveCommand(&command_buffer[num_commands],
+                        &path_buffer[kMaxCvmfsPath*num_commands]))
   {
     const CommandType command_type = command_buffer[num_commands].command_type;
     LogCvmfs(kLogQuota, kLogDebug, "received command %d", command_type);
     const uint64_t size = command_buffer[num_commands].size;
 
-    // Inserts and pins come with a cvmfs path
-    if ((command_type == kInsert) || (command_type == kPin)) {
-      const int path_length = command_buffer[num_commands].path_length;
-      ReadPipe(pipe_lru_[0], &path_buffer[kMaxCvmfsPath*num_commands],
-               path_length);
-    }
-
     // Reservations are handled immediately and "out of band"
     if (command_type == kReserve) {
       bool success = true;
-      int return_pipe = 
-        BindReturnPipe(command_buffer[num_commands].return_pipe);
       const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
                            sizeof(command_buffer[num_commands].digest));
       const string hash_str(hash.ToString());
       LogCvmfs(kLogQuota, kLogDebug, "reserve %d bytes for %s",
                size, hash_str.c_str());
 
+      pthread_mutex_lock(&lock_index_);
       if (pinned_chunks_->find(hash) == pinned_chunks_->end()) {
         if ((cleanup_threshold_ > 0) && (pinned_ + size > cleanup_threshold_)) {
           LogCvmfs(kLogQuota, kLogDebug,
@@ -386,9 +1625,9 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
           pinned_ += size;
         }
       }
+      pthread_mutex_unlock(&lock_index_);
 
-      WritePipe(return_pipe, &success, sizeof(success));
-      UnbindReturnPipe(return_pipe);
+      SendReply(command_buffer[num_commands], &success, sizeof(success));
       continue;
     }
 
@@ -398,6 +1637,7 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
                            sizeof(command_buffer[num_commands].digest));
       const string hash_str(hash.ToString());
 
+      pthread_mutex_lock(&lock_index_);
       map<hash::Any, uint64_t>::iterator iter = pinned_chunks_->find(hash);
       if (iter != pinned_chunks_->end()) {
         pinned_ -= iter->second;
@@ -405,13 +1645,15 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
       } else {
         LogCvmfs(kLogQuota, kLogDebug, "this chunk was not pinned");
       }
+      pthread_mutex_unlock(&lock_index_);
     }
 
     // Immediate commands trigger flushing of the buffer
     bool immediate_command = (command_type == kCleanup) ||
       (command_type == kList) || (command_type == kListPinned) ||
       (command_type == kListCatalogs) || (command_type == kRemove) ||
-      (command_type == kStatus) || (command_type == kLimits);
+      (command_type == kStatus) || (command_type == kLimits) ||
+      (command_type == kEvictionStats);
     if (!immediate_command) num_commands++;
 
     if ((num_commands == kCommandBufferSize) || immediate_command)
@@ -422,10 +1664,11 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
 
     if (immediate_command) {
       // Process cleanup, listings
-      int return_pipe = 
-        BindReturnPipe(command_buffer[num_commands].return_pipe);
-      int retval;
-      sqlite3_stmt *this_stmt_list = NULL;
+      const LruCommand &command = command_buffer[num_commands];
+      bool retval;
+      uint64_t status[2];
+      EvictionStatistics stats;
+      pthread_mutex_lock(&lock_index_);
       switch (command_type) {
         case kRemove: {
           const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
@@ -434,78 +1677,72 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
           LogCvmfs(kLogQuota, kLogDebug, "manually removing %s",
                    hash_str.c_str());
 
-          sqlite3_bind_text(stmt_size_, 1, &hash_str[0], hash_str.length(),
-                            SQLITE_STATIC);
-          int retval;
-          if ((retval = sqlite3_step(stmt_size_)) == SQLITE_ROW) {
-            uint64_t size = sqlite3_column_int64(stmt_size_, 0);
-            uint64_t is_pinned = sqlite3_column_int64(stmt_size_, 1);
-
-            sqlite3_bind_text(stmt_rm_, 1, &(hash_str[0]), hash_str.length(),
-                              SQLITE_STATIC);
-            retval = sqlite3_step(stmt_rm_);
-            if ((retval == SQLITE_DONE) || (retval == SQLITE_OK)) {
-              gauge_ -= size;
-              if (is_pinned) {
-                pinned_chunks_->erase(hash);
-                pinned_ -= size;
-              }
-            } else {
-              LogCvmfs(kLogQuota, kLogDebug, "could not delete %s, error %d",
-                       hash_str.c_str(), retval);
+          LruEntry *entry = LookupEntry(hash);
+          if (entry) {
+            if (entry->pinned) {
+              pinned_chunks_->erase(hash);
+              pinned_ -= entry->size;
             }
-            sqlite3_reset(stmt_rm_);
+            IndexRemove(entry, true);
+            SyncJournal();
           }
-          sqlite3_reset(stmt_size_);
           break; }
         case kCleanup:
-          retval = DoCleanup(size);
-          WritePipe(return_pipe, &retval, sizeof(retval));
+          retval = DoCleanup(kAllStripes, size);
+          SendReply(command, &retval, sizeof(retval));
           break;
         case kList:
-          if (!this_stmt_list) this_stmt_list = stmt_list_;
         case kListPinned:
-          if (!this_stmt_list) this_stmt_list = stmt_list_pinned_;
-        case kListCatalogs:
-          if (!this_stmt_list) this_stmt_list = stmt_list_catalogs_;
-
+        case kListCatalogs: {
           // Pipe back the list, one by one
+          const int return_pipe = BindReturnPipe(command.return_pipe);
           int length;
-          while (sqlite3_step(this_stmt_list) == SQLITE_ROW) {
-            string path = "(NULL)";
-            if (sqlite3_column_type(this_stmt_list, 0) != SQLITE_NULL) {
-              path = string(
-                reinterpret_cast<const char *>(
-                  sqlite3_column_text(this_stmt_list, 0)));
+          for (LruEntry *entry = lru_list_->next; entry != lru_list_;
+               entry = entry->next)
+          {
+            if (((command_type == kList) && (entry->type != kFileRegular)) ||
+                ((command_type == kListPinned) && !entry->pinned) ||
+                ((command_type == kListCatalogs) &&
+                 (entry->type != kFileCatalog)))
+            {
+              continue;
             }
+            const string &path = entry->path;
             length = path.length();
             WritePipe(return_pipe, &length, sizeof(length));
             if (length > 0)
-              WritePipe(return_pipe, &path[0], length);
+              WritePipe(return_pipe, path.data(), length);
           }
           length = -1;
           WritePipe(return_pipe, &length, sizeof(length));
-          sqlite3_reset(this_stmt_list);
-          break;
+          UnbindReturnPipe(return_pipe);
+          break; }
         case kStatus:
-          WritePipe(return_pipe, &gauge_, sizeof(gauge_));
-          WritePipe(return_pipe, &pinned_, sizeof(pinned_));
+          status[0] = gauge_;
+          status[1] = pinned_;
+          SendReply(command, status, sizeof(status));
           break;
         case kLimits:
-          WritePipe(return_pipe, &limit_, sizeof(limit_));
-          WritePipe(return_pipe, &cleanup_threshold_, 
-                    sizeof(cleanup_threshold_));
+          status[0] = limit_;
+          status[1] = cleanup_threshold_;
+          SendReply(command, status, sizeof(status));
+          break;
+        case kEvictionStats:
+          stats = eviction_stats_;
+          stats.num_pending = GetNumPendingUnlinks();
+          SendReply(command, &stats, sizeof(stats));
           break;
         default:
           abort();  // other types are handled by the bunch processor
       }
-      UnbindReturnPipe(return_pipe);
+      pthread_mutex_unlock(&lock_index_);
       num_commands = 0;
     }
   }
 
-  LogCvmfs(kLogQuota, kLogDebug, "stopping cache manager (%d)", errno);
-  close(pipe_lru_[0]);
+  LogCvmfs(kLogQuota, kLogDebug, "stopping cache manager");
+  if (shared_)
+    close(pipe_lru_[0]);
   ProcessCommandBunch(num_commands, command_buffer, path_buffer);
 
   // Unpin
@@ -521,44 +1758,36 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
 }
 
 
-/**
- * Rebuilds the SQLite cache catalog based on the stat-information of files
- * in the cache directory.
- *
- * \return True on success, false otherwise
- */
-bool RebuildDatabase() {
-  bool result = false;
-  string sql;
-  sqlite3_stmt *stmt_select = NULL;
-  sqlite3_stmt *stmt_insert = NULL;
-  int sqlerr;
-  int seq = 0;
-  char hex[3];
-  struct stat info;
-  platform_dirent64 *d;
-  DIR *dirp = NULL;
-  string path;
-  set<string> catalogs;
+static bool IsSha1Name(const string &name) {
+  if (name.length() != 2*hash::kDigestSizes[hash::kSha1])
+    return false;
+  for (unsigned i = 0; i < name.length(); ++i) {
+    if (!(((name[i] >= '0') && (name[i] <= '9')) ||
+          ((name[i] >= 'a') && (name[i] <= 'f'))))
+    {
+      return false;
+    }
+  }
+  return true;
+}
 
-  LogCvmfs(kLogQuota, kLogDebug, "re-building cache-database");
 
-  // Empty cache catalog and fscache
-  sql = "DELETE FROM cache_catalog; DELETE FROM fscache;";
-  sqlerr = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (sqlerr != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not clear cache database");
-    goto build_return;
-  }
+static bool CompareAtime(const RebuildEntry &a, const RebuildEntry &b) {
+  return a.atime < b.atime;
+}
 
-  gauge_ = 0;
 
-  // Gather file catalog hash values
-  // TODO: distiction does not exist anymore
-  if ((dirp = opendir(cache_dir_->c_str())) == NULL) {
-    LogCvmfs(kLogQuota, kLogDebug, "failed to open directory %s", path.c_str());
-    goto build_return;
+/**
+ * Catalogs are recognized by the cvmfs.checksum files in the cache directory.
+ */
+static void GatherCatalogs(set<hash::Any> *catalogs) {
+  DIR *dirp = opendir(cache_dir_->c_str());
+  if (dirp == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to open directory %s",
+             cache_dir_->c_str());
+    return;
   }
+  platform_dirent64 *d;
   while ((d = platform_readdir(dirp)) != NULL) {
     if (d->d_type != DT_REG) continue;
 
@@ -568,104 +1797,231 @@ bool RebuildDatabase() {
       if (f != NULL) {
         char sha1[40];
         if (fread(sha1, 1, 40, f) == 40) {
+          const string sha1_str(sha1, 40);
           LogCvmfs(kLogQuota, kLogDebug, "added %s to catalog list",
-                   string(sha1, 40).c_str());
-          catalogs.insert(string(sha1, 40).c_str());
+                   sha1_str.c_str());
+          if (IsSha1Name(sha1_str))
+            catalogs->insert(hash::Any(hash::kSha1, hash::HexPtr(sha1_str)));
         }
         fclose(f);
       }
     }
   }
   closedir(dirp);
+}
 
-  // Insert files from cache sub-directories 00 - ff
-  sqlite3_prepare_v2(db_, "INSERT INTO fscache (sha1, size, actime) "
-                     "VALUES (:sha1, :s, :t);", -1, &stmt_insert, NULL);
 
-  for (int i = 0; i <= 0xff; i++) {
-    snprintf(hex, sizeof(hex), "%02x", i);
-    path = (*cache_dir_) + "/" + string(hex);
-    if ((dirp = opendir(path.c_str())) == NULL) {
+/**
+ * Scan threads take cache subdirectories one by one and collect the files
+ * with their size and access time.
+ */
+static void *MainRebuildScan(void *data) {
+  RebuildScan *scan = static_cast<RebuildScan *>(data);
+  int i;
+  while (((i = atomic_xadd32(&scan->next_dir, 1)) <
+          static_cast<int>(256 * num_stripes_)) &&
+         !atomic_read32(&rebuild_terminate_))
+  {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", i & 0xff);
+    const unsigned stripe = i >> 8;
+    const string path = ((stripe == 0) ? *cache_dir_ :
+                         stripes::GetPath(stripe)) + "/" + string(hex);
+    DIR *dirp = opendir(path.c_str());
+    if (dirp == NULL) {
       LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
                "failed to open directory %s (tmpwatch interfering?)",
                path.c_str());
-      goto build_return;
+      atomic_inc32(&scan->failed);
+      continue;
     }
+    platform_dirent64 *d;
+    platform_stat64 info;
     while ((d = platform_readdir(dirp)) != NULL) {
       if (d->d_type != DT_REG) continue;
 
-      if (stat((path + "/" + string(d->d_name)).c_str(), &info) == 0) {
-        string sha1 = string(hex) + string(d->d_name);
-        sqlite3_bind_text(stmt_insert, 1, sha1.c_str(), sha1.length(),
-                          SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_insert, 2, info.st_size);
-        sqlite3_bind_int64(stmt_insert, 3, info.st_atime);
-        if (sqlite3_step(stmt_insert) != SQLITE_DONE) {
-          LogCvmfs(kLogQuota, kLogDebug, "could not insert into temp table");
-          goto build_return;
-        }
-        sqlite3_reset(stmt_insert);
-
-        gauge_ += info.st_size;
-      } else {
+      const string sha1 = string(hex) + string(d->d_name);
+      if (!IsSha1Name(sha1)) continue;
+      if (platform_stat((path + "/" + string(d->d_name)).c_str(), &info) != 0)
+      {
         LogCvmfs(kLogQuota, kLogDebug, "could not stat %s/%s",
                  path.c_str(), d->d_name);
+        continue;
       }
+      RebuildEntry entry;
+      entry.hash = hash::Any(hash::kSha1, hash::HexPtr(sha1));
+      entry.size = info.st_size;
+      entry.atime = info.st_atime;
+      scan->entries[i].push_back(entry);
     }
     closedir(dirp);
-    dirp = NULL;
   }
-  sqlite3_finalize(stmt_insert);
-  stmt_insert = NULL;
+  return NULL;
+}
 
-  // Transfer from temp table in cache catalog
-  sqlite3_prepare_v2(db_, "SELECT sha1, size FROM fscache ORDER BY actime;",
-                     -1, &stmt_select, NULL);
-  sqlite3_prepare_v2(db_,
-    "INSERT INTO cache_catalog (sha1, size, acseq, path, type, pinned) "
-    "VALUES (:sha1, :s, :seq, 'unknown (automatic rebuild)', :t, 0);",
-    -1, &stmt_insert, NULL);
-  while (sqlite3_step(stmt_select) == SQLITE_ROW) {
-    const string sha1 = string(
-      reinterpret_cast<const char *>(sqlite3_column_text(stmt_select, 0)));
-    sqlite3_bind_text(stmt_insert, 1, &sha1[0], sha1.length(), SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_insert, 2, sqlite3_column_int64(stmt_select, 1));
-    sqlite3_bind_int64(stmt_insert, 3, seq++);
-    if (catalogs.find(sha1) != catalogs.end())
-      sqlite3_bind_int64(stmt_insert, 4, kFileCatalog);
-    else
-      sqlite3_bind_int64(stmt_insert, 4, kFileRegular);
-
-    if (sqlite3_step(stmt_insert) != SQLITE_DONE) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not insert into cache catalog");
-      goto build_return;
+
+/**
+ * Adds the objects of the pack store to the scan.  They have no access time
+ * of their own and are treated as least recently used.
+ */
+static void ScanPackStore(RebuildScan *scan) {
+  vector<hash::Any> ids;
+  vector<uint64_t> sizes;
+  pack_store::ListObjects(&ids, &sizes);
+  for (unsigned i = 0; i < ids.size(); ++i) {
+    RebuildEntry entry;
+    entry.hash = ids[i];
+    entry.size = sizes[i];
+    entry.atime = 0;
+    scan->entries[ids[i].digest[0]].push_back(entry);
+  }
+}
+
+
+/**
+ * Runs kNumRebuildThreads scan threads over the 256 cache subdirectories and
+ * adds the pack store.
+ */
+static bool ScanCacheDirectory(RebuildScan *scan) {
+  scan->next_dir = 0;
+  scan->failed = 0;
+  pthread_t threads[kNumRebuildThreads];
+  unsigned num_threads = 0;
+  for (unsigned i = 0; i < kNumRebuildThreads; ++i) {
+    if (pthread_create(&threads[num_threads], NULL, MainRebuildScan, scan) == 0)
+      num_threads++;
+  }
+  if (num_threads == 0)
+    MainRebuildScan(scan);
+  for (unsigned i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+  ScanPackStore(scan);
+  return (atomic_read32(&scan->failed) == 0) &&
+         !atomic_read32(&rebuild_terminate_);
+}
+
+
+/**
+ * Brings the index in line with the scanned cache directory.  Files that are
+ * not yet indexed are added as the least recently used entries in the order
+ * of their access time.  Entries that were indexed before the scan started
+ * and whose files are gone are dropped.  Finally, the access sequence is
+ * renumbered.  Needs to be called with lock_index_ held and followed by a
+ * Checkpoint().
+ *
+ * Files evicted during a background scan can come back as entries without a
+ * file.  They only inflate the gauge until they are evicted again.
+ */
+static void MergeScan(RebuildScan *scan, const set<hash::Any> &catalogs,
+                      const uint64_t seq_boundary)
+{
+  vector<RebuildEntry> found;
+  LruIndex scanned;
+  SetIndexKeys(&scanned);
+  for (unsigned i = 0; i < 256 * num_stripes_; ++i) {
+    found.insert(found.end(), scan->entries[i].begin(),
+                 scan->entries[i].end());
+    vector<RebuildEntry>().swap(scan->entries[i]);
+  }
+  for (unsigned i = 0; i < found.size(); ++i)
+    scanned[found[i].hash] = NULL;
+
+  LruEntry *entry = lru_list_->next;
+  while (entry != lru_list_) {
+    LruEntry *next = entry->next;
+    if ((entry->acseq < seq_boundary) && !entry->pinned &&
+        (scanned.find(entry->hash) == scanned.end()))
+    {
+      IndexRemove(entry, false);
     }
-    sqlite3_reset(stmt_insert);
+    entry = next;
   }
 
-  // Delete temporary table
-  sql = "DELETE FROM fscache;";
-  sqlerr = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (sqlerr != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not clear temporary table (%d)",
-             sqlerr);
-    goto build_return;
+  sort(found.begin(), found.end(), CompareAtime);
+  unsigned num_added = 0;
+  for (vector<RebuildEntry>::reverse_iterator i = found.rbegin(),
+       iEnd = found.rend(); i != iEnd; ++i)
+  {
+    if (LookupEntry(i->hash) != NULL)
+      continue;
+    entry = new LruEntry();
+    entry->hash = i->hash;
+    entry->size = i->size;
+    entry->path = "unknown (automatic rebuild)";
+    entry->type = (catalogs.find(i->hash) != catalogs.end()) ?
+                  kFileCatalog : kFileRegular;
+    entry->pinned = false;
+    entry->stripe = GetHomeStripe(entry->hash, entry->size, entry->type);
+    (*lru_index_)[i->hash] = entry;
+    LinkEntryFront(entry);
+    AddToGauge(entry);
+    num_added++;
   }
 
+  uint64_t seq = 0;
+  for (entry = lru_list_->next; entry != lru_list_; entry = entry->next)
+    entry->acseq = seq++;
   seq_ = seq;
-  result = true;
-  LogCvmfs(kLogQuota, kLogDebug,
-           "rebuilding finished, seqence %"PRIu64 ", gauge %"PRIu64,
-           seq_, gauge_);
-
- build_return:
-  if (stmt_insert) sqlite3_finalize(stmt_insert);
-  if (stmt_select) sqlite3_finalize(stmt_select);
-  if (dirp) closedir(dirp);
+  LogCvmfs(kLogQuota, kLogDebug, "found %u files, %u not indexed",
+           unsigned(found.size()), num_added);
+}
+
+
+/**
+ * Rebuilds the cache catalog based on the stat-information of files in the
+ * cache directory.  Files that are already indexed keep their position in the
+ * LRU list.  Can run in the background while the cache manager serves
+ * requests.
+ *
+ * \return True on success, false otherwise
+ */
+bool RebuildDatabase() {
+  LogCvmfs(kLogQuota, kLogDebug, "re-building cache-database");
+  set<hash::Any> catalogs;
+  GatherCatalogs(&catalogs);
+
+  pthread_mutex_lock(&lock_index_);
+  const uint64_t seq_boundary = seq_;
+  pthread_mutex_unlock(&lock_index_);
+
+  RebuildScan *scan = new RebuildScan();
+  bool result = ScanCacheDirectory(scan);
+  if (result) {
+    pthread_mutex_lock(&lock_index_);
+    MergeScan(scan, catalogs, seq_boundary);
+    result = Checkpoint() &&
+      (sqlite3_exec(db_, "DELETE FROM properties WHERE key='rebuild';",
+                    NULL, NULL, NULL) == SQLITE_OK);
+    if (NeedsEviction())
+      RequestEviction();
+    LogCvmfs(kLogQuota, kLogDebug,
+             "rebuilding finished, seqence %"PRIu64 ", gauge %"PRIu64,
+             seq_, gauge_);
+    pthread_mutex_unlock(&lock_index_);
+  }
+  delete scan;
   return result;
 }
-  
-  
+
+
+/**
+ * Background rebuild of the cache catalog.  Until it is finished, files that
+ * are not yet indexed are in the cache but not accounted for.
+ */
+static void *MainRebuild(void *data __attribute__((unused))) {
+  LogCvmfs(kLogQuota, kLogSyslog,
+           "rebuilding cache database in the background");
+  if (RebuildDatabase()) {
+    LogCvmfs(kLogQuota, kLogSyslog, "finished rebuilding cache database, "
+             "cache size is %"PRIu64" MB", GetSize() / (1024*1024));
+  } else {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to rebuild cache database in the background");
+  }
+  return NULL;
+}
+
+
 static bool InitDatabase(const bool rebuild_database) {
   string sql;
   sqlite3_stmt *stmt;
@@ -677,6 +2033,10 @@ static bool InitDatabase(const bool rebuild_database) {
   }
   
   bool retry = false;
+  bool rebuild = rebuild_database;
+  bool rebuilt = false;
+  bool journal_valid = false;
+  bool journal_empty = true;
 init_recover:
   const string db_file = (*cache_dir_) + "/cachedb";
   int err = sqlite3_open(db_file.c_str(), &db_);
@@ -691,9 +2051,6 @@ init_recover:
   "CONSTRAINT pk_cache_catalog PRIMARY KEY (sha1)); "
   "CREATE UNIQUE INDEX IF NOT EXISTS idx_cache_catalog_acseq "
   "  ON cache_catalog (acseq); "
-  "CREATE TEMP TABLE fscache (sha1 TEXT, size INTEGER, actime INTEGER, "
-  "CONSTRAINT pk_fscache PRIMARY KEY (sha1)); "
-  "CREATE INDEX idx_fscache_actime ON fscache (actime); "
   "CREATE TABLE IF NOT EXISTS properties (key TEXT, value TEXT, "
   "  CONSTRAINT pk_properties PRIMARY KEY(key));";
   err = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
@@ -752,104 +2109,99 @@ init_recover:
     return true;
   }
   
-  // If cache catalog is empty, recreate from file system
-  sql = "SELECT count(*) FROM cache_catalog;";
+  // The journal has to belong to the last snapshot
+  checkpoint_ = 0;
+  sql = "SELECT value FROM properties WHERE key='checkpoint';";
   sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, NULL);
   if (sqlite3_step(stmt) == SQLITE_ROW) {
-    if ((sqlite3_column_int64(stmt, 0)) == 0 || rebuild_database) {
-      LogCvmfs(kLogCvmfs, kLogStdout,
-               "CernVM-FS: building lru cache database...");
-      if (!RebuildDatabase()) {
-        LogCvmfs(kLogQuota, kLogDebug,
-                 "could not build cache database from file system");
-        goto init_database_fail;
-      }
-    }
-  } else {
-    LogCvmfs(kLogQuota, kLogDebug, "could not select on cache catalog");
-    sqlite3_finalize(stmt);
-    goto init_database_fail;
+    checkpoint_ = String2Uint64(string(reinterpret_cast<const char *>(
+                                       sqlite3_column_text(stmt, 0))));
   }
   sqlite3_finalize(stmt);
+  if (!OpenJournal(&journal_valid, &journal_empty))
+    goto init_database_fail;
   
-  // How many bytes do we already have in cache?
-  sql = "SELECT sum(size) FROM cache_catalog;";
+  // An interrupted background rebuild has to be repeated
+  sql = "SELECT value FROM properties WHERE key='rebuild';";
   sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, NULL);
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    gauge_ = sqlite3_column_int64(stmt, 0);
-  } else {
-    LogCvmfs(kLogQuota, kLogDebug, "could not determine cache size");
-    sqlite3_finalize(stmt);
-    goto init_database_fail;
-  }
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    rebuild = true;
   sqlite3_finalize(stmt);
   
-  // Highest seq-no?
-  sql = "SELECT coalesce(max(acseq), 0) FROM cache_catalog;";
+  // If cache catalog is empty, recreate from file system.  An empty snapshot
+  // with a valid journal is a young cache.
+  sql = "SELECT count(*) FROM cache_catalog;";
   sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, NULL);
   if (sqlite3_step(stmt) == SQLITE_ROW) {
-    seq_ = sqlite3_column_int64(stmt, 0)+1;
+    if ((sqlite3_column_int64(stmt, 0) == 0) && !journal_valid)
+      rebuild = true;
   } else {
-    LogCvmfs(kLogQuota, kLogDebug, "could not determine highest seq-no");
+    LogCvmfs(kLogQuota, kLogDebug, "could not select on cache catalog");
     sqlite3_finalize(stmt);
     goto init_database_fail;
   }
   sqlite3_finalize(stmt);
   
-  // Prepare touch, new, remove statements
-  sqlite3_prepare_v2(db_, "UPDATE cache_catalog SET acseq=:seq "
-                     "WHERE sha1=:sha1;", -1, &stmt_touch_, NULL);
-  sqlite3_prepare_v2(db_, "UPDATE cache_catalog SET pinned=0 "
-                     "WHERE sha1=:sha1;", -1, &stmt_unpin_, NULL);
-  sqlite3_prepare_v2(db_,
-                     "INSERT OR REPLACE INTO cache_catalog "
-                     "(sha1, size, acseq, path, type, pinned) "
-                     "VALUES (:sha1, :s, :seq, :p, :t, :pin);", -1, &stmt_new_, NULL);
-  sqlite3_prepare_v2(db_,
-                     "SELECT size, pinned FROM cache_catalog WHERE sha1=:sha1;",
-                     -1, &stmt_size_, NULL);
-  sqlite3_prepare_v2(db_, "DELETE FROM cache_catalog WHERE sha1=:sha1;",
-                     -1, &stmt_rm_, NULL);
-  sqlite3_prepare_v2(db_,
-                     "SELECT sha1, size FROM cache_catalog WHERE acseq=(SELECT min(acseq) "
-                     "FROM cache_catalog WHERE pinned=0);", -1, &stmt_lru_, NULL);
-  sqlite3_prepare_v2(db_,
-                     ("SELECT path FROM cache_catalog WHERE type=" + StringifyInt(kFileRegular) +
-                      ";").c_str(), -1, &stmt_list_, NULL);
-  sqlite3_prepare_v2(db_, "SELECT path FROM cache_catalog WHERE pinned=1;",
-                     -1, &stmt_list_pinned_, NULL);
-  sqlite3_prepare_v2(db_,
-                     ("SELECT path FROM cache_catalog WHERE type=" + StringifyInt(kFileCatalog) +
-                      ";").c_str(), -1, &stmt_list_catalogs_, NULL);
+  // Load the snapshot and apply the journal on top of it
+  CreateIndex();
+  if (!LoadSnapshot())
+    goto init_database_fail;
+  if (journal_valid)
+    ReplayJournal();
+  LogCvmfs(kLogQuota, kLogDebug, "loaded %u entries, gauge %"PRIu64,
+           unsigned(lru_index_->size()), gauge_);
+  
+  // Files that are not in the index are added by a rebuild
+  rebuild_pending_ = false;
+  if (rebuild) {
+    if (rebuild_background_) {
+      sql = "INSERT OR REPLACE INTO properties (key, value) "
+            "VALUES ('rebuild', 'pending');";
+      if (sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+        LogCvmfs(kLogQuota, kLogDebug,
+                 "could not init cache database (failed: %s)", sql.c_str());
+        goto init_database_fail;
+      }
+      rebuild_pending_ = true;
+    } else {
+      LogCvmfs(kLogCvmfs, kLogStdout,
+               "CernVM-FS: building lru cache database...");
+      if (!RebuildDatabase()) {
+        LogCvmfs(kLogQuota, kLogDebug,
+                 "could not build cache database from file system");
+        goto init_database_fail;
+      }
+      rebuilt = true;
+    }
+  }
+  if (!rebuilt && (!journal_valid || !journal_empty)) {
+    if (!Checkpoint())
+      goto init_database_fail;
+  }
   return true;
   
  init_database_fail:
+  if (journal_) {
+    fclose(journal_);
+    journal_ = NULL;
+  }
+  DestroyIndex();
   UnlockFile(fd_lock_cachedb_);
   sqlite3_close(db_);
+  db_ = NULL;
   return false;
 }
   
 
 static void CloseDatabase() {
-  if (stmt_list_catalogs_) sqlite3_finalize(stmt_list_catalogs_);
-  if (stmt_list_pinned_) sqlite3_finalize(stmt_list_pinned_);
-  if (stmt_list_) sqlite3_finalize(stmt_list_);
-  if (stmt_lru_) sqlite3_finalize(stmt_lru_);
-  if (stmt_rm_) sqlite3_finalize(stmt_rm_);
-  if (stmt_size_) sqlite3_finalize(stmt_size_);
-  if (stmt_touch_) sqlite3_finalize(stmt_touch_);
-  if (stmt_unpin_) sqlite3_finalize(stmt_unpin_);
-  if (stmt_new_) sqlite3_finalize(stmt_new_);
+  if (journal_) {
+    Checkpoint();
+    fclose(journal_);
+    journal_ = NULL;
+  }
+  DestroyIndex();
   if (db_) sqlite3_close(db_);
   UnlockFile(fd_lock_cachedb_);
-  
-  stmt_list_catalogs_ = NULL;
-  stmt_list_pinned_ = NULL;
-  stmt_list_ = NULL;
-  stmt_rm_ = NULL;
-  stmt_size_ = NULL;
-  stmt_touch_ = NULL;
-  stmt_new_ = NULL;
   db_ = NULL;
   
   delete pinned_chunks_;
@@ -883,6 +2235,10 @@ bool InitShared(const std::string &exe_path, const std::string &cache_dir,
     LogCvmfs(kLogQuota, kLogDebug, "connected to existing cache manager pipe");
     Nonblock2Block(pipe_lru_[1]);
     UnlockFile(fd_lockfile);
+    if (!AttachRing(*cache_dir_ + "/cachemgr.ring")) {
+      close(pipe_lru_[1]);
+      return false;
+    }
     GetLimits(&limit_, &cleanup_threshold_);
     LogCvmfs(kLogQuota, kLogDebug, "received limit %"PRIu64", threshold %"PRIu64,
              limit_, cleanup_threshold_);
@@ -972,6 +2328,10 @@ bool InitShared(const std::string &exe_path, const std::string &cache_dir,
   LogCvmfs(kLogQuota, kLogDebug, "connected to a new cache manager");
   
   UnlockFile(fd_lockfile);
+  if (!AttachRing(*cache_dir_ + "/cachemgr.ring")) {
+    close(pipe_lru_[1]);
+    return false;
+  }
   
   GetLimits(&limit_, &cleanup_threshold_);
   LogCvmfs(kLogQuota, kLogDebug, "received limit %"PRIu64", threshold %"PRIu64,
@@ -1002,6 +2362,7 @@ int MainCacheManager(int argc, char **argv) {
   int pipe_handshake = String2Int64(argv[4]);
   limit_ = String2Int64(argv[5]);
   cleanup_threshold_ = String2Int64(argv[6]);
+  SetWatermarks();
   int foreground = String2Int64(argv[7]);
   const string logfile = argv[8];
   if (logfile != "")
@@ -1012,6 +2373,9 @@ int MainCacheManager(int argc, char **argv) {
   
   if (!InitDatabase(false))  // TODO: rebuild?
     return 1;
+  // The ring file is not removed on exit, a successor might already use it
+  if (!CreateSharedRing(*cache_dir_ + "/cachemgr.ring"))
+    return 1;
   
   // Initialize pipe, open non-blocking as cvmfs is not yet connected
   const string fifo_path = *cache_dir_ + "/cachemgr";
@@ -1031,9 +2395,12 @@ int MainCacheManager(int argc, char **argv) {
   close(pipe_handshake);
   LogCvmfs(kLogQuota, kLogDebug, "shared cache manager handshake done");
   
+  SpawnEviction();
   MainCommandServer(NULL);
   unlink(fifo_path.c_str());
+  TerminateEviction();
   CloseDatabase();
+  UnmapRing();
   
   monitor::Fini();
   
@@ -1041,6 +2408,16 @@ int MainCacheManager(int argc, char **argv) {
 }
   
   
+/**
+ * If a rebuild of the cache catalog is necessary, Init() only schedules it
+ * and Spawn() runs it in the background.  Applies to the cache manager running
+ * inside the cvmfs2 process.
+ */
+void SetBackgroundRebuild(const bool enabled) {
+  rebuild_background_ = enabled;
+}
+
+
 /**
  * Sets up parameters and SQL statements.
  * We don't check here whether cache is already too big.
@@ -1066,6 +2443,7 @@ bool Init(const string &cache_dir, const uint64_t limit,
   limit_ = limit;
   pinned_ = 0;
   cleanup_threshold_ = cleanup_threshold;
+  SetWatermarks();
   cache_dir_ = new string(cache_dir);
   pinned_chunks_ = new map<hash::Any, uint64_t>();
 
@@ -1073,25 +2451,39 @@ bool Init(const string &cache_dir, const uint64_t limit,
   if (!InitDatabase(rebuild_database))
     return false;
 
-  MakePipe(pipe_lru_);
+  if (!CreateRing()) {
+    CloseDatabase();
+    return false;
+  }
 
   return true;
 }
 
 
 /**
- * Spawns the LRU thread
+ * Spawns the LRU thread, the eviction threads, and a pending background
+ * rebuild
  */
 void Spawn() { 
   if (spawned_ || (limit_ == 0))
     return;
 
+  SpawnEviction();
   if (pthread_create(&thread_lru_, NULL, MainCommandServer, NULL) != 0) {
     LogCvmfs(kLogQuota, kLogDebug, "could not create lru thread");
     abort();
   }
 
   spawned_ = true;
+
+  if (rebuild_pending_) {
+    atomic_init32(&rebuild_terminate_);
+    if (pthread_create(&thread_rebuild_, NULL, MainRebuild, NULL) != 0) {
+      LogCvmfs(kLogQuota, kLogDebug, "could not create rebuild thread");
+      abort();
+    }
+    rebuild_spawned_ = true;
+  }
 }
 
 
@@ -1099,31 +2491,39 @@ void Spawn() {
  * Cleanup, closes SQLite connections.
  */
 void Fini() {
-  delete cache_dir_;
-  cache_dir_ = NULL;
-  
   if (shared_) {
     // Most of cleanup is done elsewhen by shared cache manager
     close(pipe_lru_[1]);
+    SignalCommandServer();
+    UnmapRing();
+    delete cache_dir_;
+    cache_dir_ = NULL;
     return;
   }
 
+  if (rebuild_spawned_) {
+    atomic_inc32(&rebuild_terminate_);
+    pthread_join(thread_rebuild_, NULL);
+    rebuild_spawned_ = false;
+  }
+
   if (spawned_) {
-    char fin = 0;
-    WritePipe(pipe_lru_[1], &fin, 1);
-    close(pipe_lru_[1]);
+    atomic_inc32(&ring_->terminate);
+    SignalCommandServer();
     pthread_join(thread_lru_, NULL);
-  } else {
-    ClosePipe(pipe_lru_);
+    TerminateEviction();
   }
 
   CloseDatabase();
+  UnmapRing();
+  delete cache_dir_;
+  cache_dir_ = NULL;
 }
 
 
 /**
  * Cleans up in data cache, until cache size is below leave_size.
- * The actual unlinking is done in a separate process (fork).
+ * The actual unlinking is done by the unlink threads.
  *
  * \return True on success, false otherwise
  */
@@ -1131,20 +2531,13 @@ bool Cleanup(const uint64_t leave_size) {
   bool result;
 
   if (!spawned_) {
-    return DoCleanup(leave_size);
+    return DoCleanup(kAllStripes, leave_size);
   }
 
-  int pipe_cleanup[2];
-  MakeReturnPipe(pipe_cleanup);
-
   LruCommand cmd;
   cmd.command_type = kCleanup;
   cmd.size = leave_size;
-  cmd.return_pipe = pipe_cleanup[1];
-
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
-  ReadHalfPipe(pipe_cleanup[0], &result, sizeof(result));
-  CloseReturnPipe(pipe_cleanup);
+  CallCommandServer(&cmd, &result, sizeof(result));
 
   return result;
 }
@@ -1167,7 +2560,7 @@ static void DoInsert(const hash::Any &hash, const uint64_t size,
   cmd->path_length = path_length;
   memcpy(reinterpret_cast<char *>(cmd)+sizeof(LruCommand),
          &cvmfs_path[0], path_length);
-  WritePipe(pipe_lru_[1], cmd, sizeof(LruCommand) + path_length);
+  SendCommand(cmd, sizeof(LruCommand) + path_length);
 }
 
 
@@ -1184,71 +2577,60 @@ void Insert(const hash::Any &any_hash, const uint64_t size,
 
 
 /**
- * Immediately inserts a new pinned catalog.
- * Does cache cleanup if necessary.
- *
- * \return True on success, false otherwise
+ * Protects an object from eviction without inserting it into the cache
+ * database.  Reserved objects count towards the pinned size.  Released by
+ * Unpin().
  */
-bool Pin(const hash::Any &hash, const uint64_t size,
-         const string &cvmfs_path)
-{
+bool Reserve(const hash::Any &hash, const uint64_t size) {
   if (limit_ == 0) return true;
 
-  const string hash_str = hash.ToString();
-  LogCvmfs(kLogQuota, kLogDebug, "pin into lru %s, path %s",
-           hash_str.c_str(), cvmfs_path.c_str());
-
   // Has to run when not spawned yet
   if (!spawned_) {
-    // Currently code duplication here, not sure if there is a more elegant way
     if (pinned_chunks_->find(hash) == pinned_chunks_->end()) {
       if ((cleanup_threshold_ > 0) && (pinned_ + size > cleanup_threshold_)) {
         LogCvmfs(kLogQuota, kLogDebug, "failed to insert %s (pinned), no space",
-                 hash_str.c_str());
+                 hash.ToString().c_str());
         return false;
-      } else {
-        (*pinned_chunks_)[hash] = size;
-        pinned_ += size;
       }
+      (*pinned_chunks_)[hash] = size;
+      pinned_ += size;
     }
-    bool exists = Contains(hash_str);
-    if (!exists && (gauge_ + size > limit_)) {
-      LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
-               gauge_, size);
-      int retval = DoCleanup(cleanup_threshold_);
-      assert(retval != 0);
-    }
-    sqlite3_bind_text(stmt_new_, 1, &hash_str[0], hash_str.length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_new_, 2, size);
-    sqlite3_bind_int64(stmt_new_, 3, seq_++);
-    sqlite3_bind_text(stmt_new_, 4, &cvmfs_path[0], cvmfs_path.length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_new_, 5, kFileCatalog);
-    sqlite3_bind_int64(stmt_new_, 6, 1);
-    int retval = sqlite3_step(stmt_new_);
-    assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-    sqlite3_reset(stmt_new_);
-    if (!exists) gauge_ += size;
     return true;
   }
 
-  int pipe_reserve[2];
-  MakeReturnPipe(pipe_reserve);
-
   LruCommand cmd;
   cmd.command_type = kReserve;
   cmd.size = size;
   memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
-  cmd.return_pipe = pipe_reserve[1];
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
   bool result;
-  ReadHalfPipe(pipe_reserve[0], &result, sizeof(result));
-  CloseReturnPipe(pipe_reserve);
+  CallCommandServer(&cmd, &result, sizeof(result));
+  return result;
+}
+
+
+/**
+ * Immediately inserts a new pinned catalog.
+ * Does cache cleanup if necessary.
+ *
+ * \return True on success, false otherwise
+ */
+bool Pin(const hash::Any &hash, const uint64_t size,
+         const string &cvmfs_path)
+{
+  if (limit_ == 0) return true;
 
-  if (!result) return false;
-  DoInsert(hash, size, cvmfs_path, true);
+  const string hash_str = hash.ToString();
+  LogCvmfs(kLogQuota, kLogDebug, "pin into lru %s, path %s",
+           hash_str.c_str(), cvmfs_path.c_str());
 
+  if (!Reserve(hash, size))
+    return false;
+  if (!spawned_) {
+    DoInsertEntry(hash, size, cvmfs_path.substr(0, kMaxCvmfsPath), true);
+    SyncJournal();
+  } else {
+    DoInsert(hash, size, cvmfs_path, true);
+  }
   return true;
 }
 
@@ -1260,7 +2642,7 @@ void Unpin(const hash::Any &hash) {
   LruCommand cmd;
   cmd.command_type = kUnpin;
   memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  SendCommand(&cmd, sizeof(cmd));
 }
 
 
@@ -1273,7 +2655,7 @@ void Touch(const hash::Any &hash) {
   LruCommand cmd;
   cmd.command_type = kTouch;
   memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  SendCommand(&cmd, sizeof(cmd));
 }
 
 
@@ -1287,10 +2669,10 @@ void Remove(const hash::Any &hash) {
     LruCommand cmd;
     cmd.command_type = kRemove;
     memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
-    WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+    SendCommand(&cmd, sizeof(cmd));
   }
 
-  unlink(((*cache_dir_) + hash.MakePath(1, 2)).c_str());
+  RemoveObject(hash);
 }
 
 
@@ -1303,7 +2685,7 @@ static vector<string> DoList(const CommandType list_command) {
   LruCommand cmd;
   cmd.command_type = list_command;
   cmd.return_pipe = pipe_list[1];
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  SendCommand(&cmd, sizeof(cmd));
 
   int length;
   do {
@@ -1359,16 +2741,24 @@ uint64_t GetCapacity() {
 
 
 static void GetStatus(uint64_t *gauge, uint64_t *pinned) {
-  int pipe_status[2];
-  MakeReturnPipe(pipe_status);
-
   LruCommand cmd;
   cmd.command_type = kStatus;
-  cmd.return_pipe = pipe_status[1];
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
-  ReadHalfPipe(pipe_status[0], gauge, sizeof(*gauge));
-  ReadPipe(pipe_status[0], pinned, sizeof(*pinned));
-  CloseReturnPipe(pipe_status);
+  uint64_t status[2];
+  CallCommandServer(&cmd, status, sizeof(status));
+  *gauge = status[0];
+  *pinned = status[1];
+}
+
+
+EvictionStatistics GetEvictionStatistics() {
+  if (limit_ == 0) return EvictionStatistics();
+  if (!spawned_) return eviction_stats_;
+
+  LruCommand cmd;
+  cmd.command_type = kEvictionStats;
+  EvictionStatistics result;
+  CallCommandServer(&cmd, &result, sizeof(result));
+  return result;
 }
 
 
@@ -1391,16 +2781,12 @@ uint64_t GetSizePinned() {
   
 
 static void GetLimits(uint64_t *limit, uint64_t *cleanup_threshold) {
-  int pipe_limits[2];
-  MakeReturnPipe(pipe_limits);
-  
   LruCommand cmd;
   cmd.command_type = kLimits;
-  cmd.return_pipe = pipe_limits[1];
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
-  ReadHalfPipe(pipe_limits[0], limit, sizeof(*limit));
-  ReadPipe(pipe_limits[0], cleanup_threshold, sizeof(*cleanup_threshold));
-  CloseReturnPipe(pipe_limits);
+  uint64_t limits[2];
+  CallCommandServer(&cmd, limits, sizeof(limits));
+  *limit = limits[0];
+  *cleanup_threshold = limits[1];
 }
 
 
@@ -16,6 +16,27 @@ struct Any;
 
 namespace quota {
 
+/**
+ * Progress of the cache eviction.  Background eviction starts when the cache
+ * grows above the high watermark and frees space down to the low watermark
+ * (the cleanup threshold).  Rates refer to the last background run.
+ */
+struct EvictionStatistics {
+  EvictionStatistics() : high_watermark(0), low_watermark(0), num_runs(0),
+    num_files(0), num_bytes(0), num_pending(0), files_per_second(0.0),
+    bytes_per_second(0.0), active(false) { }
+  uint64_t high_watermark;
+  uint64_t low_watermark;
+  uint64_t num_runs;
+  uint64_t num_files;  /**< Evicted files, including synchronous cleanups */
+  uint64_t num_bytes;
+  uint64_t num_pending;  /**< Files waiting to be unlinked */
+  double files_per_second;
+  double bytes_per_second;
+  bool active;
+};
+
+void SetBackgroundRebuild(const bool enabled);
 bool Init(const std::string &cache_dir, const uint64_t limit,
           const uint64_t cleanup_threshold, const bool rebuild_database);
 bool InitShared(const std::string &exe_path, const std::string &cache_dir, 
@@ -30,6 +51,7 @@ bool Cleanup(const uint64_t leave_size);
 
 void Insert(const hash::Any &hash, const uint64_t size,
             const std::string &cmvfs_path);
+bool Reserve(const hash::Any &hash, const uint64_t size);
 bool Pin(const hash::Any &hash, const uint64_t size,
          const std::string &path_on_cvmfs);
 void Unpin(const hash::Any &hash);
@@ -43,6 +65,7 @@ uint64_t GetMaxFileSize();
 uint64_t GetCapacity();
 uint64_t GetSize();
 uint64_t GetSizePinned();
+EvictionStatistics GetEvictionStatistics();
 std::string GetMemoryUsage();
 
 }  // namespace quota
@@ -0,0 +1,277 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The RAM cache keeps the contents of frequently opened small files in
+ * memory, in front of the disk cache.  Objects are keyed by content hash and
+ * were verified when they were downloaded.  The cache is bounded by the
+ * number of bytes and evicts the least recently used objects.
+ *
+ * Open files hold a reference to their object.  Evicted objects are removed
+ * from the index right away but freed only with the last reference.
+ *
+ * If the RAM cache is disabled, Insert() returns objects that are not
+ * indexed, so that callers can use the same objects for in-memory files.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "ram_cache.h"
+
+#include <pthread.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+
+#include <string>
+
+#include <google/dense_hash_map>
+
+#include "logging.h"
+#include "hash.h"
+#include "util.h"
+#include "MurmurHash2.h"
+
+using namespace std;  // NOLINT
+
+namespace ram_cache {
+
+/**
+ * Objects of a 1/kMinNumObjects of the cache or more are not cached.
+ */
+const uint64_t kMinNumObjects = 64;
+const uint64_t kMaxObjectSize = 128 * 1024;
+
+/**
+ * Entries are chained in access order, the least recently used entry comes
+ * first.  The object is the first member, so that entries can be handed out
+ * as objects.
+ */
+struct CacheEntry {
+  Object object;
+  hash::Any hash;
+  unsigned refcount;
+  CacheEntry *prev;
+  CacheEntry *next;
+};
+
+struct hash_any {
+  size_t operator() (const hash::Any &hash) const {
+#ifdef __x86_64__
+    return MurmurHash64A(hash.digest, hash::kDigestSizes[hash::kSha1],
+                         0x9ce603115bba659bLLU);
+#else
+    return MurmurHash2(hash.digest, hash::kDigestSizes[hash::kSha1],
+                       0x07387a4f);
+#endif
+  }
+};
+typedef google::dense_hash_map<hash::Any, CacheEntry *, hash_any> RamIndex;
+
+struct Statistics {
+  Statistics() : num_hits(0), num_misses(0), num_inserts(0),
+    num_evictions(0), num_unindexed(0) { }
+  uint64_t num_hits;
+  uint64_t num_misses;
+  uint64_t num_inserts;
+  uint64_t num_evictions;
+  uint64_t num_unindexed;  /**< Objects handed out but not cached */
+};
+
+uint64_t max_bytes_ = 0;
+uint64_t max_object_size_ = 0;
+uint64_t gauge_ = 0;
+RamIndex *index_ = NULL;
+CacheEntry *lru_list_ = NULL;
+Statistics *statistics_ = NULL;
+pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void Unlink(CacheEntry *entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+}
+
+
+static void LinkBack(CacheEntry *entry) {
+  entry->prev = lru_list_->prev;
+  entry->next = lru_list_;
+  lru_list_->prev->next = entry;
+  lru_list_->prev = entry;
+}
+
+
+/**
+ * Drops a reference, the last one frees the object.  Needs to be called with
+ * lock_ held.
+ */
+static void Unref(CacheEntry *entry) {
+  assert(entry->refcount > 0);
+  if (--entry->refcount > 0)
+    return;
+  free(entry->object.data);
+  delete entry;
+}
+
+
+/**
+ * Removes an entry from the index.  Needs to be called with lock_ held.
+ */
+static void Evict(CacheEntry *entry) {
+  Unlink(entry);
+  index_->erase(entry->hash);
+  gauge_ -= entry->object.size;
+  statistics_->num_evictions++;
+  Unref(entry);
+}
+
+
+/**
+ * Enables the RAM cache with max_bytes.  With max_bytes == 0, the RAM cache
+ * is disabled.
+ */
+bool Init(const uint64_t max_bytes) {
+  statistics_ = new Statistics();
+  if (max_bytes == 0)
+    return true;
+
+  max_bytes_ = max_bytes;
+  max_object_size_ = max_bytes / kMinNumObjects;
+  if (max_object_size_ > kMaxObjectSize)
+    max_object_size_ = kMaxObjectSize;
+  gauge_ = 0;
+  index_ = new RamIndex();
+  hash::Any empty_key(hash::kSha1);
+  hash::Any deleted_key(hash::kSha1);
+  memset(deleted_key.digest, 0xff, sizeof(deleted_key.digest));
+  index_->set_empty_key(empty_key);
+  index_->set_deleted_key(deleted_key);
+  lru_list_ = new CacheEntry();
+  lru_list_->prev = lru_list_->next = lru_list_;
+  LogCvmfs(kLogCache, kLogDebug, "RAM cache with %"PRIu64" KB, objects up to "
+           "%"PRIu64" KB", max_bytes_ / 1024, max_object_size_ / 1024);
+  return true;
+}
+
+
+/**
+ * Objects still in use must be released before.
+ */
+void Fini() {
+  if (lru_list_ != NULL) {
+    while (lru_list_->next != lru_list_)
+      Evict(lru_list_->next);
+    delete lru_list_;
+    delete index_;
+  }
+  delete statistics_;
+  lru_list_ = NULL;
+  index_ = NULL;
+  statistics_ = NULL;
+  max_bytes_ = max_object_size_ = 0;
+}
+
+
+/**
+ * Files smaller than this are kept in the RAM cache, 0 if it is disabled.
+ */
+uint64_t GetMaxObjectSize() {
+  return max_object_size_;
+}
+
+
+/**
+ * Returns a referenced object or NULL.
+ */
+Object *Lookup(const hash::Any &id) {
+  if (max_bytes_ == 0)
+    return NULL;
+
+  pthread_mutex_lock(&lock_);
+  RamIndex::const_iterator iter = index_->find(id);
+  if (iter == index_->end()) {
+    statistics_->num_misses++;
+    pthread_mutex_unlock(&lock_);
+    return NULL;
+  }
+  CacheEntry *entry = iter->second;
+  Unlink(entry);
+  LinkBack(entry);
+  entry->refcount++;
+  statistics_->num_hits++;
+  pthread_mutex_unlock(&lock_);
+  return &entry->object;
+}
+
+
+/**
+ * Takes ownership of data (allocated by malloc) and returns a referenced
+ * object.  If the object is too large for the cache, it is not indexed.  If
+ * another thread inserted the same object in the meantime, data is freed and
+ * the object of the other thread is returned.
+ */
+Object *Insert(const hash::Any &id, unsigned char *data, const uint64_t size) {
+  CacheEntry *entry;
+  pthread_mutex_lock(&lock_);
+  if (size < max_object_size_) {
+    RamIndex::const_iterator iter = index_->find(id);
+    if (iter != index_->end()) {
+      entry = iter->second;
+      entry->refcount++;
+      pthread_mutex_unlock(&lock_);
+      free(data);
+      return &entry->object;
+    }
+  }
+
+  entry = new CacheEntry();
+  entry->object.data = data;
+  entry->object.size = size;
+  entry->hash = id;
+  entry->refcount = 1;
+  if (size >= max_object_size_) {
+    statistics_->num_unindexed++;
+    pthread_mutex_unlock(&lock_);
+    return &entry->object;
+  }
+
+  while (gauge_ + size > max_bytes_)
+    Evict(lru_list_->next);
+  entry->refcount++;
+  (*index_)[id] = entry;
+  LinkBack(entry);
+  gauge_ += size;
+  statistics_->num_inserts++;
+  pthread_mutex_unlock(&lock_);
+  return &entry->object;
+}
+
+
+void Release(Object *object) {
+  pthread_mutex_lock(&lock_);
+  Unref(reinterpret_cast<CacheEntry *>(object));
+  pthread_mutex_unlock(&lock_);
+}
+
+
+string GetStatistics() {
+  if (max_bytes_ == 0)
+    return "RAM cache disabled\n";
+
+  pthread_mutex_lock(&lock_);
+  const string result =
+    "RAM cache: " + StringifyInt(index_->size()) + " objects, " +
+    StringifyInt(gauge_ / 1024) + " KB of " + StringifyInt(max_bytes_ / 1024) +
+    " KB, objects up to " + StringifyInt(max_object_size_ / 1024) + " KB\n" +
+    "  hits: " + StringifyInt(statistics_->num_hits) +
+    "  misses: " + StringifyInt(statistics_->num_misses) +
+    "  inserts: " + StringifyInt(statistics_->num_inserts) +
+    "  evictions: " + StringifyInt(statistics_->num_evictions) +
+    "  uncached: " + StringifyInt(statistics_->num_unindexed) + "\n";
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+}  // namespace ram_cache
@@ -0,0 +1,39 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_RAM_CACHE_H_
+#define CVMFS_RAM_CACHE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace hash {
+struct Any;
+}
+
+namespace ram_cache {
+
+/**
+ * Contents of a file in memory.  Objects are reference counted, they stay
+ * valid until released even if they are evicted from the RAM cache.
+ */
+struct Object {
+  unsigned char *data;
+  uint64_t size;
+};
+
+bool Init(const uint64_t max_bytes);
+void Fini();
+uint64_t GetMaxObjectSize();
+
+Object *Lookup(const hash::Any &id);
+Object *Insert(const hash::Any &id, unsigned char *data, const uint64_t size);
+void Release(Object *object);
+
+std::string GetStatistics();
+
+}  // namespace ram_cache
+
+#endif  // CVMFS_RAM_CACHE_H_
@@ -0,0 +1,365 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The cache can be striped over several directories, typically on different
+ * local disks.  Stripe 0 is the cache directory itself, it keeps the file
+ * catalogs and the cache database.  Other objects are distributed by
+ * rendezvous hashing of their content hash, so that every object has a fixed
+ * home stripe and the order of the remaining stripes serves as fallback.
+ *
+ * For every stripe, the latency of opens from the cache is tracked as a moving
+ * average.  A stripe with several I/O errors in a row is considered
+ * unhealthy.  New objects are placed on the next healthy stripe until the
+ * unhealthy stripe is retried after kRetryInterval.
+ *
+ * Optionally, objects smaller than a threshold are placed on the stripe that
+ * was fastest in a write probe at start.
+ *
+ * The quota manager accounts objects to their home stripe (Locate()).
+ * Objects that are moved to a fallback stripe due to errors are accounted to
+ * their home stripe.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "stripes.h"
+
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+
+#include <string>
+#include <vector>
+
+#include "platform.h"
+#include "atomic.h"
+#include "logging.h"
+#include "hash.h"
+#include "util.h"
+#include "smalloc.h"
+#include "MurmurHash2.h"
+
+using namespace std;  // NOLINT
+
+namespace stripes {
+
+const unsigned kMaxErrors = 3;  /**< Consecutive errors, then unhealthy */
+const time_t kRetryInterval = 60;
+const unsigned kProbeSize = 64 * 1024;
+const uint32_t kHashSeed = 0x4f3a8e61;
+
+struct Stripe {
+  string path;
+  atomic_int64 latency;  /**< Moving average in microseconds, times 8 */
+  atomic_int64 num_ops;
+  atomic_int64 num_errors;
+  atomic_int32 consecutive_errors;
+  time_t unhealthy_since;
+  uint64_t probe_time;  /**< Microseconds for the write probe at start */
+};
+
+Stripe *stripes_ = NULL;
+unsigned num_stripes_ = 1;
+uint64_t hot_threshold_ = 0;
+unsigned fast_stripe_ = 0;
+
+
+/**
+ * Writes, syncs and reads kProbeSize bytes on the stripe.
+ *
+ * \return Microseconds, or uint64_t(-1) on failure
+ */
+static uint64_t ProbeStripe(const string &path) {
+  const string probe_path = CreateTempPath(path + "/txn/probe", 0600);
+  if (probe_path == "")
+    return uint64_t(-1);
+  unsigned char *buffer = static_cast<unsigned char *>(smalloc(kProbeSize));
+  memset(buffer, 0, kProbeSize);
+
+  uint64_t result = uint64_t(-1);
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  int fd = open(probe_path.c_str(), O_RDWR);
+  if (fd >= 0) {
+    if ((pwrite(fd, buffer, kProbeSize, 0) == int64_t(kProbeSize)) &&
+        (fsync(fd) == 0) &&
+        (pread(fd, buffer, kProbeSize, 0) == int64_t(kProbeSize)))
+    {
+      gettimeofday(&end, NULL);
+      result = uint64_t(DiffTimeSeconds(start, end) * 1000000.0);
+    }
+    close(fd);
+  }
+  unlink(probe_path.c_str());
+  free(buffer);
+  return result;
+}
+
+
+/**
+ * Sets up stripe 0 in cache_dir and further stripes in the colon separated
+ * list of stripe_dirs.  With a hot_threshold > 0, smaller objects are placed
+ * on the fastest stripe.
+ */
+bool Init(const string &cache_dir, const string &stripe_dirs,
+          const uint64_t hot_threshold)
+{
+  vector<string> paths;
+  paths.push_back(cache_dir);
+  if (stripe_dirs != "") {
+    vector<string> tokens = SplitString(stripe_dirs, ':');
+    for (unsigned i = 0; i < tokens.size(); ++i) {
+      if (tokens[i] != "")
+        paths.push_back(tokens[i]);
+    }
+  }
+  if (paths.size() > kMaxStripes) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+             "too many cache stripes (%u), maximum is %u",
+             unsigned(paths.size()), kMaxStripes);
+    return false;
+  }
+
+  stripes_ = new Stripe[paths.size()];
+  for (unsigned i = 0; i < paths.size(); ++i) {
+    if ((i > 0) && !MakeCacheDirectories(paths[i], 0700)) {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "failed to create cache stripe in %s (%d)",
+               paths[i].c_str(), errno);
+      Fini();
+      return false;
+    }
+    stripes_[i].path = paths[i];
+    atomic_init64(&stripes_[i].latency);
+    atomic_init64(&stripes_[i].num_ops);
+    atomic_init64(&stripes_[i].num_errors);
+    atomic_init32(&stripes_[i].consecutive_errors);
+    stripes_[i].unhealthy_since = 0;
+    stripes_[i].probe_time = 0;
+  }
+  num_stripes_ = paths.size();
+
+  hot_threshold_ = 0;
+  fast_stripe_ = 0;
+  if ((hot_threshold > 0) && (num_stripes_ > 1)) {
+    for (unsigned i = 0; i < num_stripes_; ++i) {
+      stripes_[i].probe_time = ProbeStripe(stripes_[i].path);
+      if (stripes_[i].probe_time < stripes_[fast_stripe_].probe_time)
+        fast_stripe_ = i;
+    }
+    hot_threshold_ = hot_threshold;
+    LogCvmfs(kLogCache, kLogDebug, "fastest cache stripe is %s (%"PRIu64
+             " us)", stripes_[fast_stripe_].path.c_str(),
+             stripes_[fast_stripe_].probe_time);
+  }
+
+  LogCvmfs(kLogCache, kLogDebug, "cache striped over %u directories",
+           num_stripes_);
+  return true;
+}
+
+
+void Fini() {
+  delete[] stripes_;
+  stripes_ = NULL;
+  num_stripes_ = 1;
+  hot_threshold_ = 0;
+  fast_stripe_ = 0;
+}
+
+
+/**
+ * 1 if the cache is not striped.
+ */
+unsigned GetNumStripes() {
+  return num_stripes_;
+}
+
+
+string GetPath(const unsigned stripe) {
+  assert(stripe < num_stripes_);
+  return stripes_[stripe].path;
+}
+
+
+static bool IsHealthy(const unsigned stripe) {
+  if (atomic_read32(&stripes_[stripe].consecutive_errors) <
+      static_cast<int32_t>(kMaxErrors))
+  {
+    return true;
+  }
+  return time(NULL) - stripes_[stripe].unhealthy_since > kRetryInterval;
+}
+
+
+/**
+ * Stripes in the order of their rendezvous hash for id, the first one is the
+ * home stripe.
+ */
+static void GetHashOrder(const hash::Any &id, unsigned order[kMaxStripes]) {
+  uint32_t scores[kMaxStripes];
+  for (unsigned i = 0; i < num_stripes_; ++i) {
+    scores[i] = MurmurHash2(id.digest, hash::kDigestSizes[id.algorithm],
+                            kHashSeed + i);
+    // Insertion sort by descending score
+    unsigned j = i;
+    for (; (j > 0) && (scores[order[j-1]] < scores[i]); --j)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+}
+
+
+static bool IsHot(const uint64_t size) {
+  return (hot_threshold_ > 0) && (size < hot_threshold_);
+}
+
+
+/**
+ * The stripe an object belongs to if all stripes are healthy.
+ */
+unsigned Locate(const hash::Any &id, const uint64_t size) {
+  if (num_stripes_ == 1)
+    return 0;
+  if (IsHot(size))
+    return fast_stripe_;
+  unsigned order[kMaxStripes];
+  GetHashOrder(id, order);
+  return order[0];
+}
+
+
+/**
+ * The stripe a new object is written to.  Skips unhealthy stripes.
+ */
+unsigned Place(const hash::Any &id, const uint64_t size) {
+  if (num_stripes_ == 1)
+    return 0;
+  if (IsHot(size) && IsHealthy(fast_stripe_))
+    return fast_stripe_;
+  unsigned order[kMaxStripes];
+  GetHashOrder(id, order);
+  for (unsigned i = 0; i < num_stripes_; ++i) {
+    if (IsHealthy(order[i]))
+      return order[i];
+  }
+  return order[0];
+}
+
+
+/**
+ * The order in which stripes are searched for an object: the home stripe,
+ * the fast stripe for small objects, the fallback stripes, and the unhealthy
+ * stripes last.
+ *
+ * \return Number of stripes in order
+ */
+unsigned GetProbeOrder(const hash::Any &id, unsigned order[kMaxStripes]) {
+  if (num_stripes_ == 1) {
+    order[0] = 0;
+    return 1;
+  }
+
+  unsigned hash_order[kMaxStripes];
+  GetHashOrder(id, hash_order);
+  if (hot_threshold_ > 0) {
+    for (unsigned i = 1; i < num_stripes_; ++i) {
+      if (hash_order[i] == fast_stripe_) {
+        memmove(&hash_order[2], &hash_order[1], (i - 1) * sizeof(unsigned));
+        hash_order[1] = fast_stripe_;
+        break;
+      }
+    }
+  }
+
+  unsigned num_healthy = 0;
+  unsigned num_unhealthy = 0;
+  unsigned unhealthy[kMaxStripes];
+  for (unsigned i = 0; i < num_stripes_; ++i) {
+    if (IsHealthy(hash_order[i]))
+      order[num_healthy++] = hash_order[i];
+    else
+      unhealthy[num_unhealthy++] = hash_order[i];
+  }
+  memcpy(&order[num_healthy], unhealthy, num_unhealthy * sizeof(unsigned));
+  return num_stripes_;
+}
+
+
+/**
+ * Records a successful operation, which also resets the error streak.
+ */
+void RecordLatency(const unsigned stripe, const uint64_t microseconds) {
+  if (num_stripes_ == 1)
+    return;
+  Stripe *s = &stripes_[stripe];
+  atomic_inc64(&s->num_ops);
+  // latency holds 8 times the average, add 1/8 of the difference
+  const int64_t average = atomic_read64(&s->latency) / 8;
+  atomic_xadd64(&s->latency, int64_t(microseconds) - average);
+  if (atomic_read32(&s->consecutive_errors) > 0) {
+    if (atomic_read32(&s->consecutive_errors) >=
+        static_cast<int32_t>(kMaxErrors))
+    {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "cache stripe %s is healthy again", s->path.c_str());
+    }
+    atomic_init32(&s->consecutive_errors);
+  }
+}
+
+
+/**
+ * Errors that point to a failing or full disk count towards the health of the
+ * stripe.
+ */
+void RecordError(const unsigned stripe, const int error_code) {
+  if (num_stripes_ == 1)
+    return;
+  if ((error_code != EIO) && (error_code != EROFS) &&
+      (error_code != ENOSPC) && (error_code != EDQUOT))
+  {
+    return;
+  }
+  Stripe *s = &stripes_[stripe];
+  atomic_inc64(&s->num_errors);
+  const int32_t num_errors = atomic_xadd32(&s->consecutive_errors, 1) + 1;
+  if (num_errors >= static_cast<int32_t>(kMaxErrors)) {
+    // Also pushes back the retry of an unhealthy stripe
+    s->unhealthy_since = time(NULL);
+    if (num_errors == static_cast<int32_t>(kMaxErrors)) {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "cache stripe %s is unhealthy (error %d)", s->path.c_str(),
+               error_code);
+    }
+  }
+}
+
+
+string GetStatistics() {
+  if (num_stripes_ == 1)
+    return "Cache is not striped\n";
+
+  string result;
+  for (unsigned i = 0; i < num_stripes_; ++i) {
+    Stripe *s = &stripes_[i];
+    result += "Stripe " + StringifyInt(i) + " " + s->path + ": " +
+      (IsHealthy(i) ? "healthy" : "unhealthy") +
+      ((hot_threshold_ > 0) && (i == fast_stripe_) ? ", fast" : "") +
+      ", latency " + StringifyInt(atomic_read64(&s->latency) / 8) + " us, " +
+      StringifyInt(atomic_read64(&s->num_ops)) + " operations, " +
+      StringifyInt(atomic_read64(&s->num_errors)) + " errors\n";
+  }
+  return result;
+}
+
+}  // namespace stripes
@@ -0,0 +1,37 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_STRIPES_H_
+#define CVMFS_STRIPES_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace hash {
+struct Any;
+}
+
+namespace stripes {
+
+const unsigned kMaxStripes = 8;
+
+bool Init(const std::string &cache_dir, const std::string &stripe_dirs,
+          const uint64_t hot_threshold);
+void Fini();
+
+unsigned GetNumStripes();
+std::string GetPath(const unsigned stripe);
+unsigned Locate(const hash::Any &id, const uint64_t size);
+unsigned Place(const hash::Any &id, const uint64_t size);
+unsigned GetProbeOrder(const hash::Any &id, unsigned order[kMaxStripes]);
+
+void RecordLatency(const unsigned stripe, const uint64_t microseconds);
+void RecordError(const unsigned stripe, const int error_code);
+
+std::string GetStatistics();
+
+}  // namespace stripes
+
+#endif  // CVMFS_STRIPES_H_
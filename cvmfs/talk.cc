@@ -29,10 +29,19 @@
 
 #include <string>
 #include <vector>
+#include <map>
 
 #include "platform.h"
 #include "tracer.h"
 #include "quota.h"
+#include "pack_store.h"
+#include "ram_cache.h"
+#include "stripes.h"
+#include "pin_sets.h"
+#include "fuse_async.h"
+#include "fuse_loop.h"
+#include "latency.h"
+#include "metrics.h"
 #include "cvmfs.h"
 #include "util.h"
 #include "logging.h"
@@ -70,6 +79,19 @@ static void AnswerStringList(const int con_fd, const vector<string> &list) {
 }
 
 
+static string PrintTransferScore(const download::TransferScore &score) {
+  if (score.num_samples == 0)
+    return "";
+  string result = " [latency " + StringifyInt(int64_t(score.latency_ms)) +
+                  " ms";
+  if (score.throughput_kbs >= 0.0)
+    result += ", " + StringifyInt(int64_t(score.throughput_kbs)) + " kB/s";
+  result += ", expected " + StringifyInt(int64_t(score.expected_ms)) + " ms, " +
+            StringifyInt(score.num_samples) + " transfers]";
+  return result;
+}
+
+
 static void *MainTalk(void *data __attribute__((unused))) {
   LogCvmfs(kLogTalk, kLogDebug, "talk thread started");
 
@@ -110,8 +132,27 @@ static void *MainTalk(void *data __attribute__((unused))) {
             StringifyInt(size_unpinned) + " Bytes), pinned: " +
             StringifyInt(size_pinned / (1024*1024)) + "MB (" +
             StringifyInt(size_pinned) + " Bytes)\n";
-          Answer(con_fd, size_str);
+          const quota::EvictionStatistics evict =
+            quota::GetEvictionStatistics();
+          const string evict_str = "Eviction: high watermark " +
+            StringifyInt(evict.high_watermark / (1024*1024)) +
+            "MB, low watermark " +
+            StringifyInt(evict.low_watermark / (1024*1024)) + "MB, " +
+            StringifyInt(evict.num_runs) + " runs, evicted " +
+            StringifyInt(evict.num_files) + " files (" +
+            StringifyInt(evict.num_bytes / (1024*1024)) + "MB), " +
+            StringifyInt(evict.num_pending) + " pending unlinks, last run " +
+            StringifyInt(uint64_t(evict.files_per_second)) + " files/s (" +
+            StringifyInt(uint64_t(evict.bytes_per_second / (1024*1024))) +
+            "MB/s)" + (evict.active ? " (running)" : "") + "\n";
+          const string pack_str = (pack_store::GetThreshold() > 0) ?
+            pack_store::GetStatistics() : "";
+          Answer(con_fd, size_str + evict_str + pack_str);
         }
+      } else if (line == "cache ram") {
+        Answer(con_fd, ram_cache::GetStatistics());
+      } else if (line == "cache stripes") {
+        Answer(con_fd, stripes::GetStatistics());
       } else if (line == "cache list") {
         if (quota::GetCapacity() == 0) {
           Answer(con_fd, "Cache is unmanaged\n");
@@ -133,6 +174,40 @@ static void *MainTalk(void *data __attribute__((unused))) {
           vector<string> ls_catalogs = quota::ListCatalogs();
           AnswerStringList(con_fd, ls_catalogs);
         }
+      } else if (line == "pin sets") {
+        Answer(con_fd, pin_sets::List());
+      } else if (line.substr(0, 8) == "pin set ") {
+        vector<string> tokens = SplitString(line.substr(8), ' ');
+        if (tokens.size() < 3) {
+          Answer(con_fd, "Usage: pin set <name> <MB> <path> [<path> ...]\n");
+        } else {
+          const uint64_t limit = String2Uint64(tokens[1])*1024*1024;
+          const vector<string> paths(tokens.begin() + 2, tokens.end());
+          switch (pin_sets::Pin(tokens[0], limit, paths)) {
+            case 0:
+              Answer(con_fd, "OK\n");
+              break;
+            case -EEXIST:
+              Answer(con_fd, "Pin set exists\n");
+              break;
+            case -ENOENT:
+              Answer(con_fd, "No such file or directory\n");
+              break;
+            case -EFBIG:
+              Answer(con_fd, "Pin set exceeds its limit\n");
+              break;
+            case -ENOSPC:
+              Answer(con_fd, "Not enough cache space to pin\n");
+              break;
+            default:
+              Answer(con_fd, "Failed to fetch files\n");
+          }
+        }
+      } else if (line.substr(0, 10) == "unpin set ") {
+        if (pin_sets::Unpin(line.substr(10)) == 0)
+          Answer(con_fd, "OK\n");
+        else
+          Answer(con_fd, "No such pin set\n");
       } else if (line.substr(0, 7) == "cleanup") {
         if (quota::GetCapacity() == 0) {
           Answer(con_fd, "Cache is unmanaged\n");
@@ -217,9 +292,10 @@ static void *MainTalk(void *data __attribute__((unused))) {
       } else if (line == "host info") {
         vector<string> host_chain;
         vector<int> rtt;
+        vector<download::TransferScore> scores;
         unsigned active_host;
 
-        download::GetHostInfo(&host_chain, &rtt, &active_host);
+        download::GetHostInfo(&host_chain, &rtt, &scores, &active_host);
         string host_str;
         for (unsigned i = 0; i < host_chain.size(); ++i) {
           host_str += "  [" + StringifyInt(i) + "] " + host_chain[i] + " (";
@@ -229,7 +305,7 @@ static void *MainTalk(void *data __attribute__((unused))) {
             host_str += "host down";
           else
             host_str += StringifyInt(rtt[i]) + " ms";
-          host_str += ")\n";
+          host_str += ")" + PrintTransferScore(scores[i]) + "\n";
         }
         host_str += "Active host " + StringifyInt(active_host) + ": " +
                     host_chain[active_host] + "\n";
@@ -260,8 +336,21 @@ static void *MainTalk(void *data __attribute__((unused))) {
             proxy_str += "[" + StringifyInt(i) + "] " +
                          JoinStrings(proxy_chain[i], ", ") + "\n";
           }
-          proxy_str += "Active proxy: [" + StringifyInt(active_group) + "] " +
-                       proxy_chain[active_group][0] + "\n";
+          map<string, download::TransferScore> scores;
+          download::GetProxyScores(&scores);
+          for (map<string, download::TransferScore>::const_iterator
+               i = scores.begin(), iEnd = scores.end(); i != iEnd; ++i)
+          {
+            proxy_str += "  " + i->first + PrintTransferScore(i->second) +
+                         "\n";
+          }
+          if (download::GetProxySharding()) {
+            proxy_str += "Active group: [" + StringifyInt(active_group) +
+                         "] (sharded by consistent hashing)\n";
+          } else {
+            proxy_str += "Active proxy: [" + StringifyInt(active_group) +
+                         "] " + proxy_chain[active_group][0] + "\n";
+          }
         } else {
           proxy_str = "No proxies defined\n";
         }
@@ -318,6 +407,8 @@ static void *MainTalk(void *data __attribute__((unused))) {
         string result;
 
         result += "File System Call Statistics:\n  " + cvmfs::GetFsStats();
+        result += "  " + fuse_async::GetStatistics();
+        result += fuse_loop::GetStatistics();
 
         cvmfs::GetLruStatistics(&inode_stats, &path_stats, &md5path_stats);
         result += "File Catalog Memory Cache:\n" +
@@ -380,8 +471,13 @@ static void *MainTalk(void *data __attribute__((unused))) {
                   + " KB\n";
 
         Answer(con_fd, result);
+      } else if (line == "latency") {
+        Answer(con_fd, latency::Print());
+      } else if (line == "metrics") {
+        Answer(con_fd, metrics::Print());
       } else if (line == "reset error counters") {
         cvmfs::ResetErrorCounters();
+        latency::Reset();
         Answer(con_fd, "OK\n");
       } else if (line == "pid") {
         const string pid_str = StringifyInt(cvmfs::pid_) + "\n";
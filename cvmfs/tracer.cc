@@ -1,91 +1,112 @@
 /**
  * This file is part of the CernVM File System.
  *
- * Tracer is a thread-safe tracing module.  It uses a ring buffer
- * and spawns a helper thread, that flushes the messages onto the disk
- * when necessary.  The output file is in csv format.  Usually tracing
- * a message is a lock-free process, which therefore should have minimal
- * overhead.
+ * Tracer is a thread-safe tracing module with small overhead, so that it can
+ * stay switched on in production.  Every thread traces into a buffer of its
+ * own that only needs to be shared with Flush(), which makes tracing a
+ * gettimeofday() call and a memcpy of the path.  Full buffers are handed
+ * over to a flush thread that appends them to the trace file in a single
+ * write.  If the flush thread falls behind, records are dropped and counted
+ * rather than blocking the traced threads.
+ *
+ * The trace file is binary, see tracer.h, cvmfs_trace_convert turns it into
+ * CSV or JSON.  Records of different threads are not sorted by time.
  *
  * This is _not_ supposed to be a debugging system.  It is optimized for
  * speed and does not try to gather any additional information (like
- * threadid, status of variables, etc.) and it's in no way "intelligent".
+ * status of variables, etc.) and it's in no way "intelligent".
  * But -- most importantly -- if the thing crashes, all messages in the
- * ring buffer go to hell as well.
- *
- * Csv output is adapted from libcsv.
- *
- * \todo Currently, if anything goes wrong, the whole thing breaks
- *       down on assertion.  This might be not desired behavior.
+ * buffers go to hell as well.
  */
 
-#include "config.h"
+#include "cvmfs_config.h"
 #include "tracer.h"
 
 #include <pthread.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <cstdlib>
-#include <cstdio>
+#include <cstring>
 #include <cassert>
-#include <cerrno>
 
 #include <string>
+#include <vector>
 
+#include "platform.h"
 #include "util.h"
 #include "atomic.h"
+#include "logging.h"
+#include "smalloc.h"
 
 using namespace std;  // NOLINT
 
 namespace tracer {
 
 /**
- * Contents of a trace line.
- * \todo memory alignment
+ * Full buffers that wait for the flush thread, beyond that records are
+ * dropped.
  */
-struct BufferEntry {
-  timeval time_stamp;  /**< This is currently with milliseconds precision
-                            (using gettimeofday). */
-  int code;  /*< arbitrary code, negative codes are reserved for internal
-                 use. */
-  PathString path;  /**< The path that is subject to the trace */
-  std::string msg;
+const unsigned kMaxPendingBuffers = 32;
+/**
+ * Average path length the path space of a buffer is sized for.
+ */
+const unsigned kAveragePathLength = 64;
+/**
+ * Idle buffers are flushed after this time, so that the trace file does not
+ * lag behind too much.
+ */
+const int kFlushIntervalMs = 5000;
+/**
+ * Longer durations are cut, it is more than an hour.
+ */
+const uint64_t kMaxDuration = 0xFFFFFFFF;
+
+struct Buffer {
+  BlockHeader header;
+  Record *records;
+  char *paths;
 };
 
-struct FlushThreadStartData {
-  pthread_cond_t *sig_flush;
-  pthread_cond_t *sig_continue_trace;
-  BufferEntry *ring_buffer;
-  atomic_int32 *commit_buffer;
-  atomic_int32 *seq_no;
-  atomic_int32 *flushed;
-  atomic_int32 *terminate;
-  atomic_int32 *flush_immediately;
-  int size;
-  int threshold;
-  string filename;
+/**
+ * The busy flag is held by the owning thread while it traces and by Flush()
+ * while it takes away the buffer.  It is never contended otherwise.
+ */
+struct ThreadBuffer {
+  atomic_int32 busy;
+  Buffer *buffer;  /**< NULL until the next trace */
+  uint32_t thread;
+  uint32_t num_dropped;
 };
 
 bool active_ = false;
-std::string filename_;
-int buffer_size_;
-int flush_threshold_;
-atomic_int32 seq_no_;  /**< Starts with 0 and gets incremented by each call to
-                        trace. Contains the first non-used sequence number. */
-atomic_int32 flushed_;  /**< Starts with 0 and gets incremented by the flush
-                         thread.  Points to the first non-flushed message.
-                         flushed <= seq_no holds. */
-atomic_int32 terminate_flush_thread_;
-atomic_int32 flush_immediately_;
-BufferEntry *ring_buffer_;
-atomic_int32 *commit_buffer_;  /**< Has the same size as the ring buffer.  If a
-                                message is actually copied to the ring buffer
-                                memory, the respective flag is set to 1.
-                                Flags are reset to 0 by the flush thread. */
+int fd_trace_ = -1;
+unsigned buffer_size_ = 0;  /**< Records per buffer */
+unsigned paths_size_ = 0;  /**< Path bytes per buffer */
+pthread_key_t thread_key_;
 pthread_t thread_flush_;
-pthread_cond_t sig_flush_;
-pthread_cond_t sig_continue_trace_;
-pthread_mutex_t sig_continue_trace_mutex_;
+
+vector<ThreadBuffer *> *thread_buffers_ = NULL;
+uint32_t num_threads_ = 0;
+pthread_mutex_t lock_threads_ = PTHREAD_MUTEX_INITIALIZER;
+
+vector<Buffer *> *full_buffers_ = NULL;
+vector<Buffer *> *free_buffers_ = NULL;
+/**
+ * Exited threads whose last records were dropped, the counts are written by
+ * Fini().
+ */
+vector<ThreadBuffer *> *exited_threads_ = NULL;
+uint64_t num_submitted_ = 0;
+uint64_t num_written_ = 0;
+bool terminate_ = false;
+pthread_mutex_t lock_buffers_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sig_flush_ = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sig_written_ = PTHREAD_COND_INITIALIZER;
 
 
 /**
@@ -105,152 +126,206 @@ static void GetTimespecRel(const int64_t ms, timespec *ts) {
 }
 
 
-static int WriteCsvFile(FILE *fp, const string &field) {
-  if (fp == NULL)
-    return 0;
+static void WriteBuffer(Buffer *buffer) {
+  struct iovec iov[3];
+  iov[0].iov_base = &buffer->header;
+  iov[0].iov_len = sizeof(buffer->header);
+  iov[1].iov_base = buffer->records;
+  iov[1].iov_len = buffer->header.num_records * sizeof(Record);
+  iov[2].iov_base = buffer->paths;
+  iov[2].iov_len = buffer->header.size_paths;
+  const ssize_t size = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+  if (writev(fd_trace_, iov, 3) != size) {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "failed to write to trace file (%d)", errno);
+  }
+}
 
-  int retval;
 
-  if ((retval = fputc('"', fp)) != '"')
-    return retval;
+/**
+ * Writes a block without records that only reports dropped records, which
+ * would be lost otherwise.
+ */
+static void WriteDropped(const ThreadBuffer *thread_buffer) {
+  Buffer buffer;
+  buffer.header.magic = kBlockMagic;
+  buffer.header.version = kFormatVersion;
+  buffer.header.thread = thread_buffer->thread;
+  buffer.header.num_records = 0;
+  buffer.header.size_paths = 0;
+  buffer.header.num_dropped = thread_buffer->num_dropped;
+  buffer.records = NULL;
+  buffer.paths = NULL;
+  WriteBuffer(&buffer);
+}
 
-  for (unsigned i = 0, l = field.length(); i < l; ++i) {
-    if (field[i] == '"') {
-      if ((retval = fputc('"', fp)) != '"')
-        return retval;
-    }
-    if ((retval = fputc(field[i], fp)) != field[i])
-      return retval;
+
+static void FreeBuffer(Buffer *buffer) {
+  free(buffer->records);
+  free(buffer->paths);
+  delete buffer;
+}
+
+
+/**
+ * Hands over a buffer to the flush thread.  Empty buffers are recycled
+ * immediately.
+ */
+static void SubmitBuffer(Buffer *buffer) {
+  pthread_mutex_lock(&lock_buffers_);
+  if (buffer->header.num_records == 0) {
+    free_buffers_->push_back(buffer);
+  } else {
+    full_buffers_->push_back(buffer);
+    num_submitted_++;
+    pthread_cond_signal(&sig_flush_);
   }
+  pthread_mutex_unlock(&lock_buffers_);
+}
 
-  if ((retval = fputc('"', fp)) != '"')
-    return retval;
 
-  return 0;
+/**
+ * \return NULL if too many buffers are waiting to be written
+ */
+static Buffer *GetFreeBuffer() {
+  Buffer *buffer = NULL;
+  pthread_mutex_lock(&lock_buffers_);
+  if (!free_buffers_->empty()) {
+    buffer = free_buffers_->back();
+    free_buffers_->pop_back();
+  } else if (full_buffers_->size() < kMaxPendingBuffers) {
+    buffer = new Buffer();
+    buffer->records =
+      static_cast<Record *>(smalloc(buffer_size_ * sizeof(Record)));
+    buffer->paths = static_cast<char *>(smalloc(paths_size_));
+  }
+  pthread_mutex_unlock(&lock_buffers_);
+  return buffer;
 }
 
 
-static void *MainFlush(void *data) {
-  FlushThreadStartData *start_data =
-    reinterpret_cast<FlushThreadStartData *>(data);
-  pthread_mutex_t sig_flush_mutex;
-  int retval;
-  retval = pthread_mutex_init(&sig_flush_mutex, NULL);
-  assert(retval == 0 && "Could not initialize mutex for flush signal");
-  retval = pthread_mutex_lock(&sig_flush_mutex);
-  assert(retval == 0 && "Could not lock mutex for flush signal");
-  FILE *f = fopen(start_data->filename.c_str(), "a");
-  assert(f != NULL && "Could not open trace file");
-  struct timespec timeout;
-
-  do {
-    while ((atomic_read32(start_data->terminate) == 0) &&
-           (atomic_read32(start_data->flush_immediately) == 0) &&
-           (atomic_read32(start_data->seq_no) - atomic_read32(start_data->flushed)
-             <= start_data->threshold))
-    {
-      GetTimespecRel(2000, &timeout);
-      retval = pthread_cond_timedwait(start_data->sig_flush,
-                                      &sig_flush_mutex, &timeout);
-      assert(retval != EINVAL && "Error while waiting on flush signal");
-    }
+/**
+ * Takes away the buffers of all threads and hands them over to the flush
+ * thread.
+ */
+static void SubmitThreadBuffers() {
+  pthread_mutex_lock(&lock_threads_);
+  for (unsigned i = 0; i < thread_buffers_->size(); ++i) {
+    ThreadBuffer *thread_buffer = (*thread_buffers_)[i];
+    while (!atomic_cas32(&thread_buffer->busy, 0, 1)) { }
+    Buffer *buffer = thread_buffer->buffer;
+    thread_buffer->buffer = NULL;
+    atomic_cas32(&thread_buffer->busy, 1, 0);
+    if (buffer != NULL)
+      SubmitBuffer(buffer);
+  }
+  pthread_mutex_unlock(&lock_threads_);
+}
 
-    int base = atomic_read32(start_data->flushed) % start_data->size;
-    int pos, i = 0;
-    while ((i <= start_data->threshold) &&
-           (atomic_read32(&start_data->commit_buffer[
-             pos = ((base + i) % start_data->size)]) == 1))
-    {
-      string tmp;
-      tmp = StringifyTimeval(start_data->ring_buffer[pos].time_stamp);
-      retval = WriteCsvFile(f, tmp);
-      retval |= fputc(',', f) - ',';
-      tmp = StringifyInt(start_data->ring_buffer[pos].code);
-      retval = WriteCsvFile(f, tmp);
-      retval |= fputc(',', f) - ',';
-      retval |= WriteCsvFile(f, start_data->ring_buffer[pos].path.ToString());
-      retval |= fputc(',', f) - ',';
-      retval |= WriteCsvFile(f, start_data->ring_buffer[pos].msg);
-      retval |= (fputc(13, f) - 13) | (fputc(10, f) - 10);
-      retval |= fflush(f);
-      assert(retval == 0 && "Error while writing into trace file");
-
-      atomic_dec32(&start_data->commit_buffer[pos]);
-      ++i;
+
+static void *MainFlush(void *data __attribute__((unused))) {
+  pthread_mutex_lock(&lock_buffers_);
+  while (true) {
+    if (full_buffers_->empty()) {
+      if (terminate_)
+        break;
+      timespec timeout;
+      GetTimespecRel(kFlushIntervalMs, &timeout);
+      const int retval = pthread_cond_timedwait(&sig_flush_, &lock_buffers_,
+                                                &timeout);
+      if (retval == ETIMEDOUT) {
+        pthread_mutex_unlock(&lock_buffers_);
+        SubmitThreadBuffers();
+        pthread_mutex_lock(&lock_buffers_);
+      }
+      continue;
     }
-    atomic_xadd32(start_data->flushed, i);
-    atomic_cas32(start_data->flush_immediately, 1, 0);
-
-    retval = pthread_cond_broadcast(start_data->sig_continue_trace);
-    assert(retval == 0 && "Could not signal trace threads");
-  } while ((atomic_read32(start_data->terminate) == 0) ||
-           (atomic_read32(start_data->flushed) <
-             atomic_read32(start_data->seq_no)));
-
-  retval = fclose(f);
-  assert(retval == 0 && "Could not gracefully close trace file");
-  pthread_mutex_unlock(&sig_flush_mutex);
-  retval = pthread_mutex_destroy(&sig_flush_mutex);
-  assert(retval == 0 && "Could not gracefully destroy mutex for flush signal");
-  delete start_data;
+
+    Buffer *buffer = full_buffers_->front();
+    full_buffers_->erase(full_buffers_->begin());
+    pthread_mutex_unlock(&lock_buffers_);
+    WriteBuffer(buffer);
+    pthread_mutex_lock(&lock_buffers_);
+    buffer->header.num_records = 0;
+    buffer->header.size_paths = 0;
+    free_buffers_->push_back(buffer);
+    num_written_++;
+    pthread_cond_broadcast(&sig_written_);
+  }
+  pthread_mutex_unlock(&lock_buffers_);
   return NULL;
 }
 
+
+/**
+ * Called when a traced thread exits.
+ */
+static void CleanupThreadBuffer(void *data) {
+  ThreadBuffer *thread_buffer = static_cast<ThreadBuffer *>(data);
+  pthread_mutex_lock(&lock_threads_);
+  for (vector<ThreadBuffer *>::iterator i = thread_buffers_->begin(),
+       iEnd = thread_buffers_->end(); i != iEnd; ++i)
+  {
+    if (*i == thread_buffer) {
+      thread_buffers_->erase(i);
+      break;
+    }
+  }
+  if (thread_buffer->buffer != NULL) {
+    SubmitBuffer(thread_buffer->buffer);
+    delete thread_buffer;
+  } else if (thread_buffer->num_dropped > 0) {
+    exited_threads_->push_back(thread_buffer);
+  } else {
+    delete thread_buffer;
+  }
+  pthread_mutex_unlock(&lock_threads_);
+}
+
+
+static ThreadBuffer *RegisterThread() {
+  ThreadBuffer *thread_buffer = new ThreadBuffer();
+  atomic_init32(&thread_buffer->busy);
+  thread_buffer->buffer = NULL;
+  thread_buffer->num_dropped = 0;
+  pthread_mutex_lock(&lock_threads_);
+  thread_buffer->thread = num_threads_++;
+  thread_buffers_->push_back(thread_buffer);
+  pthread_mutex_unlock(&lock_threads_);
+  pthread_setspecific(thread_key_, thread_buffer);
+  return thread_buffer;
+}
+
+
 /**
  * Initialize module and spawns the helper thread for flushing.
- * @param[in] buffer_size The number of messages that are kept at maximum in the
- *            internal ring buffer.
- * @param[in] flush_threshold Threshold for the flushing thread.  Messages are
- *            flushed when more then t+1 messages are pending in the ring
- *            buffer. 0 <= flush_threshold < buffer_size must hold.
- * @param[in] filename File name of the trace log on the disk.  The file will
- *            be opened in 'a' mode, i.e. messages are appended.
+ * @param[in] buffer_size The number of records that a thread traces before
+ *            its buffer is written.
+ * @param[in] filename File name of the trace log on the disk.  Blocks are
+ *            appended.
  */
-void Init(const int buffer_size, const int flush_threshold,
-          const string &filename)
-{
-  active_ = true;
-  filename_ = filename;
+void Init(const unsigned buffer_size, const string &filename) {
+  assert(buffer_size > 0 && "Invalid size");
+  fd_trace_ = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+  assert(fd_trace_ >= 0 && "Could not open trace file");
   buffer_size_ = buffer_size;
-  flush_threshold_ = flush_threshold;
-  assert(buffer_size_ > 1 && "Invalid size");
-  assert(0 <= flush_threshold_ && flush_threshold_ < buffer_size_ &&
-         "Invalid threshold");
-
-  atomic_init32(&seq_no_);
-  atomic_init32(&flushed_);
-  atomic_init32(&terminate_flush_thread_);
-  atomic_init32(&flush_immediately_);
-  ring_buffer_ = new BufferEntry[buffer_size_];
-  commit_buffer_ = new atomic_int32[buffer_size_];
-  for (int i = 0; i < buffer_size_; i++)
-    atomic_init32(&commit_buffer_[i]);
+  paths_size_ = buffer_size * kAveragePathLength;
+  thread_buffers_ = new vector<ThreadBuffer *>();
+  num_threads_ = 0;
+  full_buffers_ = new vector<Buffer *>();
+  free_buffers_ = new vector<Buffer *>();
+  exited_threads_ = new vector<ThreadBuffer *>();
+  num_submitted_ = num_written_ = 0;
+  terminate_ = false;
 
   int retval;
-  retval = pthread_cond_init(&sig_continue_trace_, NULL);
-  assert(retval == 0 && "Could not create continue-trace signal");
-  retval = pthread_mutex_init(&sig_continue_trace_mutex_, NULL);
-  assert(retval == 0 && "Could not create mutex for continue-trace signal");
-  retval = pthread_cond_init(&sig_flush_, NULL);
-  assert(retval == 0 && "Could not create flush signal");
-
-  FlushThreadStartData *start_data = new FlushThreadStartData;
-  start_data->sig_flush = &sig_flush_;
-  start_data->sig_continue_trace = &sig_continue_trace_;
-  start_data->ring_buffer = ring_buffer_;
-  start_data->commit_buffer = commit_buffer_;
-  start_data->seq_no = &seq_no_;
-  start_data->flushed = &flushed_;
-  start_data->terminate = &terminate_flush_thread_;
-  start_data->flush_immediately = &flush_immediately_;
-  start_data->size = buffer_size_;
-  start_data->threshold = flush_threshold_;
-  start_data->filename = filename_;
-  retval = pthread_create(&thread_flush_, NULL, MainFlush,
-                          reinterpret_cast<void *> (start_data));
+  retval = pthread_key_create(&thread_key_, CleanupThreadBuffer);
+  assert(retval == 0 && "Could not create thread key");
+  retval = pthread_create(&thread_flush_, NULL, MainFlush, NULL);
   assert(retval == 0 && "Could not create flush thread");
 
-  TraceInternal(-1, PathString("Tracer", 6), "Trace buffer created");
+  active_ = true;
+  TraceInternal(-1, 0, PathString("Tracer", 6), 0);
 }
 
 
@@ -263,114 +338,182 @@ void InitNull() {
 
 
 /**
- * Destroys everything and terminates the flush thread.  Flushes
- * all pending messages from the ring buffer.  Be sure that all trace
- * functions have returned before destroying.
+ * Writes all pending records and terminates the flush thread.  Be sure that
+ * all trace functions have returned before destroying.
  */
 void Fini() {
   if (!active_) return;
 
-  TraceInternal(-2, PathString("Tracer", 6), "Destroying trace buffer...");
-
-  // Trigger flushing and wait for it
-  int retval;
-  atomic_inc32(&terminate_flush_thread_);
-  retval = pthread_cond_signal(&sig_flush_);
-  assert(retval == 0 && "Could not signal flush thread");
-  retval = pthread_join(thread_flush_, NULL);
+  TraceInternal(-2, 0, PathString("Tracer", 6), 0);
+  active_ = false;
+  SubmitThreadBuffers();
+  pthread_key_delete(thread_key_);
+
+  pthread_mutex_lock(&lock_buffers_);
+  terminate_ = true;
+  pthread_cond_signal(&sig_flush_);
+  pthread_mutex_unlock(&lock_buffers_);
+  int retval = pthread_join(thread_flush_, NULL);
   assert(retval == 0 && "Flush thread not gracefully terminated");
 
-  retval = pthread_cond_destroy(&sig_continue_trace_);
-  assert(retval == 0 && "Continue-trace signal could not be destroyed");
-  retval = pthread_mutex_destroy(&sig_continue_trace_mutex_);
-  assert(retval == 0 &&
-         "Mutex for continue-trace signal could not be destroyed");
-  retval = pthread_cond_destroy(&sig_flush_);
-  assert(retval == 0 && "Flush signal could not be destroyed");
-
-  delete[] ring_buffer_;
-  delete[] commit_buffer_;
+  // Records dropped after the last buffer of a thread are reported, too
+  for (unsigned i = 0; i < thread_buffers_->size(); ++i) {
+    if ((*thread_buffers_)[i]->num_dropped > 0)
+      WriteDropped((*thread_buffers_)[i]);
+    delete (*thread_buffers_)[i];
+  }
+  for (unsigned i = 0; i < exited_threads_->size(); ++i) {
+    WriteDropped((*exited_threads_)[i]);
+    delete (*exited_threads_)[i];
+  }
+  close(fd_trace_);
+  fd_trace_ = -1;
+
+  for (unsigned i = 0; i < free_buffers_->size(); ++i)
+    FreeBuffer((*free_buffers_)[i]);
+  delete thread_buffers_;
+  delete full_buffers_;
+  delete free_buffers_;
+  delete exited_threads_;
+  thread_buffers_ = NULL;
+  full_buffers_ = NULL;
+  free_buffers_ = NULL;
+  exited_threads_ = NULL;
 }
 
 
 /**
- * Trace a message.  This is usually a lock-free procedure that just
- * requires two fetch_and_add operations and a gettimeofday syscall.
- * There are two exceptions:
- *   -# If the ring buffer is full, the function blocks until the flush
- *      thread made some space.  Avoid that by carefully choosing size
- *      and threshold.
- *   -# If this message reaches the threshold, the flush thread gets
- *      signaled.
+ * Trace a record into the buffer of the calling thread.  If the buffer is
+ * full, it is handed over to the flush thread.  If there are too many
+ * buffers waiting to be written, the record is dropped.
  *
  * \param[in] event Arbitrary code, for consistency applications should use one
  *            of the TraceEvents constants. Negative codes are reserved
  *            for internal use.
- * \param[in] id Arbitrary id, for example file name or module name which is
- *            doing the trace.
- * \return The sequence number which was used to trace the record
+ * \param[in] inode Inode of the file system call, or 0
+ * \param[in] path Path of the file system call, may be empty
+ * \param[in] duration Duration of the call in microseconds, or 0
  */
-int32_t TraceInternal(const int event, const PathString &path,
-                      const string &msg)
+void TraceInternal(const int event, const uint64_t inode,
+                   const PathString &path, const uint64_t duration)
 {
-  int32_t my_seq_no = atomic_xadd32(&seq_no_, 1);
   timeval now;
   gettimeofday(&now, NULL);
-  int pos = my_seq_no % buffer_size_;
-
-  while (my_seq_no - atomic_read32(&flushed_) >= buffer_size_) {
-    timespec timeout;
-    int retval;
-    GetTimespecRel(25, &timeout);
-    retval = pthread_mutex_lock(&sig_continue_trace_mutex_);
-    retval |= pthread_cond_timedwait(&sig_continue_trace_,
-                                     &sig_continue_trace_mutex_, &timeout);
-    retval |= pthread_mutex_unlock(&sig_continue_trace_mutex_);
-    assert((retval == ETIMEDOUT || retval == 0) &&
-           "Error while waiting to continue tracing");
+  ThreadBuffer *thread_buffer =
+    static_cast<ThreadBuffer *>(pthread_getspecific(thread_key_));
+  if (thread_buffer == NULL)
+    thread_buffer = RegisterThread();
+  const uint32_t path_length = (path.GetLength() < paths_size_) ?
+                               path.GetLength() : paths_size_;
+
+  while (!atomic_cas32(&thread_buffer->busy, 0, 1)) { }
+  Buffer *buffer = thread_buffer->buffer;
+  if ((buffer != NULL) &&
+      ((buffer->header.num_records == buffer_size_) ||
+       (buffer->header.size_paths + path_length > paths_size_)))
+  {
+    SubmitBuffer(buffer);
+    buffer = NULL;
   }
-
-  ring_buffer_[pos].time_stamp = now;
-  ring_buffer_[pos].code = event;
-  ring_buffer_[pos].path = path;
-  ring_buffer_[pos].msg = msg;
-  atomic_inc32(&commit_buffer_[pos]);
-
-  if (my_seq_no - atomic_read32(&flushed_) == flush_threshold_) {
-    int err_code __attribute__((unused)) = pthread_cond_signal(&sig_flush_);
-    assert(err_code == 0 && "Could not signal flush thread");
+  if (buffer == NULL) {
+    buffer = GetFreeBuffer();
+    thread_buffer->buffer = buffer;
+    if (buffer == NULL) {
+      thread_buffer->num_dropped++;
+      atomic_cas32(&thread_buffer->busy, 1, 0);
+      return;
+    }
+    buffer->header.magic = kBlockMagic;
+    buffer->header.version = kFormatVersion;
+    buffer->header.thread = thread_buffer->thread;
+    buffer->header.num_records = 0;
+    buffer->header.size_paths = 0;
+    buffer->header.num_dropped = thread_buffer->num_dropped;
+    thread_buffer->num_dropped = 0;
   }
 
-  return my_seq_no;
+  Record *record = &buffer->records[buffer->header.num_records];
+  record->timestamp = uint64_t(now.tv_sec) * 1000000 + now.tv_usec;
+  record->inode = inode;
+  record->duration = (duration < kMaxDuration) ? duration : kMaxDuration;
+  record->event = event;
+  record->path_offset = buffer->header.size_paths;
+  record->path_length = path_length;
+  memcpy(buffer->paths + buffer->header.size_paths, path.GetChars(),
+         path_length);
+  buffer->header.size_paths += path_length;
+  buffer->header.num_records++;
+  atomic_cas32(&thread_buffer->busy, 1, 0);
 }
 
 
 /**
- * Flushes the ring buffer immediately at least up to the current seq_no.
- * It blocks until the flush thread finished the work.  It does not
- * affect further tracing during its execution.
+ * Writes the buffers of all threads to the trace file.  It blocks until the
+ * flush thread finished the work.  It does not affect further tracing during
+ * its execution.
  */
 void Flush() {
   if (!active_) return;
 
-  int32_t save_seq_no = TraceInternal(-3, PathString("Tracer", 6),
-                                      "flushed ring buffer");
-  while (atomic_read32(&flushed_) <= save_seq_no) {
-    timespec timeout;
-    int retval;
-
-    atomic_cas32(&flush_immediately_, 0, 1);
-    retval = pthread_cond_signal(&sig_flush_);
-    assert(retval == 0 && "Could not signal flush thread");
-
-    GetTimespecRel(250, &timeout);
-    retval = pthread_mutex_lock(&sig_continue_trace_mutex_);
-    retval |= pthread_cond_timedwait(&sig_continue_trace_,
-                                       &sig_continue_trace_mutex_, &timeout);
-    retval |= pthread_mutex_unlock(&sig_continue_trace_mutex_);
-    assert((retval == ETIMEDOUT || retval == 0) &&
-           "Error while waiting in flush ()");
+  TraceInternal(-3, 0, PathString("Tracer", 6), 0);
+  SubmitThreadBuffers();
+  pthread_mutex_lock(&lock_buffers_);
+  const uint64_t target = num_submitted_;
+  while (num_written_ < target)
+    pthread_cond_wait(&sig_written_, &lock_buffers_);
+  pthread_mutex_unlock(&lock_buffers_);
+}
+
+
+/**
+ * Reads the next block of a trace file, for the tools that process traces.
+ * Paths of the records are substrings of paths.  A block that is cut off, for
+ * instance because the traced process crashed while writing, is reported as
+ * corrupted.
+ */
+ReadResult ReadBlock(FILE *f, BlockHeader *header, vector<Record> *records,
+                     string *paths)
+{
+  const size_t num_read = fread(header, 1, sizeof(*header), f);
+  if (num_read == 0)
+    return kReadEof;
+  if (num_read != sizeof(*header))
+    return kReadCorrupted;
+  if ((header->magic != kBlockMagic) || (header->version != kFormatVersion))
+    return kReadCorrupted;
+  // Garbage in the header must not lead to huge allocations
+  platform_stat64 info;
+  if ((platform_fstat(fileno(f), &info) == 0) && S_ISREG(info.st_mode)) {
+    const off_t position = ftello(f);
+    if ((position < 0) ||
+        (uint64_t(header->num_records) * sizeof(Record) + header->size_paths >
+         uint64_t(info.st_size - position)))
+    {
+      return kReadCorrupted;
+    }
+  }
+
+  records->resize(header->num_records);
+  paths->resize(header->size_paths);
+  if ((header->num_records > 0) &&
+      (fread(&(*records)[0], sizeof(Record), header->num_records, f) !=
+       header->num_records))
+  {
+    return kReadCorrupted;
+  }
+  if ((header->size_paths > 0) &&
+      (fread(&(*paths)[0], 1, header->size_paths, f) != header->size_paths))
+  {
+    return kReadCorrupted;
+  }
+  for (unsigned i = 0; i < header->num_records; ++i) {
+    if (uint64_t((*records)[i].path_offset) + (*records)[i].path_length >
+        header->size_paths)
+    {
+      return kReadCorrupted;
+    }
   }
+  return kReadOk;
 }
 
 }  // namespace tracer
@@ -5,7 +5,12 @@
 #ifndef CVMFS_TRACER_H_
 #define CVMFS_TRACER_H_ 1
 
+#include <stdint.h>
+#include <stdio.h>
+
 #include <string>
+#include <vector>
+
 #include "atomic.h"
 #include "shortstring.h"
 
@@ -24,21 +29,54 @@ enum TraceEvents {
   kFuseCrowd,
 };
 
+/**
+ * The trace file is a sequence of blocks.  Every block holds the records of a
+ * single thread: a BlockHeader, followed by num_records Records, followed by
+ * size_paths bytes of path strings that are referenced by the records.  All
+ * numbers are in host byte order.
+ */
+const uint32_t kBlockMagic = 0x52545643;  // "CVTR"
+const uint32_t kFormatVersion = 1;
+
+struct BlockHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t thread;  /**< Tracing thread, numbered in order of appearance */
+  uint32_t num_records;
+  uint32_t size_paths;
+  uint32_t num_dropped;  /**< Records of thread lost since its last block */
+};
+
+struct Record {
+  uint64_t timestamp;  /**< Microseconds since the epoch */
+  uint64_t inode;
+  uint32_t duration;  /**< Microseconds */
+  int32_t event;  /**< Negative codes are reserved for internal use */
+  uint32_t path_offset;  /**< Relative to the first path byte of the block */
+  uint32_t path_length;
+};
+
+enum ReadResult {
+  kReadOk = 0,
+  kReadEof,
+  kReadCorrupted,
+};
+
 
-void Init(const int buffer_size, const int flush_threshold,
-          const std::string &tracefile);
+void Init(const unsigned buffer_size, const std::string &tracefile);
 void InitNull();
 void Fini();
 
-int32_t TraceInternal(const int event, const PathString &path,
-                      const std::string &msg);
+void TraceInternal(const int event, const uint64_t inode,
+                   const PathString &path, const uint64_t duration);
 void Flush();
-void inline __attribute__((used)) Trace(const int event, const PathString &path,
-                                        const std::string &msg)
+ReadResult ReadBlock(FILE *f, BlockHeader *header,
+                     std::vector<Record> *records, std::string *paths);
+void inline __attribute__((used)) Trace(const int event, const uint64_t inode,
+                                        const PathString &path,
+                                        const uint64_t duration)
 {
-  // TODO: could be done more elegantly by templates
-  // (only 1 if when initialized)
-  if (active_) TraceInternal(event, path, msg);
+  if (active_) TraceInternal(event, inode, path, duration);
 }
 
 }  // namespace tracer
@@ -3,13 +3,21 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
 #include <pthread.h>
-#include <fstream>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "shortstring.h"
 #include "tracer.h"
 
 using namespace std;
 
+const char *kTestPath = "Multi-Thread test string containing quote chars: \"";
+
 struct start_data {
    int iterations;
    int flush_every;
@@ -19,10 +27,11 @@ struct start_data {
 extern "C" void *thread_log (void *data) {
    int thread_id = reinterpret_cast<struct start_data *> (data)->thread_id;
    std::ostringstream o;
-   o << thread_id;
+   o << kTestPath << thread_id;
+   const PathString path(o.str().data(), o.str().length());
    int i;
    for (i = 0; i < reinterpret_cast<struct start_data *> (data)->iterations; ++i) {
-      tracer::Trace(i, o.str (), "Multi-Thread test string containing quote chars: \"");
+      tracer::Trace(tracer::kFuseOpen, i, path, thread_id);
       if ((reinterpret_cast<struct start_data *> (data)->flush_every > 0) &&
           (i % reinterpret_cast<struct start_data *> (data)->flush_every == 0))
       {
@@ -33,207 +42,254 @@ extern "C" void *thread_log (void *data) {
 }
 
 
-bool check_file (string filename, int expct_nol)
+struct trace_summary {
+   int num_blocks;
+   int num_records;  // Without the internal records
+   int num_internal;
+   int num_dropped;
+   bool records_ok;
+   tracer::ReadResult last_result;
+};
+
+/**
+ * Reads a trace file block by block.  Records traced by thread_log() must come
+ * in order per traced thread and must carry the path of their start_data.
+ */
+trace_summary read_file (string filename)
 {
-	ifstream f;
-
-	f.open (filename.c_str());
-	int nol = 0;
-	string line;
-	while (!f.eof()) {
-		getline (f, line);
-		++nol;
-	}
-	f.close ();
-	unlink (filename.c_str());
-	return (nol == expct_nol && line == "");
+   trace_summary summary;
+   summary.num_blocks = summary.num_records = summary.num_internal = 0;
+   summary.num_dropped = 0;
+   summary.records_ok = true;
+   vector<int64_t> next_inode;
+
+   FILE *f = fopen(filename.c_str(), "r");
+   if (!f) {
+      summary.records_ok = false;
+      summary.last_result = tracer::kReadCorrupted;
+      return summary;
+   }
+   tracer::BlockHeader header;
+   vector<tracer::Record> records;
+   string paths;
+   while ((summary.last_result = tracer::ReadBlock(f, &header, &records, &paths))
+          == tracer::kReadOk)
+   {
+      summary.num_blocks++;
+      summary.num_dropped += header.num_dropped;
+      for (unsigned i = 0; i < records.size(); ++i) {
+         const string path = paths.substr(records[i].path_offset,
+                                          records[i].path_length);
+         if (records[i].event < 0) {
+            summary.num_internal++;
+            if (path != "Tracer")
+               summary.records_ok = false;
+            continue;
+         }
+         summary.num_records++;
+         std::ostringstream o;
+         o << kTestPath << records[i].duration;
+         if (header.thread >= next_inode.size())
+            next_inode.resize(header.thread + 1, 0);
+         if ((records[i].event != tracer::kFuseOpen) || (path != o.str()) ||
+             (int64_t(records[i].inode) < next_inode[header.thread]))
+         {
+            summary.records_ok = false;
+         }
+         next_inode[header.thread] = records[i].inode + 1;
+      }
+   }
+   fclose(f);
+   return summary;
 }
 
-int main () {
-	cout << "Testing Tracer" << endl;
+/**
+ * Records are dropped if the flush thread falls behind, but every record is
+ * either in the file or counted as dropped.
+ */
+bool check_file (string filename, int expct_records)
+{
+   trace_summary summary = read_file(filename);
+   unlink (filename.c_str());
+   return summary.records_ok && (summary.last_result == tracer::kReadEof) &&
+          (summary.num_records <= expct_records) &&
+          (summary.num_records + summary.num_internal + summary.num_dropped ==
+           expct_records);
+}
 
+/**
+ * Runs num_rounds times num_threads threads of thread_log() at once.
+ */
+void run_threads (int num_threads, int iterations, int flush_every,
+                  int num_rounds)
+{
    pthread_t pthreads[10];
    struct start_data inits[10];
+   for (int i = 0; i < num_threads; i++) {
+      inits[i].iterations = iterations;
+      inits[i].flush_every = flush_every;
+      inits[i].thread_id = i;
+   }
+   for (int j = 0; j < num_rounds; j++) {
+      for (int i = 0; i < num_threads; i++)
+         pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
+      for (int i = 0; i < num_threads; i++)
+         pthread_join (pthreads[i], NULL);
+   }
+}
 
-   cout << "Trace null-messages... " << flush;
-   tracer::InitNull();
-	for (int i = 0; i < 100; i++)
-      tracer::Trace(i, "id", "Null");
-   cout << "pass!" << endl;
-   tracer::Fini();
+/**
+ * Copies the trace from the pipe into a regular file until the tracer closes
+ * the pipe.
+ */
+extern "C" void *drain_fifo (void *data) {
+   const int fd_fifo = *reinterpret_cast<int *>(data);
+   FILE *trace = fopen("dropped.trace", "w");
+   char buf[4096];
+   ssize_t num_bytes;
+   while ((num_bytes = read(fd_fifo, buf, sizeof(buf))) > 0)
+      fwrite(buf, 1, num_bytes, trace);
+   fclose(trace);
+   return NULL;
+}
 
-   cout << "Create and destroy... " << flush;
-   tracer::Init(5, 2, "createdestroy.trace");
-	tracer::Fini();
-   if (check_file("createdestroy.trace", 3))
-		cout << "pass!" << endl;
-	else
-		cout << "FAIL!" << endl;
-
-   cout << "Idle (5 sec)... " << flush;
-   tracer::Init(10, 7, "idle.trace");
-   sleep(5);
-   tracer::Fini();
-   cout << "pass!" << endl;
+void report (bool result) {
+   if (result) {
+      cout << "pass" << endl;
+   } else {
+      cout << "FAIL!" << endl;
+      exit(1);
+   }
+}
 
-   cout << "Test single-threaded tracing 1... " << flush;
-   tracer::Init(2, 0, "sthread1.trace");
-   for (int i = 0; i < 100; i++)
-      tracer::Trace(i, "id", "This is a test string");
-   tracer::Fini();
-   cout << "pass" << endl;
+int main () {
+   cout << "Testing Tracer" << endl;
 
-   cout << "Test single-threaded tracing 2... " << flush;
-   tracer::Init(2, 1, "sthread2.trace");
-   for (int i = 0; i < 10000; i++)
-      tracer::Trace(i, "id", "This is a test string");
+   cout << "Trace null-messages... " << flush;
+   tracer::InitNull();
+   for (int i = 0; i < 100; i++)
+      tracer::Trace(i, 0, PathString("Null", 4), 0);
    tracer::Fini();
    cout << "pass" << endl;
 
-   cout << "Test single-threaded tracing 3... " << flush;
-   tracer::Init(2048, 1024, "sthread3.trace");
-   for (int i = 0; i < 100000; i++)
-      tracer::Trace(i, "id", "This is a test string");
+   cout << "Create and destroy... " << flush;
+   unlink("createdestroy.trace");
+   tracer::Init(5, "createdestroy.trace");
    tracer::Fini();
-   cout << "pass" << endl;
+   report(check_file("createdestroy.trace", 2));
 
-
-
-   cout << "Test multi-threaded tracing with 2 threads... " << flush;
-   tracer::Init(2, 0, "m2thread.trace");
-   for (int i = 0; i < 2; i++) {
-      inits[i].iterations = 100;
-      inits[i].flush_every = 0;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 2; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Idle (6 sec)... " << flush;
+   unlink("idle.trace");
+   tracer::Init(10, "idle.trace");
+   sleep(6);
+   // The initial record is written by the periodic flush
+   report(read_file("idle.trace").num_internal == 1);
    tracer::Fini();
+   unlink("idle.trace");
 
-   cout << "pass" << endl;
-   cout << "Test multi-threaded tracing with 3 threads... " << flush;
-   tracer::Init(2, 1, "m3thread.trace");
-   for (int i = 0; i < 3; i++) {
-      inits[i].iterations = 100;
-      inits[i].flush_every = 0;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 3; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test single-threaded tracing 1... " << flush;
+   unlink("sthread1.trace");
+   tracer::Init(2, "sthread1.trace");
+   run_threads(1, 100, 0, 1);
    tracer::Fini();
-   cout << "pass" << endl;
+   report(check_file("sthread1.trace", 100 + 2));
 
-   cout << "Test multi-threaded tracing with 10 threads... " << flush;
-   tracer::Init(8, 6, "m10thread.trace");
-   for (int i = 0; i < 10; i++) {
-      inits[i].iterations = 10000;
-      inits[i].flush_every = 0;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 10; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test single-threaded tracing 2... " << flush;
+   unlink("sthread2.trace");
+   tracer::Init(2048, "sthread2.trace");
+   run_threads(1, 100000, 0, 1);
    tracer::Fini();
-   cout << "pass" << endl;
+   report(check_file("sthread2.trace", 100000 + 2));
 
-   cout << "Test big buffer with with 10 threads... " << flush;
-   tracer::Init(2048, 1024, "bigbuf.trace");
-   for (int i = 0; i < 10; i++) {
-      inits[i].iterations = 10000;
-      inits[i].flush_every = 0;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 10; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test multi-threaded tracing with 3 threads... " << flush;
+   unlink("m3thread.trace");
+   tracer::Init(2, "m3thread.trace");
+   run_threads(3, 100, 0, 1);
    tracer::Fini();
-   cout << "pass" << endl;
+   report(check_file("m3thread.trace", 300 + 2));
 
-   cout << "Test thread-thrashing with 2 concurrent threads... " << flush;
-   tracer::Init(2, 0, "thrash2.trace");
-   for (int i = 0; i < 2; i++) {
-      inits[i].iterations = 100;
-      inits[i].flush_every = 0;
-      inits[i].thread_id = i;
-   }
-   for (int j = 0; j < 100; j++) {
-      for (int i = 0; i < 2; i++)
-         pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-      for (int i = 0; i < 2; i++)
-         pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test big buffer with 10 threads... " << flush;
+   unlink("bigbuf.trace");
+   tracer::Init(2048, "bigbuf.trace");
+   run_threads(10, 10000, 0, 1);
    tracer::Fini();
-   cout << "pass" << endl;
+   report(check_file("bigbuf.trace", 100000 + 2));
 
    cout << "Test thread-thrashing with 3 concurrent threads... " << flush;
-   tracer::Init(2, 1, "thrash3.trace");
-   for (int i = 0; i < 3; i++) {
-      inits[i].iterations = 100;
-      inits[i].flush_every = 0;
-      inits[i].thread_id = i;
-   }
-   for (int j = 0; j < 100; j++) {
-      for (int i = 0; i < 3; i++)
-         pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-      for (int i = 0; i < 3; i++)
-         pthread_join (pthreads[i], NULL);
-   }
+   unlink("thrash3.trace");
+   tracer::Init(8, "thrash3.trace");
+   run_threads(3, 100, 0, 100);
    tracer::Fini();
-   cout << "pass" << endl;
+   report(check_file("thrash3.trace", 30000 + 2));
 
-   cout << "Test flushing... " << flush;
-   tracer::Init(5, 2, "flush.trace");
-   tracer::Flush();
-   tracer::Fini();
-   cout << "pass!" << endl;
-
-   cout << "Test flushing with 2 threads... " << flush;
-   tracer::Init(2, 0, "flush2.trace");
-   for (int i = 0; i < 2; i++) {
-      inits[i].iterations = 100;
-      inits[i].flush_every = 1;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 2; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test flushing with 10 threads... " << flush;
+   unlink("flush10.trace");
+   tracer::Init(64, "flush10.trace");
+   run_threads(10, 1000, 10, 1);
    tracer::Fini();
-   cout << "pass" << endl;
+   // Every flush traces an internal record
+   report(check_file("flush10.trace", 10000 + 10 * 100 + 2));
 
-   cout << "Test flushing with 3 threads... " << flush;
-   tracer::Init(2, 1, "flush3.trace");
-   for (int i = 0; i < 3; i++) {
-      inits[i].iterations = 100;
-      inits[i].flush_every = 1;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 3; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test truncated and corrupted files... " << flush;
+   unlink("corrupt.trace");
+   tracer::Init(16, "corrupt.trace");
+   run_threads(1, 100, 0, 1);
    tracer::Fini();
-   cout << "pass" << endl;
+   trace_summary summary = read_file("corrupt.trace");
+   bool result = summary.records_ok && (summary.num_blocks > 2);
+   struct stat info;
+   stat("corrupt.trace", &info);
+   // Cut off the last block in the middle of its paths, then of its header
+   truncate("corrupt.trace", info.st_size - 1);
+   summary = read_file("corrupt.trace");
+   result = result && summary.records_ok &&
+            (summary.last_result == tracer::kReadCorrupted);
+   const int num_blocks = summary.num_blocks;
+   truncate("corrupt.trace", sizeof(tracer::BlockHeader) / 2);
+   summary = read_file("corrupt.trace");
+   result = result && (summary.num_blocks == 0) &&
+            (summary.last_result == tracer::kReadCorrupted);
+   // Garbage where the record count is expected
+   FILE *f = fopen("corrupt.trace", "w");
+   tracer::BlockHeader header;
+   header.magic = tracer::kBlockMagic;
+   header.version = tracer::kFormatVersion;
+   header.thread = 0;
+   header.num_records = 0xFFFFFFFF;
+   header.size_paths = 0;
+   header.num_dropped = 0;
+   fwrite(&header, sizeof(header), 1, f);
+   fclose(f);
+   summary = read_file("corrupt.trace");
+   result = result && (num_blocks > 1) && (summary.num_blocks == 0) &&
+            (summary.last_result == tracer::kReadCorrupted);
+   unlink("corrupt.trace");
+   report(result);
 
-   cout << "Test flushing with 10 threads... " << flush;
-   tracer::Init(64, 32, "flush10.trace");
-   for (int i = 0; i < 10; i++) {
-      inits[i].iterations = 1000;
-      inits[i].flush_every = 10;
-      inits[i].thread_id = i;
-      pthread_create (&pthreads[i], NULL, thread_log, reinterpret_cast<void *>(&inits[i]));
-   }
-   for (int i = 0; i < 10; i++) {
-      pthread_join (pthreads[i], NULL);
-   }
+   cout << "Test dropped records... " << flush;
+   // The flush thread blocks on a pipe that nobody reads, the traced thread
+   // does not
+   unlink("dropped.fifo");
+   mkfifo("dropped.fifo", 0600);
+   const int fd_fifo = open("dropped.fifo", O_RDONLY | O_NONBLOCK);
+   tracer::Init(4, "dropped.fifo");
+   run_threads(1, 10000, 0, 1);
+   fcntl(fd_fifo, F_SETFL, 0);
+   pthread_t thread_drain;
+   pthread_create(&thread_drain, NULL, drain_fifo,
+                  const_cast<int *>(&fd_fifo));
+   tracer::Flush();
    tracer::Fini();
-   cout << "pass" << endl;
+   pthread_join(thread_drain, NULL);
+   close(fd_fifo);
+   summary = read_file("dropped.trace");
+   unlink("dropped.fifo");
+   unlink("dropped.trace");
+   // Initial, flush, and final record
+   report(summary.records_ok && (summary.num_dropped > 0) &&
+          (summary.last_result == tracer::kReadEof) &&
+          (summary.num_records + summary.num_internal +
+           summary.num_dropped == 10000 + 3));
 
    return 0;
 }
@@ -472,19 +472,20 @@ int main() {
   LogCvmfs(kLogDownload, kLogStdout, "Probing / Switching Hosts");
   vector<string> host_chain;
   vector<int> rtt;
+  vector<download::TransferScore> scores;
   unsigned active_host;
   download::SetHostChain("A;B;C");
-  download::GetHostInfo(&host_chain, &rtt, &active_host);
+  download::GetHostInfo(&host_chain, &rtt, &scores, &active_host);
   ShowHosts(host_chain, rtt, active_host);
   download::ProbeHosts();
-  download::GetHostInfo(&host_chain, &rtt, &active_host);
+  download::GetHostInfo(&host_chain, &rtt, &scores, &active_host);
   ShowHosts(host_chain, rtt, active_host);
   download::SetHostChain("http://cvmfs-stratum-one.cern.ch/opt/atlas;http://cvmfs-stratum-zero.cern.ch/opt/atlas");
   download::ProbeHosts();
-  download::GetHostInfo(&host_chain, &rtt, &active_host);
+  download::GetHostInfo(&host_chain, &rtt, &scores, &active_host);
   ShowHosts(host_chain, rtt, active_host);
   download::SwitchHost();
-  download::GetHostInfo(&host_chain, &rtt, &active_host);
+  download::GetHostInfo(&host_chain, &rtt, &scores, &active_host);
   ShowHosts(host_chain, rtt, active_host);
   download::Fini();
 
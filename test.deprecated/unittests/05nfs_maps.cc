@@ -0,0 +1,111 @@
+//test: 05nfs_maps.cc nfs_maps.cc lru.cc hash.cc util.cc logging.cc MurmurHash2.cpp
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -I<leveldb>/include -I<murmur> -o test $^ libleveldb.a -lcrypto -lpthread
+
+// Checks that the NFS maps keep their mappings across Fini() / Init() and
+// that no mapping handed out is lost when the process is killed.
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdint.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include <string>
+#include <vector>
+
+#include "nfs_maps.h"
+#include "shortstring.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+const uint64_t kRootInode = 256;
+const unsigned kNumPaths = 1000;
+
+static PathString MakePath(const string &prefix, const unsigned number) {
+  const string path = prefix + "/entry_" + StringifyInt(number);
+  return PathString(path.data(), path.length());
+}
+
+static void CheckPaths(const string &prefix, const vector<uint64_t> &inodes) {
+  for (unsigned i = 0; i < inodes.size(); ++i) {
+    PathString path;
+    assert(nfs_maps::GetPath(inodes[i], &path));
+    assert(path == MakePath(prefix, i));
+    assert(nfs_maps::GetInode(MakePath(prefix, i)) == inodes[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  const string dir = "/tmp/cvmfs_test_nfs_maps." + StringifyInt(getpid());
+  assert(MkdirDeep(dir, 0700));
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Mappings survive Fini / Init");
+  assert(nfs_maps::Init(dir, kRootInode, true));
+  nfs_maps::Spawn();
+  PathString root_path;
+  assert(nfs_maps::GetInode(root_path) == kRootInode);
+  vector<uint64_t> inodes;
+  for (unsigned i = 0; i < kNumPaths; ++i) {
+    inodes.push_back(nfs_maps::GetInode(MakePath("/clean", i)));
+    assert(inodes[i] > kRootInode);
+    for (unsigned j = 0; j < i; ++j)
+      assert(inodes[j] != inodes[i]);
+  }
+  CheckPaths("/clean", inodes);
+  nfs_maps::Fini();
+
+  assert(nfs_maps::Init(dir, kRootInode, false));
+  nfs_maps::Spawn();
+  assert(nfs_maps::GetInode(root_path) == kRootInode);
+  CheckPaths("/clean", inodes);
+  nfs_maps::Fini();
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Mappings survive a killed process");
+  int pipe_inodes[2];
+  assert(pipe(pipe_inodes) == 0);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    close(pipe_inodes[0]);
+    if (!nfs_maps::Init(dir, kRootInode, false))
+      _exit(1);
+    nfs_maps::Spawn();
+    // Hand out every inode before the next one is issued, no Fini()
+    for (unsigned i = 0; i < kNumPaths; ++i) {
+      const uint64_t inode = nfs_maps::GetInode(MakePath("/killed", i));
+      if (write(pipe_inodes[1], &inode, sizeof(inode)) != sizeof(inode))
+        _exit(1);
+    }
+    _exit(0);
+  }
+  close(pipe_inodes[1]);
+  vector<uint64_t> killed_inodes;
+  uint64_t inode;
+  while (read(pipe_inodes[0], &inode, sizeof(inode)) == sizeof(inode))
+    killed_inodes.push_back(inode);
+  close(pipe_inodes[0]);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  assert(killed_inodes.size() == kNumPaths);
+
+  assert(nfs_maps::Init(dir, kRootInode, false));
+  nfs_maps::Spawn();
+  CheckPaths("/clean", inodes);
+  CheckPaths("/killed", killed_inodes);
+  // New inodes must not collide with the ones handed out before the kill
+  for (unsigned i = 0; i < kNumPaths; ++i) {
+    const uint64_t new_inode = nfs_maps::GetInode(MakePath("/new", i));
+    for (unsigned j = 0; j < kNumPaths; ++j) {
+      assert(new_inode != inodes[j]);
+      assert(new_inode != killed_inodes[j]);
+    }
+  }
+  nfs_maps::Fini();
+
+  RemoveTree(dir);
+  return 0;
+}
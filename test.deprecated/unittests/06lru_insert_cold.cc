@@ -0,0 +1,112 @@
+//test: 06lru_insert_cold.cc lru.cc hash.cc util.cc logging.cc MurmurHash2.cpp
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -I<murmur> -o test $^ -lcrypto -lpthread
+
+// Checks that speculatively inserted (cold) entries survive in a full cache
+// and that they are evicted before the other entries.
+
+#include <stdint.h>
+
+#include <cassert>
+
+#include "lru.h"
+#include "logging.h"
+
+using namespace std;
+
+typedef lru::LruCache<uint64_t, uint64_t> Cache;
+
+const unsigned kCacheSize = 128;
+const unsigned kNumCold = kCacheSize / 4;
+
+static uint32_t hasher_uint64(const uint64_t &key) {
+  return uint32_t(key * 2654435761U);
+}
+
+static void Fill(Cache *cache, const uint64_t first, const unsigned num) {
+  for (uint64_t i = first; i < first + num; ++i)
+    assert(cache->Insert(i, i));
+}
+
+static void InsertCold(Cache *cache, const uint64_t first,
+                       const unsigned num)
+{
+  for (uint64_t i = first; i < first + num; ++i)
+    assert(cache->InsertCold(i, i));
+}
+
+static unsigned CountHits(Cache *cache, const uint64_t first,
+                          const unsigned num)
+{
+  unsigned hits = 0;
+  uint64_t value;
+  for (uint64_t i = first; i < first + num; ++i) {
+    if (cache->Lookup(i, &value)) {
+      assert(value == i);
+      hits++;
+    }
+  }
+  return hits;
+}
+
+int main(int argc, char **argv) {
+  Cache cache(kCacheSize, uint64_t(-1), hasher_uint64);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Cold entries survive a full cache");
+  Fill(&cache, 0, kCacheSize);
+  InsertCold(&cache, 1000, kNumCold);
+  assert(CountHits(&cache, 1000, kNumCold) == kNumCold);
+  // The least recently used entries made space
+  assert(CountHits(&cache, 0, kNumCold) == 0);
+  assert(CountHits(&cache, kNumCold, kCacheSize - kNumCold) ==
+         kCacheSize - kNumCold);
+  assert(!cache.InsertCold(1000, 0));
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Cold entries are evicted first");
+  cache.Drop();
+  Fill(&cache, 0, kCacheSize);
+  InsertCold(&cache, 1000, kNumCold);
+  Fill(&cache, 2000, kNumCold);
+  assert(CountHits(&cache, 1000, kNumCold) == 0);
+  assert(CountHits(&cache, 2000, kNumCold) == kNumCold);
+  assert(CountHits(&cache, kNumCold, kCacheSize - kNumCold) ==
+         kCacheSize - kNumCold);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Used cold entries become warm");
+  cache.Drop();
+  Fill(&cache, 0, kCacheSize);
+  InsertCold(&cache, 1000, kNumCold);
+  // Use the last and the first cold entry, the others stay cold
+  assert(CountHits(&cache, 1000 + kNumCold - 1, 1) == 1);
+  assert(CountHits(&cache, 1000, 1) == 1);
+  InsertCold(&cache, 3000, 2);
+  Fill(&cache, 2000, kNumCold);
+  // The remaining cold entries are evicted in insertion order
+  assert(CountHits(&cache, 1001, kNumCold - 2) == 0);
+  assert(CountHits(&cache, 3000, 2) == 0);
+  assert(CountHits(&cache, 1000, 1) == 1);
+  assert(CountHits(&cache, 1000 + kNumCold - 1, 1) == 1);
+  assert(CountHits(&cache, 2000, kNumCold) == kNumCold);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Cold entries beyond their share");
+  cache.Drop();
+  Fill(&cache, 0, kCacheSize);
+  InsertCold(&cache, 1000, 2 * kNumCold);
+  assert(CountHits(&cache, 1000, kNumCold) == 0);
+  assert(CountHits(&cache, 1000 + kNumCold, kNumCold) == kNumCold);
+  assert(CountHits(&cache, kNumCold, kCacheSize - kNumCold) ==
+         kCacheSize - kNumCold);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Only cold entries");
+  cache.Drop();
+  InsertCold(&cache, 1000, kCacheSize);
+  InsertCold(&cache, 2000, kNumCold);
+  assert(CountHits(&cache, 1000, kNumCold) == 0);
+  assert(CountHits(&cache, 1000 + kNumCold, kCacheSize - kNumCold) ==
+         kCacheSize - kNumCold);
+  assert(CountHits(&cache, 2000, kNumCold) == kNumCold);
+  assert(cache.Forget(2000));
+  Fill(&cache, 4000, kCacheSize);
+  assert(CountHits(&cache, 4000, kCacheSize) == kCacheSize);
+
+  return 0;
+}
@@ -0,0 +1,148 @@
+//test: 07pack_store.cc pack_store.cc hash.cc util.cc logging.cc
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -o test $^ -lcrypto -lpthread
+
+// Checks that tombstones keep probe chains intact, also if an insert fails,
+// and that compaction keeps the objects readable.
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "pack_store.h"
+#include "hash.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+const unsigned kThreshold = 128 * 1024;
+const unsigned kObjectSize = 64 * 1024;
+// Fills more than one segment of 32M
+const unsigned kNumObjects = 700;
+
+// The first four bytes of the digest select the slot in the index
+static hash::Any MakeId(const uint32_t slot, const uint32_t number) {
+  hash::Any id(hash::kSha1);
+  memcpy(id.digest, &slot, sizeof(slot));
+  memcpy(id.digest + sizeof(slot), &number, sizeof(number));
+  return id;
+}
+
+static vector<unsigned char> MakeObject(const uint32_t number,
+                                        const unsigned size)
+{
+  vector<unsigned char> object(size);
+  for (unsigned i = 0; i < size; ++i)
+    object[i] = (number + i) % 251;
+  return object;
+}
+
+static void Insert(const hash::Any &id, const uint32_t number,
+                   const unsigned size)
+{
+  vector<unsigned char> object = MakeObject(number, size);
+  assert(pack_store::Insert(id, &object[0], size));
+}
+
+static void Check(const hash::Any &id, const uint32_t number,
+                  const unsigned size)
+{
+  unsigned char *buffer;
+  uint64_t buffer_size;
+  assert(pack_store::Read(id, &buffer, &buffer_size));
+  assert(buffer_size == size);
+  vector<unsigned char> object = MakeObject(number, size);
+  assert(memcmp(buffer, &object[0], size) == 0);
+  free(buffer);
+}
+
+static uint64_t GetSegmentSize(const string &dir, const unsigned segment) {
+  struct stat info;
+  const string path = dir + "/packs/segment." + StringifyInt(segment);
+  assert(stat(path.c_str(), &info) == 0);
+  return info.st_size;
+}
+
+int main(int argc, char **argv) {
+  const string dir = "/tmp/cvmfs_test_pack_store." + StringifyInt(getpid());
+  assert(MkdirDeep(dir, 0700));
+  assert(pack_store::Init(dir, kThreshold));
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Tombstones keep probe chains");
+  const hash::Any a = MakeId(7, 1);
+  const hash::Any b = MakeId(7, 2);
+  const hash::Any c = MakeId(7, 3);
+  Insert(a, 1, 100);
+  Insert(b, 2, 200);
+  Insert(c, 3, 300);
+  assert(pack_store::Remove(a));
+  assert(!pack_store::Contains(a));
+  assert(!pack_store::Remove(a));
+  Check(b, 2, 200);
+  Check(c, 3, 300);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Failed insert into a tombstone");
+  const hash::Any d = MakeId(7, 4);
+  // Let the append to the active segment fail
+  signal(SIGXFSZ, SIG_IGN);
+  struct rlimit limit;
+  assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+  const rlim_t max_file_size = limit.rlim_cur;
+  limit.rlim_cur = GetSegmentSize(dir, 1);
+  assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+  vector<unsigned char> object = MakeObject(4, 400);
+  assert(!pack_store::Insert(d, &object[0], 400));
+  limit.rlim_cur = max_file_size;
+  assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+  assert(!pack_store::Contains(d));
+  Check(b, 2, 200);
+  Check(c, 3, 300);
+  Insert(d, 4, 400);
+  Check(d, 4, 400);
+  Check(c, 3, 300);
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Compaction");
+  for (unsigned i = 0; i < kNumObjects; ++i)
+    Insert(MakeId(1000 + i, i), i, kObjectSize);
+  pack_store::Fini();
+  // Objects above the threshold are still moved by the compaction
+  assert(pack_store::Init(dir, kObjectSize / 2));
+  for (unsigned i = 0; i < kNumObjects / 2; ++i)
+    assert(pack_store::Remove(MakeId(1000 + i, i)));
+  pack_store::Compact();
+  assert(pack_store::GetStatistics().find("compactions: 1") != string::npos);
+  Check(b, 2, 200);
+  Check(c, 3, 300);
+  Check(d, 4, 400);
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    if (i < kNumObjects / 2)
+      assert(!pack_store::Contains(MakeId(1000 + i, i)));
+    else
+      Check(MakeId(1000 + i, i), i, kObjectSize);
+  }
+  // Tombstones are reused
+  for (unsigned i = 0; i < kNumObjects / 2; ++i)
+    Insert(MakeId(1000 + i, i), i, 1000);
+  pack_store::Fini();
+
+  assert(pack_store::Init(dir, kThreshold));
+  for (unsigned i = 0; i < kNumObjects; ++i)
+    Check(MakeId(1000 + i, i), i, (i < kNumObjects / 2) ? 1000 : kObjectSize);
+  vector<hash::Any> ids;
+  vector<uint64_t> sizes;
+  pack_store::ListObjects(&ids, &sizes);
+  assert(ids.size() == kNumObjects + 3);
+  pack_store::Fini();
+
+  RemoveTree(dir);
+  return 0;
+}
@@ -0,0 +1,151 @@
+//test: 08download_paused.cc download.cc mock_server.cc compression.cc hash.cc util.cc logging.cc
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -o test $^ libcurl.a libcares.a -lz -lcrypto -lrt -lpthread
+
+// Checks that transfers which fail while they are paused by the bandwidth
+// limit do not leave the count of paused transfers behind, and that changing
+// the limit applies to transfers in flight.
+
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+
+#include "atomic.h"
+#include "download.h"
+#include "logging.h"
+#include "mock_server.h"
+#include "util.h"
+
+using namespace std;
+
+namespace download {
+extern atomic_int32 num_paused_;
+}
+
+const unsigned kChunkSize = 64 * 1024;
+const unsigned kObjectSize = 1024 * 1024;
+
+/**
+ * Announces a large file, sends the first chunk and then stalls, so that the
+ * paused transfer runs into the low speed timeout.
+ */
+static void *MainStallingServer(void *data) {
+  const int listen_fd = *static_cast<int *>(data);
+  char body[kChunkSize];
+  memset(body, 'x', sizeof(body));
+  while (true) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+      break;
+    char request[4096];
+    if (read(fd, request, sizeof(request)) <= 0) {
+      close(fd);
+      continue;
+    }
+    const string header =
+      "HTTP/1.1 200 OK\r\nContent-Length: 1048576\r\n\r\n";
+    if ((write(fd, header.data(), header.length()) < 0) ||
+        (write(fd, body, sizeof(body)) < 0))
+    {
+      close(fd);
+    }
+    // The connection is left open and idle
+  }
+  return NULL;
+}
+
+struct Transfer {
+  std::string url;
+  download::Failures result;
+};
+
+static void *MainFetch(void *data) {
+  Transfer *transfer = static_cast<Transfer *>(data);
+  download::JobInfo info(&transfer->url, false, false, NULL);
+  transfer->result = download::Fetch(&info);
+  free(info.destination_mem.data);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(listen_fd >= 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  assert(bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) == 0);
+  assert(listen(listen_fd, 16) == 0);
+  socklen_t addr_len = sizeof(addr);
+  assert(getsockname(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+                     &addr_len) == 0);
+  pthread_t thread_server;
+  assert(pthread_create(&thread_server, NULL, MainStallingServer,
+                        &listen_fd) == 0);
+
+  download::Init(16);
+  download::Spawn();
+  // The first chunk drains the bucket, the next one pauses the transfer
+  download::SetMaxBandwidth(1024);
+  download::SetTimeout(1, 1);
+
+  LogCvmfs(kLogDownload, kLogStdout, "Fail a paused transfer");
+  const string url = "http://127.0.0.1:" + StringifyInt(ntohs(addr.sin_port)) +
+                     "/stall";
+  download::JobInfo info(&url, false, false, NULL);
+  assert(download::Fetch(&info) == download::kFailHostConnection);
+  free(info.destination_mem.data);
+  assert(atomic_read32(&download::num_paused_) == 0);
+
+  LogCvmfs(kLogDownload, kLogStdout, "Change the limit of a running transfer");
+  const string dir = "/tmp/cvmfs_test_download_paused." +
+                     StringifyInt(getpid());
+  assert(MkdirDeep(dir + "/data", 0700));
+  FILE *f = fopen((dir + "/data/object").c_str(), "w");
+  assert(f);
+  for (unsigned i = 0; i < kObjectSize; ++i)
+    assert(fputc(i % 251, f) != EOF);
+  assert(fclose(f) == 0);
+  mock_server::Config config;
+  config.root = dir;
+  config.bandwidth = kObjectSize / 4;
+  mock_server::Server server(config);
+  assert(server.Start(0));
+
+  download::SetMaxBandwidth(0);
+  download::SetTimeout(10, 10);
+  Transfer transfer;
+  transfer.url = server.url() + "/data/object";
+  pthread_t thread_fetch;
+  assert(pthread_create(&thread_fetch, NULL, MainFetch, &transfer) == 0);
+  // The transfer started without a limit pauses once the limit is set
+  usleep(500 * 1000);
+  download::SetMaxBandwidth(1024);
+  for (unsigned i = 0; (i < 300) &&
+       (atomic_read32(&download::num_paused_) == 0); ++i)
+  {
+    usleep(10 * 1000);
+  }
+  assert(atomic_read32(&download::num_paused_) == 1);
+  download::SetMaxBandwidth(0);
+  pthread_join(thread_fetch, NULL);
+  assert(transfer.result == download::kFailOk);
+  assert(atomic_read32(&download::num_paused_) == 0);
+  server.Stop();
+  RemoveTree(dir);
+
+  download::Fini();
+  return 0;
+}
@@ -0,0 +1,134 @@
+//test: 09quota_journal.cc quota.cc pack_store.cc stripes.cc monitor.cc hash.cc util.cc logging.cc MurmurHash2.cpp
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -I<sparsehash> -I<murmur> -o test $^ -lsqlite3 -lcrypto -lrt -lpthread -ldl
+
+// Checks that the quota manager recovers its index from the snapshot and the
+// journal after a crash, also if the last journal record is truncated and if
+// the crash happens while a snapshot is written in the background.
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdint.h>
+
+#include <cassert>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "platform.h"
+#include "quota.h"
+#include "hash.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+namespace cvmfs {
+bool foreground_ = true;  // Referenced by the shared quota manager
+}
+
+const uint64_t kFileSize = 4096;
+const uint64_t kLimit = uint64_t(1) << 40;
+// More records than kJournalMaxRecords, starts a background snapshot
+const unsigned kNumManyFiles = 150000;
+
+// The digest must not be null, which is the empty key of the index
+static hash::Any MakeHash(const unsigned number) {
+  hash::Any result(hash::kSha1);
+  const uint64_t value = uint64_t(number) + 1;
+  memcpy(result.digest, &value, sizeof(value));
+  return result;
+}
+
+/**
+ * Inserts files [first, first + num) in a child process that exits without
+ * Fini(), i.e. without writing a snapshot.
+ */
+static void InsertAndCrash(const string &cache_dir, const unsigned first,
+                           const unsigned num, const unsigned num_touches)
+{
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    if (!quota::Init(cache_dir, kLimit, kLimit / 2, false))
+      _exit(1);
+    quota::Spawn();
+    if (num_touches > 0) {
+      for (unsigned i = 0; i < num_touches; ++i)
+        quota::Touch(MakeHash(1000 + (i % kNumManyFiles)));
+      quota::GetSize();
+      // Give the background snapshot time to finish, the next batch cuts
+      // the journal
+      sleep(2);
+    }
+    for (unsigned i = first; i < first + num; ++i)
+      quota::Insert(MakeHash(i), kFileSize, "/journal/" + StringifyInt(i));
+    // Queued behind the inserts, returns once the journal is flushed
+    quota::GetSize();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+static unsigned CountListed(const unsigned first, const unsigned num) {
+  vector<string> list = quota::List();
+  vector<bool> found(num, false);
+  for (unsigned i = 0; i < list.size(); ++i) {
+    if (!HasPrefix(list[i], "/journal/", false))
+      continue;
+    const uint64_t number = String2Uint64(list[i].substr(9));
+    if ((number >= first) && (number < first + num))
+      found[number - first] = true;
+  }
+  unsigned result = 0;
+  for (unsigned i = 0; i < num; ++i)
+    result += found[i] ? 1 : 0;
+  return result;
+}
+
+int main(int argc, char **argv) {
+  const string cache_dir = "/tmp/cvmfs_test_quota_journal." +
+                           StringifyInt(getpid());
+  assert(MakeCacheDirectories(cache_dir, 0700));
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Replay a journal with a truncated record");
+  InsertAndCrash(cache_dir, 0, 100, 0);
+  const string journal_path = cache_dir + "/lru_journal";
+  platform_stat64 info;
+  assert(platform_stat(journal_path.c_str(), &info) == 0);
+  assert(truncate(journal_path.c_str(), info.st_size - 1) == 0);
+  assert(quota::Init(cache_dir, kLimit, kLimit / 2, false));
+  quota::Spawn();
+  assert(quota::GetSize() == 99 * kFileSize);
+  assert(CountListed(0, 99) == 99);
+  assert(CountListed(99, 1) == 0);
+  quota::Fini();
+
+  // Fini() wrote a snapshot, the truncated record is gone for good
+  assert(quota::Init(cache_dir, kLimit, kLimit / 2, false));
+  quota::Spawn();
+  assert(quota::GetSize() == 99 * kFileSize);
+  quota::Fini();
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Crash during a background snapshot");
+  InsertAndCrash(cache_dir, 1000, kNumManyFiles, 0);
+  assert(quota::Init(cache_dir, kLimit, kLimit / 2, false));
+  quota::Spawn();
+  assert(quota::GetSize() == (99 + kNumManyFiles) * kFileSize);
+  assert(CountListed(1000, kNumManyFiles) == kNumManyFiles);
+  quota::Fini();
+
+  LogCvmfs(kLogCvmfs, kLogStdout, "Crash after a background snapshot");
+  InsertAndCrash(cache_dir, 500, 10, kNumManyFiles);
+  assert(quota::Init(cache_dir, kLimit, kLimit / 2, false));
+  quota::Spawn();
+  assert(quota::GetSize() == (99 + kNumManyFiles + 10) * kFileSize);
+  assert(CountListed(1000, kNumManyFiles) == kNumManyFiles);
+  assert(CountListed(500, 10) == 10);
+  quota::Fini();
+
+  RemoveTree(cache_dir);
+  return 0;
+}
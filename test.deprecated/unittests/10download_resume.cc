@@ -0,0 +1,96 @@
+//test: 10download_resume.cc download.cc mock_server.cc compression.cc hash.cc util.cc logging.cc
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -o test $^ libcurl.a libcares.a -lz -lcrypto -lrt -lpthread
+
+// Checks that a download whose connection breaks off in the middle of the
+// body continues with a range request on the next host or proxy.
+
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cassert>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+#include "download.h"
+#include "hash.h"
+#include "logging.h"
+#include "mock_server.h"
+#include "platform.h"
+#include "util.h"
+
+using namespace std;
+
+const unsigned kObjectSize = 1024 * 1024;
+
+static void Fetch(const string &dir, const hash::Any &expected_hash) {
+  const string url = "/data/object";
+  const string destination = dir + "/fetched";
+  download::JobInfo info(&url, false, true, &destination, &expected_hash);
+  assert(download::Fetch(&info) == download::kFailOk);
+
+  platform_stat64 stat_info;
+  assert(platform_stat(destination.c_str(), &stat_info) == 0);
+  assert(stat_info.st_size == kObjectSize);
+  hash::Any fetched_hash(hash::kSha1);
+  assert(hash::HashFile(destination, &fetched_hash));
+  assert(fetched_hash == expected_hash);
+  assert(unlink(destination.c_str()) == 0);
+}
+
+int main(int argc, char **argv) {
+  const string dir = "/tmp/cvmfs_test_download_resume." +
+                     StringifyInt(getpid());
+  assert(MkdirDeep(dir + "/root/data", 0700));
+  vector<unsigned char> object(kObjectSize);
+  for (unsigned i = 0; i < kObjectSize; ++i)
+    object[i] = (i * 7 + i / 251) % 256;
+  FILE *f = fopen((dir + "/root/data/object").c_str(), "w");
+  assert(f);
+  assert(fwrite(&object[0], 1, kObjectSize, f) == kObjectSize);
+  assert(fclose(f) == 0);
+  hash::Any expected_hash(hash::kSha1);
+  hash::HashMem(&object[0], kObjectSize, &expected_hash);
+
+  mock_server::Config config;
+  config.root = dir + "/root";
+  mock_server::Server origin(config);
+  assert(origin.Start(0));
+  config.drop_rate = 100;
+  mock_server::Server broken_origin(config);
+  assert(broken_origin.Start(0));
+  config.root = "";
+  mock_server::Server broken_proxy(config);
+  assert(broken_proxy.Start(0));
+  config.drop_rate = 0;
+  mock_server::Server proxy(config);
+  assert(proxy.Start(0));
+
+  download::Init(16);
+  download::Spawn();
+  download::SetTimeout(5, 5);
+
+  LogCvmfs(kLogDownload, kLogStdout, "Resume on the next host");
+  download::SetHostChain(broken_origin.url() + ";" + origin.url());
+  Fetch(dir, expected_hash);
+  assert(atomic_read64(&broken_origin.statistics()->num_drops) == 1);
+  assert(atomic_read64(&origin.statistics()->num_ranges) == 1);
+
+  LogCvmfs(kLogDownload, kLogStdout, "Resume on the next proxy");
+  download::SetHostChain(origin.url());
+  download::SetProxyChain(broken_proxy.url() + ";" + proxy.url());
+  Fetch(dir, expected_hash);
+  // The only proxy of a group is retried once before the next group is used
+  assert(atomic_read64(&broken_proxy.statistics()->num_drops) == 2);
+  assert(atomic_read64(&proxy.statistics()->num_proxied) == 1);
+  assert(atomic_read64(&origin.statistics()->num_ranges) == 3);
+
+  download::Fini();
+  origin.Stop();
+  broken_origin.Stop();
+  broken_proxy.Stop();
+  proxy.Stop();
+  RemoveTree(dir);
+  return 0;
+}
@@ -0,0 +1,158 @@
+//test: 11download_async.cc download.cc mock_server.cc compression.cc hash.cc util.cc logging.cc
+//        g++ -g -O0 -DCVMFS_CLIENT -D_FILE_OFFSET_BITS=64 -I../../cvmfs -o test $^ libcurl.a libcares.a -lz -lcrypto -lrt -lpthread
+
+// Checks that downloads started by FetchAsync() run concurrently without a
+// waiting thread each and that the I/O thread hands every finished job,
+// successful or not, to its callback.
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <string>
+#include <vector>
+
+#include "download.h"
+#include "hash.h"
+#include "logging.h"
+#include "mock_server.h"
+#include "util.h"
+
+using namespace std;
+
+const unsigned kObjectSize = 64 * 1024;
+const unsigned kNumJobs = 16;
+const unsigned kLatencyMs = 500;
+
+struct Completion {
+  download::JobInfo *info;
+  bool done;
+  download::Failures error_code;
+  bool hash_ok;
+};
+
+pthread_mutex_t lock_completions = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_completions = PTHREAD_COND_INITIALIZER;
+unsigned num_completions = 0;
+
+static void OnFetched(download::JobInfo *info, void *data) {
+  Completion *completion = static_cast<Completion *>(data);
+  assert(completion->info == info);
+  completion->error_code = info->error_code;
+  completion->hash_ok = false;
+  if (info->error_code == download::kFailOk) {
+    hash::Any fetched_hash(hash::kSha1);
+    hash::HashMem(reinterpret_cast<unsigned char *>(
+                    info->destination_mem.data),
+                  info->destination_mem.size, &fetched_hash);
+    completion->hash_ok = (info->destination_mem.size == kObjectSize) &&
+                          (fetched_hash == *info->expected_hash);
+    free(info->destination_mem.data);
+  } else {
+    assert(info->destination_mem.data == NULL);
+  }
+
+  pthread_mutex_lock(&lock_completions);
+  completion->done = true;
+  num_completions++;
+  pthread_cond_signal(&cond_completions);
+  pthread_mutex_unlock(&lock_completions);
+}
+
+static void WaitForCompletions(const unsigned num) {
+  pthread_mutex_lock(&lock_completions);
+  while (num_completions < num)
+    pthread_cond_wait(&cond_completions, &lock_completions);
+  num_completions = 0;
+  pthread_mutex_unlock(&lock_completions);
+}
+
+int main(int argc, char **argv) {
+  const string dir = "/tmp/cvmfs_test_download_async." +
+                     StringifyInt(getpid());
+  assert(MkdirDeep(dir + "/root/data", 0700));
+  vector<unsigned char> object(kObjectSize);
+  for (unsigned i = 0; i < kObjectSize; ++i)
+    object[i] = (i * 13 + i / 97) % 256;
+  FILE *f = fopen((dir + "/root/data/object").c_str(), "w");
+  assert(f);
+  assert(fwrite(&object[0], 1, kObjectSize, f) == kObjectSize);
+  assert(fclose(f) == 0);
+  hash::Any expected_hash(hash::kSha1);
+  hash::HashMem(&object[0], kObjectSize, &expected_hash);
+  hash::Any wrong_hash(expected_hash);
+  wrong_hash.digest[0] ^= 0xFF;
+
+  mock_server::Config config;
+  config.root = dir + "/root";
+  config.latency_ms = kLatencyMs;
+  mock_server::Server origin(config);
+  assert(origin.Start(0));
+
+  download::Init(kNumJobs);
+  download::SetHostChain(origin.url());
+  download::SetTimeout(5, 5);
+
+  // Not started before the I/O threads run
+  const string url = "/data/object";
+  download::JobInfo early(&url, false, true, &expected_hash);
+  assert(!download::FetchAsync(&early, OnFetched, NULL));
+  download::Spawn();
+
+  LogCvmfs(kLogDownload, kLogStdout, "Concurrent downloads");
+  vector<download::JobInfo *> jobs;
+  vector<Completion> completions(kNumJobs);
+  const time_t start = time(NULL);
+  for (unsigned i = 0; i < kNumJobs; ++i) {
+    jobs.push_back(new download::JobInfo(&url, false, true, &expected_hash));
+    completions[i].info = jobs[i];
+    completions[i].done = false;
+    assert(download::FetchAsync(jobs[i], OnFetched, &completions[i]));
+  }
+  WaitForCompletions(kNumJobs);
+  // Serial downloads would take kNumJobs times the latency
+  assert(time(NULL) - start < 4);
+  for (unsigned i = 0; i < kNumJobs; ++i) {
+    assert(completions[i].done);
+    assert(completions[i].error_code == download::kFailOk);
+    assert(completions[i].hash_ok);
+    delete jobs[i];
+  }
+  jobs.clear();
+
+  LogCvmfs(kLogDownload, kLogStdout, "Failed downloads");
+  const string missing_url = "/data/missing";
+  download::JobInfo missing(&missing_url, false, true, &expected_hash);
+  completions[0].info = &missing;
+  completions[0].done = false;
+  assert(download::FetchAsync(&missing, OnFetched, &completions[0]));
+  download::JobInfo corrupted(&url, false, true, &wrong_hash);
+  completions[1].info = &corrupted;
+  completions[1].done = false;
+  assert(download::FetchAsync(&corrupted, OnFetched, &completions[1]));
+  WaitForCompletions(2);
+  assert(completions[0].done && completions[1].done);
+  assert(completions[0].error_code != download::kFailOk);
+  assert(completions[1].error_code == download::kFailBadData);
+
+  LogCvmfs(kLogDownload, kLogStdout, "Blocking downloads in between");
+  download::JobInfo async(&url, false, true, &expected_hash);
+  completions[0].info = &async;
+  completions[0].done = false;
+  assert(download::FetchAsync(&async, OnFetched, &completions[0]));
+  download::JobInfo blocking(&url, false, true, &expected_hash);
+  assert(download::Fetch(&blocking) == download::kFailOk);
+  free(blocking.destination_mem.data);
+  WaitForCompletions(1);
+  assert(completions[0].hash_ok);
+
+  download::Fini();
+  origin.Stop();
+  RemoveTree(dir);
+  return 0;
+}